@@ -138,7 +138,7 @@
 #define INCLUDE_vTaskDelay    1
 #define INCLUDE_xTaskGetCurrentTaskHandle 1
 #define INCLUDE_xTaskGetSchedulerState 1
-// #define INCLUDE_xSemaphoreGetMutexHolder 1
+#define INCLUDE_xSemaphoreGetMutexHolder 1
 #define INCLUDE_uxTaskGetStackHighWaterMark 1
 
 /* Probably we should just have one FreeRTOSConfig.h per chip, but in the mean time, ... */
@@ -186,8 +186,9 @@
 #define vPortSVCHandler SVC_Handler
 #define xPortPendSVHandler PendSV_Handler
 
-#define configNUM_THREAD_LOCAL_STORAGE_POINTERS 1
+#define configNUM_THREAD_LOCAL_STORAGE_POINTERS 2
 #define FREERTOS_TLS_CUR_HEAP 0
+#define FREERTOS_TLS_FLASH_TAG 1
 #define configUSE_DISABLE_TICK_AUTO_CORRECTION_DEBUG 0
 #define configUSE_TICKLESS_IDLE_SIMPLE_DEBUG 0
 
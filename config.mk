@@ -104,8 +104,10 @@ SRCS_all += rcore/smartstrap.c
 SRCS_all += rcore/rebble_time.c
 SRCS_all += rcore/tz.c
 SRCS_all += rcore/rebble_memory.c
+SRCS_all += rcore/qalloc_test.c
 SRCS_all += rcore/vibrate.c
 SRCS_all += rcore/flash.c
+SRCS_all += rcore/flash_test.c
 SRCS_all += rcore/fs.c
 SRCS_all += rcore/fs_crc.c
 SRCS_all += rcore/fs_test.c
@@ -165,6 +167,7 @@ SRCS_all += rwatch/ui/notifications/call_window.c
 SRCS_all += rwatch/ui/notifications/progress_window.c
 SRCS_all += rwatch/ui/vibes.c
 SRCS_all += rwatch/storage/storage_persist.c
+SRCS_all += rwatch/storage/storage_persist_test.c
 SRCS_all += rwatch/storage/dictionary.c
 
 SRCS_all += Watchfaces/simple.c
@@ -197,6 +200,7 @@ include hw/drivers/stm32_buttons/config.mk
 include hw/drivers/stm32_power/config.mk
 include hw/drivers/stm32_rtc/config.mk
 include hw/drivers/stm32_backlight/config.mk
+include hw/drivers/stm32_crc/config.mk
 include hw/drivers/stm32_bluetooth_cc256x/config.mk
 include hw/platform/snowy_family/config.mk
 include hw/platform/snowy/config.mk
@@ -0,0 +1,87 @@
+/* stm32_crc.c
+ * Driver for the stm32 CRC calculation unit
+ * RebbleOS
+ *
+ * The CRC unit computes the same CRC-32 as PebbleFS does in software:
+ * polynomial 0x04C11DB7, no reflection, one 32-bit word at a time.  It
+ * takes a word per AHB write, which is quite a lot quicker than any table
+ * we could afford to keep in RAM.
+ *
+ * The catch is that on stm32f4 there is no way to load the CRC register
+ * with anything other than its reset value of 0xFFFFFFFF, and callers want
+ * to accumulate across many calls (and, for that matter, share the unit
+ * between threads).  So, to resume from an arbitrary crc, we compute the
+ * one word that takes the reset value to it, and feed that in first.
+ */
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "stm32_crc.h"
+#if defined(STM32F4XX)
+#    include <stm32f4xx.h>
+#    include <stm32f4xx_rcc.h>
+#elif defined(STM32F2XX)
+#    include "stm32f2xx.h"
+#    include "stm32f2xx_rcc.h"
+#else
+#    error "I have no idea what kind of stm32 this is; sorry"
+#endif
+#include "stm32_power.h"
+
+#define CRC32_POLY 0x04C11DB7
+#define CRC32_RESET 0xFFFFFFFF
+
+static SemaphoreHandle_t _crc_mutex;
+static StaticSemaphore_t _crc_mutex_buf;
+
+/* Runs the unit's 32 shift steps backwards: given the value of the CRC
+ * register after a word went in, returns the value the register had
+ * (xor'ed with the word) before.  Every step of the forward direction
+ * shifts a zero into the bottom bit, and the polynomial has its bottom bit
+ * set, so the bottom bit tells us whether the polynomial went in. */
+static uint32_t _crc_unshift(uint32_t crc)
+{
+    for (int i = 0; i < 32; i++) {
+        if (crc & 1)
+            crc = ((crc ^ CRC32_POLY) >> 1) | 0x80000000;
+        else
+            crc = crc >> 1;
+    }
+    
+    return crc;
+}
+
+uint32_t hw_crc32_accum(uint32_t crc, const void *p, size_t nwords)
+{
+    const uint8_t *bufp = p;
+    
+    if (!nwords)
+        return crc;
+    
+    /* Avoid race on mutex setup. */
+    taskENTER_CRITICAL();
+    if (!_crc_mutex)
+        _crc_mutex = xSemaphoreCreateMutexStatic(&_crc_mutex_buf);
+    taskEXIT_CRITICAL();
+    
+    xSemaphoreTake(_crc_mutex, portMAX_DELAY);
+    stm32_power_request(STM32_POWER_AHB1, RCC_AHB1Periph_CRC);
+    
+    CRC->CR = CRC_CR_RESET;
+    if (crc != CRC32_RESET)
+        CRC->DR = _crc_unshift(crc) ^ CRC32_RESET;
+    
+    /* Cortex-M3/M4 are happy to do unaligned single-word loads, but we
+     * don't want the compiler getting clever and pairing them up. */
+    while (nwords--) {
+        CRC->DR = *(volatile const uint32_t *)bufp;
+        bufp += 4;
+    }
+    crc = CRC->DR;
+    
+    stm32_power_release(STM32_POWER_AHB1, RCC_AHB1Periph_CRC);
+    xSemaphoreGive(_crc_mutex);
+    
+    return crc;
+}
@@ -0,0 +1,15 @@
+/*
+ * stm32_crc.h
+ * API for the stm32 CRC calculation unit
+ * RebbleOS
+ */
+
+#ifndef __STM32_CRC_H
+#define __STM32_CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint32_t hw_crc32_accum(uint32_t crc, const void *p, size_t nwords);
+
+#endif
@@ -10,6 +10,10 @@
 #define PLATFORM_FLASH_PAGE_MASK 0xFFFFFF00
 #define PLATFORM_FLASH_PAGE_SIZE 256
 
+/* Read cache in front of the QSPI flash: 4k of lines. */
+#define PLATFORM_FLASH_CACHE_LINES 16
+#define PLATFORM_FLASH_CACHE_LINE_SIZE 256
+
 #ifdef ASTERIX_BOARD_ASTERIX
 
 /* Asterix has 16MB of flash. */
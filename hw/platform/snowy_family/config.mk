@@ -7,6 +7,7 @@ CFLAGS_snowy_family += $(CFLAGS_driver_stm32_buttons)
 CFLAGS_snowy_family += $(CFLAGS_driver_stm32_power)
 CFLAGS_snowy_family += $(CFLAGS_driver_stm32_rtc)
 CFLAGS_snowy_family += $(CFLAGS_driver_stm32_backlight)
+CFLAGS_snowy_family += $(CFLAGS_driver_stm32_crc)
 CFLAGS_snowy_family += -Ihw/platform/snowy_family
 
 SRCS_snowy_family = $(SRCS_stm32f4xx)
@@ -18,6 +19,7 @@ SRCS_snowy_family += $(SRCS_driver_stm32_buttons)
 SRCS_snowy_family += $(SRCS_driver_stm32_power)
 SRCS_snowy_family += $(SRCS_driver_stm32_rtc)
 SRCS_snowy_family += $(SRCS_driver_stm32_backlight)
+SRCS_snowy_family += $(SRCS_driver_stm32_crc)
 SRCS_snowy_family += hw/platform/snowy_family/snowy_display.c
 SRCS_snowy_family += hw/platform/snowy_family/snowy_power.c
 SRCS_snowy_family += hw/platform/snowy_family/snowy_scanlines.c
@@ -64,6 +64,16 @@
 #define PLATFORM_FLASH_PAGE_MASK 0xFFFFFFC0
 #define PLATFORM_FLASH_PAGE_SIZE 64
 
+/* Read cache in front of the external flash: 2k of lines. */
+#define PLATFORM_FLASH_CACHE_LINES 16
+#define PLATFORM_FLASH_CACHE_LINE_SIZE 128
+
+/* PebbleFS checksums go through the CRC unit (see stm32_crc.c). */
+#define PLATFORM_HW_CRC32
+
+/* The NOR sits on the FMC bus, so it can be read in place; see flash_map. */
+#define PLATFORM_FLASH_MAPPED
+
 
 //Snowy uses OC1 for backlight
 #define BL_TIM_CH 1
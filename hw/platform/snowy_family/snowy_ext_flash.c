@@ -6,6 +6,8 @@
  */
 
 #include "stm32f4xx.h"
+#include "FreeRTOS.h"
+#include "task.h"
 #include "stdio.h"
 #include "string.h"
 #include "stm32f4xx_gpio.h"
@@ -350,15 +352,40 @@ void hw_flash_read_bytes(uint32_t address, uint8_t *buffer, size_t length)
     flash_operation_complete(0);
 }
 
-/* returns 0 if success, nonzero if error */
-static int _flash_poll_complete(uint32_t address)
+/* The FMC bank is just memory, as long as the clock is on and nobody is
+ * programming the part; flash.c makes sure of the latter. */
+const void *hw_flash_map(uint32_t address, size_t length)
+{
+    _nor_clock_request();
+    return (const void *)(Bank1_NOR_ADDR + address);
+}
+
+void hw_flash_unmap(const void *p, size_t length)
+{
+    _nor_clock_release();
+}
+
+/* returns 0 if success, nonzero if error
+ *
+ * A buffer program is done in a few hundred microseconds, so that just
+ * spins; but a sector erase keeps the part busy for the best part of a
+ * second, and spinning through that starves every task below the caller.
+ * With sleep set, it checks back once a tick instead, and the CPU goes to
+ * whoever wants it while the part erases.  (Nobody else can touch the part
+ * in the meantime: flash.c holds the mutex, and mappings off, across the
+ * whole erase.) */
+static int _flash_poll_complete(uint32_t address, int sleep)
 {
     uint16_t sr;
     
-    do {
+    for (;;) {
         NOR_WRITE(Bank1_NOR_ADDR + SECTOR_START(address) + SHF(0x555), FLASH_CMD_STATUS_READ);
         sr = *(__IO uint16_t *)(Bank1_NOR_ADDR + SECTOR_START(address));
-    } while (!(sr & FLASH_STATUS_READY));
+        if (sr & FLASH_STATUS_READY)
+            break;
+        if (sleep && xTaskGetSchedulerState() == taskSCHEDULER_RUNNING)
+            vTaskDelay(1);
+    }
     
     return sr & (FLASH_STATUS_PROG_ERROR | FLASH_STATUS_ERASE_ERROR);
 }
@@ -386,7 +413,7 @@ int hw_flash_write_sync(uint32_t address, uint8_t *buffer, size_t length)
     
     NOR_WRITE(Bank1_NOR_ADDR + SECTOR_START(addr_aligned) + SHF(0x555), FLASH_CMD_WRITE_CONFIRM);
     
-    int err = _flash_poll_complete(addr_aligned);
+    int err = _flash_poll_complete(addr_aligned, 0);
 
     _nor_reset_state();
     
@@ -403,7 +430,7 @@ int hw_flash_erase_32k_sync(uint32_t address)
     NOR_WRITE(Bank1_NOR_ADDR + (address) + SHF(0x555), FLASH_CMD_ERASE_SETUP);
     NOR_WRITE(Bank1_NOR_ADDR + (address) + SHF(0x2AA), FLASH_CMD_SECTOR_ERASE);
         
-    int err = _flash_poll_complete(address);
+    int err = _flash_poll_complete(address, 1);
 
     _nor_reset_state();
 
@@ -64,6 +64,10 @@
 #define MEM_REGION_HEAP_WRK
 #define MEM_REGION_PANIC
 
+/* Read cache in front of the SPI flash; RAM is tight here. */
+#define PLATFORM_FLASH_CACHE_LINES 8
+#define PLATFORM_FLASH_CACHE_LINE_SIZE 64
+
 
 static inline uint8_t is_interrupt_set(void)
 {
@@ -10,7 +10,11 @@
 
 typedef struct _qarena_t {
 	unsigned int size;
-	/* ... */
+	unsigned int used;	/* in blocks that are allocated, headers and all */
+	uint32_t flmap;		/* which first-level size classes have free blocks */
+	unsigned int nfl;	/* how many first-level classes this arena has */
+	uint8_t *slmap;		/* per first-level class, which second-level ones do */
+	struct qblock **freelist;	/* nfl by SL_COUNT of them */
 } qarena_t;
 
 extern qarena_t *qinit(void *start, unsigned size);
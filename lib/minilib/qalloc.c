@@ -3,6 +3,14 @@
  *
  * Author: Elizabeth Fong-Jones <elly@leptoquark.net>
  * Public domain; optionally see LICENSE
+ *
+ * Free blocks are kept on segregated lists, TLSF-style: a first-level class
+ * for each power of two, split into SL_COUNT second-level classes, with a
+ * bitmap of which lists have anything on them.  An allocation rounds its
+ * size up to the next class boundary, so that anything on the first list
+ * that the bitmaps turn up is sure to fit, and takes the head of it; a free
+ * finds its neighbours from its own size and a footer that every free block
+ * keeps at its end.  Neither has to walk the arena.
  */
 
 #include <minilib.h>
@@ -13,10 +21,9 @@
 #define HEAP_INTEGRITY
 //#define HEAP_PARANOID
 
-#define MINBSZ	4
-
 #define SZFLAG_SZ (~3)
 #define SZFLAG_FFREE 1
+#define SZFLAG_PFREE 2	/* the block before this one is free */
 
 
 typedef struct qblock {
@@ -29,18 +36,39 @@ typedef struct qblock {
 #endif
 } qblock_t;
 
-#define ALIGN(s)	((s + 3) & ~3)
+/* A free block keeps these at the start of its payload, and its size in its
+ * last word, so that the block after it can find it. */
+typedef struct qlinks {
+	qblock_t *next;
+	qblock_t *prev;
+} qlinks_t;
+
+#define QALIGN	sizeof(void *)
+#define ALIGN(s)	(((s) + QALIGN - 1) & ~(QALIGN - 1))
+
+/* The smallest block that can be free. */
+#define MINBLK	(sizeof(qblock_t) + sizeof(qlinks_t) + sizeof(unsigned long))
+
+/* Size classes.  Blocks are never smaller than 1 << FL_MIN. */
+#define SL_SHIFT	2
+#define SL_COUNT	(1 << SL_SHIFT)
+#define FL_MIN	4
 
 #define BLK(blk)		((qblock_t *)(blk))
 #define BLK_FROMPAYLOAD(p)	(void*)((char*)(p) - sizeof(qblock_t))
 #define BLK_SZ(blk)	((blk)->szflag & SZFLAG_SZ)
 #define BLK_NEXT(blk)	((qblock_t *)((char*)(blk) + BLK_SZ(blk)))
+#define BLK_PREV(blk)	((qblock_t *)((char*)(blk) - ((unsigned long *)(blk))[-1]))
 #define BLK_ISFREE(blk)	((blk)->szflag & SZFLAG_FFREE)
 #define BLK_FREE(blk)	((blk)->szflag |= SZFLAG_FFREE)
 #define BLK_ALLOC(blk)	((blk)->szflag &= ~SZFLAG_FFREE)
 #define BLK_PAYLOAD(p)	(void*)((char*)(p) + sizeof(qblock_t))
-#define BLK_COOKIE(arena, blk) ((unsigned)(arena) >> 4 ^ (unsigned)(blk))
-#define BLK_ALSIZE(size) ALIGN(size) + sizeof(qblock_t);
+#define BLK_LINKS(blk)	((qlinks_t *)BLK_PAYLOAD(blk))
+#define BLK_FOOTER(blk)	(((unsigned long *)BLK_NEXT(blk))[-1])
+#define BLK_COOKIE(arena, blk) ((unsigned)(uintptr_t)(arena) >> 4 ^ (unsigned)(uintptr_t)(blk))
+#define BLK_ALSIZE(size) (ALIGN(size) + sizeof(qblock_t) < MINBLK ? MINBLK : ALIGN(size) + sizeof(qblock_t))
+
+#define ARENA_END(arena)	BLK((char *)(arena) + (arena)->size)
 
 static void _cookie_set(qarena_t *arena, qblock_t *blk) {
 #ifdef HEAP_INTEGRITY
@@ -55,137 +83,231 @@ static void _cookie_unset(qarena_t *arena, qblock_t *blk) {
 #endif
 }
 
-static void qjoin(qarena_t *arena);
+static void qjoin(qarena_t *arena, qblock_t *blk);
 static void qcheck(qarena_t *arena, qblock_t *blk);
-static void _qsplit(qarena_t *arena, qblock_t *blk, unsigned size);
+static void _qtrim(qarena_t *arena, qblock_t *blk, unsigned size);
+
+/*** Size classes. ***/
+
+static unsigned _qfls(unsigned x) {
+	return 31 - __builtin_clz(x);
+}
+
+static void _qmapping(unsigned size, unsigned *fl, unsigned *sl) {
+	unsigned f = _qfls(size);
+
+	*fl = f - FL_MIN;
+	*sl = (size >> (f - SL_SHIFT)) & (SL_COUNT - 1);
+}
+
+static qblock_t **_qhead(qarena_t *arena, unsigned fl, unsigned sl) {
+	return &arena->freelist[fl * SL_COUNT + sl];
+}
+
+static void _qinsert(qarena_t *arena, qblock_t *blk) {
+	unsigned fl, sl;
+	qblock_t **head;
+
+	_qmapping(BLK_SZ(blk), &fl, &sl);
+	head = _qhead(arena, fl, sl);
+	BLK_LINKS(blk)->prev = NULL;
+	BLK_LINKS(blk)->next = *head;
+	if (*head)
+		BLK_LINKS(*head)->prev = blk;
+	*head = blk;
+	arena->flmap |= 1u << fl;
+	arena->slmap[fl] |= 1u << sl;
+}
+
+static void _qremove(qarena_t *arena, qblock_t *blk) {
+	unsigned fl, sl;
+	qlinks_t *l = BLK_LINKS(blk);
+
+#ifdef HEAP_INTEGRITY
+	if ((l->next && BLK_LINKS(l->next)->prev != blk) ||
+	    (l->prev && BLK_LINKS(l->prev)->next != blk))
+		panic("qcheck: free list corrupt");
+#endif
+	_qmapping(BLK_SZ(blk), &fl, &sl);
+	if (l->next)
+		BLK_LINKS(l->next)->prev = l->prev;
+	if (l->prev) {
+		BLK_LINKS(l->prev)->next = l->next;
+	} else if (!(*_qhead(arena, fl, sl) = l->next)) {
+		arena->slmap[fl] &= ~(1u << sl);
+		if (!arena->slmap[fl])
+			arena->flmap &= ~(1u << fl);
+	}
+}
+
+/* Finds a free block of at least size bytes, without taking it. */
+static qblock_t *_qfind(qarena_t *arena, unsigned size) {
+	unsigned fl, sl;
+	uint32_t map = 0;
+	qblock_t *blk;
+
+	/* Anything in a class past the one that size is in is big enough. */
+	_qmapping(size + (1u << (_qfls(size) - SL_SHIFT)) - 1, &fl, &sl);
+	if (fl < arena->nfl) {
+		map = arena->slmap[fl] & (~0u << sl);
+		if (!map && fl + 1 < arena->nfl) {
+			uint32_t flmap = arena->flmap & (~0u << (fl + 1));
+
+			if (flmap) {
+				fl = __builtin_ctz(flmap);
+				map = arena->slmap[fl];
+			}
+		}
+	}
+	if (map)
+		return *_qhead(arena, fl, __builtin_ctz(map));
+
+	/* Nearly out of memory, then; but there might still be a block in
+	 * size's own class that happens to be big enough. */
+	_qmapping(size, &fl, &sl);
+	if (fl >= arena->nfl)
+		return NULL;
+	for (blk = *_qhead(arena, fl, sl); blk; blk = BLK_LINKS(blk)->next)
+		if (BLK_SZ(blk) >= size)
+			return blk;
+	return NULL;
+}
+
+/*** Blocks. ***/
+
+/* Makes blk, of size bytes, into a free block, and files it.  Whatever is
+ * on either side of it must already be in use. */
+static void _qmkfree(qarena_t *arena, qblock_t *blk, unsigned size) {
+	blk->szflag = size | SZFLAG_FFREE;
+	_cookie_unset(arena, blk);
+	BLK_FOOTER(blk) = size;
+#ifdef HEAP_PARANOID
+	memset((char *)BLK_LINKS(blk) + sizeof(qlinks_t), 0xAA, size - MINBLK);
+#endif
+	if (BLK_NEXT(blk) < ARENA_END(arena))
+		BLK_NEXT(blk)->szflag |= SZFLAG_PFREE;
+	_qinsert(arena, blk);
+}
 
 qarena_t *qinit(void *start, unsigned size) {
 	qarena_t *arena = start;
+	unsigned nfl, ofs;
+
+	size &= ~(QALIGN - 1);
+	nfl = _qfls(size) - FL_MIN + 1;
 	arena->size = size;
-	
-	qblock_t *blk = BLK(arena + 1); // start = &arena[1], so arena[0] is left alone.
-	blk->szflag = size - sizeof(*arena);
-		_cookie_unset(arena, blk);
-#ifdef HEAP_PARANOID
-	memset(BLK_PAYLOAD(blk), 0xAA, BLK_SZ(blk) - sizeof(qblock_t));
-#endif
-	BLK_FREE(blk);
-	
+	arena->used = 0;
+	arena->flmap = 0;
+	arena->nfl = nfl;
+
+	/* The lists go after the arena, and then the blocks. */
+	arena->freelist = (qblock_t **)(arena + 1);
+	arena->slmap = (uint8_t *)(arena->freelist + nfl * SL_COUNT);
+	memset(arena->freelist, 0, nfl * SL_COUNT * sizeof(qblock_t *));
+	memset(arena->slmap, 0, nfl);
+	ofs = ALIGN((unsigned)((char *)(arena->slmap + nfl) - (char *)arena));
+
+	qblock_t *blk = BLK((char *)arena + ofs);
+	_qmkfree(arena, blk, size - ofs);
+
 	return arena;
 }
 
 void *qalloc(qarena_t *arena, unsigned size) {
-	qblock_t *blk = BLK(arena+1);
-	qblock_t *end = BLK((char *)arena + arena->size);
-	void *n = NULL;
-	
-	if (size == 0)
+	qblock_t *blk;
+
+	if (size == 0 || size > arena->size)
 		return NULL;
 
 	size = BLK_ALSIZE(size);
-	
-	while (blk && blk < end) {
-		qcheck(arena, blk);
-		
-		/* We need either exactly enough room for this block, or we
-		 * need enough room for this and one more block to be
-		 * constructed at the end.  */
-		if (!BLK_ISFREE(blk) ||
-			((BLK_SZ(blk) != size) &&
-			 (BLK_SZ(blk) < size + sizeof(qblock_t)))) {
-			blk = BLK_NEXT(blk);
-			continue;
-		}
 
-		if (BLK_SZ(blk) > size) {
-			_qsplit(arena, blk, size);
-		}
+	blk = _qfind(arena, size);
+	if (!blk)
+		return NULL;
+	qcheck(arena, blk);
 
-		_cookie_set(arena, blk);
-		BLK_ALLOC(blk);
-		
-		return BLK_PAYLOAD(blk);
-	}
-	return NULL;
+	_qremove(arena, blk);
+	BLK_ALLOC(blk);
+	_qtrim(arena, blk, size);
+	_cookie_set(arena, blk);
+	arena->used += BLK_SZ(blk);
+
+	return BLK_PAYLOAD(blk);
 }
 
-/* init a new block, carving the remaining space into a new free */
-static void _qsplit(qarena_t *arena, qblock_t *blk, unsigned size) {
-	qblock_t *newblk = (qblock_t *)((char*)blk + size);
-	newblk->szflag = BLK_SZ(blk) - size;
-	blk->szflag = size;
-	_cookie_unset(arena, newblk);
-	BLK_FREE(newblk);
+/* Cuts blk, which is in use, down to size, and frees the rest -- if the
+ * rest is big enough to be a block of its own; if not, blk keeps it. */
+static void _qtrim(qarena_t *arena, qblock_t *blk, unsigned size) {
+	if (BLK_SZ(blk) - size >= MINBLK) {
+		qblock_t *newblk = (qblock_t *)((char*)blk + size);
+		newblk->szflag = BLK_SZ(blk) - size;
+		blk->szflag = size | (blk->szflag & ~SZFLAG_SZ);
+		qjoin(arena, newblk);
+	} else if (BLK_NEXT(blk) < ARENA_END(arena)) {
+		BLK_NEXT(blk)->szflag &= ~SZFLAG_PFREE;
+	}
 }
 
 void *qrealloc(qarena_t *arena, void *ptr, unsigned size) {
-	if (size == 0)
+	if (size == 0 || size > arena->size)
 		return NULL;
-	
-	size = BLK_ALSIZE(size);
-	
+
 	if (!ptr)
 		return qalloc(arena, size);
-	
+
 	qblock_t *blk = BLK_FROMPAYLOAD(ptr);
-	
-	if (size == BLK_SZ(blk)) {
-		return BLK_PAYLOAD(blk);
-	}
+	unsigned oldsz = BLK_SZ(blk);
+	unsigned alsize = BLK_ALSIZE(size);
+
+#ifdef HEAP_INTEGRITY
+	qcheck(arena, blk);
+	if (BLK_ISFREE(blk))
+		panic("qrealloc: block is free");
+#endif
 
 	/* is the new size smaller? */
-	if (size < BLK_SZ(blk)) {
-		_qsplit(arena, blk, size);
-		_cookie_unset(arena, blk);
-		_cookie_set(arena, blk);
-		qjoin(arena);
-		return BLK_PAYLOAD(blk);
+	if (alsize <= oldsz) {
+		_qtrim(arena, blk, alsize);
+		arena->used -= oldsz - BLK_SZ(blk);
+		return ptr;
 	}
-	
-	/* is there room after */
+
+	/* is there a free block after, with room enough */
 	qblock_t *nblk = BLK_NEXT(blk);
-	uint32_t reqsize = size - BLK_SZ(blk);
-	if (BLK_SZ(nblk) >= reqsize) {
-		/* there is a free block after. Lets take what we need */
-		_qsplit(arena, nblk, reqsize);
-		blk->szflag = size;
-		return BLK_PAYLOAD(blk);
+	if (nblk < ARENA_END(arena) && BLK_ISFREE(nblk) && oldsz + BLK_SZ(nblk) >= alsize) {
+		qcheck(arena, nblk);
+		_qremove(arena, nblk);
+		blk->szflag += BLK_SZ(nblk);
+		_qtrim(arena, blk, alsize);
+		arena->used += BLK_SZ(blk) - oldsz;
+		return ptr;
 	}
 
 	/* There is no room after. Try malloc */
 	void *newm = qalloc(arena, size);
 	if (!newm)
 		return NULL;
-	
-	memcpy(newm, BLK_PAYLOAD(blk), BLK_SZ(blk));
-	qfree(arena, BLK_PAYLOAD(blk));
-	qjoin(arena);
-	
+
+	memcpy(newm, ptr, oldsz - sizeof(qblock_t));
+	qfree(arena, ptr);
+
 	return newm;
 }
 
 uint32_t qusedbytes(qarena_t *arena) {
-	qblock_t *blk = BLK(arena+1);
-	qblock_t *end = BLK((char *)arena + arena->size);
-	uint32_t cnt = 0;
-	
-	while (blk && blk < end) {
-		if (!BLK_ISFREE(blk)) {
-			cnt += BLK_SZ(blk);
-		}
-		blk = BLK_NEXT(blk);
-	}
-	return cnt;
+	return arena->used;
 }
 
 uint32_t qfreebytes(qarena_t *arena) {
-	return arena->size - qusedbytes(arena);
+	unsigned ofs = ALIGN((unsigned)((char *)(arena->slmap + arena->nfl) - (char *)arena));
+
+	return arena->size - ofs - arena->used;
 }
 
 void qfree(qarena_t *arena, void *ptr) {
 	if (!ptr)
 		return;
-		
+
 	qblock_t *blk = BLK_FROMPAYLOAD(ptr);
 
 #ifdef HEAP_INTEGRITY
@@ -193,31 +315,30 @@ void qfree(qarena_t *arena, void *ptr) {
 	if (BLK_ISFREE(blk))
 		panic("qfree: double free");	/* XXX: this "panic" needs to not panic if we are in an app */
 #endif
-#ifdef HEAP_PARANOID
-	memset(BLK_PAYLOAD(blk), 0xAA, BLK_SZ(blk) - sizeof(qblock_t));
-#endif
 
-	BLK_FREE(blk);
-	_cookie_unset(arena, blk);
-	qjoin(arena);
-}
-
-static void qjoin(qarena_t *arena) {
-	qblock_t *blk = BLK(arena+1);
-	qblock_t *end = (qblock_t *)((char *)arena + arena->size);
-	
-	while (blk && blk < end) {
-		qcheck(arena, blk);
-		if (BLK_NEXT(blk) < end && BLK_ISFREE(blk) && BLK_ISFREE(BLK_NEXT(blk))) {
-			qblock_t *nblk = BLK_NEXT(blk);
-			blk->szflag += BLK_SZ(nblk);
-#ifdef HEAP_PARANOID
-			memset(nblk, 0xAA, sizeof(qblock_t));
-#endif
-		} else {
-			blk = BLK_NEXT(blk);
-		}
+	arena->used -= BLK_SZ(blk);
+	qjoin(arena, blk);
+}
+
+/* Frees blk, along with whichever of its neighbours are free already. */
+static void qjoin(qarena_t *arena, qblock_t *blk) {
+	qblock_t *nblk = BLK_NEXT(blk);
+	unsigned size = BLK_SZ(blk);
+
+	if (nblk < ARENA_END(arena) && BLK_ISFREE(nblk)) {
+		qcheck(arena, nblk);
+		_qremove(arena, nblk);
+		size += BLK_SZ(nblk);
 	}
+	if (blk->szflag & SZFLAG_PFREE) {
+		qblock_t *pblk = BLK_PREV(blk);
+
+		qcheck(arena, pblk);
+		_qremove(arena, pblk);
+		size += BLK_SZ(pblk);
+		blk = pblk;
+	}
+	_qmkfree(arena, blk, size);
 }
 
 static void qcheck(qarena_t *arena, qblock_t *blk) {
@@ -227,6 +348,8 @@ static void qcheck(qarena_t *arena, qblock_t *blk) {
 			panic("qcheck: cookie0 corrupt on free blk");
 		if (blk->cookie1 != ~BLK_COOKIE(arena, blk))
 			panic("qcheck: cookie1 corrupt on free blk");
+		if (BLK_FOOTER(blk) != BLK_SZ(blk))
+			panic("qcheck: footer corrupt on free blk");
 	} else {
 		if (blk->cookie0 != ~BLK_COOKIE(arena, blk))
 			panic("qcheck: cookie0 corrupt on alloc blk");
@@ -237,9 +360,9 @@ static void qcheck(qarena_t *arena, qblock_t *blk) {
 #ifdef HEAP_PARANOID
 	if (BLK_ISFREE(blk)) {
 		unsigned i;
-		uint8_t *p = BLK_PAYLOAD(blk);
-		
-		for (i = 0; i < BLK_SZ(blk) - sizeof(qblock_t); i++)
+		uint8_t *p = (uint8_t *)BLK_LINKS(blk) + sizeof(qlinks_t);
+
+		for (i = 0; i < BLK_SZ(blk) - MINBLK; i++)
 			if (p[i] != 0xAA) {
 				printf("%08x %08x %08x %02x\n", p, i, &p[i], p[i]);
 				panic("qcheck: paranoia pays off -- heap corruption deep inside free block");
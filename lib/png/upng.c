@@ -1195,9 +1195,11 @@ upng_error upng_decode(upng_t* upng)
         }
 
 // Pebble has only so much free ram, so free source buffer now that we are
-// done with it.
-app_free(upng->source.buffer);
+// done with it -- if it's ours to free; otherwise it belongs to the caller.
+if (upng->source.owning != 0)
+        app_free((void*)upng->source.buffer);
 upng->source.buffer = NULL;
+upng->source.owning = 0;
 
         /* allocate space to store inflated (but still filtered) data */
         //inflated_size = ((upng->width * (upng->height * upng_get_bpp(upng) + 7)) / 8) + upng->height;
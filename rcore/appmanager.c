@@ -212,6 +212,39 @@ void appmanager_app_set_flag(App *app, uint8_t flag, bool value)
     app->flags = (app->flags & ~(1 << flag)) | ((value == true ? 1 : 0) << flag);
 }
 
+static void _app_release_files(app_running_thread *thread)
+{
+    char buffer[14];
+    
+    if (!thread->files_held)
+        return;
+    
+    snprintf(buffer, 14, "@%08lx/app", thread->files_held->id);
+    fs_gc_release(buffer);
+    snprintf(buffer, 14, "@%08lx/res", thread->files_held->id);
+    fs_gc_release(buffer);
+    thread->files_held = NULL;
+}
+
+/* The garbage collector moves app files around while they aren't in use,
+ * so what we found at boot might not be where they are now; look them up
+ * again, and keep them there for as long as the app runs. */
+static void _app_hold_files(app_running_thread *thread)
+{
+    App *app = thread->app;
+    char buffer[14];
+    
+    _app_release_files(thread);
+    
+    snprintf(buffer, 14, "@%08lx/app", app->id);
+    fs_gc_hold(buffer);
+    appmanager_app_set_flag(app, AppFilePresent, fs_find_file(&app->app_file, buffer) >= 0);
+    snprintf(buffer, 14, "@%08lx/res", app->id);
+    fs_gc_hold(buffer);
+    appmanager_app_set_flag(app, ResourceFilePresent, fs_find_file(&app->resource_file, buffer) >= 0);
+    thread->files_held = app;
+}
+
 static void _draw(uint8_t state)
 {
     static TickType_t _last_complete_draw = 0;
@@ -290,6 +323,7 @@ static void _appmanager_thread_state_update(uint32_t app_id, uint8_t thread_id,
         if (_this_thread->app_start_tick > 0 && 
             _this_thread->app_start_tick + pdMS_TO_TICKS(6000) < xTaskGetTickCount()) {
                 LOG_ERROR("Timed out loading app");
+                _app_release_files(_this_thread);
                 _this_thread->status = AppThreadUnloaded;
                 appmanager_app_start("System");
         }
@@ -327,6 +361,8 @@ static void _appmanager_thread_state_update(uint32_t app_id, uint8_t thread_id,
             vTaskDelete(_this_thread->task_handle);
             _this_thread->task_handle = NULL;
             LOG_ERROR("The previous task was still running. FIXME");
+            if (_this_thread->thread_type == AppThreadMainApp)
+                persist_app_exit(true);
         }
         
         mem_heap_init(_this_thread->heap);
@@ -336,6 +372,7 @@ static void _appmanager_thread_state_update(uint32_t app_id, uint8_t thread_id,
         if (!_app_executes_from_internal_rom(app))
         {
             /* Check to see if we have app and resource files */
+            _app_hold_files(_this_thread);
             if (!_app_file_present(app))
             {
                 /* We now request the app from the host device */
@@ -475,6 +512,7 @@ static void _app_management_thread(void *parms)
                     vTaskDelete(_this_thread->task_handle);
                     _this_thread->task_handle = NULL;
                     _this_thread->shutdown_at_tick = 0;
+                    _app_release_files(_this_thread);
                     _this_thread->app = NULL;
                     _this_thread->status = AppThreadUnloaded;
 
@@ -500,6 +538,11 @@ static void _app_management_thread(void *parms)
                 vTaskDelete(_this_thread->task_handle);
                 _this_thread->shutdown_at_tick = 0;
                 _this_thread->status = AppThreadUnloaded;
+                _app_release_files(_this_thread);
+                
+                /* It didn't get to write back its persist cache itself. */
+                if (_this_thread->thread_type == AppThreadMainApp)
+                    persist_app_exit(true);
             }
             /* app really should have died by now */
         }
@@ -128,6 +128,7 @@ App *appmanager_get_app_by_uuid(Uuid *uuid);
 void appmanager_app_loader_init(void);
 uint32_t appmanager_get_next_appid(void);
 void appmanager_app_loader_init_n();
+int appmanager_app_delete_n(const Uuid *uuid);
 void rocky_event_loop_with_resource(uint16_t resource_id);
 
 void timer_init(void);
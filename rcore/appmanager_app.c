@@ -16,6 +16,7 @@
 #include "node_list.h"
 #include "rdb.h"
 #include "musicapp.h"
+#include "storage_persist.h"
 
 static App *_appmanager_create_app(char *name, Uuid *uuid, uint32_t app_id, uint8_t type, void *entry_point, bool is_internal,
                                    const struct file *app_file, const struct file *resource_file);
@@ -75,12 +76,184 @@ typedef struct appdb_n
 
 static list_head _app_manifest_head = LIST_HEAD(_app_manifest_head);
 
+/* Apps on flash live in files called "@<id>/app" and "@<id>/res".  Rather
+ * than look each of those up by name for every app in the databases, we
+ * list them all in one go, and the loaders look in here.  Ids that nobody
+ * claims are left over from apps that were deleted, and get cleaned up. */
+#define APP_FILES_APP 1
+#define APP_FILES_RES 2
+
+struct app_files {
+    uint32_t id;
+    uint8_t present;    /* APP_FILES_APP | APP_FILES_RES */
+    uint8_t referenced; /* some database knows about this app */
+    struct file app;
+    struct file res;
+};
+
+static struct app_files *_app_files;
+static int _app_files_n;
+
+/* Pulls the id out of "@<id>/...", and returns a pointer to the "...", or
+ * NULL if the name isn't one of ours. */
+static const char *_appmanager_parse_app_file_name(const char *name, uint32_t *id)
+{
+    char *end;
+    
+    if (name[0] != '@')
+        return NULL;
+    *id = strtoul(name + 1, &end, 16);
+    if (end != name + 9 || *end != '/')
+        return NULL;
+    
+    return end + 1;
+}
+
+static struct app_files *_appmanager_find_app_files(uint32_t id)
+{
+    for (int i = 0; i < _app_files_n; i++)
+        if (_app_files[i].id == id)
+            return &_app_files[i];
+    
+    return NULL;
+}
+
+static void _appmanager_scan_app_files(void)
+{
+    struct fs_dir dir;
+    struct fs_dirent ent;
+    int nalloc = 0;
+    
+    free(_app_files);
+    _app_files = NULL;
+    _app_files_n = 0;
+    
+    fs_opendir(&dir, "@");
+    while (fs_readdir(&dir, &ent)) {
+        uint32_t id;
+        const char *kind = _appmanager_parse_app_file_name(ent.name, &id);
+        if (!kind)
+            continue;
+        
+        struct app_files *af = _appmanager_find_app_files(id);
+        if (!af) {
+            if (_app_files_n == nalloc) {
+                int n = nalloc ? nalloc * 2 : 16;
+                struct app_files *p = realloc(_app_files, n * sizeof(*p));
+                if (!p) {
+                    KERN_LOG("app", APP_LOG_LEVEL_ERROR, "out of memory listing app files");
+                    break;
+                }
+                _app_files = p;
+                nalloc = n;
+            }
+            af = &_app_files[_app_files_n++];
+            memset(af, 0, sizeof(*af));
+            af->id = id;
+        }
+        
+        if (!strcmp(kind, "app")) {
+            af->app = ent.file;
+            af->present |= APP_FILES_APP;
+        } else if (!strcmp(kind, "res")) {
+            af->res = ent.file;
+            af->present |= APP_FILES_RES;
+        }
+    }
+}
+
+/* Deletes the files of every app that no database mentions.  The legacy
+ * appdb loader has already marked the ones that it knows about.  Persist
+ * data go by UUID, not by id, so those go if no app in the manifest has
+ * their UUID. */
+static void _appmanager_reclaim_app_files(void)
+{
+    struct fs_dir dir;
+    struct fs_dirent ent;
+    struct rdb_iter it;
+    int nstale = 0;
+    int complete = 0;
+    
+    /* Only believe the database if it's there, and has something in it; a
+     * missing one is no reason to throw every app away. */
+    struct rdb_database *db = rdb_open(RDB_ID_APP);
+    if (rdb_iter_start(db, &it)) {
+        do {
+            uint32_t id;
+            struct app_files *af;
+            
+            if (it.key_len == sizeof(id) && rdb_iter_read_key(&it, &id) == sizeof(id) &&
+                (af = _appmanager_find_app_files(id)))
+                af->referenced = 1;
+        } while (rdb_iter_next(&it));
+        complete = 1;
+    }
+    rdb_close(db);
+    if (!complete)
+        return;
+    
+    persist_reclaim();
+    
+    for (int i = 0; i < _app_files_n; i++)
+        nstale += !_app_files[i].referenced;
+    if (!nstale)
+        return;
+    
+    fs_opendir(&dir, "@");
+    while (fs_readdir(&dir, &ent)) {
+        uint32_t id;
+        struct app_files *af;
+        
+        if (!_appmanager_parse_app_file_name(ent.name, &id))
+            continue;
+        af = _appmanager_find_app_files(id);
+        if (!af || af->referenced)
+            continue;
+        
+        KERN_LOG("app", APP_LOG_LEVEL_INFO, "reclaiming %s, which belongs to no app", ent.name);
+        fs_unlink(ent.name);
+    }
+}
+
 
 void appmanager_app_loader_init_n()
 {
+    _appmanager_scan_app_files();
     _appmanager_flash_load_app_manifest_n();
 }
 
+/*
+ * Uninstall an app that the phone put in the app database: its records go,
+ * and so do its persist values.  Its files are left for the sweep at the
+ * next boot, when nothing claims them any more.
+ */
+int appmanager_app_delete_n(const Uuid *uuid)
+{
+    struct rdb_database *db = rdb_open(RDB_ID_APP);
+    struct rdb_cursor cur;
+    uint32_t key;
+    int n = 0;
+    
+    struct rdb_selector selectors[] = {
+        { offsetof(appdb_n, app_uuid), FIELD_SIZEOF(appdb_n, app_uuid), RDB_OP_EQ, (void *)uuid },
+        { }
+    };
+    
+    rdb_cursor_start(&cur, db, selectors, &key, sizeof(key));
+    while (rdb_cursor_next(&cur))
+        if (rdb_delete(&cur.it) == Blob_Success)
+            n++;
+    rdb_close(db);
+    
+    if (!n)
+        return Blob_KeyDoesNotExist;
+    
+    KERN_LOG("app", APP_LOG_LEVEL_INFO, "uninstalled app, %d records", n);
+    persist_delete_app(uuid);
+    
+    return Blob_Success;
+}
+
 /*
  * Load any pre-existing apps into the manifest, search for any new ones and then start up
  */
@@ -115,10 +288,15 @@ void appmanager_app_loader_init()
                                                        NULL, 9997, 
                                                        AppTypeSystem, music_main, true, &empty, &empty));
   
-    /* now load the ones on flash */
+    /* now load the ones on flash, with the collector held off until we're
+     * done with what the scan found */
+    fs_gc_hold(NULL);
+    _appmanager_scan_app_files();
     _appmanager_flash_load_app_manifest();
-    
-    appmanager_app_loader_init_n();
+    _appmanager_flash_load_app_manifest_n();
+    fs_gc_release(NULL);
+    persist_init();
+    _appmanager_reclaim_app_files();
 }
 
 
@@ -175,57 +353,52 @@ static App *_appmanager_create_app(char *name, Uuid *uuid, uint32_t app_id, uint
 
 static void _appmanager_flash_load_app_manifest_n(void)
 {
-    list_head head;
-    list_init_head(&head);
-    
     struct rdb_database *db = rdb_open(RDB_ID_APP);
-    struct rdb_iter it;
-    if (rdb_iter_start(db, &it) == 0) {
-        rdb_close(db);
-        return;
-    }
+    struct rdb_cursor cur;
+    uint32_t buf[(sizeof(uint32_t) + FIELD_SIZEOF(appdb_n, app_name) + sizeof(Uuid) + sizeof(uint32_t)) / 4 + 3];
+    int count = 0;
     
-    int zero = 0;
     struct rdb_selector selectors[] = {
         { offsetof(appdb_n, app_name), FIELD_SIZEOF(appdb_n, app_name), RDB_OP_RESULT },
         { offsetof(appdb_n, app_uuid), FIELD_SIZEOF(appdb_n, app_uuid), RDB_OP_RESULT },
         { offsetof(appdb_n, flags), FIELD_SIZEOF(appdb_n, flags), RDB_OP_RESULT },
         { }
     };
-    int count = rdb_select(&it, &head, selectors);
+    
+    rdb_cursor_start(&cur, db, selectors, buf, sizeof(buf));
+    while (rdb_cursor_next(&cur)) {
+        if (!cur.key || cur.it.key_len != sizeof(uint32_t) || !cur.result[0] || !cur.result[1] || !cur.result[2])
+            continue;
         
-    struct rdb_select_result *res;
-    KERN_LOG("app", APP_LOG_LEVEL_ERROR, "found %d apps", count);
-    rdb_select_result_foreach(res, &head) {
-        uint32_t appid = *(uint32_t *)res->key;
+        uint32_t appid = *(uint32_t *)cur.key;
+        char name[FIELD_SIZEOF(appdb_n, app_name) + 1];
+        memcpy(name, cur.result[0], FIELD_SIZEOF(appdb_n, app_name));
+        name[FIELD_SIZEOF(appdb_n, app_name)] = 0;
+        count++;
         
         /* does it have a file? */
-        struct file appfile, resfile;
-        int hasapp, hasres;
-        char fname[14];
-        snprintf(fname, 14, "@%08lx/app", appid);
-        hasapp = fs_find_file(&appfile, fname) >= 0;
-        snprintf(fname, 14, "@%08lx/res", appid);
-        hasres = fs_find_file(&resfile, fname) >= 0;
-
-        KERN_LOG("app", APP_LOG_LEVEL_ERROR, "FOUND App %d (%s) with key %08x (app %s, res %s)", count, (char *)res->result[0], appid,
+        struct app_files *af = _appmanager_find_app_files(appid);
+        int hasapp = af && (af->present & APP_FILES_APP);
+        int hasres = af && (af->present & APP_FILES_RES);
+
+        KERN_LOG("app", APP_LOG_LEVEL_ERROR, "FOUND App %d (%s) with key %08x (app %s, res %s)", count, name, appid,
             hasapp ? "present" : "missing",
             hasres ? "present" : "missing");
         
         /* main gets set later */
-        App *app = _appmanager_create_app((char *)res->result[0],
-                                                           (Uuid *)res->result[1],
-                                                           *(uint32_t *)res->key,
-                                                           ((*(uint32_t *)res->result[2]) & APPDB_FLAGS_IS_WATCHFACE) ? AppTypeWatchface : AppTypeApp,
+        App *app = _appmanager_create_app(name,
+                                                           (Uuid *)cur.result[1],
+                                                           appid,
+                                                           ((*(uint32_t *)cur.result[2]) & APPDB_FLAGS_IS_WATCHFACE) ? AppTypeWatchface : AppTypeApp,
                                                            NULL,
                                                            false,
-                                                           hasapp ? &appfile : NULL,
-                                                           hasres ? &resfile : NULL);
+                                                           hasapp ? &af->app : NULL,
+                                                           hasres ? &af->res : NULL);
         
         _appmanager_add_to_manifest(app);
     }
+    KERN_LOG("app", APP_LOG_LEVEL_ERROR, "found %d apps", count);
     rdb_close(db);
-    rdb_select_free_all(&head);
 }
 
 /*
@@ -244,11 +417,9 @@ static void _appmanager_flash_load_app_manifest(void)
         return;
     }
 
-    char buffer[14];
     struct appdb appdb;
     struct fd fd;
-    struct file app_file;
-    struct file res_file;
+    struct app_files *af;
     struct fd app_fd;
     ApplicationHeader header;
 
@@ -279,15 +450,14 @@ static void _appmanager_flash_load_app_manifest(void)
             break;
         }
         
-        snprintf(buffer, 14, "@%08lx/app", appdb.application_id);
-        if (fs_find_file(&app_file, buffer) < 0)
+        af = _appmanager_find_app_files(appdb.application_id);
+        if (!af)
             continue;
-
-        snprintf(buffer, 14, "@%08lx/res", appdb.application_id);
-        if (fs_find_file(&res_file, buffer) < 0)
+        af->referenced = 1;
+        if (af->present != (APP_FILES_APP | APP_FILES_RES))
             continue;
 
-        fs_open(&app_fd, &app_file);
+        fs_open(&app_fd, &af->app);
 
         if (fs_read(&app_fd, &header, sizeof(ApplicationHeader)) != sizeof(ApplicationHeader))
             break;
@@ -313,8 +483,8 @@ static void _appmanager_flash_load_app_manifest(void)
                                                            (appdb.flags & APPDB_FLAGS_IS_WATCHFACE) ? AppTypeWatchface : AppTypeApp,
                                                            NULL,
                                                            false,
-                                                           &app_file,
-                                                           &res_file));
+                                                           &af->app,
+                                                           &af->res));
     }
 }
 
@@ -13,6 +13,7 @@
 #include "timers.h"
 #include "ngfxwrap.h"
 #include "event_service.h"
+#include "storage_persist.h"
 
 /* Configure Logging */
 #define MODULE_NAME "apploop"
@@ -74,6 +75,9 @@ void appmanager_app_main_entry(void)
     /* App done */
     _this_thread->status = AppThreadUnloading;
     
+    /* Write back anything it left in the persist cache. */
+    persist_app_exit(false);
+    
     LOG_DEBUG("App Finished.");
     appmanager_app_quit_done();
     
@@ -97,6 +97,7 @@ typedef struct app_running_thread_t {
     size_t stack_size;
     StackType_t *stack;
     struct CoreTimer *timer_head;
+    App *files_held;            // whose files the garbage collector has to leave where they are, if anyone's
     struct mem_heap *heap;
     struct n_GContext *graphics_context;
 } app_running_thread;
@@ -417,39 +417,30 @@ static int _bondreq_datalen;
 static void _get_bond_data(void *p) {
     struct rdb_database *db = rdb_open(RDB_ID_BLUETOOTH);
     struct rdb_iter it;
-    rdb_select_result_list head = LIST_HEAD(head);
     
-    int rv = rdb_iter_start(db, &it);
-    if (!rv) {
-        DRV_LOG("btbond", APP_LOG_LEVEL_INFO, "no bond database (looking up \"%08x...\")", *(uint32_t *)_bondreq_peer);
+    if (!rdb_find(db, _bondreq_peer, _bondreq_len, &it)) {
+        DRV_LOG("btbond", APP_LOG_LEVEL_INFO, "no bond data available for \"%08x...\"", *(uint32_t *)_bondreq_peer);
         hw_bluetooth_bond_data_available(NULL, 0);
         rdb_close(db);
         return;
     }
-
-    struct rdb_selector selectors[] = {
-        { RDB_SELECTOR_OFFSET_KEY, _bondreq_len, RDB_OP_EQ, (void *) _bondreq_peer },
-        { 0, 0, RDB_OP_RESULT_FULLY_LOAD },
-        { }
-    };
     
-    int n = rdb_select(&it, &head, selectors);
-    assert(n <= 1 && "must have zero or one bluetooth bond results...");
-    if (n == 0) {
-        DRV_LOG("btbond", APP_LOG_LEVEL_INFO, "no bond data available for \"%08x...\"", *(uint32_t *)_bondreq_peer);
+    uint8_t *data = malloc(it.data_len);
+    if (!data || rdb_iter_read_data(&it, 0, data, it.data_len) != it.data_len) {
+        DRV_LOG("btbond", APP_LOG_LEVEL_ERROR, "failed to read bond data for \"%08x...\"", *(uint32_t *)_bondreq_peer);
         hw_bluetooth_bond_data_available(NULL, 0);
+        free(data);
         rdb_close(db);
         return;
     }
     
-    struct rdb_select_result *res = rdb_select_result_head(&head);
-    uint8_t namelen = ((uint8_t *)res->result[0])[0] /* including terminating 0 */;
-    uint8_t bondlen = ((uint8_t *)res->result[0])[1];
+    uint8_t namelen = data[0] /* including terminating 0 */;
+    uint8_t bondlen = data[1];
     
-    DRV_LOG("btbond", APP_LOG_LEVEL_INFO, "found bond (res %p, result %p) for device %s with len %d", res, res->result[0], ((uint8_t *)res->result[0]) + 2, bondlen);
-    hw_bluetooth_bond_data_available((res->result[0]) + 2 + namelen, bondlen);
+    DRV_LOG("btbond", APP_LOG_LEVEL_INFO, "found bond (data %p) for device %s with len %d", data, data + 2, bondlen);
+    hw_bluetooth_bond_data_available(data + 2 + namelen, bondlen);
     
-    rdb_select_free_all(&head);
+    free(data);
     rdb_close(db);
 }
 
@@ -9,16 +9,35 @@
 #include "platform.h"
 #include "flash.h"
 #include "fs.h"
+#include "rtoswrap.h"
 
 extern void hw_flash_init(void);
 extern void hw_flash_read_bytes(uint32_t, uint8_t*, size_t);
 extern int hw_flash_erase_sync(uint32_t addr, uint32_t len);
 extern int hw_flash_write_sync(uint32_t addr, uint8_t *buf, size_t len);
+#ifdef PLATFORM_FLASH_MAPPED
+extern const void *hw_flash_map(uint32_t addr, size_t len);
+extern void hw_flash_unmap(const void *p, size_t len);
+#endif
 
 static SemaphoreHandle_t _flash_mutex;
 static StaticSemaphore_t _flash_mutex_buf;
 static SemaphoreHandle_t _flash_wait_semaphore;
 static StaticSemaphore_t _flash_wait_semaphore_buf;
+#ifdef PLATFORM_FLASH_MAPPED
+static SemaphoreHandle_t _flash_unmapped; /* given when the last mapping goes away */
+static StaticSemaphore_t _flash_unmapped_buf;
+#endif
+static struct flash_io_stats _flash_io_stats;
+static volatile uint32_t _flash_activity; /* see flash_get_activity */
+static struct flash_tag_stats _flash_tag_stats[FLASH_TAG_COUNT];
+
+static void _flash_cache_init(void);
+static void _flash_io_thread(void *par);
+static void _flash_program_begin(uint32_t addr);
+static void _flash_program_end(void);
+
+THREAD_DEFINE(flash_io, 400, tskIDLE_PRIORITY + 7UL, _flash_io_thread);
 
 uint8_t flash_init()
 {
@@ -27,12 +46,77 @@ uint8_t flash_init()
     
     _flash_mutex = xSemaphoreCreateMutexStatic(&_flash_mutex_buf);
     _flash_wait_semaphore = xSemaphoreCreateBinaryStatic(&_flash_wait_semaphore_buf);
+#ifdef PLATFORM_FLASH_MAPPED
+    _flash_unmapped = xSemaphoreCreateBinaryStatic(&_flash_unmapped_buf);
+#endif
+    
+    _flash_cache_init();
+    THREAD_CREATE(flash_io);
     
     fs_init();
     
     return 0;
 }
 
+/*** Who's using the flash. ***/
+
+/* Each task has a tag in its thread-local storage, which starts out as
+ * FLASH_TAG_OTHER; subsystems that want their traffic counted separately
+ * set it around what they do.  The counters are only approximate across
+ * tasks, since they're bumped without a lock, but each one only ever goes
+ * up. */
+static uint8_t _flash_get_tag(void)
+{
+    return (uintptr_t)pvTaskGetThreadLocalStoragePointer(NULL /* this task */, FREERTOS_TLS_FLASH_TAG);
+}
+
+uint8_t flash_set_tag(uint8_t tag)
+{
+    uint8_t old = _flash_get_tag();
+    
+    vTaskSetThreadLocalStoragePointer(NULL /* this task */, FREERTOS_TLS_FLASH_TAG, (void *)(uintptr_t)tag);
+    
+    return old;
+}
+
+static struct flash_tag_stats *_flash_tag_stats_for(uint32_t addr)
+{
+    uint8_t tag = _flash_get_tag();
+    
+    if (tag >= FLASH_TAG_COUNT)
+        tag = FLASH_TAG_OTHER;
+    if (tag == FLASH_TAG_OTHER && addr >= REGION_FS_START && addr < REGION_FS_START + REGION_FS_N_PAGES * REGION_FS_PAGE_SIZE)
+        tag = FLASH_TAG_FS;
+    
+    return &_flash_tag_stats[tag];
+}
+
+void flash_note_written(size_t bytes)
+{
+    _flash_tag_stats_for(REGION_FS_START)->written_bytes += bytes;
+}
+
+void flash_get_tag_stats(struct flash_tag_stats *stats)
+{
+    taskENTER_CRITICAL();
+    memcpy(stats, _flash_tag_stats, sizeof(_flash_tag_stats));
+    taskEXIT_CRITICAL();
+}
+
+/* Takes the mutex, and writes down how long we had to wait for it. */
+static void _flash_lock(uint32_t addr)
+{
+    if (xSemaphoreTake(_flash_mutex, 0))
+        return;
+    
+    struct flash_tag_stats *st = _flash_tag_stats_for(addr);
+    TickType_t start = xTaskGetTickCount();
+    
+    xSemaphoreTake(_flash_mutex, portMAX_DELAY);
+    st->lock_waits++;
+    st->lock_ticks += xTaskGetTickCount() - start;
+}
+
 /* Some platforms have brain damage, like nRF52840, and can't read from
  * flash in multiples less than 4 bytes. */
 #ifndef PLATFORM_FLASH_DMA_ALIGNMENT
@@ -53,13 +137,194 @@ uint8_t flash_init()
 
 // #define FLASH_NOISY_WRITE_ALIGNMENT
 
+/*** Read cache. ***/
+
+/* Every read used to mean taking the mutex, starting a transfer, and
+ * waiting for it to finish, even for the two bytes of an rdb header.  So
+ * we keep a small LRU cache of aligned lines of flash; reads that only
+ * touch a line or two get served out of it, and bigger ones (which are
+ * usually somebody streaming a resource into a buffer of their own) go
+ * straight to the hardware.  When a miss lands right after the last line
+ * that we filled, we assume that someone is reading sequentially, and fill
+ * the next few lines in the same transfer.
+ *
+ * Anything that writes or erases flash drops the lines that it touches,
+ * under the same mutex that the reads take.
+ */
+#ifndef PLATFORM_FLASH_CACHE_LINES
+#define PLATFORM_FLASH_CACHE_LINES 8
+#endif
+
+#ifndef PLATFORM_FLASH_CACHE_LINE_SIZE
+#define PLATFORM_FLASH_CACHE_LINE_SIZE 64 /* must be a power of two */
+#endif
+
+#ifndef PLATFORM_FLASH_CACHE_READAHEAD
+#define PLATFORM_FLASH_CACHE_READAHEAD 4 /* lines */
+#endif
+
+/* Read-ahead never crosses one of these, so that we never read off the end
+ * of the chip; every flash part that we know of is a multiple of 4k. */
+#define FLASH_CACHE_READAHEAD_BOUNDARY 4096
+
+#define FLASH_CACHE_LINE_MASK (~(uint32_t)(PLATFORM_FLASH_CACHE_LINE_SIZE - 1))
+#define FLASH_CACHE_INVALID   0xFFFFFFFF
+
+#if PLATFORM_FLASH_CACHE_READAHEAD > PLATFORM_FLASH_CACHE_LINES
+#error read-ahead must fit in the cache
+#endif
+
+struct flash_cache_line {
+    uint32_t addr; /* FLASH_CACHE_INVALID if this line is empty */
+    uint32_t last_used;
+    uint8_t data[PLATFORM_FLASH_CACHE_LINE_SIZE] __attribute__((aligned(4)));
+};
+
+static struct flash_cache_line _flash_cache[PLATFORM_FLASH_CACHE_LINES];
+static uint8_t _flash_cache_fill_buf[PLATFORM_FLASH_CACHE_READAHEAD * PLATFORM_FLASH_CACHE_LINE_SIZE] __attribute__((aligned(4)));
+static uint32_t _flash_cache_clock = 0;
+static uint32_t _flash_cache_next_fill = FLASH_CACHE_INVALID;
+static struct flash_cache_stats _flash_cache_stats;
+
+static void _flash_cache_init(void)
+{
+    for (int i = 0; i < PLATFORM_FLASH_CACHE_LINES; i++)
+        _flash_cache[i].addr = FLASH_CACHE_INVALID;
+}
+
+/* Reads straight from the hardware.  Call with the mutex held. */
+static void _flash_hw_read(uint32_t address, uint8_t *buffer, size_t num_bytes)
+{
+    _flash_tag_stats_for(address)->read_bytes += num_bytes;
+    hw_flash_read_bytes(address, buffer, num_bytes);
+    
+    /* sit the caller being this wait lock semaphore */
+    if (!xSemaphoreTake(_flash_wait_semaphore, pdMS_TO_TICKS(200)))
+        panic("Got stuck behind a wait lock in flash.c");
+}
+
+static struct flash_cache_line *_flash_cache_victim()
+{
+    struct flash_cache_line *line = &_flash_cache[0];
+    
+    for (int i = 0; i < PLATFORM_FLASH_CACHE_LINES; i++) {
+        if (_flash_cache[i].addr == FLASH_CACHE_INVALID)
+            return &_flash_cache[i];
+        if (_flash_cache[i].last_used < line->last_used)
+            line = &_flash_cache[i];
+    }
+    
+    return line;
+}
+
+/* Returns the line that holds addr, filling it (and maybe some more after
+ * it) if need be.  Call with the mutex held. */
+static struct flash_cache_line *_flash_cache_get(uint32_t addr)
+{
+    struct flash_cache_line *line = NULL;
+    uint32_t lineaddr = addr & FLASH_CACHE_LINE_MASK;
+    int nlines = 1;
+    
+    for (int i = 0; i < PLATFORM_FLASH_CACHE_LINES; i++) {
+        if (_flash_cache[i].addr == lineaddr) {
+            _flash_cache_stats.hits++;
+            _flash_cache[i].last_used = ++_flash_cache_clock;
+            return &_flash_cache[i];
+        }
+    }
+    
+    _flash_cache_stats.misses++;
+    
+    if (lineaddr == _flash_cache_next_fill) {
+        uint32_t boundary = (lineaddr & ~(FLASH_CACHE_READAHEAD_BOUNDARY - 1)) + FLASH_CACHE_READAHEAD_BOUNDARY;
+        
+        nlines = PLATFORM_FLASH_CACHE_READAHEAD;
+        if (lineaddr + nlines * PLATFORM_FLASH_CACHE_LINE_SIZE > boundary)
+            nlines = (boundary - lineaddr) / PLATFORM_FLASH_CACHE_LINE_SIZE;
+    }
+    
+    _flash_hw_read(lineaddr, _flash_cache_fill_buf, nlines * PLATFORM_FLASH_CACHE_LINE_SIZE);
+    _flash_cache_next_fill = lineaddr + nlines * PLATFORM_FLASH_CACHE_LINE_SIZE;
+    
+    /* Fill them back to front, so that the line that we were asked for is
+     * the most recently used, and the one that we return. */
+    for (int n = nlines - 1; n >= 0; n--) {
+        uint32_t fillad = lineaddr + n * PLATFORM_FLASH_CACHE_LINE_SIZE;
+        
+        line = NULL;
+        for (int i = 0; i < PLATFORM_FLASH_CACHE_LINES; i++)
+            if (_flash_cache[i].addr == fillad)
+                line = &_flash_cache[i];
+        if (!line)
+            line = _flash_cache_victim();
+        
+        line->addr = fillad;
+        line->last_used = ++_flash_cache_clock;
+        memcpy(line->data, _flash_cache_fill_buf + n * PLATFORM_FLASH_CACHE_LINE_SIZE, PLATFORM_FLASH_CACHE_LINE_SIZE);
+        if (n)
+            _flash_cache_stats.readahead_lines++;
+    }
+    
+    return line;
+}
+
+/* Drops anything that overlaps [addr, addr + len).  Call with the mutex
+ * held. */
+static void _flash_cache_invalidate(uint32_t addr, uint32_t len)
+{
+    for (int i = 0; i < PLATFORM_FLASH_CACHE_LINES; i++) {
+        if (_flash_cache[i].addr == FLASH_CACHE_INVALID)
+            continue;
+        if (_flash_cache[i].addr < addr + len &&
+            _flash_cache[i].addr + PLATFORM_FLASH_CACHE_LINE_SIZE > addr) {
+            _flash_cache[i].addr = FLASH_CACHE_INVALID;
+            _flash_cache_stats.invalidations++;
+        }
+    }
+    
+    _flash_cache_next_fill = FLASH_CACHE_INVALID;
+}
+
+void flash_get_cache_stats(struct flash_cache_stats *stats)
+{
+    xSemaphoreTake(_flash_mutex, portMAX_DELAY);
+    *stats = _flash_cache_stats;
+    xSemaphoreGive(_flash_mutex);
+}
+
 /*
  * Read a given number of bytes SAFELY from the flash chip
  * DO NOT use from an ISR
  */
 void flash_read_bytes(uint32_t address, uint8_t *buffer, size_t num_bytes)
 {
-    int unaligned = ((uint32_t)buffer) & (PLATFORM_FLASH_DMA_ALIGNMENT - 1);
+    if (!num_bytes)
+        return;
+    
+    _flash_activity++;
+    
+    /* Small reads come out of the cache, which takes care of alignment for
+     * us, too. */
+    if (((address + num_bytes - 1) & FLASH_CACHE_LINE_MASK) - (address & FLASH_CACHE_LINE_MASK) < 2 * PLATFORM_FLASH_CACHE_LINE_SIZE) {
+        _flash_lock(address);
+        while (num_bytes) {
+            struct flash_cache_line *line = _flash_cache_get(address);
+            size_t ofs = address - line->addr;
+            size_t n = PLATFORM_FLASH_CACHE_LINE_SIZE - ofs;
+            
+            if (n > num_bytes)
+                n = num_bytes;
+            memcpy(buffer, line->data + ofs, n);
+            buffer += n;
+            address += n;
+            num_bytes -= n;
+        }
+        xSemaphoreGive(_flash_mutex);
+        
+        return;
+    }
+    
+    int unaligned = ((uintptr_t)buffer) & (PLATFORM_FLASH_DMA_ALIGNMENT - 1);
     if (unaligned) {
         int nfix = PLATFORM_FLASH_DMA_ALIGNMENT - unaligned;
         if (nfix > num_bytes)
@@ -76,13 +341,10 @@ void flash_read_bytes(uint32_t address, uint8_t *buffer, size_t num_bytes)
     if (!num_bytes)
         return;
 
-    xSemaphoreTake(_flash_mutex, portMAX_DELAY);
-    
-    hw_flash_read_bytes(address, buffer, num_bytes & ~(PLATFORM_FLASH_DMA_ALIGNMENT - 1));
+    _flash_lock(address);
     
-    /* sit the caller being this wait lock semaphore */
-    if (!xSemaphoreTake(_flash_wait_semaphore, pdMS_TO_TICKS(200)))
-        panic("Got stuck behind a wait lock in flash.c");
+    _flash_cache_stats.bypassed++;
+    _flash_hw_read(address, buffer, num_bytes & ~(PLATFORM_FLASH_DMA_ALIGNMENT - 1));
 
     xSemaphoreGive(_flash_mutex);
     
@@ -103,11 +365,17 @@ static int _flash_write_aligned_paged(uint32_t addr, uint8_t *buf, size_t len) {
 
     assert(((addr + len - 1) & PLATFORM_FLASH_PAGE_MASK) == (addr & PLATFORM_FLASH_PAGE_MASK));
     assert((len & (PLATFORM_FLASH_DMA_ALIGNMENT - 1)) == 0);
-    assert((((uint32_t)buf) & (PLATFORM_FLASH_DMA_ALIGNMENT - 1)) == 0);
+    assert((((uintptr_t)buf) & (PLATFORM_FLASH_DMA_ALIGNMENT - 1)) == 0);
     
     int rv = 0;
 
-    xSemaphoreTake(_flash_mutex, portMAX_DELAY);
+    _flash_program_begin(addr);
+    
+    _flash_io_stats.programs++;
+    struct flash_tag_stats *st = _flash_tag_stats_for(addr);
+    st->programs++;
+    st->program_bytes += len;
+    _flash_cache_invalidate(addr, len);
     
     if ((void *)buf < (void *)0x20000000) /* XXX: this is correct on both STM32 and nRF52, but not guaranteed */ {
         /* On nRF52, DMA out of microflash doesn't work, so need to copy
@@ -130,7 +398,7 @@ static int _flash_write_aligned_paged(uint32_t addr, uint8_t *buf, size_t len) {
         rv |= hw_flash_write_sync(addr, buf, len);
     }
 
-    xSemaphoreGive(_flash_mutex);
+    _flash_program_end();
         
     return rv;
 }
@@ -144,7 +412,7 @@ static int _flash_write_paged(uint32_t addr, uint8_t *buf, size_t len) {
     int rv = 0;
     
     /* Leading edge DMA alignment... */
-    int unaligned = ((uint32_t)buf) & (PLATFORM_FLASH_DMA_ALIGNMENT - 1);
+    int unaligned = ((uintptr_t)buf) & (PLATFORM_FLASH_DMA_ALIGNMENT - 1);
     if (unaligned) {
         int nfix = PLATFORM_FLASH_DMA_ALIGNMENT - unaligned;
         if (nfix > len)
@@ -218,6 +486,7 @@ int flash_write_bytes(uint32_t addr, uint8_t *buf, size_t len)
     
     int rv;
     
+    _flash_activity++;
     while (len) {
         int nthis = len;
         int npagemax = PLATFORM_FLASH_PAGE_SIZE - (addr & ~PLATFORM_FLASH_PAGE_MASK);
@@ -240,13 +509,358 @@ int flash_erase(uint32_t address, uint32_t len)
 {
     int rv;
     
-    xSemaphoreTake(_flash_mutex, portMAX_DELAY);
+    _flash_activity++;
+    _flash_program_begin(address);
+    _flash_tag_stats_for(address)->erases++;
+    _flash_cache_invalidate(address, len);
     rv = hw_flash_erase_sync(address, len);
+    _flash_program_end();
+    
+    return rv;
+}
+
+/*** Mapped reads. ***/
+
+/* On platforms where the flash is on the memory bus, a caller can read it
+ * in place, with no copy, no trip through the cache, and no mutex per read. 
+ * The catch is that while the part is programming or erasing, reads from
+ * it don't return data, so a mapping holds off program and erase until it
+ * is unmapped: mappings should be short-lived (look something up, unmap),
+ * and a task that holds one must not write to flash itself.
+ *
+ * _flash_maps counts the live mappings, and _flash_programming is set while
+ * program or erase has the part; each only changes from 0 when the other
+ * is 0.  Writers hold the mutex while they program, so a mapper that finds
+ * the part busy waits on that, and then tries again.  */
+#ifdef PLATFORM_FLASH_MAPPED
+static int _flash_maps = 0;
+static int _flash_programming = 0;
+static int _flash_unmap_waiters = 0; /* writers waiting on _flash_unmapped */
+
+static void _flash_program_begin(uint32_t addr)
+{
+    int pass;
+    
+    for (;;) {
+        _flash_lock(addr);
+        
+        taskENTER_CRITICAL();
+        if (_flash_maps == 0)
+            _flash_programming = 1;
+        taskEXIT_CRITICAL();
+        
+        if (_flash_programming)
+            return;
+        
+        /* Someone is reading in place; let them finish (and let everyone
+         * else who wants the mutex in the meantime have it). */
+        taskENTER_CRITICAL();
+        _flash_unmap_waiters++;
+        taskEXIT_CRITICAL();
+        xSemaphoreGive(_flash_mutex);
+        xSemaphoreTake(_flash_unmapped, portMAX_DELAY);
+        
+        /* The semaphore only wakes one of us, so pass it along to the
+         * next. */
+        taskENTER_CRITICAL();
+        pass = --_flash_unmap_waiters && _flash_maps == 0;
+        taskEXIT_CRITICAL();
+        if (pass)
+            xSemaphoreGive(_flash_unmapped);
+    }
+}
+
+static void _flash_program_end(void)
+{
+    taskENTER_CRITICAL();
+    _flash_programming = 0;
+    taskEXIT_CRITICAL();
+    
     xSemaphoreGive(_flash_mutex);
+}
+
+const void *flash_map(uint32_t address, size_t num_bytes)
+{
+    _flash_activity++;
+    for (;;) {
+        int ok;
+        
+        taskENTER_CRITICAL();
+        ok = !_flash_programming;
+        if (ok)
+            _flash_maps++;
+        taskEXIT_CRITICAL();
+        
+        if (ok)
+            return hw_flash_map(address, num_bytes);
+        
+        /* Wait out the program or erase that's going on. */
+        _flash_lock(address);
+        xSemaphoreGive(_flash_mutex);
+    }
+}
+
+void flash_unmap(const void *p, size_t num_bytes)
+{
+    int last;
+    
+    hw_flash_unmap(p, num_bytes);
+    
+    taskENTER_CRITICAL();
+    assert(_flash_maps > 0);
+    last = --_flash_maps == 0;
+    taskEXIT_CRITICAL();
+    
+    if (last)
+        xSemaphoreGive(_flash_unmapped);
+}
+#else
+static void _flash_program_begin(uint32_t addr)
+{
+    _flash_lock(addr);
+}
+
+static void _flash_program_end(void)
+{
+    xSemaphoreGive(_flash_mutex);
+}
+
+const void *flash_map(uint32_t address, size_t num_bytes)
+{
+    return NULL;
+}
+
+void flash_unmap(const void *p, size_t num_bytes)
+{
+}
+#endif
+
+/*** Asynchronous requests. ***/
+
+/* flash_read_bytes and friends make their caller sit and wait for the
+ * hardware.  Instead, callers can hand a struct flash_req to flash_submit,
+ * and get called back (on the flash I/O thread) or woken up (in
+ * flash_wait) once it's done.  The I/O thread runs interactive requests
+ * before bulk ones, and first-come first-served within each; when it picks
+ * up a read, it also takes any other reads queued behind it that pick up
+ * where it leaves off, and does them all in one transfer through a bounce
+ * buffer.  It doesn't look past a write or an erase for those, so that
+ * nobody sees flash change out of order.  Requests in different
+ * priorities aren't ordered with respect to each other at all.
+ *
+ * The I/O thread does the actual work with the same routines as everyone
+ * else, so synchronous callers still work, and take their turn on the
+ * mutex.  There's no DMA under it: snowy's NOR is on the FMC, where a read
+ * is CPU loads (or no copy at all, with flash_map) and programming is a
+ * command sequence a word at a time.  What the part spends its time on is
+ * erasing, and the driver sleeps through that rather than spinning, so the
+ * I/O thread gives the CPU back while the part works.
+ */
+#ifndef FLASH_IO_MERGE_MAX
+#define FLASH_IO_MERGE_MAX 512 /* bytes */
+#endif
+
+static struct flash_req *_flash_io_head[FLASH_PRIO_COUNT];
+static struct flash_req *_flash_io_tail[FLASH_PRIO_COUNT];
+static uint8_t _flash_io_bounce[FLASH_IO_MERGE_MAX] __attribute__((aligned(4)));
+
+static size_t _flash_req_len(struct flash_req *req)
+{
+    size_t len = 0;
+    
+    for (int i = 0; i < req->iovcnt; i++)
+        len += req->iov[i].len;
+    
+    return len;
+}
+
+int flash_submit(struct flash_req *req)
+{
+    if (req->prio >= FLASH_PRIO_COUNT || req->op > FLASH_OP_ERASE)
+        return -1;
+    if (req->op != FLASH_OP_ERASE && req->iovcnt && !req->iov)
+        return -1;
+    
+    _flash_activity++;
+    req->rv = 0;
+    req->next = NULL;
+    req->tag = _flash_get_tag();
+    if (!req->done)
+        req->wait_sem = xSemaphoreCreateBinaryStatic(&req->wait_sem_buf);
+    
+    taskENTER_CRITICAL();
+    if (_flash_io_tail[req->prio])
+        _flash_io_tail[req->prio]->next = req;
+    else
+        _flash_io_head[req->prio] = req;
+    _flash_io_tail[req->prio] = req;
+    _flash_io_stats.submitted++;
+    taskEXIT_CRITICAL();
+    
+    xTaskNotifyGive(THREAD_HANDLE(flash_io));
+    
+    return 0;
+}
+
+int flash_wait(struct flash_req *req)
+{
+    assert(!req->done && "flash_wait on a request with a callback");
+    
+    xSemaphoreTake(req->wait_sem, portMAX_DELAY);
+    
+    return req->rv;
+}
+
+/* Background work that wants to stay out of everyone's way can look at
+ * this before and after waiting a while: if it hasn't changed, nobody asked
+ * the flash for anything in between. */
+uint32_t flash_get_activity(void)
+{
+    return _flash_activity;
+}
+
+void flash_get_io_stats(struct flash_io_stats *stats)
+{
+    taskENTER_CRITICAL();
+    *stats = _flash_io_stats;
+    taskEXIT_CRITICAL();
+}
+
+/* Takes the next request off the queue, along with any reads that can go
+ * in the same transfer, chained through ->next.  Returns the number of
+ * bytes that the batch spans if it's more than one read, or 0. */
+static struct flash_req *_flash_io_dequeue(size_t *span)
+{
+    struct flash_req *req = NULL, *last;
+    int prio;
+    
+    *span = 0;
+    
+    taskENTER_CRITICAL();
+    
+    for (prio = 0; prio < FLASH_PRIO_COUNT && !req; prio++)
+        req = _flash_io_head[prio];
+    prio--;
+    
+    if (!req)
+        goto out;
+    
+    _flash_io_head[prio] = req->next;
+    if (!req->next)
+        _flash_io_tail[prio] = NULL;
+    req->next = NULL;
+    last = req;
+    
+    if (req->op != FLASH_OP_READ)
+        goto out;
+    
+    size_t len = _flash_req_len(req);
+    if (len > FLASH_IO_MERGE_MAX)
+        goto out;
+    
+    /* Keep going around until nothing else lines up. */
+    int found = 1;
+    while (found) {
+        struct flash_req *prev = NULL, *cand;
+        
+        found = 0;
+        for (cand = _flash_io_head[prio]; cand && cand->op == FLASH_OP_READ; prev = cand, cand = cand->next) {
+            size_t clen = _flash_req_len(cand);
+            
+            if (cand->address != req->address + len || len + clen > FLASH_IO_MERGE_MAX)
+                continue;
+            
+            if (prev)
+                prev->next = cand->next;
+            else
+                _flash_io_head[prio] = cand->next;
+            if (_flash_io_tail[prio] == cand)
+                _flash_io_tail[prio] = prev;
+            
+            cand->next = NULL;
+            last->next = cand;
+            last = cand;
+            len += clen;
+            found = 1;
+            _flash_io_stats.merged++;
+            break;
+        }
+    }
+    
+    if (req->next)
+        *span = len;
+    
+out:
+    if (req)
+        _flash_io_stats.transfers++;
+    taskEXIT_CRITICAL();
+    
+    return req;
+}
+
+static int _flash_io_run(struct flash_req *req)
+{
+    uint32_t addr = req->address;
+    int rv = 0;
+    
+    if (req->op == FLASH_OP_ERASE)
+        return flash_erase(req->address, req->erase_len);
+    
+    for (int i = 0; i < req->iovcnt; i++) {
+        if (req->op == FLASH_OP_READ)
+            flash_read_bytes(addr, req->iov[i].buf, req->iov[i].len);
+        else
+            rv |= flash_write_bytes(addr, req->iov[i].buf, req->iov[i].len);
+        addr += req->iov[i].len;
+    }
     
     return rv;
 }
 
+static void _flash_io_complete(struct flash_req *req, int rv)
+{
+    req->rv = rv;
+    if (req->done)
+        req->done(req);
+    else
+        xSemaphoreGive(req->wait_sem);
+}
+
+static void _flash_io_thread(void *par)
+{
+    for (;;) {
+        size_t span;
+        struct flash_req *req = _flash_io_dequeue(&span);
+        
+        if (!req) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        
+        /* A batch counts for whoever is at the front of it. */
+        flash_set_tag(req->tag);
+        
+        if (!span) {
+            _flash_io_complete(req, _flash_io_run(req));
+            continue;
+        }
+        
+        /* A batch of reads, one after the other on flash. */
+        uint8_t *p = _flash_io_bounce;
+        flash_read_bytes(req->address, _flash_io_bounce, span);
+        while (req) {
+            struct flash_req *next = req->next;
+            
+            for (int i = 0; i < req->iovcnt; i++) {
+                memcpy(req->iov[i].buf, p, req->iov[i].len);
+                p += req->iov[i].len;
+            }
+            _flash_io_complete(req, 0);
+            req = next;
+        }
+    }
+}
+
 void flash_dump(void)
 {
     uint8_t buffer[1025];
@@ -7,7 +7,10 @@
  */
 
 /* flash regions have moved to platform.h / platform_config.h */
-#include "appmanager.h"
+#include <stdint.h>
+#include <stddef.h>
+#include "FreeRTOS.h"
+#include "semphr.h"
 
 #define RES_COUNT           0x00
 #define RES_CRC             0x04
@@ -25,11 +28,110 @@ typedef struct ResourceHeader {
     uint32_t unknownoffset;
 } __attribute__((__packed__)) ResourceHeader;
  
+/* Counters for the read cache in front of flash_read_bytes; see
+ * flash_get_cache_stats. */
+struct flash_cache_stats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t readahead_lines; /* filled on a miss, before anyone asked for them */
+    uint32_t bypassed;        /* reads too big to be worth caching */
+    uint32_t invalidations;   /* lines dropped by a write or an erase */
+};
+
+/* Asynchronous flash requests; see flash_submit. */
+enum flash_op {
+    FLASH_OP_READ,
+    FLASH_OP_WRITE,
+    FLASH_OP_ERASE
+};
+
+enum flash_prio {
+    FLASH_PRIO_INTERACTIVE, /* someone is waiting on the screen for this */
+    FLASH_PRIO_BULK,        /* app installs, garbage collection, ... */
+    FLASH_PRIO_COUNT
+};
+
+struct flash_iovec {
+    uint8_t *buf;
+    size_t len;
+};
+
+struct flash_req;
+typedef void (*flash_req_cb_t)(struct flash_req *req);
+
+struct flash_req {
+    /* Filled in by the caller.  The iovecs cover consecutive bytes of
+     * flash, starting at address; erases use erase_len instead. */
+    uint8_t op;   /* enum flash_op */
+    uint8_t prio; /* enum flash_prio */
+    uint32_t address;
+    const struct flash_iovec *iov;
+    int iovcnt;
+    uint32_t erase_len;
+    flash_req_cb_t done; /* runs on the flash I/O thread; NULL to use flash_wait */
+    void *ctx;
+    
+    /* Private to flash.c. */
+    int rv;
+    uint8_t tag; /* whoever submitted it */
+    struct flash_req *next;
+    SemaphoreHandle_t wait_sem;
+    StaticSemaphore_t wait_sem_buf;
+};
+
+/* Counters for the flash I/O thread; see flash_get_io_stats. */
+struct flash_io_stats {
+    uint32_t submitted;
+    uint32_t transfers; /* requests, or batches of merged requests, that we ran */
+    uint32_t merged;    /* requests that rode along in someone else's transfer */
+    uint32_t programs;  /* page program operations, from anyone */
+};
+
+/* Who the flash is busy for; see flash_set_tag.  Anything untagged that
+ * lands in the filesystem's region counts as FLASH_TAG_FS. */
+enum flash_tag {
+    FLASH_TAG_OTHER, /* resources, firmware, and anything else untagged */
+    FLASH_TAG_FS,
+    FLASH_TAG_FS_GC, /* the garbage collector, and checkpoints */
+    FLASH_TAG_RDB,
+    FLASH_TAG_COUNT
+};
+
+/* Counters for each tag; see flash_get_tag_stats.  written_bytes is what
+ * the filesystem was asked to write, so that program_bytes over
+ * written_bytes is the write amplification. */
+struct flash_tag_stats {
+    uint32_t read_bytes;    /* from the part, not out of the cache */
+    uint32_t written_bytes;
+    uint32_t program_bytes;
+    uint32_t programs;
+    uint32_t erases;
+    uint32_t lock_waits;    /* times that someone else had the flash */
+    uint32_t lock_ticks;    /* and how long we waited for them */
+};
+
 uint8_t flash_init(void);
 void flash_test(uint16_t resource_id);
 void flash_read_bytes(uint32_t address, uint8_t *buffer, size_t num_bytes);
 int flash_write_bytes(uint32_t address, uint8_t *buffer, size_t num_bytes);
 int flash_erase(uint32_t address, uint32_t len);
 void flash_dump(void);
+void flash_get_cache_stats(struct flash_cache_stats *stats);
+int flash_submit(struct flash_req *req);
+int flash_wait(struct flash_req *req);
+void flash_get_io_stats(struct flash_io_stats *stats);
+/* Sets the tag that this task's flash traffic gets counted under, and
+ * returns the old one, to put back afterwards. */
+uint8_t flash_set_tag(uint8_t tag);
+void flash_note_written(size_t bytes);
+/* Fills in FLASH_TAG_COUNT of them. */
+void flash_get_tag_stats(struct flash_tag_stats *stats);
+/* Goes up every time that anyone reads, writes, erases, or maps flash. */
+uint32_t flash_get_activity(void);
+/* Returns a pointer that reads num_bytes of flash at address in place, or
+ * NULL if this platform can't do that.  Don't hold onto it: program and
+ * erase wait until it's handed back with flash_unmap. */
+const void *flash_map(uint32_t address, size_t num_bytes);
+void flash_unmap(const void *p, size_t num_bytes);
 void flash_operation_complete(uint8_t cmd);
 void flash_operation_complete_isr(uint8_t cmd);
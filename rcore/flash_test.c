@@ -0,0 +1,288 @@
+/* flash_test.c
+ * Tests for RebbleOS flash layer
+ * RebbleOS
+ */
+
+#include "fs.h"
+#include "flash.h"
+#include "test.h"
+#include "debug.h"
+#include "platform.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include <string.h>
+#include <stdio.h>
+
+#ifdef REBBLEOS_TESTING
+
+TEST(flash_cache) {
+#define CACHEFILE_SIZE 4096
+    struct flash_cache_stats before, after;
+    struct fd fd, *fdp;
+    struct file file;
+    uint8_t buf[16];
+
+    fdp = fs_creat(&fd, "flashcache", CACHEFILE_SIZE);
+    if (!fdp) { *artifact = 1; return TEST_FAIL; }
+
+    /* Pull the still-erased file into the cache ... */
+    for (int ofs = 0; ofs < CACHEFILE_SIZE; ofs += sizeof(buf)) {
+        fs_seek(&fd, ofs, FS_SEEK_SET);
+        fs_read(&fd, buf, sizeof(buf));
+        for (int i = 0; i < sizeof(buf); i++)
+            if (buf[i] != 0xFF) { *artifact = 2; return TEST_FAIL; }
+    }
+
+    /* ... then write over it, and make sure that we don't see stale data. */
+    fs_seek(&fd, 0, FS_SEEK_SET);
+    for (int ofs = 0; ofs < CACHEFILE_SIZE; ofs += sizeof(buf)) {
+        for (int i = 0; i < sizeof(buf); i++)
+            buf[i] = (ofs + i) * 7;
+        fs_write(&fd, buf, sizeof(buf));
+    }
+    fs_mark_written(fdp);
+
+    if (fs_find_file(&file, "flashcache") < 0) { *artifact = 3; return TEST_FAIL; }
+    fs_open(&fd, &file);
+
+    /* Small sequential reads should mostly hit. */
+    flash_get_cache_stats(&before);
+    for (int ofs = 0; ofs < CACHEFILE_SIZE; ofs += sizeof(buf)) {
+        fs_read(&fd, buf, sizeof(buf));
+        for (int i = 0; i < sizeof(buf); i++)
+            if (buf[i] != (uint8_t)((ofs + i) * 7)) {
+                printf("stale data at ofs %d: got %02x\n", ofs + i, buf[i]);
+                *artifact = 4;
+                return TEST_FAIL;
+            }
+    }
+    flash_get_cache_stats(&after);
+
+    printf("flash cache: %d hits, %d misses, %d lines read ahead, %d bypassed, %d invalidated\n",
+        (int)(after.hits - before.hits), (int)(after.misses - before.misses),
+        (int)(after.readahead_lines - before.readahead_lines),
+        (int)(after.bypassed - before.bypassed), (int)(after.invalidations - before.invalidations));
+
+    if (after.hits - before.hits < after.misses - before.misses) { *artifact = 5; return TEST_FAIL; }
+
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+static volatile int _async_order[16];
+static volatile int _async_norder;
+
+static void _async_done(struct flash_req *req)
+{
+    _async_order[_async_norder++] = (int)req->ctx;
+}
+
+TEST(flash_async) {
+#define ASYNCFILE_SIZE 512
+#define ASYNC_NREQS 8
+#define ASYNC_REQSIZE 32
+    struct flash_req reqs[ASYNC_NREQS + 2];
+    struct flash_iovec iovs[ASYNC_NREQS + 2][2];
+    uint8_t bufs[ASYNC_NREQS + 1][ASYNC_REQSIZE];
+    struct flash_io_stats before, after;
+    struct fd fd, *fdp;
+    struct file file;
+    uint8_t buf[16];
+    
+    fdp = fs_creat(&fd, "flashasync", ASYNCFILE_SIZE);
+    if (!fdp) { *artifact = 1; return TEST_FAIL; }
+    for (int ofs = 0; ofs < ASYNCFILE_SIZE; ofs += sizeof(buf)) {
+        for (int i = 0; i < sizeof(buf); i++)
+            buf[i] = (ofs + i) * 3 + 1;
+        fs_write(&fd, buf, sizeof(buf));
+    }
+    fs_mark_written(fdp);
+    
+    if (fs_find_file(&file, "flashasync") < 0) { *artifact = 7; return TEST_FAIL; }
+    
+    /* It all fits in the first page, so it's all in one place on flash. */
+    uint32_t addr = REGION_FS_START + file.startpage * REGION_FS_PAGE_SIZE + file.startpofs;
+    
+    memset(reqs, 0, sizeof(reqs));
+    memset(bufs, 0, sizeof(bufs));
+    _async_norder = 0;
+    flash_get_io_stats(&before);
+    
+    /* Queue up a pile of bulk reads, out of order, split across two
+     * buffers each, and an interactive read behind them, all before the
+     * I/O thread gets a chance to look. */
+    vTaskSuspendAll();
+    for (int n = 0; n < ASYNC_NREQS; n++) {
+        int blk = (n * 5) % ASYNC_NREQS;
+        
+        iovs[n][0].buf = bufs[blk];
+        iovs[n][0].len = 10;
+        iovs[n][1].buf = bufs[blk] + 10;
+        iovs[n][1].len = ASYNC_REQSIZE - 10;
+        reqs[n].op = FLASH_OP_READ;
+        reqs[n].prio = FLASH_PRIO_BULK;
+        reqs[n].address = addr + blk * ASYNC_REQSIZE;
+        reqs[n].iov = iovs[n];
+        reqs[n].iovcnt = 2;
+        reqs[n].done = _async_done;
+        reqs[n].ctx = (void *)n;
+        flash_submit(&reqs[n]);
+    }
+    
+    iovs[ASYNC_NREQS][0].buf = bufs[ASYNC_NREQS];
+    iovs[ASYNC_NREQS][0].len = ASYNC_REQSIZE;
+    reqs[ASYNC_NREQS].op = FLASH_OP_READ;
+    reqs[ASYNC_NREQS].prio = FLASH_PRIO_INTERACTIVE;
+    reqs[ASYNC_NREQS].address = addr + ASYNCFILE_SIZE - ASYNC_REQSIZE;
+    reqs[ASYNC_NREQS].iov = iovs[ASYNC_NREQS];
+    reqs[ASYNC_NREQS].iovcnt = 1;
+    reqs[ASYNC_NREQS].done = _async_done;
+    reqs[ASYNC_NREQS].ctx = (void *)ASYNC_NREQS;
+    flash_submit(&reqs[ASYNC_NREQS]);
+    
+    /* Bulk requests finish in order, so once this one is done, they all
+     * are. */
+    reqs[ASYNC_NREQS + 1].op = FLASH_OP_READ;
+    reqs[ASYNC_NREQS + 1].prio = FLASH_PRIO_BULK;
+    reqs[ASYNC_NREQS + 1].address = addr;
+    reqs[ASYNC_NREQS + 1].iov = NULL;
+    reqs[ASYNC_NREQS + 1].iovcnt = 0;
+    flash_submit(&reqs[ASYNC_NREQS + 1]);
+    xTaskResumeAll();
+    
+    if (flash_wait(&reqs[ASYNC_NREQS + 1]) != 0) { *artifact = 2; return TEST_FAIL; }
+    flash_get_io_stats(&after);
+    
+    printf("flash io: %d requests in %d transfers, %d merged; first done was %d\n",
+        (int)(after.submitted - before.submitted), (int)(after.transfers - before.transfers),
+        (int)(after.merged - before.merged), _async_order[0]);
+    
+    if (_async_norder != ASYNC_NREQS + 1) { *artifact = 3; return TEST_FAIL; }
+    if (_async_order[0] != ASYNC_NREQS) { *artifact = 4; return TEST_FAIL; }
+    
+    for (int blk = 0; blk < ASYNC_NREQS; blk++)
+        for (int i = 0; i < ASYNC_REQSIZE; i++)
+            if (bufs[blk][i] != (uint8_t)((blk * ASYNC_REQSIZE + i) * 3 + 1)) {
+                printf("async read wrong at block %d ofs %d: got %02x\n", blk, i, bufs[blk][i]);
+                *artifact = 5;
+                return TEST_FAIL;
+            }
+    for (int i = 0; i < ASYNC_REQSIZE; i++)
+        if (bufs[ASYNC_NREQS][i] != (uint8_t)((ASYNCFILE_SIZE - ASYNC_REQSIZE + i) * 3 + 1)) {
+            *artifact = 6;
+            return TEST_FAIL;
+        }
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+/* Writers that each program their own 8 bytes whenever they're poked.
+ * They never exit, so they're started once and kept for later runs. */
+#define MAPWAIT_NWRITERS 2
+static StaticTask_t _mapwait_tasks[MAPWAIT_NWRITERS];
+static StackType_t _mapwait_stacks[MAPWAIT_NWRITERS][256];
+static TaskHandle_t _mapwait_handles[MAPWAIT_NWRITERS];
+static uint32_t _mapwait_addr;
+static volatile int _mapwait_done;
+
+static void _mapwait_writer(void *par)
+{
+    int n = (int)par;
+    uint8_t buf[8];
+    
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        memset(buf, 0xA0 + n, sizeof(buf));
+        flash_write_bytes(_mapwait_addr + n * sizeof(buf), buf, sizeof(buf));
+        taskENTER_CRITICAL();
+        _mapwait_done++;
+        taskEXIT_CRITICAL();
+    }
+}
+
+/* Every writer held off by a mapping gets to go once it's unmapped, not
+ * just the first one to wake. */
+TEST(flash_map_wait) {
+    struct fd fd, *fdp;
+    struct file file;
+    uint8_t buf[MAPWAIT_NWRITERS * 8];
+    const void *p;
+    
+    fdp = fs_creat(&fd, "flashmapwait", sizeof(buf));
+    if (!fdp) { *artifact = 1; return TEST_FAIL; }
+    fs_mark_written(fdp);
+    if (fs_find_file(&file, "flashmapwait") < 0) { *artifact = 2; return TEST_FAIL; }
+    _mapwait_addr = REGION_FS_START + file.startpage * REGION_FS_PAGE_SIZE + file.startpofs;
+    
+    p = flash_map(_mapwait_addr, sizeof(buf));
+    if (!p) {
+        /* Nothing to wait for on this platform. */
+        *artifact = 0;
+        return TEST_PASS;
+    }
+    
+    _mapwait_done = 0;
+    for (int n = 0; n < MAPWAIT_NWRITERS; n++) {
+        if (!_mapwait_handles[n])
+            _mapwait_handles[n] = xTaskCreateStatic(_mapwait_writer, "mapwait", 256, (void *)n, tskIDLE_PRIORITY + 2UL, _mapwait_stacks[n], &_mapwait_tasks[n]);
+        xTaskNotifyGive(_mapwait_handles[n]);
+    }
+    vTaskDelay(pdMS_TO_TICKS(20));
+    if (_mapwait_done) { flash_unmap(p, sizeof(buf)); *artifact = 3; return TEST_FAIL; }
+    flash_unmap(p, sizeof(buf));
+    
+    for (int i = 0; i < 10 && _mapwait_done < MAPWAIT_NWRITERS; i++)
+        vTaskDelay(pdMS_TO_TICKS(10));
+    printf("flash map wait: %d of %d writers finished\n", _mapwait_done, MAPWAIT_NWRITERS);
+    if (_mapwait_done != MAPWAIT_NWRITERS) { *artifact = 4; return TEST_FAIL; }
+    
+    fs_open(&fd, &file);
+    fs_read(&fd, buf, sizeof(buf));
+    for (int i = 0; i < sizeof(buf); i++)
+        if (buf[i] != 0xA0 + i / 8) { *artifact = 5; return TEST_FAIL; }
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+/* Whatever the filesystem writes while we have a tag on counts under that
+ * tag, and everything that it was asked to write shows up, too. */
+TEST(flash_tag_stats) {
+    struct flash_tag_stats before[FLASH_TAG_COUNT], after[FLASH_TAG_COUNT];
+    struct fd fd, *fdp;
+    uint8_t buf[64];
+    uint16_t wear[16];
+    int nsectors = 0;
+    
+    memset(buf, 0x3C, sizeof(buf));
+    flash_get_tag_stats(before);
+    uint8_t tag = flash_set_tag(FLASH_TAG_RDB);
+    fdp = fs_creat(&fd, "flashtags", sizeof(buf));
+    if (fdp) {
+        fs_write(&fd, buf, sizeof(buf));
+        fs_mark_written(fdp);
+    }
+    flash_set_tag(tag);
+    flash_get_tag_stats(after);
+    if (!fdp) { *artifact = 1; return TEST_FAIL; }
+    
+    if (after[FLASH_TAG_RDB].written_bytes - before[FLASH_TAG_RDB].written_bytes != sizeof(buf)) { *artifact = 2; return TEST_FAIL; }
+    if (after[FLASH_TAG_RDB].program_bytes - before[FLASH_TAG_RDB].program_bytes < sizeof(buf)) { *artifact = 3; return TEST_FAIL; }
+    if (after[FLASH_TAG_FS].written_bytes != before[FLASH_TAG_FS].written_bytes) { *artifact = 4; return TEST_FAIL; }
+    
+    /* Every sector is in the histogram somewhere. */
+    fs_get_wear_histogram(wear, 16);
+    for (int i = 0; i < 16; i++)
+        nsectors += wear[i];
+    if (nsectors != (REGION_FS_N_PAGES * REGION_FS_PAGE_SIZE + REGION_FS_ERASE_SIZE - 1) / REGION_FS_ERASE_SIZE) { *artifact = 5; return TEST_FAIL; }
+    
+    printf("flash tags: %u bytes asked, %u programmed; fs has %d sectors, %d never erased\n",
+        (unsigned)(after[FLASH_TAG_RDB].written_bytes - before[FLASH_TAG_RDB].written_bytes),
+        (unsigned)(after[FLASH_TAG_RDB].program_bytes - before[FLASH_TAG_RDB].program_bytes), nsectors, wear[0]);
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+#endif
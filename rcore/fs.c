@@ -10,6 +10,10 @@
 #include "fs.h"
 #include "fs_internal.h"
 #include "flash.h"
+#include "rebble_memory.h"
+#include "FreeRTOS.h"
+#include "semphr.h"
+#include "rtoswrap.h"
 
 /* XXX: should filesystem bits and bobs get split out somewhere else? 
  * Probably, but who's counting, anyway?  */
@@ -17,12 +21,123 @@
 /* flag values are *cleared* to mean "true" */
 #define FLASHFLAG(val, flag) (((val) & (flag)) == 0)
 
+static void _fs_ckpt_touch(int pg);
+
+#ifdef REBBLEOS_TESTING
+int fs_fail_programs = 0;
+#endif
+
+static int _fs_program(int pg, size_t ofs, const void *p, size_t n) {
+#ifdef REBBLEOS_TESTING
+    if (fs_fail_programs) {
+        fs_fail_programs--;
+        return -1;
+    }
+#endif
+    _fs_ckpt_touch(pg);
+    return flash_write_bytes(REGION_FS_START + pg * REGION_FS_PAGE_SIZE + ofs, (uint8_t *)p, n);
+}
+
+/*** Write combining. ***/
+
+/* rdb writes a record as a header, then a key, then the data, and its
+ * garbage collector copies records over sixteen bytes at a time; each of
+ * those used to be a program operation of its own.  An fd that asks for it
+ * (fs_set_write_combine) has its writes gathered up here instead, and they
+ * go down in one go when they reach the end of a flash program page.
+ *
+ * There is only the one buffer, and it lives under the FS lock.  Anything
+ * else that writes to flash, or reads the bytes that are pending, pushes it
+ * out first, so the only reordering that ever happens is that a write gets
+ * glued onto the end of the one before it.  Callers that care about the
+ * order *within* that (rdb's flags do) call fs_flush.
+ *
+ * The pending bytes belong to where they are going, not to whichever fd
+ * wrote them: a write that carries on from where they end gets added on,
+ * and anything else pushes them out.  So an fd that goes away without a
+ * flush (rdb gives up on a record partway, say) doesn't leave anything
+ * behind that could be mistaken for it later.  If pushing them out fails,
+ * somewhere that can't blame the writer, the next fs_flush says so.  */
+#if defined(PLATFORM_FLASH_PAGE_SIZE) && PLATFORM_FLASH_PAGE_SIZE <= 256
+#define FS_WC_SIZE PLATFORM_FLASH_PAGE_SIZE
+#else
+#define FS_WC_SIZE 64
+#endif
+
+static uint8_t _fs_wc_buf[FS_WC_SIZE] __attribute__((aligned(4)));
+static int _fs_wc_pg;
+static size_t _fs_wc_pofs;
+static size_t _fs_wc_len; /* 0 if nothing is pending */
+static int _fs_wc_err;    /* from a flush that nobody has heard about yet */
+
+static int _fs_wc_flush() {
+    int rv;
+    
+    if (!_fs_wc_len)
+        return 0;
+    
+    rv = _fs_program(_fs_wc_pg, _fs_wc_pofs, _fs_wc_buf, _fs_wc_len);
+    _fs_wc_len = 0;
+    if (rv)
+        _fs_wc_err = rv;
+    
+    return rv;
+}
+
+/* Pushes out pending bytes that overlap somebody who's about to read. */
+static void _fs_wc_flush_overlapping(int pg, size_t ofs, size_t n) {
+    if (_fs_wc_len && pg == _fs_wc_pg && ofs < _fs_wc_pofs + _fs_wc_len && ofs + n > _fs_wc_pofs)
+        _fs_wc_flush();
+}
+
 static void _fs_read_page_ofs(int pg, size_t ofs, void *p, size_t n) {
+    _fs_wc_flush_overlapping(pg, ofs, n);
     flash_read_bytes(REGION_FS_START + pg * REGION_FS_PAGE_SIZE + ofs, (uint8_t *)p, n);
 }
 
+/* Whoever had bytes pending doesn't stop us from writing ours; if those
+ * didn't make it, _fs_wc_err keeps it for them. */
 static int _fs_write_page_ofs(int pg, size_t ofs, const void *p, size_t n) {
-    return flash_write_bytes(REGION_FS_START + pg * REGION_FS_PAGE_SIZE + ofs, (uint8_t *)p, n);
+    _fs_wc_flush();
+    return _fs_program(pg, ofs, p, n);
+}
+
+/* Like _fs_write_page_ofs, but for fds that combine writes; the write must
+ * not cross a filesystem page.  Fails if any of these bytes, or the ones
+ * that they got combined with, didn't make it. */
+static int _fs_wc_write(const struct fd *fd, const void *p, size_t n) {
+    int pg = fd->curpage;
+    size_t pofs = fd->curpofs;
+    int rv = 0;
+    
+    if (_fs_wc_len && (_fs_wc_pg != pg || _fs_wc_pofs + _fs_wc_len != pofs))
+        _fs_wc_flush();
+    
+    while (n && !rv) {
+        size_t room = FS_WC_SIZE - ((REGION_FS_START + pg * REGION_FS_PAGE_SIZE + pofs) % FS_WC_SIZE);
+        size_t chunk = n < room ? n : room;
+        
+        if (!_fs_wc_len && chunk == FS_WC_SIZE) {
+            /* Nothing to combine with, and a whole program page of our
+             * own: no sense in copying it. */
+            rv = _fs_program(pg, pofs, p, chunk);
+        } else {
+            if (!_fs_wc_len) {
+                _fs_wc_pg = pg;
+                _fs_wc_pofs = pofs;
+            }
+            memcpy(_fs_wc_buf + _fs_wc_len, p, chunk);
+            _fs_wc_len += chunk;
+            if (chunk == room)
+                rv = _fs_wc_flush();
+        }
+        
+        p += chunk;
+        pofs += chunk;
+        n -= chunk;
+    }
+    
+    return rv;
 }
 
 static void _fs_read_file_hdr(int pg, struct fs_file_hdr_with_name *p) {
@@ -31,18 +146,61 @@ static void _fs_read_file_hdr(int pg, struct fs_file_hdr_with_name *p) {
     p->name[(MAX_FILENAME_LEN < p->hdr.filename_len) ? MAX_FILENAME_LEN : p->hdr.filename_len] = 0;
 }
 
+/* Returns the page after this one in its file, or 0xFFFF if it's the last. 
+ * The last page of a growable file gets its link written long after the
+ * rest of its header, so if we lost power in the middle of that, it's
+ * still the last page. */
+static uint16_t _fs_next_page(const struct fs_page_hdr *hdr) {
+    if (FLASHFLAG(hdr->rsvd_3, HDR_RSVD_3_GROWABLE) && hdr->next_page != 0xFFFF &&
+        hdr->next_page_crc != fs_next_page_crc(hdr->next_page))
+        return 0xFFFF;
+    
+    return hdr->next_page;
+}
+
 
 static uint8_t _fs_valid = 1;
 
+/* All of the public entry points take this, so that the garbage collector
+ * (which runs in its own thread, and moves files around) never sees a
+ * filesystem in the middle of being changed.  It's recursive so that the
+ * collector can use the same routines that everyone else does.  */
+static SemaphoreHandle_t _fs_mutex;
+static StaticSemaphore_t _fs_mutex_buf;
+
+#define FS_LOCK()   xSemaphoreTakeRecursive(_fs_mutex, portMAX_DELAY)
+#define FS_UNLOCK() xSemaphoreGiveRecursive(_fs_mutex)
+
 /*** Page table routines. ***/
 
 static int _fs_lastpg = -1;
 
-/* We store the lowest erase count, and the first available page with that
- * erase count, for use with the block allocator.  */
-static uint32_t _fs_best_erase_count = 0xFFFFFFFF;
-static int _fs_last_allocated_page = -1;
-static int _fs_free_pages = 0; /* dirty + clean */
+/* These are kept up to date by _fs_set_page_state. */
+static int _fs_nclean = 0;
+static int _fs_ndirty = 0;
+
+/* Pages whose headers made no sense at mount time, and the first live GC
+ * file that we saw; see fs_init. */
+static int _fs_bad_pages = 0;
+static int _fs_gc_file_pg = -1;
+
+/* The page table checkpoint that we keep a journal in, if any, and one
+ * that we found at mount time but didn't use; see "Checkpoints", below. */
+#define FS_CKPT_NAME "rebble/fsckpt"
+
+#ifndef FS_CKPT_INTERVAL_MS
+#define FS_CKPT_INTERVAL_MS (10 * 60 * 1000)
+#endif
+
+#define FS_CKPT_JOURNAL_SOFT_LIMIT (N_SECTORS / 8) /* past this, the background thread writes a new checkpoint */
+
+static int _fs_ckpt_pg = -1;
+static int _fs_ckpt_stale_pg = -1;
+static int _fs_ckpt_njournal = 0; /* sectors written down since the checkpoint */
+static uint8_t _fs_ckpt_dirty = 0; /* anything changed since the checkpoint */
+static uint8_t _fs_ckpt_loaded = 0; /* we mounted from it */
+
+static int _fs_ckpt_load(int pg, size_t size);
 
 enum page_state {
     PageStateClean = 0,     /* Block is erased, and we can write to it. */
@@ -53,250 +211,1562 @@ enum page_state {
 
 static uint8_t _fs_page_flags[(REGION_FS_N_PAGES + 3) >> 2];
 
+#define PAGES_PER_SECTOR (REGION_FS_ERASE_SIZE / REGION_FS_PAGE_SIZE)
+#define N_SECTORS ((REGION_FS_N_PAGES + PAGES_PER_SECTOR - 1) / PAGES_PER_SECTOR)
+
+/* The sector that the garbage collector is working on, if any; the
+ * allocator mustn't hand out pages from it, since they're about to get
+ * erased. */
+static int _gc_sector = -1;
+
+/* The allocator hands out a clean page with the lowest erase count.  All of
+ * the pages in a sector get erased together, so we keep one erase count per
+ * sector (the highest that we saw in any of its page headers at mount
+ * time, bumped every time that we erase it), and a min-heap, ordered by
+ * erase count and then by sector number, of the sectors that have a clean
+ * page in them.  Allocating a page is then a look at the top of the heap,
+ * and never has to go out to flash.
+ */
+static uint32_t _fs_sector_wear[N_SECTORS];
+static uint8_t  _fs_sector_nclean[N_SECTORS];
+static uint8_t  _fs_sector_ndirty[N_SECTORS]; /* a sector with nothing else is worth erasing ahead of time */
+static uint8_t  _fs_preerased[(REGION_FS_N_PAGES + 7) / 8]; /* pages erased ahead of time, that nobody has used yet */
+
+static void _fs_gc_preerase_wake();
+static uint16_t _fs_wear_heap[N_SECTORS];
+static int16_t  _fs_wear_heap_pos[N_SECTORS]; /* -1 if not in the heap */
+static int      _fs_wear_heap_n = 0;
+
+static int _fs_wear_heap_less(int i, int j)
+{
+    uint16_t a = _fs_wear_heap[i], b = _fs_wear_heap[j];
+    
+    if (_fs_sector_wear[a] != _fs_sector_wear[b])
+        return _fs_sector_wear[a] < _fs_sector_wear[b];
+    return a < b;
+}
+
+static void _fs_wear_heap_swap(int i, int j)
+{
+    uint16_t t = _fs_wear_heap[i];
+    
+    _fs_wear_heap[i] = _fs_wear_heap[j];
+    _fs_wear_heap[j] = t;
+    _fs_wear_heap_pos[_fs_wear_heap[i]] = i;
+    _fs_wear_heap_pos[_fs_wear_heap[j]] = j;
+}
+
+static void _fs_wear_heap_sift(int i)
+{
+    /* Up first ... */
+    while (i > 0 && _fs_wear_heap_less(i, (i - 1) / 2)) {
+        _fs_wear_heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    
+    /* ... then down. */
+    for (;;) {
+        int l = 2 * i + 1, r = 2 * i + 2, m = i;
+        
+        if (l < _fs_wear_heap_n && _fs_wear_heap_less(l, m))
+            m = l;
+        if (r < _fs_wear_heap_n && _fs_wear_heap_less(r, m))
+            m = r;
+        if (m == i)
+            break;
+        _fs_wear_heap_swap(i, m);
+        i = m;
+    }
+}
+
+static void _fs_wear_heap_insert(int sec)
+{
+    if (_fs_wear_heap_pos[sec] != -1)
+        return;
+    
+    _fs_wear_heap[_fs_wear_heap_n] = sec;
+    _fs_wear_heap_pos[sec] = _fs_wear_heap_n;
+    _fs_wear_heap_n++;
+    _fs_wear_heap_sift(_fs_wear_heap_n - 1);
+}
+
+static void _fs_wear_heap_remove(int sec)
+{
+    int i = _fs_wear_heap_pos[sec];
+    
+    if (i == -1)
+        return;
+    
+    _fs_wear_heap_n--;
+    if (i != _fs_wear_heap_n) {
+        _fs_wear_heap_swap(i, _fs_wear_heap_n);
+        _fs_wear_heap_sift(i);
+    }
+    _fs_wear_heap_pos[sec] = -1;
+}
+
+/* A sector belongs in the heap if it has a clean page, and the garbage
+ * collector isn't about to erase it. */
+static void _fs_wear_heap_update(int sec)
+{
+    if (_fs_sector_nclean[sec] && (sec * PAGES_PER_SECTOR != _gc_sector))
+        _fs_wear_heap_insert(sec);
+    else
+        _fs_wear_heap_remove(sec);
+}
+
+static void _fs_sector_set_wear(int sec, uint32_t wear)
+{
+    int in_heap = _fs_wear_heap_pos[sec] != -1;
+    
+    if (in_heap)
+        _fs_wear_heap_remove(sec);
+    _fs_sector_wear[sec] = wear;
+    if (in_heap)
+        _fs_wear_heap_insert(sec);
+}
+
+/* Everything starts off clean, with an erase count of zero, to match the
+ * page flags after they get cleared. */
+static void _fs_wear_reset()
+{
+    _fs_wear_heap_n = 0;
+    memset(_fs_preerased, 0, sizeof(_fs_preerased));
+    for (int sec = 0; sec < N_SECTORS; sec++) {
+        int npgs = REGION_FS_N_PAGES - sec * PAGES_PER_SECTOR;
+        
+        _fs_sector_wear[sec] = 0;
+        _fs_sector_nclean[sec] = (npgs < PAGES_PER_SECTOR) ? npgs : PAGES_PER_SECTOR;
+        _fs_sector_ndirty[sec] = 0;
+        _fs_wear_heap_pos[sec] = -1;
+        _fs_wear_heap_update(sec);
+    }
+}
+
+static enum page_state _fs_get_page_state(uint16_t pg)
+{
+    return (_fs_page_flags[pg >> 2] >> (6  - 2 * (pg & 3))) & 3;
+}
+
 static void _fs_set_page_state(uint16_t pg, enum page_state state)
 {
     int offset = 6 - 2 * (pg & 3);
+    enum page_state old = _fs_get_page_state(pg);
+    int sec = pg / PAGES_PER_SECTOR;
+    
+    _fs_nclean += (state == PageStateClean) - (old == PageStateClean);
+    _fs_ndirty += (state == PageStateDirty) - (old == PageStateDirty);
+    _fs_sector_ndirty[sec] += (state == PageStateDirty) - (old == PageStateDirty);
+    if (state == PageStateDirty && _fs_sector_ndirty[sec] == PAGES_PER_SECTOR)
+        _fs_gc_preerase_wake();
+    
+    if (state == PageStateClean && old != PageStateClean) {
+        if (_fs_sector_nclean[sec]++ == 0)
+            _fs_wear_heap_update(sec);
+    } else if (state != PageStateClean && old == PageStateClean) {
+        if (--_fs_sector_nclean[sec] == 0)
+            _fs_wear_heap_update(sec);
+    }
+    
     _fs_page_flags[pg >> 2] &= ~(3 << offset); // clear flag bits
     _fs_page_flags[pg >> 2] |= (state << offset); // set flag bits
 }
 
-static enum page_state _fs_get_page_state(uint16_t pg)
+/* Marks which sector the garbage collector is working on, taking it out of
+ * (or putting it back into) circulation for the allocator. */
+static void _fs_set_gc_sector(int sector)
 {
-    return (_fs_page_flags[pg >> 2] >> (6  - 2 * (pg & 3))) & 3;
+    int old = _gc_sector;
+    
+    _gc_sector = sector;
+    if (old != -1)
+        _fs_wear_heap_update(old / PAGES_PER_SECTOR);
+    if (sector != -1)
+        _fs_wear_heap_update(sector / PAGES_PER_SECTOR);
 }
 
-static int _fs_page_table_init()
+/* Reads one page's header, and sets the page's state (and its sector's
+ * erase count) to match.  Leaves the header in buffer.  */
+static enum page_state _fs_page_scan(int pg, struct fs_file_hdr_with_name *buffer)
 {
-    struct fs_page_hdr pagehdr;
+    struct fs_file_hdr *hdr = &buffer->hdr;
+    enum page_state st;
+    
+    /* We read the whole file header, since it's about as cheap as reading
+     * the page header, and we need to go looking for GC files before we
+     * can do anything else.  */
+    _fs_read_file_hdr(pg, buffer);
+    
+    if (hdr->v_0x5001 == 0xFFFF) {
+        st = PageStateClean;
+    } else if (hdr->v_0x5001 != 0x5001) {
+        /* This might be a sector that we lost power while erasing; we
+         * find out for sure once we've looked for a GC file. */
+        if (!_fs_bad_pages)
+            KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "page %d has bad header version 0x%04x", pg, hdr->v_0x5001);
+        _fs_bad_pages++;
+        st = PageStateDirty;
+    } else {
+        if (hdr->wear_level_counter != 0xFFFFFFFF &&
+            hdr->wear_level_counter > _fs_sector_wear[pg / PAGES_PER_SECTOR])
+            _fs_sector_set_wear(pg / PAGES_PER_SECTOR, hdr->wear_level_counter);
+        
+        if (!FLASHFLAG(hdr->empty, HDR_EMPTY_ALLOCATED) || /* block has never been written to */
+            (/* allocated && */ !FLASHFLAG(hdr->status, HDR_STATUS_FILE_START) && !FLASHFLAG(hdr->status, HDR_STATUS_FILE_CONT)) /* block was erased, has no data now */) {
+            st = PageStateClean;
+        } else if (FLASHFLAG(hdr->status, HDR_STATUS_DEAD)) {
+            st = PageStateDirty;
+        } else if (FLASHFLAG(hdr->status, HDR_STATUS_FILE_START)) {
+            st = PageStateFileStart;
+            if (_fs_gc_file_pg == -1 && !hdr->st_tmp_file && !strcmp(buffer->name, "GC"))
+                _fs_gc_file_pg = pg;
+        } else if (FLASHFLAG(hdr->status, HDR_STATUS_FILE_CONT)) {
+            st = PageStateFileCont;
+        } else {
+            /* We should have hit one of those cases. */
+            assert(0);
+            st = PageStateClean;
+        }
+    }
+    
+    _fs_set_page_state(pg, st);
+    return st;
+}
+
+/* Builds the page table, either by reading every page header on flash, or
+ * (if use_ckpt is set, and we find a good one) from a checkpoint. */
+static int _fs_page_table_init(int use_ckpt)
+{
+    struct fs_file_hdr_with_name buffer;
+    struct fs_file_hdr *hdr = &buffer.hdr;
     uint8_t saw_blank_page = 0;
     uint8_t saw_page_in_outer_space = 0;
     
-    int nclean = 0;
-    int ndirty = 0;
     int nused = 0;
     
     /* Find the last written page, and while we're at it, populate the page
-     * state table, and find the earliest, lowest, page with the smallest
-     * erase count.
+     * state table and the erase count of each sector.
      *
      * XXX: The lastpg optimization is bizarre; we seem to have it down now,
      * but it's not really clear how exactly this was supposed to work.
      */
     
     _fs_lastpg = -1;
-    _fs_best_erase_count = 0xFFFFFFFF;
-    _fs_last_allocated_page = -1;
-    _fs_free_pages = 0;
+    _fs_bad_pages = 0;
+    _fs_gc_file_pg = -1;
+    _fs_ckpt_stale_pg = -1;
+    
+    memset(&_fs_page_flags, 0, sizeof(_fs_page_flags));
+    _fs_nclean = REGION_FS_N_PAGES;
+    _fs_ndirty = 0;
+    _fs_wear_reset();
     
     for (int pg = 0; pg < REGION_FS_N_PAGES; pg++) {
-        _fs_read_page_ofs(pg, 0, &pagehdr, sizeof(pagehdr));
+        enum page_state st = _fs_page_scan(pg, &buffer);
         
-        if (pagehdr.v_0x5001 == 0xFFFF) {
+        if (hdr->v_0x5001 == 0xFFFF) {
             if (!saw_blank_page)
                 KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "this filesystem has a blank page in it... hmm...");
             saw_blank_page = 1;
-            _fs_set_page_state(pg, PageStateClean);
-            _fs_free_pages++;
             continue;
         }
         
-        if (pagehdr.v_0x5001 != 0x5001) {
-            KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "page %d has bad header version 0x%04x; I give up", pg, pagehdr.v_0x5001);
-            return -1;
-        }
+        if (hdr->v_0x5001 != 0x5001)
+            continue;
         
-        if (FLASHFLAG(pagehdr.empty, HDR_EMPTY_ALLOCATED) && !FLASHFLAG(pagehdr.empty, HDR_EMPTY_MOREBLOCKS) && _fs_lastpg == -1) {
+        if (FLASHFLAG(hdr->empty, HDR_EMPTY_ALLOCATED) && !FLASHFLAG(hdr->empty, HDR_EMPTY_MOREBLOCKS) && _fs_lastpg == -1) {
             _fs_lastpg = pg;
-        } else if ((_fs_lastpg != -1) && FLASHFLAG(pagehdr.empty, HDR_EMPTY_ALLOCATED)) {
+        } else if ((_fs_lastpg != -1) && FLASHFLAG(hdr->empty, HDR_EMPTY_ALLOCATED)) {
             if (!saw_page_in_outer_space)
                 KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "page %d is marked as allocated, but page %d had the last page marker... hmm...", pg, _fs_lastpg);
             saw_page_in_outer_space = 1;
             _fs_lastpg = pg;
         }
         
-        if (!FLASHFLAG(pagehdr.empty, HDR_EMPTY_ALLOCATED) || /* block has never been written to */
-            (/* allocated && */ !FLASHFLAG(pagehdr.status, HDR_STATUS_FILE_START) && !FLASHFLAG(pagehdr.status, HDR_STATUS_FILE_CONT)) /* block was erased, has no data now */) {
-            _fs_set_page_state(pg, PageStateClean);
-            if (pagehdr.wear_level_counter < _fs_best_erase_count) {
-                _fs_best_erase_count = pagehdr.wear_level_counter;
-                _fs_last_allocated_page = pg;
-            }
-            nclean++;
-            _fs_free_pages++;
-            continue;
-        }
-        
-        if (FLASHFLAG(pagehdr.status, HDR_STATUS_DEAD)) {
-            _fs_set_page_state(pg, PageStateDirty);
-            _fs_free_pages++;
-            ndirty++;
-            continue;
-        }
-        
-        if (FLASHFLAG(pagehdr.status, HDR_STATUS_FILE_START)) {
-            _fs_set_page_state(pg, PageStateFileStart);
+        if (st == PageStateFileStart || st == PageStateFileCont)
             nused++;
-            continue;
-        }
-
-        if (FLASHFLAG(pagehdr.status, HDR_STATUS_FILE_CONT)) {
-            _fs_set_page_state(pg, PageStateFileCont);
-            nused++;
-            continue;
-        }
         
-        /* We should have hit one of those cases. */
-        assert(0);
+        if (st == PageStateFileStart && !hdr->st_tmp_file && !strcmp(buffer.name, FS_CKPT_NAME)) {
+            if (use_ckpt) {
+                if (_fs_ckpt_load(pg, hdr->file_size) == 0)
+                    return 0;
+                KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "checkpoint at page %d is no good; scanning the whole filesystem", pg);
+                return _fs_page_table_init(0);
+            }
+            
+            /* We're not going to keep its journal up to date, so it has to
+             * go; see fs_init. */
+            if (_fs_ckpt_stale_pg == -1)
+                _fs_ckpt_stale_pg = pg;
+        }
     }
+    
+    /* Sectors that the garbage collector has erased stay marked as having
+     * more blocks after them, so we might not have found the marker. */
+    if (_fs_lastpg == -1 && nused)
+        _fs_lastpg = REGION_FS_N_PAGES - 1;
  
-    KERN_LOG("flash", APP_LOG_LEVEL_INFO, "filesystem has last page %d/%d (%d used, %d dirty, %d clean; next clean %d w/ count %d)", _fs_lastpg, REGION_FS_N_PAGES, nused, ndirty, nclean, _fs_last_allocated_page, _fs_best_erase_count);
+    KERN_LOG("flash", APP_LOG_LEVEL_INFO, "filesystem has last page %d/%d (%d used, %d dirty, %d clean; next clean sector %d w/ count %d)", _fs_lastpg, REGION_FS_N_PAGES, nused, _fs_ndirty, _fs_nclean,
+        _fs_wear_heap_n ? _fs_wear_heap[0] : -1, _fs_wear_heap_n ? _fs_sector_wear[_fs_wear_heap[0]] : -1);
     
     return 0;
 }
 
+static uint8_t _fs_alloc_low = 0;
+
 /* Note that this should be immediately followed by an _fs_set_page_state. */
 static int _fs_page_alloc()
 {
-    assert(_fs_best_erase_count != 0xFFFFFFFF);
-    assert(_fs_last_allocated_page != -1);
-    
-    /* The general algorithm is: we look at the last allocated page, then if
-     * it's taken, we iterate through the entire flash looking for an open
-     * page with the best erase count.  At the same time, we write down the
-     * new best erase count, and if we don't find a page with the old best
-     * erase count, we iterate again with the new one.
-     */
-    
-    int pgstart = _fs_last_allocated_page;
-    int new_best_erase_count = 0xFFFFFFFF;
-    
-    for (int i = 0; i < REGION_FS_N_PAGES; i++) {
-        struct fs_page_hdr pagehdr;
-        
-        int pg = (i + pgstart) % REGION_FS_N_PAGES;
-        if (_fs_get_page_state(pg) != PageStateClean)
-            continue;
-        
-        _fs_read_page_ofs(pg, 0, &pagehdr, sizeof(pagehdr));
-        if (pagehdr.wear_level_counter < new_best_erase_count)
-            new_best_erase_count = pagehdr.wear_level_counter;
-        if (pagehdr.wear_level_counter == _fs_best_erase_count) {
-            /* Looks like we're in luck. */
-            _fs_last_allocated_page = pg;
-            return pg;
-        }
+    /* The checkpoint goes as close to the start of flash as we can get it,
+     * since mounting has to scan up to it to find it. */
+    if (_fs_alloc_low) {
+        for (int pg = 0; pg < REGION_FS_N_PAGES; pg++)
+            if (_fs_get_page_state(pg) == PageStateClean &&
+                (pg - pg % PAGES_PER_SECTOR) != _gc_sector)
+                return pg;
+        return -1;
     }
     
-    /* Ok, that didn't work out, but at least we have a new best erase
-     * count.  Loop again with the new one. */
-    _fs_best_erase_count = new_best_erase_count;
-    for (int i = 0; i < REGION_FS_N_PAGES; i++) {
-        struct fs_page_hdr pagehdr;
-
-        int pg = (i + pgstart) % REGION_FS_N_PAGES;
-        if (_fs_get_page_state(pg) != PageStateClean)
-            continue;
-
-        _fs_read_page_ofs(pg, 0, &pagehdr, sizeof(pagehdr));
-        if (pagehdr.wear_level_counter == _fs_best_erase_count) {
-            /* Finally, found one. */
-            _fs_last_allocated_page = pg;
+    /* The least-worn sector with a clean page in it is on top of the heap;
+     * take the first clean page in it. */
+    if (!_fs_wear_heap_n)
+        return -1;
+    
+    int sec = _fs_wear_heap[0];
+    for (int pg = sec * PAGES_PER_SECTOR; pg < (sec + 1) * PAGES_PER_SECTOR && pg < REGION_FS_N_PAGES; pg++)
+        if (_fs_get_page_state(pg) == PageStateClean)
             return pg;
-        }
-    }
     
+    /* The heap said that there was a clean page in here. */
+    assert(0);
     return -1;
 }
 
 static int _update_moreblocks(int pg) {
     struct fs_page_hdr pagehdr;
+    if (pg >= REGION_FS_N_PAGES)
+        return 0;
     _fs_read_page_ofs(pg, 0, &pagehdr, sizeof(pagehdr));
     pagehdr.empty &= ~HDR_EMPTY_ALLOCATED;
     return _fs_write_page_ofs(pg, 0, &pagehdr, sizeof(pagehdr));
 }
 
-/*** GC routines. ***/
+/*** Filename index. ***/
 
-static int _gc_sector;
+/* fs_find_file used to walk every file-start page, reading each header out
+ * of flash to compare names.  Instead, we keep a small open-addressed hash
+ * table from filename to start page; it gets populated when we mount, and
+ * kept up to date as files are created and deleted, so that a lookup is one
+ * probe and one header read to verify the name.  We keep an 8-bit tag of
+ * the hash alongside each page so that collisions rarely cost us a read.
+ *
+ * The same name can be in the table twice, since a file being replaced
+ * lives alongside its temporary replacement until fs_mark_written.  A file
+ * that goes away leaves a tombstone, so that lookups carry on past it; once
+ * a quarter of the table is tombstones, it gets built again from the files
+ * that are left, before they can crowd out the empty slots that end a
+ * lookup.  If the table ever fills up with live files, we give up on it
+ * and go back to scanning.
+ */
+#ifndef FS_NAME_INDEX_SIZE
+#define FS_NAME_INDEX_SIZE 256 /* must be a power of two */
+#endif
 
-struct fs_gc_file_hdr {
-    uint8_t version; /* XXX: what should this be? */
-    uint8_t flags;
-    uint16_t start_pg;
-    uint32_t page_mask;
-    uint8_t num_entries;
-};
+#define NAME_INDEX_EMPTY     0xFFFF
+#define NAME_INDEX_TOMBSTONE 0xFFFE
 
-#define PAGES_PER_SECTOR (REGION_FS_ERASE_SIZE / REGION_FS_PAGE_SIZE)
-static void _fs_gc_find_sector()
+static uint16_t _fs_name_index_pg[FS_NAME_INDEX_SIZE];
+static uint8_t _fs_name_index_tag[FS_NAME_INDEX_SIZE];
+static uint8_t _fs_name_index_valid = 0;
+static int _fs_name_index_tombstones = 0;
+
+static uint32_t _fs_name_hash(const char *name)
 {
-    /* What we want to find is an erase-block-contiguous region of empty
-     * pages with the lowest erase count.  */
-    uint32_t lowest_erase_count = 0xFFFFFFFF;
-    int best_sector = -1;
+    /* FNV-1a */
+    uint32_t h = 2166136261u;
     
-    int pg;
+    while (*name) {
+        h ^= (uint8_t) *name++;
+        h *= 16777619u;
+    }
+    
+    return h;
+}
+
+static void _fs_name_index_reset()
+{
+    memset(_fs_name_index_pg, 0xFF, sizeof(_fs_name_index_pg));
+    _fs_name_index_valid = 1;
+    _fs_name_index_tombstones = 0;
+}
+
+static void _fs_name_index_insert(const char *name, uint16_t pg);
+
+/* Puts the files that are left back in, without the tombstones.  We only
+ * keep a few bits of each name's hash, so that means reading their names
+ * back; but it doesn't happen often. */
+static void _fs_name_index_rehash()
+{
+    struct fs_file_hdr_with_name buffer;
+    uint16_t *old = malloc(sizeof(_fs_name_index_pg));
+    
+    if (!old)
+        return;
+    
+    memcpy(old, _fs_name_index_pg, sizeof(_fs_name_index_pg));
+    _fs_name_index_reset();
+    for (int slot = 0; slot < FS_NAME_INDEX_SIZE; slot++) {
+        if (old[slot] == NAME_INDEX_EMPTY || old[slot] == NAME_INDEX_TOMBSTONE)
+            continue;
+        _fs_read_file_hdr(old[slot], &buffer);
+        _fs_name_index_insert(buffer.name, old[slot]);
+    }
+    
+    free(old);
+}
+
+static void _fs_name_index_insert(const char *name, uint16_t pg)
+{
+    if (!_fs_name_index_valid)
+        return;
+    
+    if (_fs_name_index_tombstones > FS_NAME_INDEX_SIZE / 4)
+        _fs_name_index_rehash();
+    
+    uint32_t h = _fs_name_hash(name);
+    
+    for (int i = 0; i < FS_NAME_INDEX_SIZE; i++) {
+        int slot = (h + i) & (FS_NAME_INDEX_SIZE - 1);
+        
+        if (_fs_name_index_pg[slot] == NAME_INDEX_EMPTY ||
+            _fs_name_index_pg[slot] == NAME_INDEX_TOMBSTONE) {
+            if (_fs_name_index_pg[slot] == NAME_INDEX_TOMBSTONE)
+                _fs_name_index_tombstones--;
+            _fs_name_index_pg[slot] = pg;
+            _fs_name_index_tag[slot] = h >> 24;
+            return;
+        }
+    }
     
-    for (pg = 0; pg < REGION_FS_N_PAGES; pg += PAGES_PER_SECTOR) {
-        int is_possible = 1;
-        int is_dirty = 0;
+    KERN_LOG("flash", APP_LOG_LEVEL_INFO, "filename index is full; falling back to scanning for files");
+    _fs_name_index_valid = 0;
+}
+
+static void _fs_name_index_remove(uint16_t pg)
+{
+    /* We don't necessarily have the name handy, and the table is small
+     * enough to just search outright. */
+    for (int slot = 0; slot < FS_NAME_INDEX_SIZE; slot++)
+        if (_fs_name_index_pg[slot] == pg) {
+            _fs_name_index_pg[slot] = NAME_INDEX_TOMBSTONE;
+            _fs_name_index_tombstones++;
+        }
+}
+
+/* Finds a file by name, either the live one or (if tmp is set) a
+ * replacement that is still being written, skipping the file that starts at
+ * notpg.  Returns the start page, with the header in buffer, or -1. */
+static int _fs_lookup(const char *name, int tmp, int notpg, struct fs_file_hdr_with_name *buffer)
+{
+    if (_fs_name_index_valid) {
+        uint32_t h = _fs_name_hash(name);
         
-        /* Is this sector empty? */
-        for (int i = 0; i < PAGES_PER_SECTOR; i++) {
-            enum page_state st = _fs_get_page_state(pg + i);
-            if (st != PageStateClean && st != PageStateDirty) {
-                is_possible = 0;
+        for (int i = 0; i < FS_NAME_INDEX_SIZE; i++) {
+            int slot = (h + i) & (FS_NAME_INDEX_SIZE - 1);
+            uint16_t pg = _fs_name_index_pg[slot];
+            
+            if (pg == NAME_INDEX_EMPTY)
                 break;
-            }
+            if (pg == NAME_INDEX_TOMBSTONE || pg == notpg || _fs_name_index_tag[slot] != (uint8_t)(h >> 24))
+                continue;
             
-            if (st == PageStateDirty)
-                is_dirty = 1;
+            _fs_read_file_hdr(pg, buffer);
+            if (!strcmp(name, buffer->name) && ((buffer->hdr.st_tmp_file != 0x0000) == !!tmp))
+                return pg;
         }
         
-        if (!is_possible)
-            continue;
-        
-        /* Ok, read the erase count from it. */
-        uint32_t cur_erase_count;
-        
-        struct fs_page_hdr pagehdr;
-        _fs_read_page_ofs(pg, 0, &pagehdr, sizeof(pagehdr));
-        cur_erase_count = pagehdr.wear_level_counter;
-        
-        if (is_dirty) /* We're gonna have to erase it. */
-            cur_erase_count++;
+        return -1;
+    }
+
+    for (uint16_t pg = 0; pg <= _fs_lastpg; pg++)
+    {
+        if (_fs_get_page_state(pg) == PageStateFileStart && pg != notpg)
+        {
+            _fs_read_file_hdr(pg, buffer);
+            if (!strcmp(name, buffer->name) && ((buffer->hdr.st_tmp_file != 0x0000) == !!tmp))
+                return pg;
+        }
+    }
+
+    return -1;
+}
+
+/*** Extent maps. ***/
+
+/* Finding a given page in a file means walking the chain of next_page
+ * pointers, one header read at a time, and fs_seek used to rewind to the
+ * start page on every backwards seek.  Instead, we keep a handful of
+ * recently used page lists, keyed by the page that the chain starts at (so
+ * all fds on the same file, or on the same sub-file, share one); once a
+ * page has been looked up, finding it again costs no flash I/O at all.
+ *
+ * The chain of a live file never changes, so these only go stale when
+ * pages get freed and might be reused, at which point we throw them all
+ * out.
+ */
+#ifndef FS_EXTENT_SLOTS
+#define FS_EXTENT_SLOTS 4
+#endif
+
+#ifndef FS_EXTENT_PAGES
+#define FS_EXTENT_PAGES 32
+#endif
+
+struct fs_extent {
+    uint16_t startpage; /* 0xFFFF if this slot is unused */
+    uint16_t npages;
+    uint32_t last_used;
+    uint16_t pages[FS_EXTENT_PAGES];
+};
+
+static struct fs_extent _fs_extents[FS_EXTENT_SLOTS];
+static uint32_t _fs_extent_clock = 0;
+
+static void _fs_extent_invalidate()
+{
+    for (int i = 0; i < FS_EXTENT_SLOTS; i++)
+        _fs_extents[i].startpage = 0xFFFF;
+}
+
+static struct fs_extent *_fs_extent_get(uint16_t startpage)
+{
+    struct fs_extent *ext = &_fs_extents[0];
+    
+    for (int i = 0; i < FS_EXTENT_SLOTS; i++) {
+        if (_fs_extents[i].startpage == startpage) {
+            ext = &_fs_extents[i];
+            ext->last_used = ++_fs_extent_clock;
+            return ext;
+        }
+        if (_fs_extents[i].last_used < ext->last_used)
+            ext = &_fs_extents[i];
+    }
+    
+    /* Not here; evict the least recently used one. */
+    ext->startpage = startpage;
+    ext->npages = 1;
+    ext->pages[0] = startpage;
+    ext->last_used = ++_fs_extent_clock;
+    
+    return ext;
+}
+
+/* Returns the pgidx'th page in the chain that starts at startpage, or
+ * 0xFFFF if the chain isn't that long. */
+static uint16_t _fs_extent_page(uint16_t startpage, size_t pgidx)
+{
+    struct fs_extent *ext = _fs_extent_get(startpage);
+    
+    if (pgidx < ext->npages)
+        return ext->pages[pgidx];
+    
+    /* Walk the rest of the way, writing down what we find as long as there
+     * is room to. */
+    size_t curidx = ext->npages - 1;
+    uint16_t curpg = ext->pages[curidx];
+    while (curidx < pgidx) {
+        struct fs_page_hdr hdr;
         
-        /* New best? */
-        if (cur_erase_count < lowest_erase_count) {
-            lowest_erase_count = cur_erase_count;
-            best_sector = pg;
+        _fs_read_page_ofs(curpg, 0, &hdr, sizeof(hdr));
+        curpg = _fs_next_page(&hdr);
+        curidx++;
+        if (curpg == 0xFFFF)
+            break;
+        if (curidx == ext->npages && curidx < FS_EXTENT_PAGES) {
+            ext->pages[curidx] = curpg;
+            ext->npages++;
         }
     }
     
-    _gc_sector = best_sector;
-    assert(_gc_sector != -1);
-    KERN_LOG("flash", APP_LOG_LEVEL_INFO, "chose GC sector of %d-%d, with erase count %d", _gc_sector, _gc_sector + PAGES_PER_SECTOR - 1, lowest_erase_count);
+    return curpg;
+}
+
+/* Moves an fd to a given offset in its file, without touching flash unless
+ * the extent map hasn't seen that part of the chain yet. */
+static void _fs_fd_locate(struct fd *fd, size_t offset)
+{
+    const size_t bytes_in_pg = REGION_FS_PAGE_SIZE - sizeof(struct fs_page_hdr);
+    size_t first_pg_bytes = REGION_FS_PAGE_SIZE - fd->file.startpofs;
+    size_t pgidx;
+    
+    fd->offset = offset;
+    if (offset < first_pg_bytes) {
+        fd->curpage = fd->file.startpage;
+        fd->curpofs = fd->file.startpofs + offset;
+        return;
+    }
+    
+    offset -= first_pg_bytes;
+    pgidx = 1 + offset / bytes_in_pg;
+    fd->curpofs = sizeof(struct fs_page_hdr) + offset % bytes_in_pg;
+    fd->curpage = _fs_extent_page(fd->file.startpage, pgidx);
+}
+
+/* How much room there is in a file, given its start page and header; for
+ * a growable one, that means counting up its pages. */
+static size_t _fs_file_size(int pg, const struct fs_file_hdr *hdr)
+{
+    const size_t bytes_in_pg = REGION_FS_PAGE_SIZE - sizeof(struct fs_page_hdr);
+    size_t npgs = 1;
+    
+    if (!FLASHFLAG(hdr->flag_2, HDR_FLAG_2_GROWABLE))
+        return hdr->file_size;
+    
+    while (_fs_extent_page(pg, npgs) != 0xFFFF)
+        npgs++;
+    
+    return npgs * bytes_in_pg - (sizeof(struct fs_file_hdr) - sizeof(struct fs_page_hdr) + hdr->filename_len);
+}
+
+static void _fs_file_from_hdr(struct file *file, int pg, const struct fs_file_hdr *hdr)
+{
+    file->startpage = pg;
+    file->size = _fs_file_size(pg, hdr);
+    file->startpofs = sizeof(struct fs_file_hdr) + hdr->filename_len;
+    file->flags = FILE_HAS_DIRENT;
+    if (FLASHFLAG(hdr->flag_2, HDR_FLAG_2_GROWABLE))
+        file->flags |= FILE_GROWABLE;
+}
+
+/*** GC routines. ***/
+
+/* The garbage collector works one erase sector at a time.  NOR flash can
+ * only have bits cleared, so we can't relink a live file's chain around a
+ * page that we want to erase; instead, every file with a page in the victim
+ * sector gets copied somewhere else in its entirety, just as if someone had
+ * called fs_creat_replacing on it, and once the sector holds nothing but
+ * dead and clean pages, we erase it and write its page headers back with
+ * the erase count bumped.
+ *
+ * Before we erase, we write down a "GC" file saying which sector we're
+ * about to erase (like PebbleOS does, although its GC files aren't the same
+ * as ours), and we delete it once the headers have been rewritten.  If we
+ * lose power in between, fs_init finds the GC file, and erases the sector
+ * again.
+ *
+ * Each call to _fs_gc_step does a bounded amount of work -- moving one
+ * file, or erasing one sector -- so that fs_creat_replacing only pays for
+ * as much collection as it needs right then, and so that the background
+ * thread can let go of the filesystem in between.
+ *
+ * Moving a file means that anyone still holding a struct file for it will
+ * be reading pages that are going to be erased out from under them.  Files
+ * that are mid-write (temp files, and files that have a replacement
+ * pending) never get moved; rdb takes a hold for as long as it has a
+ * database open, during which we only erase sectors that have nothing live
+ * in them.  XXX: The app manager keeps a struct file around for every
+ * installed app, forever, so we never move files in app directories; it
+ * would be better to have the app manager rescan when we do.
+ *
+ * Erasing a sector takes long enough to notice, and usually someone is
+ * waiting for it: whoever is calling fs_creat, or the background thread
+ * that only wakes up once we're running low.  So when the flash has been
+ * left alone for FS_PREERASE_IDLE_MS, the background thread also erases
+ * sectors with nothing but dead pages in them, one at a time, looking to
+ * see whether anyone else wanted the flash in between each.  Those never
+ * need anything moved, and would have to be erased before they got used
+ * again anyway, so it costs no extra wear.
+ */
+
+#ifndef FS_GC_CLEAN_TARGET
+#define FS_GC_CLEAN_TARGET (REGION_FS_N_PAGES / 8) /* the background thread tries to keep this many pages clean */
+#endif
+
+#ifndef FS_PREERASE_IDLE_MS
+#define FS_PREERASE_IDLE_MS 500
+#endif
+
+/* Clean pages that only the collector gets to use, so that it always has
+ * somewhere to move a sector's worth of live pages to, and to put its GC
+ * file.  */
+#define FS_GC_RESERVE_PAGES (PAGES_PER_SECTOR + 1)
+
+#define FS_GC_FILE_VERSION 0x52 /* 'R', so that we don't try to clean up after PebbleOS's */
+
+struct fs_gc_file_hdr {
+    uint8_t version;
+    uint8_t flags;
+    uint16_t start_pg;
+    uint32_t page_mask; /* pages in the sector that were dead */
+    uint8_t num_entries;
+    uint32_t wear_level_counter; /* for the sector, once it's erased */
+} __attribute__((__packed__));
+
+static struct fd *_fs_creat_replacing(struct fd *fd, const char *name, size_t bytes, const struct file *previous, uint8_t flags);
+static void _fs_mark_written(struct fd *fd);
+static int _fs_read(struct fd *fd, void *p, size_t bytes);
+static int _fs_write(struct fd *fd, const void *p, size_t bytes);
+static int _delete_file_by_pg(int pg);
+
+static uint8_t _gc_abandoned[(N_SECTORS + 7) / 8]; /* sectors we couldn't empty out this time around */
+static uint16_t _gc_pinned = 0xFFFF; /* a file that's about to be replaced */
+static int _fs_gc_holds = 0; /* on everything; see fs_gc_hold */
+static int _fs_gc_stuck = 0;
+static int _fs_gc_background = 0; /* the background thread has the lock */
+static struct fs_gc_stats _fs_gc_stats;
+
+static int _fs_ckpt_write();
+
+static void _fs_gc_thread(void *par);
+THREAD_DEFINE(fs_gc, 400, tskIDLE_PRIORITY + 1UL, _fs_gc_thread);
+
+static size_t _fs_npages(const char *name, size_t bytes)
+{
+    size_t fs_bytes = bytes + (name ? strlen(name) : 0) + sizeof(struct fs_file_hdr) - sizeof(struct fs_page_hdr);
+    size_t bytes_in_pg = REGION_FS_PAGE_SIZE - sizeof(struct fs_page_hdr);
+    
+    return fs_bytes / bytes_in_pg + ((fs_bytes % bytes_in_pg) ? 1 : 0);
+}
+
+static int _fs_sector_count(int sector, enum page_state st)
+{
+    int n = 0;
+    
+    for (int i = 0; i < PAGES_PER_SECTOR; i++)
+        if (_fs_get_page_state(sector + i) == st)
+            n++;
+    
+    return n;
+}
+
+/* Clean pages that the allocator is allowed to hand out right now. */
+static int _fs_clean_available()
+{
+    int n = _fs_nclean;
+    
+    if (_gc_sector != -1)
+        n -= _fs_sector_nclean[_gc_sector / PAGES_PER_SECTOR];
+    
+    return n;
+}
+
+static void _fs_gc_wake()
+{
+    if (THREAD_HANDLE(fs_gc) && _fs_nclean < FS_GC_CLEAN_TARGET)
+        xTaskNotifyGive(THREAD_HANDLE(fs_gc));
+}
+
+/* Lets the background thread know that there's a sector to erase once
+ * things quiet down. */
+static void _fs_gc_preerase_wake()
+{
+    if (THREAD_HANDLE(fs_gc))
+        xTaskNotifyGive(THREAD_HANDLE(fs_gc));
+}
+
+/* Picks the sector that gets us the most dead pages back, breaking ties by
+ * how little we'd have to move, and then by how little it's been erased; in
+ * the background, we don't bother with sectors that are still mostly
+ * alive. */
+static int _fs_gc_choose_sector(int urgent)
+{
+    int best = -1;
+    int best_dirty = 0, best_live = 0;
+    
+    for (int sec = 0; sec + PAGES_PER_SECTOR <= REGION_FS_N_PAGES; sec += PAGES_PER_SECTOR) {
+        int ndirty = _fs_sector_count(sec, PageStateDirty);
+        int nclean = _fs_sector_count(sec, PageStateClean);
+        int nlive = PAGES_PER_SECTOR - ndirty - nclean;
+        
+        if (!ndirty || (_gc_abandoned[sec / PAGES_PER_SECTOR / 8] & (1 << (sec / PAGES_PER_SECTOR % 8))))
+            continue;
+        if (!urgent && (ndirty * 2 < PAGES_PER_SECTOR))
+            continue;
+        if (nlive && _fs_gc_holds)
+            continue;
+        /* There has to be somewhere to put what's live, and the GC file. */
+        if (nlive + 1 > _fs_nclean - nclean)
+            continue;
+        
+        if (ndirty > best_dirty || (ndirty == best_dirty && nlive < best_live) ||
+            (ndirty == best_dirty && nlive == best_live &&
+             _fs_sector_wear[sec / PAGES_PER_SECTOR] < _fs_sector_wear[best / PAGES_PER_SECTOR])) {
+            best = sec;
+            best_dirty = ndirty;
+            best_live = nlive;
+        }
+    }
+    
+    return best;
+}
+
+/* Returns the start page of a live file that has a page in the sector, -1
+ * if there are none left, or -2 if we couldn't clean up after a file that
+ * was growing when we lost power. */
+static int _fs_gc_find_file(int sector)
+{
+    for (int i = 0; i < PAGES_PER_SECTOR; i++)
+        if (_fs_get_page_state(sector + i) == PageStateFileStart)
+            return sector + i;
+    
+    if (!_fs_sector_count(sector, PageStateFileCont))
+        return -1;
+    
+    /* Only continuation pages left; we have to go find out whose they are. */
+    for (int pg = 0; pg < REGION_FS_N_PAGES; pg++) {
+        if (_fs_get_page_state(pg) != PageStateFileStart)
+            continue;
+        
+        uint16_t curpg = pg;
+        while (curpg != 0xFFFF) {
+            struct fs_page_hdr pagehdr;
+            
+            _fs_read_page_ofs(curpg, 0, &pagehdr, sizeof(pagehdr));
+            curpg = _fs_next_page(&pagehdr);
+            if (curpg != 0xFFFF && curpg >= sector && curpg < sector + PAGES_PER_SECTOR)
+                return pg;
+        }
+    }
+    
+    /* Nobody links to them.  We can end up with one of these if we lose
+     * power while growing a file, between setting up a page and linking it
+     * on; they're garbage. */
+    KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "sector %d has continuation pages that nobody owns; throwing them away", sector);
+    for (int i = 0; i < PAGES_PER_SECTOR; i++) {
+        struct fs_page_hdr pagehdr;
+        
+        if (_fs_get_page_state(sector + i) != PageStateFileCont)
+            continue;
+        _fs_read_page_ofs(sector + i, 0, &pagehdr, sizeof(pagehdr));
+        pagehdr.status &= ~HDR_STATUS_DEAD;
+        if (_fs_write_page_ofs(sector + i, 0, &pagehdr, sizeof(pagehdr)))
+            return -2;
+        _fs_set_page_state(sector + i, PageStateDirty);
+    }
+    
+    return -1;
+}
+
+/* Files that somebody has an fd open on, which the collector has to leave
+ * where they are, by the hash of their name; two names that collide just
+ * both stay put.  Holds that don't fit in here hold everything. */
+#define FS_GC_MAX_HELD 8
+
+static struct {
+    uint32_t hash;
+    uint16_t count;
+} _fs_gc_held[FS_GC_MAX_HELD];
+
+static int _fs_gc_is_held(const char *name)
+{
+    uint32_t h;
+    
+    if (_fs_gc_holds)
+        return 1;
+    
+    h = _fs_name_hash(name);
+    for (int i = 0; i < FS_GC_MAX_HELD; i++)
+        if (_fs_gc_held[i].count && _fs_gc_held[i].hash == h)
+            return 1;
+    
+    return 0;
+}
+
+#ifdef REBBLEOS_TESTING
+int fs_gc_lose_power = 0;
+#endif
+
+static int _fs_gc_relocate(uint16_t startpg)
+{
+    struct fs_file_hdr_with_name buffer, twin;
+    struct file from;
+    struct fd fromfd, tofd;
+    uint8_t buf[64];
+    size_t npgs;
+    
+    _fs_read_file_hdr(startpg, &buffer);
+    if (buffer.hdr.st_tmp_file || startpg == _gc_pinned)
+        return -1;
+    if (buffer.hdr.filename_len > MAX_FILENAME_LEN || _fs_gc_is_held(buffer.name))
+        return -1;
+    if (_fs_lookup(buffer.name, 1, startpg, &twin) >= 0)
+        return -1;
+    
+    /* It's cheaper to throw the checkpoint away, and write a new one later,
+     * than to move it. */
+    if (!strcmp(buffer.name, FS_CKPT_NAME)) {
+        if (startpg == _fs_ckpt_pg)
+            _fs_ckpt_pg = -1;
+        return _delete_file_by_pg(startpg);
+    }
+    
+    _fs_file_from_hdr(&from, startpg, &buffer.hdr);
+    npgs = _fs_npages(buffer.name, from.size);
+    if (npgs + 1 > _fs_clean_available()) /* leave room for the GC file */
+        return -1;
+    
+    if (!_fs_creat_replacing(&tofd, buffer.name, from.size, &from, from.flags & FILE_GROWABLE))
+        return -1;
+    
+    fs_open(&fromfd, &from);
+    size_t rem = from.size;
+    while (rem) {
+        size_t n = rem < sizeof(buf) ? rem : sizeof(buf);
+        
+        _fs_read(&fromfd, buf, n);
+        _fs_write(&tofd, buf, n);
+        rem -= n;
+        
+#ifdef REBBLEOS_TESTING
+        if (fs_gc_lose_power && rem <= from.size / 2) {
+            fs_gc_lose_power = 0;
+            return -1;
+        }
+#endif
+    }
+    
+    _fs_mark_written(&tofd);
+    _fs_gc_stats.files_relocated++;
+    _fs_gc_stats.pages_relocated += npgs;
+    
+    return 0;
+}
+
+static int _fs_gc_erase_sector(int sector, uint32_t wear)
+{
+    struct fs_page_hdr pagehdr;
+    int rv;
+    
+    rv = _fs_wc_flush();
+    if (rv)
+        return rv;
+    
+    _fs_ckpt_touch(sector);
+    for (int i = 0; i < PAGES_PER_SECTOR; i++)
+        _fs_preerased[(sector + i) / 8] &= ~(1 << ((sector + i) % 8));
+    rv = flash_erase(REGION_FS_START + sector * REGION_FS_PAGE_SIZE, REGION_FS_ERASE_SIZE);
+    if (rv)
+        return rv;
+    
+    /* These stay marked as allocated, so that the last-page scan at mount
+     * time carries on past them. */
+    memset(&pagehdr, 0xFF, sizeof(pagehdr));
+    pagehdr.v_0x5001 = 0x5001;
+    pagehdr.empty &= ~(HDR_EMPTY_MOREBLOCKS | HDR_EMPTY_ALLOCATED);
+    pagehdr.wear_level_counter = wear;
+    
+    _fs_sector_set_wear(sector / PAGES_PER_SECTOR, wear);
+    for (int i = 0; i < PAGES_PER_SECTOR; i++) {
+        rv = _fs_write_page_ofs(sector + i, 0, &pagehdr, sizeof(pagehdr));
+        if (rv)
+            return rv;
+        _fs_set_page_state(sector + i, PageStateClean);
+    }
+    assert(_update_moreblocks(sector + PAGES_PER_SECTOR) >= 0);
+    
+    _fs_gc_stats.sectors_erased++;
+    
+    return 0;
+}
+
+/* Erases a sector that has nothing live left in it. */
+static int _fs_gc_collect_sector(int sector)
+{
+    struct fs_gc_file_hdr gchdr;
+    struct fd fd;
+    
+    memset(&gchdr, 0xFF, sizeof(gchdr));
+    gchdr.version = FS_GC_FILE_VERSION;
+    gchdr.start_pg = sector;
+    gchdr.page_mask = 0;
+    gchdr.num_entries = PAGES_PER_SECTOR;
+    gchdr.wear_level_counter = _fs_sector_wear[sector / PAGES_PER_SECTOR] + 1;
+    
+    for (int i = 0; i < PAGES_PER_SECTOR; i++)
+        if (_fs_get_page_state(sector + i) == PageStateDirty)
+            gchdr.page_mask |= 1 << i;
+    
+    if (!_fs_creat_replacing(&fd, "GC", sizeof(gchdr), NULL, 0))
+        return -1;
+    _fs_write(&fd, &gchdr, sizeof(gchdr));
+    
+    uint16_t gcpg = fd.file.startpage;
+    _fs_mark_written(&fd);
+    
+    if (_fs_gc_erase_sector(sector, gchdr.wear_level_counter) < 0) {
+        /* Leave the GC file there, and don't make any more of them; next
+         * boot will have another go. */
+        KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "failed to erase sector %d; no more GC until reboot", sector);
+        _fs_gc_stuck = 1;
+        return -1;
+    }
+    
+    return _delete_file_by_pg(gcpg);
+}
+
+/* Redoes the erase described by a GC file that we found at mount time. */
+static int _fs_gc_recover(int pg)
+{
+    struct fs_file_hdr filehdr;
+    struct fs_gc_file_hdr gchdr;
+    
+    _fs_read_page_ofs(pg, 0, &filehdr, sizeof(filehdr));
+    if (filehdr.file_size < sizeof(gchdr))
+        return -1;
+    _fs_read_page_ofs(pg, sizeof(filehdr) + filehdr.filename_len, &gchdr, sizeof(gchdr));
+    
+    if (gchdr.version != FS_GC_FILE_VERSION ||
+        gchdr.num_entries != PAGES_PER_SECTOR ||
+        (gchdr.start_pg % PAGES_PER_SECTOR) != 0 ||
+        gchdr.start_pg >= REGION_FS_N_PAGES ||
+        (pg >= gchdr.start_pg && pg < gchdr.start_pg + PAGES_PER_SECTOR))
+        return -1;
+    
+    KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "page %d has a GC file for sector %d-%d; finishing the erase", pg, gchdr.start_pg, gchdr.start_pg + PAGES_PER_SECTOR - 1);
+    if (_fs_gc_erase_sector(gchdr.start_pg, gchdr.wear_level_counter) < 0)
+        return -1;
+    
+    return _delete_file_by_pg(pg);
+}
+
+static void _fs_gc_abandon()
+{
+    int sec = _gc_sector / PAGES_PER_SECTOR;
+    
+    _gc_abandoned[sec / 8] |= 1 << (sec % 8);
+    _fs_set_gc_sector(-1);
+}
+
+/* Does one unit of collection.  Returns nonzero if it's worth calling
+ * again. */
+static int _fs_gc_step(int urgent)
+{
+    if (_fs_gc_stuck)
+        return 0;
+    
+    if (_gc_sector == -1) {
+        int sector = _fs_gc_choose_sector(urgent);
+        if (sector == -1)
+            return 0;
+        _fs_set_gc_sector(sector);
+        KERN_LOG("flash", APP_LOG_LEVEL_DEBUG, "collecting sector %d-%d", _gc_sector, _gc_sector + PAGES_PER_SECTOR - 1);
+    }
+    
+    int pg = _fs_gc_find_file(_gc_sector);
+    if (pg != -1) {
+        if (pg >= 0 && _fs_gc_relocate(pg) == 0)
+            return 1;
+        
+        KERN_LOG("flash", APP_LOG_LEVEL_DEBUG, "can't move file at %d out of sector %d right now", pg, _gc_sector);
+        _fs_gc_abandon();
+        return urgent;
+    }
+    
+    if (_fs_clean_available() < 1 || _fs_gc_collect_sector(_gc_sector) < 0) {
+        _fs_gc_abandon();
+        return urgent;
+    }
+    
+    /* There's more room now, so it's worth trying again on anything that
+     * we gave up on. */
+    memset(_gc_abandoned, 0, sizeof(_gc_abandoned));
+    _fs_set_gc_sector(-1);
+    return 1;
+}
+
+/* Erases one sector that's entirely dead, if there is one, picking the
+ * least worn.  Returns nonzero if it did. */
+static int _fs_gc_preerase_step()
+{
+    int best = -1;
+    
+    if (_fs_gc_stuck || _gc_sector != -1 || _fs_clean_available() < 1)
+        return 0;
+    
+    for (int sec = 0; sec + PAGES_PER_SECTOR <= REGION_FS_N_PAGES; sec += PAGES_PER_SECTOR)
+        if (_fs_sector_ndirty[sec / PAGES_PER_SECTOR] == PAGES_PER_SECTOR &&
+            (best == -1 || _fs_sector_wear[sec / PAGES_PER_SECTOR] < _fs_sector_wear[best / PAGES_PER_SECTOR]))
+            best = sec;
+    if (best == -1)
+        return 0;
+    
+    KERN_LOG("flash", APP_LOG_LEVEL_DEBUG, "erasing dead sector %d-%d while idle", best, best + PAGES_PER_SECTOR - 1);
+    _fs_set_gc_sector(best);
+    if (_fs_gc_collect_sector(best) < 0) {
+        _fs_set_gc_sector(-1);
+        return 0;
+    }
+    _fs_set_gc_sector(-1);
+    
+    for (int i = 0; i < PAGES_PER_SECTOR; i++)
+        _fs_preerased[(best + i) / 8] |= 1 << ((best + i) % 8);
+    _fs_gc_stats.sectors_preerased++;
+    
+    return 1;
+}
+
+static int _fs_gc_preerase_pending()
+{
+    for (int sec = 0; sec < N_SECTORS; sec++)
+        if (_fs_sector_ndirty[sec] == PAGES_PER_SECTOR)
+            return 1;
+    
+    return 0;
+}
+
+/* Collects until there are npgs pages that we can allocate (on top of the
+ * collector's reserve), or until we run out of things to collect.  Doesn't
+ * move the file that starts at pinned, since our caller is about to replace
+ * it. */
+static int _fs_gc_make_room(size_t npgs, int pinned)
+{
+    int budget = 2 * N_SECTORS;
+    
+    npgs += FS_GC_RESERVE_PAGES;
+    if (_fs_clean_available() >= npgs)
+        return 0;
+    if (_fs_nclean + _fs_ndirty < npgs)
+        return -1;
+    
+    TickType_t start = xTaskGetTickCount();
+    
+    uint8_t tag = flash_set_tag(FLASH_TAG_FS_GC);
+    _gc_pinned = pinned;
+    memset(_gc_abandoned, 0, sizeof(_gc_abandoned));
+    while (_fs_clean_available() < npgs && budget--)
+        if (!_fs_gc_step(1))
+            break;
+    _gc_pinned = 0xFFFF;
+    flash_set_tag(tag);
+    
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    _fs_gc_stats.foreground_ticks += elapsed;
+    if (elapsed > _fs_gc_stats.max_pause_ticks)
+        _fs_gc_stats.max_pause_ticks = elapsed;
+    
+    return (_fs_clean_available() >= npgs) ? 0 : -1;
+}
+
+/* The collector's thread also looks after writing checkpoints, since it
+ * already wakes up whenever the filesystem has been busy. */
+static void _fs_gc_thread(void *par)
+{
+    TickType_t ckpt_due = xTaskGetTickCount() + pdMS_TO_TICKS(FS_CKPT_INTERVAL_MS);
+    int preerase = 0;
+    
+    flash_set_tag(FLASH_TAG_FS_GC);
+    for (;;) {
+        /* If there's something to erase, come back soon to see whether
+         * the flash has gone quiet. */
+        TickType_t wait = ckpt_due - xTaskGetTickCount();
+        if ((int32_t)wait < 0)
+            wait = 0;
+        if (preerase && wait > pdMS_TO_TICKS(FS_PREERASE_IDLE_MS))
+            wait = pdMS_TO_TICKS(FS_PREERASE_IDLE_MS);
+        
+        uint32_t activity = flash_get_activity();
+        int woken = ulTaskNotifyTake(pdTRUE, wait) != 0;
+        int idle = !woken && flash_get_activity() == activity;
+        int timed_out = (int32_t)(xTaskGetTickCount() - ckpt_due) >= 0;
+        if (timed_out)
+            ckpt_due = xTaskGetTickCount() + pdMS_TO_TICKS(FS_CKPT_INTERVAL_MS);
+        
+        int budget = 2 * N_SECTORS;
+        int progress = 1;
+        
+        memset(_gc_abandoned, 0, sizeof(_gc_abandoned));
+        while (progress && budget--) {
+            FS_LOCK();
+            TickType_t start = xTaskGetTickCount();
+            _fs_gc_background = 1;
+            progress = _fs_valid && (_fs_nclean < FS_GC_CLEAN_TARGET) && _fs_gc_step(0);
+            _fs_gc_background = 0;
+            _fs_gc_stats.background_ticks += xTaskGetTickCount() - start;
+            FS_UNLOCK();
+        }
+        
+        FS_LOCK();
+        if (_fs_valid && (_fs_ckpt_pg == -1 || _fs_ckpt_njournal > FS_CKPT_JOURNAL_SOFT_LIMIT || (timed_out && _fs_ckpt_dirty)))
+            _fs_ckpt_write();
+        
+        /* Only one sector per quiet spell, so that anyone who shows up
+         * waits for one erase at most. */
+        if (_fs_valid && idle) {
+            TickType_t start = xTaskGetTickCount();
+            _fs_gc_background = 1;
+            _fs_gc_preerase_step();
+            _fs_gc_background = 0;
+            _fs_gc_stats.background_ticks += xTaskGetTickCount() - start;
+        }
+        preerase = _fs_valid && _fs_gc_preerase_pending();
+        FS_UNLOCK();
+    }
+}
+
+void fs_gc_hold(const char *name)
+{
+    uint32_t h = name ? _fs_name_hash(name) : 0;
+    int slot = -1;
+    
+    FS_LOCK();
+    for (int i = 0; name && i < FS_GC_MAX_HELD; i++) {
+        if (_fs_gc_held[i].count && _fs_gc_held[i].hash == h) {
+            slot = i;
+            break;
+        }
+        if (!_fs_gc_held[i].count && slot == -1)
+            slot = i;
+    }
+    
+    if (slot == -1) {
+        _fs_gc_holds++;
+    } else {
+        _fs_gc_held[slot].hash = h;
+        _fs_gc_held[slot].count++;
+    }
+    FS_UNLOCK();
+}
+
+void fs_gc_release(const char *name)
+{
+    uint32_t h = name ? _fs_name_hash(name) : 0;
+    int i;
+    
+    FS_LOCK();
+    for (i = 0; name && i < FS_GC_MAX_HELD; i++)
+        if (_fs_gc_held[i].count && _fs_gc_held[i].hash == h)
+            break;
+    
+    if (name && i < FS_GC_MAX_HELD) {
+        _fs_gc_held[i].count--;
+    } else {
+        assert(_fs_gc_holds > 0);
+        _fs_gc_holds--;
+    }
+    FS_UNLOCK();
+    _fs_gc_wake();
+}
+
+void fs_gc_get_stats(struct fs_gc_stats *stats)
+{
+    FS_LOCK();
+    *stats = _fs_gc_stats;
+    stats->clean_pages = _fs_nclean;
+    stats->dirty_pages = _fs_ndirty;
+    FS_UNLOCK();
+}
+
+void fs_gc_reset_stats()
+{
+    FS_LOCK();
+    memset(&_fs_gc_stats, 0, sizeof(_fs_gc_stats));
+    FS_UNLOCK();
+}
+
+void fs_get_wear_histogram(uint16_t *hist, int nbuckets)
+{
+    memset(hist, 0, nbuckets * sizeof(*hist));
+    
+    FS_LOCK();
+    for (int sec = 0; sec < N_SECTORS; sec++) {
+        int b = 0;
+        
+        while (b < nbuckets - 1 && (_fs_sector_wear[sec] >> b) != 0)
+            b++;
+        hist[b]++;
+    }
+    FS_UNLOCK();
+}
+
+/*** Checkpoints. ***/
+
+/* Mounting used to mean reading the header of every page on flash, which
+ * is most of a second on a big filesystem.  Instead, we keep a checkpoint
+ * file with a copy of the page table, the erase counts, and the filename
+ * index in it, followed by a journal: before we write to any sector for
+ * the first time since the checkpoint was taken, we append that sector's
+ * number to the journal.  Mounting then only has to scan up to the
+ * checkpoint (which we keep as close to the start of flash as we can),
+ * read it, and rescan the sectors in the journal.
+ *
+ * Each sector goes in the journal at most once, so it can't fill up.  A
+ * journal entry is the sector number with its complement in the top half,
+ * so that one which we lost power in the middle of writing doesn't look
+ * like anything; if the checkpoint fails its CRC, or has a bad journal
+ * entry, we scan the whole filesystem just like we used to, and throw it
+ * away.
+ *
+ * The collector's thread writes a new checkpoint every so often if there
+ * have been changes, or when the journal gets long; fs_checkpoint writes
+ * one on the way down.
+ */
+
+#define FS_CKPT_MAGIC   0x54504B43 /* 'CKPT' */
+#define FS_CKPT_VERSION 1
+
+struct fs_ckpt_hdr {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t n_pages;
+    uint16_t n_sectors;
+    uint16_t name_index_size;
+    uint8_t  name_index_valid;
+    uint8_t  rsvd[3];
+};
+
+/* The header and the tables are covered by a CRC that comes right after
+ * them; the journal comes after that. */
+#define FS_CKPT_SNAPSHOT_LEN (sizeof(struct fs_ckpt_hdr) + sizeof(_fs_page_flags) + sizeof(_fs_sector_wear) + sizeof(_fs_name_index_pg) + sizeof(_fs_name_index_tag))
+#define FS_CKPT_JOURNAL_OFS  (FS_CKPT_SNAPSHOT_LEN + sizeof(uint32_t))
+#define FS_CKPT_SIZE         (FS_CKPT_JOURNAL_OFS + N_SECTORS * sizeof(uint32_t))
+
+#define FS_CKPT_RECORD(sec) ((uint32_t)(sec) | ((~(uint32_t)(sec) & 0xFFFF) << 16))
+
+static uint8_t _fs_ckpt_touched[(N_SECTORS + 7) / 8];
+
+static void _fs_ckpt_open(struct fd *fd, int pg)
+{
+    struct file file;
+    
+    file.flags = FILE_HAS_DIRENT;
+    file.startpage = pg;
+    file.startpofs = sizeof(struct fs_file_hdr) + strlen(FS_CKPT_NAME);
+    file.size = FS_CKPT_SIZE;
+    fs_open(fd, &file);
+}
+
+static void _fs_ckpt_reset_journal()
+{
+    memset(_fs_ckpt_touched, 0, sizeof(_fs_ckpt_touched));
+    _fs_ckpt_njournal = 0;
+}
+
+static int _fs_ckpt_sector_touched(int sec)
+{
+    return _fs_ckpt_touched[sec / 8] & (1 << (sec % 8));
+}
+
+/* Called before anything gets written to (or erased from) the sector that
+ * pg is in. */
+static void _fs_ckpt_touch(int pg)
+{
+    struct fd fd;
+    int sec = pg / PAGES_PER_SECTOR;
+    uint32_t rec = FS_CKPT_RECORD(sec);
+    uint8_t *p = (uint8_t *)&rec;
+    size_t n = sizeof(rec);
+    
+    _fs_ckpt_dirty = 1;
+    if (_fs_ckpt_pg == -1 || pg >= REGION_FS_N_PAGES || _fs_ckpt_sector_touched(sec))
+        return;
+    
+    /* The entry might straddle a page boundary, and these don't go through
+     * _fs_write_page_ofs, since that would bring us right back here. */
+    _fs_ckpt_open(&fd, _fs_ckpt_pg);
+    _fs_fd_locate(&fd, FS_CKPT_JOURNAL_OFS + _fs_ckpt_njournal * sizeof(rec));
+    while (n) {
+        size_t chunk = REGION_FS_PAGE_SIZE - fd.curpofs;
+        if (chunk > n)
+            chunk = n;
+        
+        if (fd.curpage == 0xFFFF ||
+            flash_write_bytes(REGION_FS_START + fd.curpage * REGION_FS_PAGE_SIZE + fd.curpofs, p, chunk)) {
+            /* If we can't write it down, the checkpoint is no good to
+             * anyone. */
+            int ckpt_pg = _fs_ckpt_pg;
+            
+            KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "couldn't write to checkpoint journal; throwing it away");
+            _fs_ckpt_pg = -1;
+            _delete_file_by_pg(ckpt_pg);
+            return;
+        }
+        
+        p += chunk;
+        n -= chunk;
+        _fs_fd_locate(&fd, fd.offset + chunk);
+    }
+    
+    _fs_ckpt_touched[sec / 8] |= 1 << (sec % 8);
+    _fs_ckpt_njournal++;
+}
+
+/* Loads the page table from the checkpoint at pg, and rescans anything
+ * that the journal says has changed since.  Doesn't touch anything unless
+ * the checkpoint checks out. */
+static int _fs_ckpt_load(int pg, size_t size)
+{
+    struct fs_file_hdr_with_name buffer;
+    struct fs_ckpt_hdr hdr;
+    struct fd fd;
+    uint32_t crc, rec;
+    
+    if (size != FS_CKPT_SIZE)
+        return -1;
+    
+    _fs_ckpt_open(&fd, pg);
+    _fs_read(&fd, &hdr, sizeof(hdr));
+    if (hdr.magic != FS_CKPT_MAGIC ||
+        hdr.version != FS_CKPT_VERSION ||
+        hdr.n_pages != REGION_FS_N_PAGES ||
+        hdr.n_sectors != N_SECTORS ||
+        hdr.name_index_size != FS_NAME_INDEX_SIZE)
+        return -1;
+    
+    _fs_fd_locate(&fd, FS_CKPT_SNAPSHOT_LEN);
+    _fs_read(&fd, &crc, sizeof(crc));
+    if (fs_file_crc32(&fd, FS_CKPT_SNAPSHOT_LEN) != crc)
+        return -1;
+    
+    _fs_ckpt_reset_journal();
+    _fs_fd_locate(&fd, FS_CKPT_JOURNAL_OFS);
+    for (int i = 0; i < N_SECTORS; i++) {
+        _fs_read(&fd, &rec, sizeof(rec));
+        if (rec == 0xFFFFFFFF)
+            break;
+        if ((rec & 0xFFFF) >= N_SECTORS || rec != FS_CKPT_RECORD(rec & 0xFFFF)) {
+            _fs_ckpt_reset_journal();
+            return -1;
+        }
+        _fs_ckpt_touched[(rec & 0xFFFF) / 8] |= 1 << ((rec & 0xFFFF) % 8);
+        _fs_ckpt_njournal++;
+    }
+    
+    /* It's good; take the tables ... */
+    _fs_fd_locate(&fd, sizeof(hdr));
+    _fs_read(&fd, _fs_page_flags, sizeof(_fs_page_flags));
+    _fs_read(&fd, _fs_sector_wear, sizeof(_fs_sector_wear));
+    _fs_read(&fd, _fs_name_index_pg, sizeof(_fs_name_index_pg));
+    _fs_read(&fd, _fs_name_index_tag, sizeof(_fs_name_index_tag));
+    _fs_name_index_valid = hdr.name_index_valid;
+    _fs_name_index_tombstones = 0;
+    for (int slot = 0; slot < FS_NAME_INDEX_SIZE; slot++)
+        _fs_name_index_tombstones += _fs_name_index_pg[slot] == NAME_INDEX_TOMBSTONE;
+    
+    /* ... work out everything that follows from them ... */
+    _fs_nclean = 0;
+    _fs_ndirty = 0;
+    _fs_wear_heap_n = 0;
+    memset(_fs_preerased, 0, sizeof(_fs_preerased));
+    for (int sec = 0; sec < N_SECTORS; sec++) {
+        _fs_sector_nclean[sec] = 0;
+        _fs_sector_ndirty[sec] = 0;
+        _fs_wear_heap_pos[sec] = -1;
+    }
+    for (int i = 0; i < REGION_FS_N_PAGES; i++) {
+        enum page_state st = _fs_get_page_state(i);
+        
+        _fs_nclean += st == PageStateClean;
+        _fs_ndirty += st == PageStateDirty;
+        _fs_sector_nclean[i / PAGES_PER_SECTOR] += st == PageStateClean;
+        _fs_sector_ndirty[i / PAGES_PER_SECTOR] += st == PageStateDirty;
+    }
+    for (int sec = 0; sec < N_SECTORS; sec++)
+        _fs_wear_heap_update(sec);
+    
+    /* ... and catch up on what happened since.  fs_init puts files that
+     * start in these sectors back in the filename index. */
+    _fs_bad_pages = 0;
+    _fs_gc_file_pg = -1;
+    for (int sec = 0; sec < N_SECTORS; sec++) {
+        if (!_fs_ckpt_sector_touched(sec))
+            continue;
+        for (int i = sec * PAGES_PER_SECTOR; i < (sec + 1) * PAGES_PER_SECTOR && i < REGION_FS_N_PAGES; i++) {
+            _fs_name_index_remove(i);
+            _fs_page_scan(i, &buffer);
+        }
+    }
+    
+    _fs_lastpg = REGION_FS_N_PAGES - 1;
+    _fs_ckpt_pg = pg;
+    _fs_ckpt_loaded = 1;
+    _fs_ckpt_dirty = _fs_ckpt_njournal != 0;
+    
+    KERN_LOG("flash", APP_LOG_LEVEL_INFO, "mounted from checkpoint at page %d, with %d sectors to catch up on (%d dirty, %d clean)", pg, _fs_ckpt_njournal, _fs_ndirty, _fs_nclean);
+    
+    return 0;
+}
+
+static int _fs_ckpt_write()
+{
+    struct fd fd;
+    struct file prev;
+    struct fs_ckpt_hdr hdr;
+    struct fs_file_hdr_with_name buffer;
+    uint32_t crc;
+    
+    /* Don't take the collector's reserve, and don't write down a GC file
+     * that we'd never find again. */
+    if (_fs_gc_stuck || _fs_clean_available() < _fs_npages(FS_CKPT_NAME, FS_CKPT_SIZE) + FS_GC_RESERVE_PAGES)
+        return -1;
+    
+    if (_fs_ckpt_pg != -1) {
+        prev.flags = FILE_HAS_DIRENT;
+        prev.startpage = _fs_ckpt_pg;
+        prev.startpofs = sizeof(struct fs_file_hdr) + strlen(FS_CKPT_NAME);
+        prev.size = FS_CKPT_SIZE;
+    }
+    
+    _fs_alloc_low = 1;
+    struct fd *fdp = _fs_creat_replacing(&fd, FS_CKPT_NAME, FS_CKPT_SIZE, (_fs_ckpt_pg != -1) ? &prev : NULL, 0);
+    _fs_alloc_low = 0;
+    if (!fdp)
+        return -1;
+    
+    /* Everything has been allocated for the new checkpoint, so the tables
+     * won't change between here and the journal being reset. */
+    memset(&hdr, 0xFF, sizeof(hdr));
+    hdr.magic = FS_CKPT_MAGIC;
+    hdr.version = FS_CKPT_VERSION;
+    hdr.n_pages = REGION_FS_N_PAGES;
+    hdr.n_sectors = N_SECTORS;
+    hdr.name_index_size = FS_NAME_INDEX_SIZE;
+    hdr.name_index_valid = _fs_name_index_valid;
+    
+    _fs_write(&fd, &hdr, sizeof(hdr));
+    _fs_write(&fd, _fs_page_flags, sizeof(_fs_page_flags));
+    _fs_write(&fd, _fs_sector_wear, sizeof(_fs_sector_wear));
+    _fs_write(&fd, _fs_name_index_pg, sizeof(_fs_name_index_pg));
+    _fs_write(&fd, _fs_name_index_tag, sizeof(_fs_name_index_tag));
+    
+    /* Check what actually made it to flash. */
+    crc = fs_file_crc32(&fd, FS_CKPT_SNAPSHOT_LEN);
+    _fs_write(&fd, &crc, sizeof(crc));
+    
+    /* Until the old checkpoint goes away, it's still the one that mount
+     * uses, so everything up to here went in its journal; from here on,
+     * things go in the new one. */
+    _fs_ckpt_pg = fd.file.startpage;
+    _fs_ckpt_reset_journal();
+    
+    /* Files that are still being written have to get looked at again by
+     * fs_init if we lose power before they're done. */
+    for (int pg = 0; pg < REGION_FS_N_PAGES; pg++) {
+        if (_fs_get_page_state(pg) != PageStateFileStart || pg == _fs_ckpt_pg)
+            continue;
+        _fs_read_page_ofs(pg, 0, &buffer.hdr, sizeof(buffer.hdr));
+        if (buffer.hdr.st_tmp_file || buffer.hdr.st_create_complete)
+            _fs_ckpt_touch(pg);
+    }
+    
+    _fs_mark_written(&fd);
+    _fs_ckpt_dirty = 0;
     
-    /* Mark it all as in use so the allocator doesn't come for it.  Also,
-     * mark it moreblocks so that we scan for things that come after it.
-     */
-    for (int i = 0; i < PAGES_PER_SECTOR; i++) {
-        struct fs_page_hdr pagehdr;
-        
-        _fs_set_page_state(_gc_sector + i, PageStateDirty);
-        _fs_read_page_ofs(_gc_sector + i, 0, &pagehdr, sizeof(pagehdr));
-        pagehdr.empty &= ~(HDR_EMPTY_MOREBLOCKS | HDR_EMPTY_ALLOCATED);
-        
-        assert(_update_moreblocks(_gc_sector + i + 1) >= 0);
-        
-        int rv = _fs_write_page_ofs(_gc_sector + i, 0, &pagehdr, sizeof(pagehdr));
-        assert(rv >= 0);
-    }
+    KERN_LOG("flash", APP_LOG_LEVEL_DEBUG, "wrote checkpoint at page %d", _fs_ckpt_pg);
+    
+    return 0;
 }
 
-static void _fs_gc_trigger()
+int fs_checkpoint()
 {
-    panic("GC not yet supported");
+    int rv = 0;
+    
+    FS_LOCK();
+    _fs_wc_flush();
+    if (_fs_valid && (_fs_ckpt_dirty || _fs_ckpt_pg == -1))
+        rv = _fs_ckpt_write();
+    FS_UNLOCK();
+    
+    return rv;
 }
 
 /*** File creation and deletion. ***/
@@ -318,20 +1788,27 @@ static int _delete_file_by_pg(int pg)
         if (_fs_write_page_ofs(curpg, 0, &pagehdr, sizeof(pagehdr)))
             return -1;
         _fs_set_page_state(curpg, PageStateDirty);
-        curpg = pagehdr.next_page;
+        curpg = _fs_next_page(&pagehdr);
     } while (curpg != 0xFFFF);
     
+    _fs_name_index_remove(pg);
+    _fs_extent_invalidate();
+    
     /* Now mark it as deleted. */
     _fs_read_page_ofs(pg, 0, &filehdr, sizeof(filehdr));
     filehdr.st_delete_complete = 0x0000;
     if (_fs_write_page_ofs(pg, 0, &filehdr, sizeof(filehdr)))
         return -1;
     
+    _fs_gc_wake();
+    
     return 0;
 }
 
 
-void fs_init()
+/* Builds the page table, and does whatever cleanup is needed after an
+ * unclean shutdown.  Called with the lock held. */
+static int _fs_mount(int use_ckpt)
 {
     /* Do a basic integrity check to see if there's any cleanup that needs
      * to be done that we don't know how to do yet.
@@ -340,10 +1817,15 @@ void fs_init()
     struct fs_file_hdr *hdr = &buffer.hdr;
     int pg;
     
-    KERN_LOG("flash", APP_LOG_LEVEL_INFO, "doing basic filesystem check");
     _fs_valid = 1;
     _fs_lastpg = -1;
-    memset(&_fs_page_flags, 0, sizeof(_fs_page_flags));
+    _gc_sector = -1;
+    _fs_gc_stuck = 0;
+    _fs_ckpt_pg = -1;
+    _fs_ckpt_loaded = 0;
+    _fs_ckpt_reset_journal();
+    _fs_name_index_reset();
+    _fs_extent_invalidate();
 
     /* Make sure that at least the first page has the header of the right
      * version.  There might be pages with missing headers later, and we can
@@ -353,17 +1835,50 @@ void fs_init()
     if (hdr->v_0x5001 != 0x5001) {
         KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "this doesn't appear to be a Pebble filesystem %x", hdr->v_0x5001);
         _fs_valid = 0;
-        return;
+        return -1;
     }
 
     /* Start off by finding the last written page. */
-    if (_fs_page_table_init()) {
+    if (_fs_page_table_init(use_ckpt)) {
         _fs_valid = 0;
-        return;
+        return -1;
+    }
+    
+    /* If we were in the middle of erasing a sector, finish the job before
+     * we go trusting anything that we read out of it. */
+    if (_fs_gc_file_pg != -1 && _fs_gc_recover(_fs_gc_file_pg) < 0) {
+        KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "page %d has a GC file; I can't deal with this; go boot PebbleOS to clean up first", _fs_gc_file_pg);
+        _fs_valid = 0;
+        return -1;
+    }
+    
+    if (_fs_bad_pages) {
+        for (pg = 0; pg < REGION_FS_N_PAGES; pg++) {
+            if (_fs_get_page_state(pg) != PageStateDirty)
+                continue;
+            _fs_read_page_ofs(pg, 0, hdr, sizeof(struct fs_page_hdr));
+            if (hdr->v_0x5001 != 0x5001) {
+                KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "page %d has bad header version 0x%04x; I give up", pg, hdr->v_0x5001);
+                _fs_valid = 0;
+                return -1;
+            }
+        }
+    }
+    
+    if (_fs_ckpt_stale_pg != -1) {
+        KERN_LOG("flash", APP_LOG_LEVEL_INFO, "throwing away checkpoint at page %d", _fs_ckpt_stale_pg);
+        assert(_delete_file_by_pg(_fs_ckpt_stale_pg) == 0);
+        _fs_ckpt_stale_pg = -1;
     }
     
-    /* Do file-level cleanup. */
+    /* Do file-level cleanup.  If we mounted from a checkpoint, the only
+     * files that can need it are in sectors that were written to since. */
     for (pg = 0; pg <= _fs_lastpg; pg++) {
+        if (_fs_ckpt_loaded && !_fs_ckpt_sector_touched(pg / PAGES_PER_SECTOR)) {
+            pg += PAGES_PER_SECTOR - 1 - pg % PAGES_PER_SECTOR;
+            continue;
+        }
+        
         if ((_fs_get_page_state(pg) != PageStateFileStart) &&
             (_fs_get_page_state(pg) != PageStateDirty))
             continue;
@@ -394,14 +1909,36 @@ void fs_init()
         if (hdr->filename_len > MAX_FILENAME_LEN)
             KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "page %d has unexpectedly long file name: %d; it may cause further errors", pg, hdr->filename_len);
 
-        if (!strcmp(buffer.name, "GC")) {
+        if (_fs_get_page_state(pg) == PageStateFileStart && !strcmp(buffer.name, "GC")) {
             KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "page %d has a GC file; I can't deal with this; go boot PebbleOS to clean up first", pg);
             _fs_valid = 0;
-            return;
+            return -1;
         }
+        
+        if (_fs_get_page_state(pg) == PageStateFileStart)
+            _fs_name_index_insert(buffer.name, pg);
     }
     
-    _fs_gc_find_sector();
+    return 0;
+}
+
+void fs_init()
+{
+    int rv;
+    
+    KERN_LOG("flash", APP_LOG_LEVEL_INFO, "doing basic filesystem check");
+    if (!_fs_mutex)
+        _fs_mutex = xSemaphoreCreateRecursiveMutexStatic(&_fs_mutex_buf);
+    
+    FS_LOCK();
+    rv = _fs_mount(1);
+    FS_UNLOCK();
+    if (rv < 0)
+        return;
+    
+    if (!THREAD_HANDLE(fs_gc))
+        THREAD_CREATE(fs_gc);
+    _fs_gc_wake();
     
     /* test it out some ... */
     struct file file;
@@ -419,16 +1956,54 @@ void fs_init()
     KERN_LOG("flash", APP_LOG_LEVEL_DEBUG, "first 3 bytes of appdb are %s", b);
 }
 
+#ifdef REBBLEOS_TESTING
+void fs_name_index_counts(int *live, int *tombstones, int *empty)
+{
+    *live = *tombstones = *empty = 0;
+    FS_LOCK();
+    if (!_fs_name_index_valid) {
+        *live = *tombstones = *empty = -1;
+        FS_UNLOCK();
+        return;
+    }
+    for (int slot = 0; slot < FS_NAME_INDEX_SIZE; slot++) {
+        *empty += _fs_name_index_pg[slot] == NAME_INDEX_EMPTY;
+        *tombstones += _fs_name_index_pg[slot] == NAME_INDEX_TOMBSTONE;
+    }
+    *live = FS_NAME_INDEX_SIZE - *empty - *tombstones;
+    FS_UNLOCK();
+}
+
+int fs_remount(int use_checkpoint)
+{
+    int rv;
+    
+    FS_LOCK();
+    rv = _fs_mount(use_checkpoint);
+    if (rv == 0)
+        rv = _fs_ckpt_loaded;
+    FS_UNLOCK();
+    
+    return rv;
+}
+#endif
+
 int fs_format()
 {
     int rv;
     
+    FS_LOCK();
     _fs_valid = 0;
     _fs_lastpg = 0;
+    _gc_sector = -1;
+    _fs_ckpt_pg = -1;
+    _fs_ckpt_loaded = 0;
+    _fs_wc_len = 0;
+    _fs_wc_err = 0;
     
     rv = flash_erase(REGION_FS_START, REGION_FS_N_PAGES * REGION_FS_PAGE_SIZE);
     if (rv)
-        return rv;
+        goto out;
     
     struct fs_page_hdr hdr;
     memset(&hdr, 0xFF, sizeof(hdr));
@@ -443,12 +2018,24 @@ int fs_format()
     for (int pg = 0; pg < REGION_FS_N_PAGES; pg++) {
         rv = flash_write_bytes(REGION_FS_START + pg * REGION_FS_PAGE_SIZE, (uint8_t *)&hdr, sizeof(hdr));
         if (rv)
-            return rv;
+            goto out;
     }
     
-    _fs_valid = 1;
+    _fs_name_index_reset();
+    _fs_extent_invalidate();
+    rv = _fs_page_table_init(0);
+    if (rv == 0)
+        _fs_valid = 1;
     
-    return 0;
+out:
+    FS_UNLOCK();
+    
+    /* If there wasn't a filesystem to mount at boot, fs_init never
+     * started the background thread. */
+    if (rv == 0 && !THREAD_HANDLE(fs_gc))
+        THREAD_CREATE(fs_gc);
+    
+    return rv;
 }
 
 int fs_find_file(struct file *file, const char *name)
@@ -459,35 +2046,100 @@ int fs_find_file(struct file *file, const char *name)
 
     struct fs_file_hdr_with_name buffer;
     struct fs_file_hdr *hdr = &buffer.hdr;
+    int pg;
+    
+    FS_LOCK();
+    pg = _fs_lookup(name, 0, -1, &buffer);
+    if (pg >= 0)
+        _fs_file_from_hdr(file, pg, hdr);
+    FS_UNLOCK();
+    
+    return pg < 0 ? -1 : 0;
+}
 
-    for (uint16_t pg = 0; pg <= _fs_lastpg; pg++)
-    {
-        if (_fs_get_page_state(pg) == PageStateFileStart)
-        {
-            _fs_read_file_hdr(pg, &buffer);
-            if (!strcmp(name, buffer.name) && (hdr->st_tmp_file == 0x0000)) {
-                file->startpage = pg;
-                file->size = hdr->file_size;
-                file->startpofs = sizeof(struct fs_file_hdr) + hdr->filename_len;
-                file->flags = FILE_HAS_DIRENT;
-                return 0;
-            }
-        }
+/*** Directories. ***/
+
+/* There's no directory structure on flash to read, so a listing is a walk
+ * over the file start pages, which we know from the page table without any
+ * I/O; the only flash reads are the headers of those files, to get at the
+ * names.  The walk doesn't keep the filesystem locked between entries, so
+ * files that get created, deleted, or moved by the garbage collector while
+ * it goes on might show up twice or not at all.  Callers that care should
+ * hold the collector off (fs_gc_hold(NULL)) for the duration. */
+void fs_opendir(struct fs_dir *dir, const char *prefix)
+{
+    dir->prefix = prefix ? prefix : "";
+    dir->pg = 0;
+}
+
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *ent)
+{
+    struct fs_file_hdr_with_name buffer;
+    size_t plen = strlen(dir->prefix);
+    int found = 0;
+    
+    if (!_fs_valid)
+        return 0;
+    
+    FS_LOCK();
+    while (!found && dir->pg <= _fs_lastpg) {
+        uint16_t pg = dir->pg++;
+        
+        if (_fs_get_page_state(pg) != PageStateFileStart)
+            continue;
+        
+        _fs_read_file_hdr(pg, &buffer);
+        if (buffer.hdr.st_tmp_file != 0x0000 || buffer.hdr.filename_len > MAX_FILENAME_LEN)
+            continue;
+        if (strncmp(buffer.name, dir->prefix, plen))
+            continue;
+        
+        strcpy(ent->name, buffer.name);
+        _fs_file_from_hdr(&ent->file, pg, &buffer.hdr);
+        found = 1;
     }
+    FS_UNLOCK();
+    
+    return found;
+}
 
-    return -1;
+int fs_unlink(const char *name)
+{
+    struct fs_file_hdr_with_name buffer;
+    int pg, rv;
+    
+    if (!_fs_valid)
+        return -1;
+    
+    FS_LOCK();
+    pg = _fs_lookup(name, 0, -1, &buffer);
+    if (pg < 0) {
+        FS_UNLOCK();
+        return -1;
+    }
+    
+    /* Nobody had better be counting on the checkpoint that they're
+     * deleting; there'll be a new one along later. */
+    if (pg == _fs_ckpt_pg)
+        _fs_ckpt_pg = -1;
+    rv = _delete_file_by_pg(pg);
+    FS_UNLOCK();
+    
+    return rv;
 }
 
 static uint16_t _fs_verily_alloc_page(enum page_state st)
 {
+    /* Our caller made sure that there was room, so this had better work. */
     int pg = _fs_page_alloc();
-    if (pg < 0)
-    {
-        _fs_gc_trigger();
-        pg = _fs_page_alloc();
-    }
     assert(pg >= 0);
     
+    if (_fs_preerased[pg / 8] & (1 << (pg % 8))) {
+        _fs_preerased[pg / 8] &= ~(1 << (pg % 8));
+        if (!_fs_gc_background)
+            _fs_gc_stats.preerased_allocs++;
+    }
+    
     _fs_set_page_state(pg, st);
     if (pg > _fs_lastpg)
         _fs_lastpg = pg;
@@ -496,28 +2148,22 @@ static uint16_t _fs_verily_alloc_page(enum page_state st)
 }
 
 
-struct fd *fs_creat_replacing(struct fd *fd, const char *name, size_t bytes, const struct file *previous /* can be NULL */)
+static struct fd *_fs_creat_replacing(struct fd *fd, const char *name, size_t bytes, const struct file *previous, uint8_t flags)
 {
-    /* XXX: Take a fs mutex around this entire function. */
-    size_t fs_bytes = bytes + (name ? strlen(name) : 0) + sizeof(struct fs_file_hdr) - sizeof(struct fs_page_hdr);
-    size_t bytes_in_pg = REGION_FS_PAGE_SIZE - sizeof(struct fs_page_hdr);
-    size_t npgs = fs_bytes / bytes_in_pg + ((fs_bytes % bytes_in_pg) ? 1 : 0);
+    size_t npgs = _fs_npages(name, bytes);
     
-    if (previous && !(previous->flags & FILE_HAS_DIRENT)) {
-        KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "cannot replace file %s that ain't a real file", name);
-        assert(0);
-        return NULL;
-    }
+    /* A growable file gets all of its last page, since there's no telling
+     * later how much of it was meant to be there. */
+    if (flags & FILE_GROWABLE)
+        bytes = npgs * (REGION_FS_PAGE_SIZE - sizeof(struct fs_page_hdr)) - (strlen(name) + sizeof(struct fs_file_hdr) - sizeof(struct fs_page_hdr));
     
     KERN_LOG("flash", APP_LOG_LEVEL_DEBUG, "preparing to create file %s with %d pages (%d bytes)", name, npgs, bytes);
-    if (_fs_free_pages < npgs)
+    if (_fs_clean_available() < npgs)
     {
         KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "not enough free storage for file");
         return NULL;
     }
     
-    _fs_free_pages -= npgs;
-    
     uint16_t startpg = 0;
     uint16_t pg; /* We have to do this here, since we also need a next page.  Sigh. */
     struct fs_file_hdr filehdr; /* We keep this around since we'll use it to rewrite the create_complete later. */
@@ -544,11 +2190,18 @@ struct fd *fs_creat_replacing(struct fd *fd, const char *name, size_t bytes, con
             filehdr.wear_level_counter = pagehdr.wear_level_counter;
             filehdr.next_page = nextpg;
             filehdr.next_page_crc = fs_next_page_crc(nextpg);
-            filehdr.pagehdr_crc = fs_pagehdr_crc((struct fs_page_hdr *)&filehdr);
+            if (flags & FILE_GROWABLE)
+                filehdr.rsvd_3 &= ~HDR_RSVD_3_GROWABLE;
+            /* The last page of a growable file gets its CRC once it has
+             * somewhere to point. */
+            if (nextpg != 0xFFFF || !(flags & FILE_GROWABLE))
+                filehdr.pagehdr_crc = fs_pagehdr_crc((struct fs_page_hdr *)&filehdr);
             
             filehdr.file_size = bytes;
             if (name)
                 filehdr.flag_2 &= ~HDR_FLAG_2_HAS_FILENAME;
+            if (flags & FILE_GROWABLE)
+                filehdr.flag_2 &= ~HDR_FLAG_2_GROWABLE;
             assert(strlen(name) < MAX_FILENAME_LEN);
             filehdr.filename_len = strlen(name);
             
@@ -560,6 +2213,7 @@ struct fd *fs_creat_replacing(struct fd *fd, const char *name, size_t bytes, con
             if (name) {
                 rv = _fs_write_page_ofs(pg, sizeof(filehdr), name, strlen(name));
                 assert(rv >= 0);
+                _fs_name_index_insert(name, pg);
             }
             
             KERN_LOG("flash", APP_LOG_LEVEL_DEBUG, "wrote start page at %d", pg);
@@ -571,7 +2225,10 @@ struct fd *fs_creat_replacing(struct fd *fd, const char *name, size_t bytes, con
             pagehdr.status &= ~(HDR_STATUS_VALID | HDR_STATUS_FILE_CONT);
             pagehdr.next_page = nextpg;
             pagehdr.next_page_crc = fs_next_page_crc(nextpg);
-            pagehdr.pagehdr_crc = fs_pagehdr_crc(&pagehdr);
+            if (flags & FILE_GROWABLE)
+                pagehdr.rsvd_3 &= ~HDR_RSVD_3_GROWABLE;
+            if (nextpg != 0xFFFF || !(flags & FILE_GROWABLE))
+                pagehdr.pagehdr_crc = fs_pagehdr_crc(&pagehdr);
             
             assert(_update_moreblocks(pg + 1) >= 0);
 
@@ -591,11 +2248,12 @@ struct fd *fs_creat_replacing(struct fd *fd, const char *name, size_t bytes, con
     fd->file.startpage = startpg;
     fd->file.startpofs = (name ? strlen(name) : 0) + sizeof(struct fs_file_hdr);
     fd->file.size = bytes;
-    fd->file.flags = FILE_HAS_DIRENT;
+    fd->file.flags = FILE_HAS_DIRENT | (flags & FILE_GROWABLE);
     
     fd->curpage = fd->file.startpage;
     fd->curpofs = fd->file.startpofs;
     fd->offset = 0;
+    fd->flags = 0;
     
     memset(&fd->replaces, 0x0, sizeof(fd->replaces));
     if (previous)
@@ -606,11 +2264,44 @@ struct fd *fs_creat_replacing(struct fd *fd, const char *name, size_t bytes, con
     return fd;
 }
 
+struct fd *fs_creat_replacing(struct fd *fd, const char *name, size_t bytes, const struct file *previous /* can be NULL */)
+{
+    struct fd *rv = NULL;
+    
+    if (previous && !(previous->flags & FILE_HAS_DIRENT)) {
+        KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "cannot replace file %s that ain't a real file", name);
+        assert(0);
+        return NULL;
+    }
+    
+    FS_LOCK();
+    if (_fs_gc_make_room(_fs_npages(name, bytes), previous ? previous->startpage : 0xFFFF) == 0)
+        rv = _fs_creat_replacing(fd, name, bytes, previous, 0);
+    FS_UNLOCK();
+    
+    return rv;
+}
+
 struct fd *fs_creat(struct fd *fd, const char *name, size_t bytes)
 {
     return fs_creat_replacing(fd, name, bytes, NULL);
 }
 
+struct fd *fs_creat_growable(struct fd *fd, const char *name, size_t bytes, const struct file *previous)
+{
+    struct fd *rv = NULL;
+    
+    if (previous && !(previous->flags & FILE_HAS_DIRENT))
+        return NULL;
+    
+    FS_LOCK();
+    if (_fs_gc_make_room(_fs_npages(name, bytes), previous ? previous->startpage : 0xFFFF) == 0)
+        rv = _fs_creat_replacing(fd, name, bytes, previous, FILE_GROWABLE);
+    FS_UNLOCK();
+    
+    return rv;
+}
+
 void fs_open(struct fd *fd, const struct file *file)
 {
     fd->file = *file;
@@ -619,6 +2310,7 @@ void fs_open(struct fd *fd, const struct file *file)
     fd->curpofs = fd->file.startpofs;
     
     fd->offset  = 0;
+    fd->flags   = 0;
     
     memset(&fd->replaces, 0x0, sizeof(fd->replaces));
 }
@@ -628,7 +2320,7 @@ void fs_file_from_file(struct file *file, const struct file *from, size_t offset
     struct fd fd;
     
     fs_open(&fd, from);
-    fs_seek(&fd, offset, FS_SEEK_SET);
+    fs_seek(&fd, offset, FS_SEEK_SET); /* takes the lock for us */
     
     *file = *from;
     file->flags &= ~FILE_HAS_DIRENT;
@@ -651,13 +2343,18 @@ void fs_file_from_flash(struct file *file, size_t addr, size_t len)
     file->size = len;
 }
 
-void fs_mark_written(struct fd *fd)
+static void _fs_mark_written(struct fd *fd)
 {
     int rv;
     
+    /* Everything that was written has to be down before the file is
+     * marked as such. */
+    rv = _fs_wc_flush();
+    assert(rv >= 0);
+    
     /* The only 'close' operation is to clean up tmpfile status, and to
      * erase the old file.  So we do that.  */
-    if (fd->replaces.size)
+    if (fd->replaces.flags & FILE_HAS_DIRENT)
     {
         /* First off, mark the old one as staged for deletion. */
         struct fs_file_hdr filehdr;
@@ -689,7 +2386,14 @@ void fs_mark_written(struct fd *fd)
     memset(&fd, 0, sizeof(fd));
 }
 
-int fs_read(struct fd *fd, void *p, size_t bytes)
+void fs_mark_written(struct fd *fd)
+{
+    FS_LOCK();
+    _fs_mark_written(fd);
+    FS_UNLOCK();
+}
+
+static int _fs_read(struct fd *fd, void *p, size_t bytes)
 {
     size_t bytesrem;
     
@@ -721,24 +2425,99 @@ int fs_read(struct fd *fd, void *p, size_t bytes)
         p += n;
         
         if (fd->curpofs == REGION_FS_PAGE_SIZE)
-        {
-            struct fs_page_hdr hdr;
-            
-            _fs_read_page_ofs(fd->curpage, 0, &hdr, sizeof(hdr));
-            fd->curpage = hdr.next_page; /* XXX check this */
-            fd->curpofs = sizeof(hdr);
-        }
+            _fs_fd_locate(fd, fd->offset);
     }
     
     return bytes;
 }
 
-int fs_write(struct fd *fd, const void *p, size_t bytes)
+int fs_read(struct fd *fd, void *p, size_t bytes)
+{
+    int rv;
+    
+    FS_LOCK();
+    rv = _fs_read(fd, p, bytes);
+    FS_UNLOCK();
+    
+    return rv;
+}
+
+/*** Growable files. ***/
+
+/* A growable file gets longer by having a page linked onto the end of its
+ * chain.  We set up the new page's header first, and then program the
+ * link, its CRC, and the last page's header CRC in one go; if we lose
+ * power in the middle of that, the link's CRC doesn't match, and the file
+ * ends where it did before (see _fs_next_page).  Either way, the new page
+ * is left with nobody pointing at it, and the garbage collector picks it
+ * up later.  The size is never written down anywhere; it's however many
+ * pages the chain has.
+ *
+ * Someone else might have grown the file since our fd found out how big
+ * it was, in which case there's already a page there to take.  */
+static int _fs_grow(struct fd *fd, size_t bytes)
+{
+    const size_t bytes_in_pg = REGION_FS_PAGE_SIZE - sizeof(struct fs_page_hdr);
+    
+    if ((fd->file.flags & (FILE_GROWABLE | FILE_HAS_DIRENT)) != (FILE_GROWABLE | FILE_HAS_DIRENT))
+        return -1;
+    
+    while (fd->file.size < bytes) {
+        struct fs_page_hdr lasthdr, pagehdr;
+        size_t npgs = (fd->file.size + fd->file.startpofs - sizeof(struct fs_page_hdr)) / bytes_in_pg;
+        uint16_t lastpg = _fs_extent_page(fd->file.startpage, npgs - 1);
+        uint16_t pg;
+        
+        _fs_read_page_ofs(lastpg, 0, &lasthdr, sizeof(lasthdr));
+        if (_fs_next_page(&lasthdr) != 0xFFFF) {
+            fd->file.size += bytes_in_pg;
+            continue;
+        }
+        if (lasthdr.next_page != 0xFFFF) {
+            /* A link that didn't make it; we can't write another over it. */
+            KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "page %d has a broken link; can't grow the file any more", lastpg);
+            return -1;
+        }
+        
+        if (_fs_gc_make_room(1, fd->file.startpage) < 0) {
+            KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "no room to grow file at page %d", fd->file.startpage);
+            return -1;
+        }
+        
+        pg = _fs_verily_alloc_page(PageStateFileCont);
+        _fs_read_page_ofs(pg, 0, &pagehdr, sizeof(pagehdr));
+        pagehdr.empty &= ~(HDR_EMPTY_MOREBLOCKS | HDR_EMPTY_ALLOCATED);
+        pagehdr.status &= ~(HDR_STATUS_VALID | HDR_STATUS_FILE_CONT);
+        pagehdr.rsvd_3 &= ~HDR_RSVD_3_GROWABLE;
+        if (_update_moreblocks(pg + 1) < 0 ||
+            _fs_write_page_ofs(pg, 0, &pagehdr, sizeof(pagehdr)) < 0)
+            return -1;
+        
+        lasthdr.next_page = pg;
+        lasthdr.next_page_crc = fs_next_page_crc(pg);
+        lasthdr.pagehdr_crc = fs_pagehdr_crc(&lasthdr);
+        if (_fs_write_page_ofs(lastpg, 0, &lasthdr, sizeof(lasthdr)) < 0)
+            return -1;
+        
+        KERN_LOG("flash", APP_LOG_LEVEL_DEBUG, "grew file at page %d onto page %d", fd->file.startpage, pg);
+        fd->file.size += bytes_in_pg;
+    }
+    
+    return 0;
+}
+
+static int _fs_write(struct fd *fd, const void *p, size_t bytes)
 {
     size_t bytesrem;
     
     assert(!(fd->file.flags & FILE_IS_RAW_FLASH) && "cannot write to raw flash");
     
+    /* If it doesn't grow all the way, we write what we can. */
+    if (bytes > (fd->file.size - fd->offset) && (fd->file.flags & FILE_GROWABLE)) {
+        _fs_grow(fd, fd->offset + bytes);
+        /* We might have been sitting off the end of the old chain. */
+        _fs_fd_locate(fd, fd->offset);
+    }
     if (bytes > (fd->file.size - fd->offset))
         bytes = fd->file.size - fd->offset;
     bytesrem = bytes;
@@ -750,7 +2529,11 @@ int fs_write(struct fd *fd, const void *p, size_t bytes)
         if (n > (REGION_FS_PAGE_SIZE - fd->curpofs))
             n = REGION_FS_PAGE_SIZE - fd->curpofs;
         
-        _fs_write_page_ofs(fd->curpage, fd->curpofs, p, n);
+        if ((fd->flags & FD_WRITE_COMBINE) ? _fs_wc_write(fd, p, n) :
+                                             _fs_write_page_ofs(fd->curpage, fd->curpofs, p, n)) {
+            KERN_LOG("flash", APP_LOG_LEVEL_ERROR, "write to page %d failed", fd->curpage);
+            break;
+        }
         
         fd->curpofs += n;
         fd->offset += n;
@@ -758,21 +2541,136 @@ int fs_write(struct fd *fd, const void *p, size_t bytes)
         p += n;
         
         if (fd->curpofs == REGION_FS_PAGE_SIZE)
-        {
-            struct fs_page_hdr hdr;
-            
-            _fs_read_page_ofs(fd->curpage, 0, &hdr, sizeof(hdr));
-            fd->curpage = hdr.next_page; /* XXX check this */
-            fd->curpofs = sizeof(hdr);
+            _fs_fd_locate(fd, fd->offset);
+    }
+    
+    return bytes - bytesrem;
+}
+
+int fs_grow(struct fd *fd, size_t bytes)
+{
+    int rv;
+    
+    FS_LOCK();
+    rv = _fs_grow(fd, bytes);
+    _fs_fd_locate(fd, fd->offset);
+    FS_UNLOCK();
+    
+    return rv;
+}
+
+int fs_write(struct fd *fd, const void *p, size_t bytes)
+{
+    int rv;
+    
+    FS_LOCK();
+    rv = _fs_write(fd, p, bytes);
+    FS_UNLOCK();
+    flash_note_written(rv);
+    
+    return rv;
+}
+
+const void *fs_map(struct fd *fd, struct fs_mapping *map, void *buf, size_t bytes)
+{
+    const void *p = NULL;
+    
+    memset(map, 0, sizeof(*map));
+    if (bytes == 0 || bytes > fd->file.size - fd->offset)
+        return NULL;
+    
+    FS_LOCK();
+    
+    if (fd->file.flags & FILE_IS_RAW_FLASH) {
+        p = flash_map(fd->curpofs, bytes);
+        if (p) {
+            fd->curpofs += bytes;
+            fd->offset += bytes;
+        }
+    } else if (fd->curpofs + bytes <= REGION_FS_PAGE_SIZE) {
+        /* A file is only contiguous on flash within one of its pages. */
+        _fs_wc_flush_overlapping(fd->curpage, fd->curpofs, bytes);
+        p = flash_map(REGION_FS_START + fd->curpage * REGION_FS_PAGE_SIZE + fd->curpofs, bytes);
+        if (p) {
+            fd->curpofs += bytes;
+            fd->offset += bytes;
+            if (fd->curpofs == REGION_FS_PAGE_SIZE)
+                _fs_fd_locate(fd, fd->offset);
         }
     }
     
-    return bytes;
+    if (p) {
+        map->how = FS_MAPPED_IN_PLACE;
+    } else {
+        if (!buf) {
+            buf = malloc(bytes);
+            if (!buf) {
+                FS_UNLOCK();
+                return NULL;
+            }
+            map->how = FS_MAPPED_ALLOC;
+        }
+        _fs_read(fd, buf, bytes);
+        p = buf;
+    }
+    
+    FS_UNLOCK();
+    
+    map->p = p;
+    map->len = bytes;
+    
+    return p;
+}
+
+void fs_unmap(struct fs_mapping *map)
+{
+    if (map->how & FS_MAPPED_IN_PLACE)
+        flash_unmap(map->p, map->len);
+    else if (map->how & FS_MAPPED_ALLOC)
+        free((void *)map->p);
+    
+    memset(map, 0, sizeof(*map));
+}
+
+int fs_flush(struct fd *fd)
+{
+    int rv;
+    
+    FS_LOCK();
+    rv = _fs_wc_flush();
+    if (_fs_wc_err)
+        rv = _fs_wc_err;
+    _fs_wc_err = 0;
+    FS_UNLOCK();
+    
+    return rv;
+}
+
+int fs_in_one_program(const struct fd *fd, size_t n)
+{
+    size_t addr;
+    
+    if (n == 0 || (fd->file.flags & FILE_IS_RAW_FLASH) || n > fd->file.size - fd->offset ||
+        fd->curpofs + n > REGION_FS_PAGE_SIZE)
+        return 0;
+    
+    addr = REGION_FS_START + fd->curpage * REGION_FS_PAGE_SIZE + fd->curpofs;
+    return addr / FS_WC_SIZE == (addr + n - 1) / FS_WC_SIZE;
+}
+
+void fs_set_write_combine(struct fd *fd, int enable)
+{
+    if (enable) {
+        fd->flags |= FD_WRITE_COMBINE;
+    } else {
+        fd->flags &= ~FD_WRITE_COMBINE;
+        fs_flush(fd);
+    }
 }
 
 long fs_seek(struct fd *fd, long ofs, enum seek whence)
 {
-    size_t newoffset;
+    size_t newoffset = fd->offset;
     switch (whence)
     {
     case FS_SEEK_SET: newoffset = ofs; break;
@@ -790,34 +2688,11 @@ long fs_seek(struct fd *fd, long ofs, enum seek whence)
         return newoffset;
     }
     
-    if (newoffset < fd->offset)
-    {
-        fd->curpage = fd->file.startpage;
-        fd->curpofs = fd->file.startpofs;
-        fd->offset = 0;
-    }
-    
-    size_t delta = newoffset - fd->offset;
-    while (delta)
-    {
-        size_t n = delta;
-        
-        if (n > (REGION_FS_PAGE_SIZE - fd->curpofs))
-            n = REGION_FS_PAGE_SIZE - fd->curpofs;
-        
-        fd->curpofs += n;
-        fd->offset += n;
-        delta -= n;
-        
-        if (fd->curpofs == REGION_FS_PAGE_SIZE)
-        {
-            struct fs_page_hdr hdr;
-            
-            _fs_read_page_ofs(fd->curpage, 0, &hdr, sizeof(hdr));
-            fd->curpage = hdr.next_page; /* XXX check this */
-            fd->curpofs = sizeof(hdr);
-        }
-    }
+    FS_LOCK();
+    if (fd->flags & FD_WRITE_COMBINE)
+        _fs_wc_flush();
+    _fs_fd_locate(fd, newoffset);
+    FS_UNLOCK();
     
     return fd->offset;
 }
@@ -9,6 +9,7 @@
 
 #define FILE_IS_RAW_FLASH 0x1
 #define FILE_HAS_DIRENT   0x2 /* i.e., it's not a file-within-a-file */
+#define FILE_GROWABLE     0x4 /* see fs_creat_growable */
 
 struct file {
     uint8_t flags;
@@ -25,6 +26,48 @@ struct fd {
     size_t curpofs;
     
     size_t offset;
+    
+    uint8_t flags;
+};
+
+#define FD_WRITE_COMBINE 0x1
+
+/* The longest name that a file can have. */
+#define FS_NAME_MAX 32
+
+/* See fs_opendir. */
+struct fs_dir {
+    const char *prefix;
+    uint16_t pg;
+};
+
+struct fs_dirent {
+    char name[FS_NAME_MAX + 1];
+    struct file file;
+};
+
+/* See fs_map. */
+struct fs_mapping {
+    const void *p;
+    size_t len;
+    uint8_t how;
+};
+
+#define FS_MAPPED_IN_PLACE 0x1 /* p points at flash */
+#define FS_MAPPED_ALLOC    0x2 /* p is a copy that fs_unmap frees */
+
+/* Counters for the garbage collector; see fs_gc_get_stats. */
+struct fs_gc_stats {
+    uint32_t sectors_erased;
+    uint32_t files_relocated;
+    uint32_t pages_relocated;
+    uint32_t foreground_ticks; /* spent collecting inside fs_creat */
+    uint32_t max_pause_ticks;  /* longest that one fs_creat spent collecting */
+    uint32_t background_ticks;
+    uint32_t sectors_preerased; /* dead sectors erased while the flash was idle */
+    uint32_t preerased_allocs;  /* pages that fs_creat got from those */
+    uint32_t clean_pages;
+    uint32_t dirty_pages;
 };
 
 enum seek {
@@ -40,9 +83,80 @@ void fs_file_from_file(struct file *file, const struct file *from, size_t offset
 void fs_file_from_flash(struct file *file, size_t addr, size_t len);
 struct fd *fs_creat_replacing(struct fd *fd, const char *name, size_t bytes, const struct file *previous /* can be NULL */);
 struct fd *fs_creat(struct fd *fd, const char *name, size_t bytes);
+/* Like fs_creat_replacing, except that bytes is only how big the file
+ * starts out (rounded up to fill its last page), and writing past the end
+ * links more pages onto it, rather than coming up short.  The filesystem
+ * doesn't keep track of how much of a growable file has been written --
+ * its size is just however much it has room for, and the rest reads as
+ * 0xFF -- so anyone appending to one has to find their own end, the way
+ * that rdb does.  Other fds, and struct files from before it grew, carry
+ * on seeing the old size.  Returns NULL if there's no room. */
+struct fd *fs_creat_growable(struct fd *fd, const char *name, size_t bytes, const struct file *previous /* can be NULL */);
+/* Makes room for a growable file to be at least bytes long, without
+ * writing anything; fs_write does this on its own, but this way, someone
+ * can find out before they start writing.  Returns 0, or -1 if the file
+ * isn't growable, or can't get that big. */
+int fs_grow(struct fd *fd, size_t bytes);
 void fs_open(struct fd *fd, const struct file *file);
 void fs_mark_written(struct fd *fd);
 int fs_read(struct fd *fd, void *p, size_t n);
 int fs_write(struct fd *fd, const void *p, size_t n);
 long fs_seek(struct fd *fd, long ofs, enum seek whence);
 long fs_size(struct fd *fd);
+
+/* Lists the files whose names start with prefix (or all of them, if it's
+ * NULL), in no particular order.  fs_readdir returns 1 and fills in ent
+ * for each one, and 0 once there are no more.  The prefix has to stay
+ * around until the listing is done. */
+void fs_opendir(struct fs_dir *dir, const char *prefix);
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *ent);
+
+/* Deletes a file.  Anyone who still has it open is in for a surprise. */
+int fs_unlink(const char *name);
+
+/* Lets small writes to fd pile up, and go to flash a program page at a
+ * time.  Pending bytes go out on fs_flush, fs_seek, fs_mark_written, or
+ * before anything else writes to flash; before an fd that combines writes
+ * goes away, or before writing anything that must not land until they
+ * have (a "this record is valid" flag, say), call fs_flush.  That is also
+ * the only way to find out that they didn't make it, if they went out on
+ * their own: fs_flush fails if any pending bytes have, since it was last
+ * called.  (fs_write comes up short if its own bytes don't make it.) */
+void fs_set_write_combine(struct fd *fd, int enable);
+int fs_flush(struct fd *fd);
+
+/* Whether the n bytes at fd's offset would go down in a single program
+ * operation: that is, whether they're all in one page of the file, and in
+ * one program page of flash.  For anyone who writes over bytes that are
+ * already there, and can't have them tear if we lose power. */
+int fs_in_one_program(const struct fd *fd, size_t n);
+
+/* Like fs_read, but tries not to copy: if the n bytes at fd's offset are
+ * all in one place on flash, and the platform can map flash, this returns
+ * a pointer straight to them.  Otherwise, they get read into buf -- or, if
+ * buf is NULL, into a fresh allocation.  Either way, the result is good
+ * until fs_unmap, which should come soon: nobody can write to flash while
+ * it is mapped (including the caller).  Returns NULL if fewer than n bytes
+ * are left, or if it can't allocate a copy. */
+const void *fs_map(struct fd *fd, struct fs_mapping *map, void *buf, size_t n);
+void fs_unmap(struct fs_mapping *map);
+
+/* Anyone who keeps an fd open across calls into the filesystem (rdb does,
+ * between rdb_open and rdb_close) should hold the file, by name, so that
+ * the garbage collector doesn't move it out from underneath them; anything
+ * else can still move.  A struct file that is kept for longer than that
+ * can go stale, so look the file up again by name before using it.  A NULL
+ * name holds every file. */
+void fs_gc_hold(const char *name);
+void fs_gc_release(const char *name);
+void fs_gc_get_stats(struct fs_gc_stats *stats);
+void fs_gc_reset_stats();
+/* Counts up how many times each sector has been erased: hist[0] is how
+ * many never have been, and hist[n] how many have been erased between
+ * 2^(n-1) and 2^n - 1 times, except that the last bucket takes everything
+ * past it. */
+void fs_get_wear_histogram(uint16_t *hist, int nbuckets);
+
+/* Writes down the page table, so that the next boot doesn't have to scan
+ * all of flash to rebuild it.  Call this before powering off. */
+int fs_checkpoint();
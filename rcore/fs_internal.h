@@ -23,6 +23,7 @@ struct fs_page_hdr {
     uint32_t rsvd_1;
     uint32_t rsvd_2;
     uint8_t  rsvd_3;
+#define HDR_RSVD_3_GROWABLE 0x1 /* ours: next_page might get written after the fact */
     uint8_t  next_page_crc;
     uint16_t next_page;
     uint32_t pagehdr_crc; /* random numbers? */
@@ -50,6 +51,7 @@ struct fs_file_hdr {
     uint32_t file_size;
     uint8_t  flag_2; /* FF or FE; FE if there's a filename */
 #define HDR_FLAG_2_HAS_FILENAME 0x1
+#define HDR_FLAG_2_GROWABLE 0x2 /* ours: file_size is only how big it started out */
     uint8_t  filename_len;
     uint16_t rsvd_4; /* FF FF */
     uint32_t rsvd_5;
@@ -61,7 +63,7 @@ struct fs_file_hdr {
 };
 
 /* assuming that no longer files are possible, just a guess */
-#define MAX_FILENAME_LEN 32
+#define MAX_FILENAME_LEN FS_NAME_MAX
 
 struct fs_file_hdr_with_name {
     struct fs_file_hdr hdr;
@@ -69,9 +71,31 @@ struct fs_file_hdr_with_name {
 };
 
 uint32_t fs_pbfs_crc32(void *p, size_t len);
+uint32_t fs_pbfs_crc32_accum(uint32_t crc, void *p, size_t len);
 uint8_t fs_pbfs_crc8(void *p, size_t len);
 
 uint32_t fs_pagehdr_crc(struct fs_page_hdr *hdr);
 uint32_t fs_filehdr_crc(struct fs_file_hdr *hdr);
 uint8_t  fs_next_page_crc(uint16_t next_page);
-uint32_t fs_file_crc32(struct fd *fd, size_t len);
\ No newline at end of file
+uint32_t fs_file_crc32(struct fd *fd, size_t len);
+
+#ifdef REBBLEOS_TESTING
+/* Throws away the page table and builds it again, as if we had just booted;
+ * returns 1 if it came from a checkpoint, 0 if we scanned, or -1. */
+int fs_remount(int use_checkpoint);
+
+/* Counts up the slots in the filename index: all -1 if it has given up. */
+void fs_name_index_counts(int *live, int *tombstones, int *empty);
+
+/* If set, the next file that the collector moves only gets halfway copied,
+ * and then the collector gives up on it, as if we had lost power; follow it
+ * with fs_remount.  Goes back to 0 once it has happened. */
+extern int fs_gc_lose_power;
+
+/* If set, that many of the next program operations that the filesystem
+ * asks for fail, without touching flash. */
+extern int fs_fail_programs;
+
+/* The plain table-driven CRC, for checking fs_pbfs_crc32_accum against. */
+uint32_t fs_pbfs_crc32_accum_ref(uint32_t crc, void *p, size_t len);
+#endif
@@ -4,8 +4,13 @@
  */
 
 #include "fs.h"
+#include "fs_internal.h"
+#include "flash.h"
 #include "test.h"
 #include "debug.h"
+#include "platform.h"
+#include "FreeRTOS.h"
+#include "task.h"
 #include <string.h>
 #include <stdio.h>
 
@@ -162,6 +167,45 @@ TEST(fs_find_noent) {
     return (rv < 0) ? TEST_PASS : TEST_FAIL;
 }
 
+/* Files coming and going leave tombstones in the filename index, which
+ * mustn't crowd out the empty slots that end a lookup. */
+TEST(fs_name_index) {
+    int live0, live, tombstones, empty;
+    struct fd fd;
+    struct file file;
+    char name[16];
+    
+    for (int i = 0; i < 8; i++) {
+        sprintf(name, "nidxkeep%d", i);
+        if (!fs_creat(&fd, name, 16)) { *artifact = 1; return TEST_FAIL; }
+        fs_mark_written(&fd);
+    }
+    fs_name_index_counts(&live0, &tombstones, &empty);
+    if (live0 < 0) { *artifact = 2; return TEST_FAIL; }
+    
+    for (int i = 0; i < 300; i++) {
+        sprintf(name, "nidx%d", i);
+        if (!fs_creat(&fd, name, 16)) { *artifact = 3; return TEST_FAIL; }
+        fs_mark_written(&fd);
+        if (fs_unlink(name) < 0) { *artifact = 4; return TEST_FAIL; }
+    }
+    
+    fs_name_index_counts(&live, &tombstones, &empty);
+    printf("fs_name_index: %d live, %d tombstones, %d empty\n", live, tombstones, empty);
+    if (live != live0) { *artifact = 5; return TEST_FAIL; }
+    if (tombstones * 4 > live + tombstones + empty + 4) { *artifact = 6; return TEST_FAIL; }
+    
+    for (int i = 0; i < 8; i++) {
+        sprintf(name, "nidxkeep%d", i);
+        if (fs_find_file(&file, name) < 0) { *artifact = 7; return TEST_FAIL; }
+        if (fs_unlink(name) < 0) { *artifact = 8; return TEST_FAIL; }
+    }
+    if (fs_find_file(&file, "nidx0") >= 0 || fs_find_file(&file, "nidx299") >= 0) { *artifact = 9; return TEST_FAIL; }
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
 TEST(fs_two_files) {
     struct fd fd1, fd2, *fdp;
     struct file file1, file2;
@@ -279,4 +323,749 @@ TEST(fs_sub_file) {
 }
 
 
+/* Byte at a given offset of the seek test file, so that we can check any
+ * read without having to replay an LFSR from the start. */
+static uint8_t _seekfile_byte(uint32_t ofs) {
+    return (ofs * 31) ^ (ofs >> 8);
+}
+
+TEST(fs_seek_perf) {
+#define SEEKFILE_SIZE 65536
+#define SEEKFILE_NSEEKS 1000
+    struct fd fd, *fdp;
+    struct file file;
+    uint8_t buf[IOBUFSIZ];
+    int rv;
+    
+    fdp = fs_creat(&fd, "seekfile", SEEKFILE_SIZE);
+    if (!fdp) { *artifact = 1; return TEST_FAIL; }
+    for (uint32_t ofs = 0; ofs < SEEKFILE_SIZE; ofs += IOBUFSIZ) {
+        for (int i = 0; i < IOBUFSIZ; i++)
+            buf[i] = _seekfile_byte(ofs + i);
+        fs_write(&fd, buf, IOBUFSIZ);
+    }
+    fs_mark_written(fdp);
+    
+    rv = fs_find_file(&file, "seekfile");
+    if (rv < 0) { *artifact = 2; return TEST_FAIL; }
+    fs_open(&fd, &file);
+    
+    /* Bounce around the file, mostly backwards, the way that font and
+     * resource lookups do. */
+    uint32_t lcg = 12345;
+    TickType_t start = xTaskGetTickCount();
+    for (int n = 0; n < SEEKFILE_NSEEKS; n++) {
+        lcg = lcg * 1103515245 + 12345;
+        uint32_t ofs = (lcg >> 8) % (SEEKFILE_SIZE - 8);
+        
+        fs_seek(&fd, ofs, FS_SEEK_SET);
+        rv = fs_read(&fd, buf, 8);
+        if (rv != 8) { *artifact = 3; return TEST_FAIL; }
+        for (int i = 0; i < 8; i++)
+            if (buf[i] != _seekfile_byte(ofs + i)) {
+                printf("seek read error at ofs %d: exp %d, got %d\n", (int)(ofs + i), _seekfile_byte(ofs + i), buf[i]);
+                *artifact = 4;
+                return TEST_FAIL;
+            }
+    }
+    TickType_t end = xTaskGetTickCount();
+    
+    printf("%d seek+reads in %d ms\n", SEEKFILE_NSEEKS, (int)((end - start) * portTICK_PERIOD_MS));
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+/* Churns a file through more than the whole filesystem's worth of pages,
+ * so that the garbage collector has to kick in, with a file that sits still
+ * the whole time, which has to come through it intact.  (There are always
+ * sectors with nothing live in them to collect, so it doesn't get moved;
+ * fs_gc_relocate sees to that.) */
+TEST(fs_gc) {
+#define GCFILE_SIZE 98304
+#define GCFILE_ITERS 160
+    struct fd fd, *fdp;
+    struct file file;
+    struct fs_gc_stats st;
+    uint8_t buf[IOBUFSIZ];
+    TickType_t maxpause = 0;
+    int rv;
+    
+    rv = bigfile_make("gcfile/still", 20000, 31337);
+    if (rv != 0) { *artifact = 1000 + rv; return TEST_FAIL; }
+    
+    TickType_t start = xTaskGetTickCount();
+    for (int n = 0; n < GCFILE_ITERS; n++) {
+        int have = fs_find_file(&file, "gcfile/churn") == 0;
+        
+        TickType_t cstart = xTaskGetTickCount();
+        fdp = fs_creat_replacing(&fd, "gcfile/churn", GCFILE_SIZE, have ? &file : NULL);
+        if (xTaskGetTickCount() - cstart > maxpause)
+            maxpause = xTaskGetTickCount() - cstart;
+        if (!fdp) {
+            printf("create failed on iteration %d\n", n);
+            *artifact = 2;
+            return TEST_FAIL;
+        }
+        
+        memset(buf, n, IOBUFSIZ);
+        for (int ofs = 0; ofs < GCFILE_SIZE; ofs += IOBUFSIZ)
+            fs_write(&fd, buf, IOBUFSIZ);
+        fs_mark_written(fdp);
+    }
+    TickType_t end = xTaskGetTickCount();
+    
+    rv = fs_find_file(&file, "gcfile/churn");
+    if (rv < 0) { *artifact = 3; return TEST_FAIL; }
+    fs_open(&fd, &file);
+    for (int ofs = 0; ofs < GCFILE_SIZE; ofs += IOBUFSIZ) {
+        fs_read(&fd, buf, IOBUFSIZ);
+        for (int i = 0; i < IOBUFSIZ; i++)
+            if (buf[i] != (uint8_t)(GCFILE_ITERS - 1)) {
+                printf("churn file wrong at ofs %d: got %d\n", ofs + i, buf[i]);
+                *artifact = 4;
+                return TEST_FAIL;
+            }
+    }
+    
+    rv = bigfile_verify("gcfile/still", 20000, 31337);
+    if (rv != 0) { *artifact = 5000 + rv; return TEST_FAIL; }
+    
+    fs_gc_get_stats(&st);
+    printf("wrote %d KB in %d ms; longest fs_creat took %d ms\n", GCFILE_ITERS * GCFILE_SIZE / 1024, (int)((end - start) * portTICK_PERIOD_MS), (int)(maxpause * portTICK_PERIOD_MS));
+    printf("gc: %d sectors erased, %d files (%d pages) moved, %d ms foreground, %d ms background, %d clean, %d dirty\n",
+        (int)st.sectors_erased, (int)st.files_relocated, (int)st.pages_relocated,
+        (int)(st.foreground_ticks * portTICK_PERIOD_MS), (int)(st.background_ticks * portTICK_PERIOD_MS),
+        (int)st.clean_pages, (int)st.dirty_pages);
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+static int _relocfile_make(const char *name, int n, const struct file *previous) {
+#define RELOCFILE_SIZE (REGION_FS_PAGE_SIZE / 2)
+    struct fd fd;
+    uint8_t buf[IOBUFSIZ];
+    
+    if (!fs_creat_replacing(&fd, name, RELOCFILE_SIZE, previous))
+        return -1;
+    memset(buf, n * 7 + 1, IOBUFSIZ);
+    for (int ofs = 0; ofs < RELOCFILE_SIZE; ofs += IOBUFSIZ)
+        fs_write(&fd, buf, IOBUFSIZ);
+    fs_mark_written(&fd);
+    
+    return 0;
+}
+
+/* Checks the first n still files that fs_gc_relocate made. */
+static int _relocfile_check(int n) {
+    struct file file;
+    struct fd fd;
+    char name[16];
+    uint8_t buf[IOBUFSIZ];
+    
+    for (int i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "reloc/%d", i);
+        if (fs_find_file(&file, name) < 0) {
+            printf("%s went missing\n", name);
+            return -1;
+        }
+        fs_open(&fd, &file);
+        for (int ofs = 0; ofs < RELOCFILE_SIZE; ofs += IOBUFSIZ) {
+            if (fs_read(&fd, buf, IOBUFSIZ) != IOBUFSIZ)
+                return -1;
+            for (int j = 0; j < IOBUFSIZ; j++)
+                if (buf[j] != (uint8_t)(i * 7 + 1)) {
+                    printf("%s wrong at ofs %d: got %d\n", name, ofs + j, buf[j]);
+                    return -1;
+                }
+        }
+    }
+    
+    return 0;
+}
+
+/* Lays down still files one page apiece, each next to a page of a file that
+ * keeps getting replaced, until every sector is half alive; then the
+ * collector has no way to make room but to move files.  The first one that
+ * it moves loses power halfway across, and after the reboot, it has to
+ * still be where it was, and the collector has to manage it the next time. */
+TEST(fs_gc_relocate) {
+    struct fs_gc_stats before, after;
+    struct file file;
+    char name[16];
+    int n = 0, crashed = 0, moved = 0;
+    
+    fs_gc_get_stats(&before);
+    fs_gc_lose_power = 1;
+    while (!moved && n < REGION_FS_N_PAGES / 2) {
+        int have = fs_find_file(&file, "reloc/churn") >= 0;
+        
+        snprintf(name, sizeof(name), "reloc/%d", n);
+        if (_relocfile_make(name, n, NULL) < 0 ||
+            _relocfile_make("reloc/churn", 0, have ? &file : NULL) < 0) {
+            printf("create failed on file %d\n", n);
+            *artifact = 1;
+            return TEST_FAIL;
+        }
+        n++;
+        
+        if (!fs_gc_lose_power && !crashed) {
+            crashed = 1;
+            if (fs_remount(0) < 0) { *artifact = 2; return TEST_FAIL; }
+            if (_relocfile_check(n) < 0) { *artifact = 3; return TEST_FAIL; }
+        }
+        
+        fs_gc_get_stats(&after);
+        moved = crashed && after.files_relocated > before.files_relocated;
+    }
+    fs_gc_lose_power = 0;
+    
+    fs_gc_get_stats(&after);
+    printf("relocate: %d still files; gc moved %d files (%d pages)\n", n,
+        (int)(after.files_relocated - before.files_relocated), (int)(after.pages_relocated - before.pages_relocated));
+    if (!crashed) { *artifact = 4; return TEST_FAIL; }
+    if (after.files_relocated == before.files_relocated) { *artifact = 5; return TEST_FAIL; }
+    if (_relocfile_check(n) < 0) { *artifact = 6; return TEST_FAIL; }
+    
+    for (int i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "reloc/%d", i);
+        fs_unlink(name);
+    }
+    fs_unlink("reloc/churn");
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+/* Whether any of the first n app files that fs_gc_hold made has moved. */
+static int _gchold_moved(const uint16_t *startpg, int n) {
+    struct file file;
+    char name[16];
+    int moved = 0;
+    
+    for (int i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "@%08x/res", 0x100 + i);
+        if (fs_find_file(&file, name) < 0)
+            return -1;
+        moved += file.startpage != startpg[i];
+    }
+    
+    return moved;
+}
+
+/* App files move like anything else, and holding one file by name only
+ * keeps that one where it is.  The held file goes in a sector of its own
+ * among dead pages, which makes its sector the first that the collector
+ * has to move something out of; it has to work around it, and move other
+ * apps' files instead. */
+TEST(fs_gc_hold) {
+#define GCHOLD_NFILES (REGION_FS_N_PAGES / 2)
+#define GCHOLD_PAGES_PER_SECTOR (REGION_FS_ERASE_SIZE / REGION_FS_PAGE_SIZE)
+    static uint16_t startpg[GCHOLD_NFILES];
+    struct fs_gc_stats before, after;
+    struct file file, churn, pinned;
+    struct fd fd;
+    char name[16];
+    uint8_t buf[IOBUFSIZ];
+    int n = 0, moved = 0;
+    
+    fs_gc_hold("@00000001/app");
+    for (int i = 0; i < 2 * GCHOLD_PAGES_PER_SECTOR; i++) {
+        int have = fs_find_file(&churn, "gchold/churn") >= 0;
+        
+        if (i == GCHOLD_PAGES_PER_SECTOR &&
+            (_relocfile_make("@00000001/app", 1, NULL) < 0 || fs_find_file(&pinned, "@00000001/app") < 0)) {
+            *artifact = 1;
+            return TEST_FAIL;
+        }
+        if (_relocfile_make("gchold/churn", 0, have ? &churn : NULL) < 0) { *artifact = 2; return TEST_FAIL; }
+    }
+    
+    fs_gc_get_stats(&before);
+    while (moved <= 0 && n < GCHOLD_NFILES) {
+        int have = fs_find_file(&churn, "gchold/churn") >= 0;
+        
+        snprintf(name, sizeof(name), "@%08x/res", 0x100 + n);
+        if (_relocfile_make(name, n, NULL) < 0 || fs_find_file(&file, name) < 0 ||
+            _relocfile_make("gchold/churn", 0, have ? &churn : NULL) < 0) {
+            printf("create failed on file %d\n", n);
+            *artifact = 3;
+            return TEST_FAIL;
+        }
+        startpg[n++] = file.startpage;
+        
+        fs_gc_get_stats(&after);
+        if (after.files_relocated != before.files_relocated)
+            moved = _gchold_moved(startpg, n);
+    }
+    
+    fs_gc_get_stats(&after);
+    printf("gc hold: %d app files, %d of them moved; gc moved %d files (%d pages)\n", n, moved,
+        (int)(after.files_relocated - before.files_relocated), (int)(after.pages_relocated - before.pages_relocated));
+    
+    if (moved <= 0) { *artifact = 4; return TEST_FAIL; }
+    if (fs_find_file(&file, "@00000001/app") < 0 || file.startpage != pinned.startpage) { *artifact = 5; return TEST_FAIL; }
+    fs_gc_release("@00000001/app");
+    
+    for (int i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "@%08x/res", 0x100 + i);
+        if (fs_find_file(&file, name) < 0) { *artifact = 6; return TEST_FAIL; }
+        fs_open(&fd, &file);
+        for (int ofs = 0; ofs < RELOCFILE_SIZE; ofs += IOBUFSIZ) {
+            if (fs_read(&fd, buf, IOBUFSIZ) != IOBUFSIZ) { *artifact = 7; return TEST_FAIL; }
+            for (int j = 0; j < IOBUFSIZ; j++)
+                if (buf[j] != (uint8_t)(i * 7 + 1)) { *artifact = 8; return TEST_FAIL; }
+        }
+        fs_unlink(name);
+    }
+    fs_unlink("@00000001/app");
+    fs_unlink("gchold/churn");
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+/* Leaves a few sectors' worth of dead pages behind, and then sits still,
+ * so that the background thread gets a chance to erase them before anyone
+ * needs them. */
+TEST(fs_preerase) {
+#define PREERASE_FILE_SIZE (REGION_FS_ERASE_SIZE * 3)
+#define PREERASE_WAIT_MS 20000
+    struct fs_gc_stats before, after;
+    struct fd fd, *fdp;
+    uint8_t buf[IOBUFSIZ];
+    
+    fs_unlink("preerase");
+    fdp = fs_creat(&fd, "preerase", PREERASE_FILE_SIZE);
+    if (!fdp) { *artifact = 1; return TEST_FAIL; }
+    memset(buf, 0x55, IOBUFSIZ);
+    for (int ofs = 0; ofs < PREERASE_FILE_SIZE; ofs += IOBUFSIZ)
+        fs_write(&fd, buf, IOBUFSIZ);
+    fs_mark_written(fdp);
+    
+    fs_gc_get_stats(&before);
+    if (fs_unlink("preerase") < 0) { *artifact = 2; return TEST_FAIL; }
+    
+    /* Looking at the stats doesn't touch flash, so this counts as idle. */
+    TickType_t start = xTaskGetTickCount();
+    do {
+        vTaskDelay(pdMS_TO_TICKS(100));
+        fs_gc_get_stats(&after);
+    } while (after.sectors_preerased == before.sectors_preerased &&
+             (xTaskGetTickCount() - start) < pdMS_TO_TICKS(PREERASE_WAIT_MS));
+    if (after.sectors_preerased == before.sectors_preerased) { *artifact = 3; return TEST_FAIL; }
+    
+    /* Give it long enough to do the rest, and then use some of them. */
+    vTaskDelay(pdMS_TO_TICKS(PREERASE_WAIT_MS / 4));
+    fdp = fs_creat(&fd, "preerase", PREERASE_FILE_SIZE);
+    if (!fdp) { *artifact = 4; return TEST_FAIL; }
+    fs_mark_written(fdp);
+    fs_gc_get_stats(&after);
+    
+    printf("preerase: %d sectors erased while idle; fs_creat then got %d pages that were already erased (%d so far)\n",
+        (int)(after.sectors_preerased - before.sectors_preerased),
+        (int)(after.preerased_allocs - before.preerased_allocs), (int)after.preerased_allocs);
+    
+    fs_unlink("preerase");
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+TEST(fs_mount_time) {
+    struct fs_gc_stats scan_st, ckpt_st;
+    int rv;
+    
+    /* Make sure that there's at least something to mount. */
+    rv = bigfile_make("mountfile", 20000, 8086);
+    if (rv != 0) { *artifact = 1000 + rv; return TEST_FAIL; }
+    
+    TickType_t start = xTaskGetTickCount();
+    rv = fs_remount(0);
+    TickType_t scan_ticks = xTaskGetTickCount() - start;
+    if (rv != 0) { *artifact = 1; return TEST_FAIL; }
+    fs_gc_get_stats(&scan_st);
+    
+    if (fs_checkpoint() != 0) { *artifact = 2; return TEST_FAIL; }
+    
+    start = xTaskGetTickCount();
+    rv = fs_remount(1);
+    TickType_t ckpt_ticks = xTaskGetTickCount() - start;
+    if (rv != 1) { *artifact = 3; return TEST_FAIL; }
+    fs_gc_get_stats(&ckpt_st);
+    
+    /* The checkpoint itself took up some clean pages, and the scan threw
+     * away whatever checkpoint was there before it, so only the file
+     * contents are directly comparable. */
+    printf("mount: %d ms scanning (%d clean, %d dirty); %d ms from checkpoint (%d clean, %d dirty)\n",
+        (int)(scan_ticks * portTICK_PERIOD_MS), (int)scan_st.clean_pages, (int)scan_st.dirty_pages,
+        (int)(ckpt_ticks * portTICK_PERIOD_MS), (int)ckpt_st.clean_pages, (int)ckpt_st.dirty_pages);
+    
+    rv = bigfile_verify("mountfile", 20000, 8086);
+    if (rv != 0) { *artifact = 4000 + rv; return TEST_FAIL; }
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+static int _wcfile_write(const char *name, int combine, uint32_t *programs) {
+#define WCFILE_SIZE 3000
+    struct flash_io_stats before, after;
+    struct fd fd, rfd, *fdp;
+    struct file file;
+    uint8_t buf[3];
+    
+    fdp = fs_creat(&fd, name, WCFILE_SIZE);
+    if (!fdp)
+        return 1;
+    fs_set_write_combine(&fd, combine);
+    
+    flash_get_io_stats(&before);
+    for (int ofs = 0; ofs < WCFILE_SIZE; ofs += sizeof(buf)) {
+        for (int i = 0; i < sizeof(buf); i++)
+            buf[i] = _seekfile_byte(ofs + i);
+        fs_write(&fd, buf, sizeof(buf));
+        
+        /* Whatever is still pending had better show up to readers. */
+        if (ofs == 300) {
+            fs_file_from_file(&file, &fd.file, ofs, sizeof(buf));
+            fs_open(&rfd, &file);
+            fs_read(&rfd, buf, sizeof(buf));
+            for (int i = 0; i < sizeof(buf); i++)
+                if (buf[i] != _seekfile_byte(ofs + i))
+                    return 2;
+        }
+    }
+    fs_mark_written(fdp);
+    flash_get_io_stats(&after);
+    *programs = after.programs - before.programs;
+    
+    if (fs_find_file(&file, name) < 0)
+        return 3;
+    fs_open(&fd, &file);
+    for (int ofs = 0; ofs < WCFILE_SIZE; ofs += sizeof(buf)) {
+        fs_read(&fd, buf, sizeof(buf));
+        for (int i = 0; i < sizeof(buf); i++)
+            if (buf[i] != _seekfile_byte(ofs + i))
+                return 4;
+    }
+    
+    return 0;
+}
+
+TEST(fs_write_combine) {
+    uint32_t plain, combined;
+    int rv;
+    
+    rv = _wcfile_write("wcfile0", 0, &plain);
+    if (rv) { *artifact = rv; return TEST_FAIL; }
+    rv = _wcfile_write("wcfile1", 1, &combined);
+    if (rv) { *artifact = 10 + rv; return TEST_FAIL; }
+    
+    printf("%d bytes in 3-byte writes: %d program operations plain, %d combined\n",
+        WCFILE_SIZE, (int)plain, (int)combined);
+    
+    if (combined >= plain) { *artifact = 20; return TEST_FAIL; }
+    
+    /* A write that doesn't make it comes up short... */
+    struct fd fd;
+    uint8_t buf[8];
+    
+    memset(buf, 0x5A, sizeof(buf));
+    if (!fs_creat(&fd, "wcfile2", 64)) { *artifact = 21; return TEST_FAIL; }
+    fs_fail_programs = 1;
+    rv = fs_write(&fd, buf, sizeof(buf));
+    fs_fail_programs = 0;
+    if (rv != 0) { *artifact = 22; return TEST_FAIL; }
+    
+    /* ... and combined bytes that go out on their own, and don't make it,
+     * fail the next flush (but only that one). */
+    fs_set_write_combine(&fd, 1);
+    if (fs_write(&fd, buf, sizeof(buf)) != sizeof(buf)) { *artifact = 23; return TEST_FAIL; }
+    fs_fail_programs = 1;
+    fs_seek(&fd, 0, FS_SEEK_CUR);
+    fs_fail_programs = 0;
+    if (fs_flush(&fd) == 0) { *artifact = 24; return TEST_FAIL; }
+    if (fs_flush(&fd) != 0) { *artifact = 25; return TEST_FAIL; }
+    fs_mark_written(&fd);
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+static int _mapfile_check(const uint8_t *p, uint32_t ofs, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (p[i] != _seekfile_byte(ofs + i))
+            return 1;
+    return 0;
+}
+
+TEST(fs_map) {
+#define MAPFILE_SIZE (REGION_FS_PAGE_SIZE * 2)
+    struct fd fd, rfd, *fdp;
+    struct file file;
+    struct fs_mapping map;
+    uint8_t buf[IOBUFSIZ];
+    const uint8_t *p;
+    
+    fdp = fs_creat(&fd, "mapfile", MAPFILE_SIZE);
+    if (!fdp) { *artifact = 1; return TEST_FAIL; }
+    for (uint32_t ofs = 0; ofs < MAPFILE_SIZE; ofs += IOBUFSIZ) {
+        for (int i = 0; i < IOBUFSIZ; i++)
+            buf[i] = _seekfile_byte(ofs + i);
+        fs_write(&fd, buf, IOBUFSIZ);
+    }
+    fs_mark_written(fdp);
+    
+    if (fs_find_file(&file, "mapfile") < 0) { *artifact = 2; return TEST_FAIL; }
+    fs_open(&fd, &file);
+    
+    /* Something small, well inside the first page. */
+    fs_seek(&fd, 100, FS_SEEK_SET);
+    p = fs_map(&fd, &map, NULL, 64);
+    if (!p || _mapfile_check(p, 100, 64)) { *artifact = 3; return TEST_FAIL; }
+    printf("fs_map: small map was %s\n", (map.how & FS_MAPPED_IN_PLACE) ? "in place" : "a copy");
+    fs_unmap(&map);
+    if (fs_seek(&fd, 0, FS_SEEK_CUR) != 164) { *artifact = 4; return TEST_FAIL; }
+    
+    /* The whole thing can't be in one place, so we get a copy ... */
+    fs_seek(&fd, 0, FS_SEEK_SET);
+    p = fs_map(&fd, &map, NULL, MAPFILE_SIZE);
+    if (!p || _mapfile_check(p, 0, MAPFILE_SIZE)) { *artifact = 5; return TEST_FAIL; }
+    if (map.how != FS_MAPPED_ALLOC) { *artifact = 6; return TEST_FAIL; }
+    fs_unmap(&map);
+    
+    /* ... or, if we have somewhere to put it, it goes there.  This
+     * straddles the end of the file's first page. */
+    uint32_t pgend = REGION_FS_PAGE_SIZE - file.startpofs;
+    fs_seek(&fd, pgend - 8, FS_SEEK_SET);
+    p = fs_map(&fd, &map, buf, 16);
+    if (p != buf || _mapfile_check(p, pgend - 8, 16)) { *artifact = 7; return TEST_FAIL; }
+    fs_unmap(&map);
+    
+    /* Asking for more than there is gets nothing. */
+    fs_seek(&fd, MAPFILE_SIZE - 8, FS_SEEK_SET);
+    if (fs_map(&fd, &map, buf, 16)) { *artifact = 8; return TEST_FAIL; }
+    
+    /* Bytes still sitting in the write combining buffer have to show up. */
+    fdp = fs_creat(&fd, "mapfile1", 64);
+    if (!fdp) { *artifact = 9; return TEST_FAIL; }
+    fs_set_write_combine(&fd, 1);
+    for (int i = 0; i < 8; i++)
+        buf[i] = _seekfile_byte(i);
+    fs_write(&fd, buf, 8);
+    fs_file_from_file(&file, &fd.file, 0, 8);
+    fs_open(&rfd, &file);
+    p = fs_map(&rfd, &map, NULL, 8);
+    if (!p || _mapfile_check(p, 0, 8)) { *artifact = 10; return TEST_FAIL; }
+    fs_unmap(&map);
+    fs_mark_written(fdp);
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+static int _readdir_count(const char *prefix) {
+    struct fs_dir dir;
+    struct fs_dirent ent;
+    int n = 0;
+    
+    fs_opendir(&dir, prefix);
+    while (fs_readdir(&dir, &ent)) {
+        if (strncmp(ent.name, prefix, strlen(prefix)))
+            return -1;
+        n++;
+    }
+    
+    return n;
+}
+
+TEST(fs_readdir) {
+    struct fd fd;
+    struct file file;
+    struct fs_dir dir;
+    struct fs_dirent ent;
+    char name[16];
+    
+    /* Clear out anything left over from a previous run. */
+    fs_opendir(&dir, "dirtest");
+    while (fs_readdir(&dir, &ent))
+        fs_unlink(ent.name);
+    
+    for (int i = 0; i < 4; i++) {
+        snprintf(name, sizeof(name), "dirtest/%d", i);
+        if (!fs_creat(&fd, name, 16)) { *artifact = 1; return TEST_FAIL; }
+        fs_write(&fd, name, 16);
+        fs_mark_written(&fd);
+    }
+    if (!fs_creat(&fd, "dirtestx", 16)) { *artifact = 2; return TEST_FAIL; }
+    fs_mark_written(&fd);
+    
+    /* A file that never got finished isn't there yet. */
+    if (!fs_creat(&fd, "dirtest/tmp", 16)) { *artifact = 3; return TEST_FAIL; }
+    
+    if (_readdir_count("dirtest/") != 4) { *artifact = 4; return TEST_FAIL; }
+    if (_readdir_count("dirtest") != 5) { *artifact = 5; return TEST_FAIL; }
+    if (_readdir_count("dirtestnope") != 0) { *artifact = 6; return TEST_FAIL; }
+    
+    if (fs_unlink("dirtest/2") < 0) { *artifact = 7; return TEST_FAIL; }
+    if (fs_unlink("dirtest/2") >= 0) { *artifact = 8; return TEST_FAIL; }
+    if (fs_find_file(&file, "dirtest/2") >= 0) { *artifact = 9; return TEST_FAIL; }
+    if (_readdir_count("dirtest/") != 3) { *artifact = 10; return TEST_FAIL; }
+    
+    fs_mark_written(&fd);
+    if (_readdir_count("dirtest/") != 4) { *artifact = 11; return TEST_FAIL; }
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+/* Writes a growable file out past where it started, a little at a time,
+ * and then checks that it comes back as big as it got, from the top. */
+TEST(fs_growable) {
+#define GROW_BYTES (REGION_FS_PAGE_SIZE * 3)
+    struct fd fd, fd2;
+    struct file file;
+    uint8_t buf[IOBUFSIZ];
+    
+    fs_unlink("growable");
+    if (!fs_creat_growable(&fd, "growable", 16, NULL)) { *artifact = 1; return TEST_FAIL; }
+    if (fs_size(&fd) < 16 || fs_size(&fd) >= REGION_FS_PAGE_SIZE) { *artifact = 2; return TEST_FAIL; }
+    
+    for (int ofs = 0; ofs < GROW_BYTES; ofs += IOBUFSIZ) {
+        for (int i = 0; i < IOBUFSIZ; i++)
+            buf[i] = (ofs + i) * 7;
+        if (fs_write(&fd, buf, IOBUFSIZ) != IOBUFSIZ) {
+            printf("short write at ofs %d\n", ofs);
+            *artifact = 3;
+            return TEST_FAIL;
+        }
+    }
+    fs_mark_written(&fd);
+    
+    if (fs_find_file(&file, "growable") < 0) { *artifact = 4; return TEST_FAIL; }
+    if (!(file.flags & FILE_GROWABLE) || file.size < GROW_BYTES) {
+        printf("growable file came back with flags %x, size %d\n", file.flags, (int)file.size);
+        *artifact = 5;
+        return TEST_FAIL;
+    }
+    
+    fs_open(&fd, &file);
+    for (int ofs = 0; ofs < GROW_BYTES; ofs += IOBUFSIZ) {
+        fs_read(&fd, buf, IOBUFSIZ);
+        for (int i = 0; i < IOBUFSIZ; i++)
+            if (buf[i] != (uint8_t)((ofs + i) * 7)) {
+                printf("growable file wrong at ofs %d: got %d\n", ofs + i, buf[i]);
+                *artifact = 6;
+                return TEST_FAIL;
+            }
+    }
+    /* What nobody has written yet is still erased. */
+    fs_read(&fd, buf, 1);
+    if (buf[0] != 0xFF) { *artifact = 7; return TEST_FAIL; }
+    
+    /* Grow it from one fd, and then write there from another one that
+     * still thinks that it's the old size. */
+    fs_open(&fd, &file);
+    fs_open(&fd2, &file);
+    if (fs_grow(&fd, file.size + 1) < 0 || fs_size(&fd) <= file.size) { *artifact = 8; return TEST_FAIL; }
+    fs_seek(&fd2, file.size, FS_SEEK_SET);
+    memset(buf, 0x42, IOBUFSIZ);
+    if (fs_write(&fd2, buf, IOBUFSIZ) != IOBUFSIZ) { *artifact = 9; return TEST_FAIL; }
+    fs_seek(&fd, file.size, FS_SEEK_SET);
+    buf[0] = 0;
+    fs_read(&fd, buf, 1);
+    if (buf[0] != 0x42) { *artifact = 10; return TEST_FAIL; }
+    
+    /* A file that can't grow still stops at the end. */
+    if (!fs_creat(&fd, "growable/not", 16)) { *artifact = 11; return TEST_FAIL; }
+    if (fs_grow(&fd, 32) >= 0 || fs_write(&fd, buf, 32) != 16) { *artifact = 12; return TEST_FAIL; }
+    
+    fs_unlink("growable");
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+/* Checks whichever CRC kernel we were built with against the plain
+ * table-driven one, at every alignment and all the odd tail lengths, and
+ * with crcs carried across calls the way fs_file_crc32 does. */
+TEST(fs_crc) {
+#define CRCBUF_SIZE 1024
+    static uint8_t buf[CRCBUF_SIZE + 8];
+    uint32_t lfsr = 0xC0FFEE;
+    
+    for (int i = 0; i < sizeof(buf); i++)
+        buf[i] = lfsr_next(&lfsr);
+    
+    for (int align = 0; align < 8; align++)
+        for (int len = 0; len <= 64; len++) {
+            uint32_t exp = fs_pbfs_crc32_accum_ref(0xFFFFFFFF, buf + align, len);
+            uint32_t got = fs_pbfs_crc32_accum(0xFFFFFFFF, buf + align, len);
+            if (got != exp) {
+                printf("crc mismatch at align %d len %d: exp %08lx, got %08lx\n", align, len, exp, got);
+                *artifact = 1;
+                return TEST_FAIL;
+            }
+        }
+    
+    uint32_t exp = 0xFFFFFFFF, got = 0xFFFFFFFF;
+    for (int ofs = 0; ofs < CRCBUF_SIZE; ofs += 36) {
+        int len = (CRCBUF_SIZE - ofs) < 36 ? (CRCBUF_SIZE - ofs) : 36;
+        exp = fs_pbfs_crc32_accum_ref(exp, buf + ofs, len);
+        got = fs_pbfs_crc32_accum(got, buf + ofs, len);
+    }
+    if (got != exp) { *artifact = 2; return TEST_FAIL; }
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+TEST(fs_crc_perf) {
+#define CRCPERF_BUF_SIZE 4096
+#define CRCPERF_ITERS 64
+#define CRCPERF_FILE_SIZE 65536
+    static uint8_t buf[CRCPERF_BUF_SIZE];
+    uint32_t lfsr = 0xC0FFEE;
+    uint32_t crc_ref = 0xFFFFFFFF, crc = 0xFFFFFFFF;
+    int rv;
+    
+    for (int i = 0; i < sizeof(buf); i++)
+        buf[i] = lfsr_next(&lfsr);
+    
+    TickType_t start = xTaskGetTickCount();
+    for (int n = 0; n < CRCPERF_ITERS; n++)
+        crc_ref = fs_pbfs_crc32_accum_ref(crc_ref, buf, sizeof(buf));
+    TickType_t ref_ticks = xTaskGetTickCount() - start;
+    
+    start = xTaskGetTickCount();
+    for (int n = 0; n < CRCPERF_ITERS; n++)
+        crc = fs_pbfs_crc32_accum(crc, buf, sizeof(buf));
+    TickType_t fast_ticks = xTaskGetTickCount() - start;
+    
+    if (crc != crc_ref) { *artifact = 1; return TEST_FAIL; }
+    
+    /* And the whole path, as the protocol layer sees it. */
+    rv = bigfile_make("crcfile", CRCPERF_FILE_SIZE, 1234);
+    if (rv != 0) { *artifact = 1000 + rv; return TEST_FAIL; }
+    
+    struct file file;
+    struct fd fd;
+    if (fs_find_file(&file, "crcfile") < 0) { *artifact = 2; return TEST_FAIL; }
+    fs_open(&fd, &file);
+    
+    start = xTaskGetTickCount();
+    crc = fs_file_crc32(&fd, CRCPERF_FILE_SIZE);
+    TickType_t file_ticks = xTaskGetTickCount() - start;
+    
+    printf("crc32 of %d kB: %d ms table, %d ms fast; %d kB file in %d ms (crc %08lx)\n",
+        CRCPERF_BUF_SIZE * CRCPERF_ITERS / 1024,
+        (int)(ref_ticks * portTICK_PERIOD_MS), (int)(fast_ticks * portTICK_PERIOD_MS),
+        CRCPERF_FILE_SIZE / 1024, (int)(file_ticks * portTICK_PERIOD_MS), crc);
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
 #endif
@@ -280,6 +280,8 @@ int notifications_get_all(rdb_select_result_list *notif_list)
 
     int notif_count = 0;
 
+    /* Every record, in the order that they arrived: rdb_select_sorted
+     * would skip any that are too short to have a timestamp. */
     if (rdb_iter_start(db, &it)) {
         struct rdb_selector selectors[] = {
             { offsetof(timeline_item, uuid), FIELD_SIZEOF(timeline_item, uuid), RDB_OP_RESULT },
@@ -9,6 +9,7 @@
 #include "rebbleos.h"
 #include "notification_manager.h"
 #include "battery_state_service.h"
+#include "fs.h"
 
 static uint8_t _charge_mode_prev = 0;
 static uint8_t _charge_mode = 0;
@@ -23,6 +24,8 @@ void power_init()
 
 void power_off()
 {
+    /* Save the next boot from having to scan the whole filesystem. */
+    fs_checkpoint();
 }
 
 uint8_t power_get_charge_mode(void)
@@ -36,6 +36,7 @@ enum {
     WatchProtocol_TimelineAction     = 11440,
     WatchProtocol_VoiceControl       = 11000,
     WatchProtocol_HealthSync         = 911,
+    WatchProtocol_FlashStats         = 0xf1a5, /* ours; see protocol_flash_stats */
 };
 
 
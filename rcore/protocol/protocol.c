@@ -38,6 +38,7 @@ const PebbleEndpoint pebble_endpoints[] =
     { .endpoint = WatchProtocol_TimelineAction,     .handler  = protocol_process_timeline_action_response },
     { .endpoint = WatchProtocol_PutBytes,           .handler  = protocol_process_transfer },
     { .endpoint = WatchProtocol_AppReorder,         .handler  = protocol_process_reorder },
+    { .endpoint = WatchProtocol_FlashStats,         .handler  = protocol_flash_stats    },
     { .handler = NULL }
 };
 
@@ -187,6 +188,28 @@ int protocol_rx_buffer_consume(uint16_t len)
     return mv;
 }
 
+/*
+ * Returns the endpoint of the packet after the one at the front of the
+ * buffer, which has len bytes of data, if all of it is here already, or 0
+ * if not.  This is for endpoint handlers, which run with the buffer locked,
+ * and whose packet is the one at the front, to see what comes next.
+ */
+uint16_t protocol_rx_buffer_peek_next(uint16_t len)
+{
+    uint16_t ofs = len + sizeof(RebblePacketHeader);
+    
+    if (_buf_ptr < ofs + sizeof(RebblePacketHeader))
+        return 0;
+    
+    uint16_t pkt_length = (_rx_buffer[ofs] << 8) | (_rx_buffer[ofs + 1] & 0xff);
+    uint16_t pkt_endpoint = (_rx_buffer[ofs + 2] << 8) | (_rx_buffer[ofs + 3] & 0xff);
+    
+    if (pkt_length == 0 || _buf_ptr < ofs + sizeof(RebblePacketHeader) + pkt_length)
+        return 0;
+    
+    return pkt_endpoint;
+}
+
 int protocol_rx_buffer_pointer_adjust(int howmuch)
 {
     /* XXX not locked. kinda don't use this function unless you know why you need to */
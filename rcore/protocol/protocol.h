@@ -49,6 +49,7 @@ size_t protocol_get_rx_buf_used(void);
 uint8_t *protocol_rx_buffer_request(void);
 void protocol_rx_buffer_release(uint16_t len);
 int protocol_rx_buffer_consume(uint16_t len);
+uint16_t protocol_rx_buffer_peek_next(uint16_t len);
 int protocol_rx_buffer_pointer_adjust(int howmuch);
 void protocol_rx_buffer_reset(void);
 ProtocolTransportSender protocol_get_current_transport_sender();
@@ -64,15 +64,22 @@ uint8_t blob_process(pcol_blob_db_key *blob, void *data, uint16_t data_size)
     return Blob_Success;
 }
 
-uint8_t blob_insert(pcol_blob_db_key *blob)
+static void *_blob_value(pcol_blob_db_key *blob, uint8_t *val_sz)
 {
     pcol_blob_db_insert *iblob = (pcol_blob_db_insert *)blob;
     void *val_sz_start = (void *)blob + sizeof(pcol_blob_db_key) + blob->key_size;
-    uint8_t val_sz = *((uint8_t *)val_sz_start);
+    *val_sz = *((uint8_t *)val_sz_start);
+
+    return val_sz_start + sizeof(iblob->value_size);
+}
+
+uint8_t blob_insert(pcol_blob_db_key *blob)
+{
+    uint8_t val_sz;
+    void *val_start = _blob_value(blob, &val_sz);
     int key_size = blob->key_size;
 
-    printf("  ValueSize: %d, %d\n", val_sz, key_size);
-    void *val_start = val_sz_start + sizeof(iblob->value_size);
+    printf("  ValueSize: %d, %d\n", val_sz, blob->key_size);
 
     /* Pre-process */
     if (blob->blobdb.database_id == RDB_ID_APP)
@@ -98,8 +105,136 @@ uint8_t blob_insert(pcol_blob_db_key *blob)
     return blob_process((pcol_blob_db_key *)&blob->blobdb, val_start, val_sz);
 }
 
-void blob_delete(pcol_blob_db_delete *blob)
+/* When the phone syncs, it sends a burst of inserts to one database, back
+ * to back.  Those go into one rdb transaction, and their responses wait for
+ * it to be committed -- but only for as long as the next packet is already
+ * here, and is another BlobDB message, so nobody waits on a packet that
+ * hasn't arrived.
+ *
+ * The transaction stays open from one packet to the next, with nothing to
+ * lock it, so only the protocol rx thread, which handles every BlobDB
+ * packet, may touch any of this. */
+static struct {
+    struct rdb_txn txn;
+    uint8_t database_id;
+    int n;
+    ProtocolTransportSender transport;
+    pcol_blob_db_key *blobs[RDB_TXN_MAX_OPS]; /* copies of the inserts, for the token, and for blob_process */
+} _blob_batch;
+
+static void _blob_respond(ProtocolTransportSender transport, uint16_t token, uint8_t ret)
+{
+    pcol_blob_db_response response;
+    response.token = token;
+    response.response = ret;
+    SYS_LOG("pblob", APP_LOG_LEVEL_ERROR, "Done: Send Response: token %d, %d\n", response.token, response.response);
+
+    RebblePacket packet = packet_create(WatchProtocol_BlobDbMessage, sizeof(pcol_blob_db_response));
+    if (!packet)
+        return;
+    packet_copy_data(packet, (void *)&response, sizeof(pcol_blob_db_response));
+    packet_set_transport(packet, transport);
+    packet_send(packet);
+}
+
+static void _blob_batch_commit(void)
+{
+    uint8_t status[RDB_TXN_MAX_OPS];
+    
+    assert(protocol_service_is_rx_thread());
+    if (!_blob_batch.n)
+        return;
+    
+    struct rdb_database *db = rdb_open(_blob_batch.database_id);
+    if (db) {
+        rdb_txn_commit(&_blob_batch.txn, status);
+        rdb_close(db);
+    } else {
+        rdb_txn_abort(&_blob_batch.txn);
+        memset(status, Blob_InvalidDatabaseID, _blob_batch.n);
+    }
+    
+    for (int i = 0; i < _blob_batch.n; i++) {
+        pcol_blob_db_key *blob = _blob_batch.blobs[i];
+        uint8_t val_sz;
+        void *val_start = _blob_value(blob, &val_sz);
+        
+        if (status[i] == Blob_Success)
+            status[i] = blob_process(blob, val_start, val_sz);
+        _blob_respond(_blob_batch.transport, blob->blobdb.token, status[i]);
+        free(blob);
+    }
+    _blob_batch.n = 0;
+}
+
+/* Returns Blob_Success if the insert is staged, and its response is up to
+ * _blob_batch_commit. */
+static uint8_t _blob_batch_insert(const RebblePacket packet, pcol_blob_db_key *blob)
+{
+    uint8_t val_sz;
+    void *val_start = _blob_value(blob, &val_sz);
+    size_t blob_sz = (uint8_t *)val_start + val_sz - (uint8_t *)blob;
+    
+    assert(protocol_service_is_rx_thread());
+    if (!_blob_batch.n) {
+        struct rdb_database *db = rdb_open(blob->blobdb.database_id);
+        if (!db)
+            return Blob_InvalidDatabaseID;
+        rdb_txn_begin(&_blob_batch.txn, db);
+        rdb_close(db);
+        _blob_batch.database_id = blob->blobdb.database_id;
+        _blob_batch.transport = packet_get_transport(packet);
+    }
+    
+    pcol_blob_db_key *copy = malloc(blob_sz);
+    if (!copy) {
+        _blob_batch_commit();
+        return Blob_GeneralFailure;
+    }
+    memcpy(copy, blob, blob_sz);
+    
+    int rv = rdb_txn_insert(&_blob_batch.txn, blob->key, blob->key_size, val_start, val_sz);
+    if (rv == Blob_TryLater) {
+        /* Full; this one starts the next batch. */
+        _blob_batch_commit();
+        free(copy);
+        return _blob_batch_insert(packet, blob);
+    }
+    if (rv != Blob_Success) {
+        free(copy);
+        _blob_batch_commit();
+        return rv;
+    }
+    
+    _blob_batch.blobs[_blob_batch.n++] = copy;
+    
+    if (protocol_rx_buffer_peek_next(packet_get_data_length(packet)) != WatchProtocol_BlobDbMessage)
+        _blob_batch_commit();
+    
+    return Blob_Success;
+}
+
+uint8_t blob_delete(pcol_blob_db_key *blob)
 {
+    /* The phone deletes an app by its UUID, not by the key that it went in
+     * with; and that takes its persist values with it. */
+    if (blob->blobdb.database_id == RDB_ID_APP) {
+        if (blob->key_size != sizeof(Uuid))
+            return Blob_InvalidData;
+        return appmanager_app_delete_n((Uuid *)blob->key);
+    }
+    
+    struct rdb_database *db = rdb_open(blob->blobdb.database_id);
+    struct rdb_iter it;
+    int rv;
+    
+    if (!db)
+        return Blob_InvalidDatabaseID;
+    
+    rv = rdb_find(db, blob->key, blob->key_size, &it) ? rdb_delete(&it) : Blob_KeyDoesNotExist;
+    rdb_close(db);
+    
+    return rv;
 }
 
 void protocol_process_blobdb(const RebblePacket packet)
@@ -118,15 +253,29 @@ void protocol_process_blobdb(const RebblePacket packet)
     }
     printf("  Command: ");
 
+    /* Anything else has to wait for the inserts that came before it. */
+    if (_blob_batch.n && (blob->blobdb.command != Blob_Insert ||
+                          blob->blobdb.database_id != _blob_batch.database_id))
+        _blob_batch_commit();
+
     uint8_t ret = 0;
     switch(blob->blobdb.command) {
         case Blob_Insert:
             printf("  INSERT,\n");
-            ret = blob_insert(blob);
+            /* App ids come from what's already in the database. */
+            if (blob->blobdb.database_id == RDB_ID_APP) {
+                ret = blob_insert(blob);
+                break;
+            }
+            ret = _blob_batch_insert(packet, blob);
+            if (ret == Blob_Success) {
+                printf("}\n");
+                return;
+            }
             break;
         case Blob_Delete:
             printf("  DELETE,\n");
-            ret = Blob_GeneralFailure;
+            ret = blob_delete(blob);
             break;
         case Blob_Clear:
             printf("  CLEAR,\n");
@@ -138,11 +287,6 @@ void protocol_process_blobdb(const RebblePacket packet)
     }
     printf("}\n");
 
-    pcol_blob_db_response response;
-    response.token = blob->blobdb.token;
-    response.response = ret;
-    SYS_LOG("pblob", APP_LOG_LEVEL_ERROR, "Done: Send Response: token %d, %d\n", response.token, response.response);
-
     /* Reply back with the cookie */
-    packet_reply(packet, (void *)&response, sizeof(pcol_blob_db_response));
+    _blob_respond(packet_get_transport(packet), blob->blobdb.token, ret);
 }
@@ -9,6 +9,7 @@
 #include "protocol_system.h"
 #include "pebble_protocol.h"
 #include "protocol_service.h"
+#include "fs.h"
 
 typedef struct firmware_version_t {
     uint32_t timestamp;
@@ -177,3 +178,80 @@ void protocol_time(const RebblePacket packet)
     else
         assert(!"Invalid time request!");
 }
+
+/* Flash statistics, so that a watch out in the field can tell us how hard
+ * it's working its flash.  A request is just FlashStatsRequest; the
+ * response is below, with everything in network order.  The counters
+ * only ever go up, so take two, and subtract. */
+enum {
+    FlashStatsRequest,
+    FlashStatsResponse
+};
+
+#define FLASH_STATS_WEAR_BUCKETS 16
+
+typedef struct flash_stats_response_t {
+    uint8_t command;
+    uint8_t version; /* 1 */
+    uint8_t ntags;
+    uint8_t nbuckets;
+    struct {
+        uint32_t read_bytes;
+        uint32_t written_bytes;
+        uint32_t program_bytes;
+        uint32_t programs;
+        uint32_t erases;
+        uint32_t lock_waits;
+        uint32_t lock_ms;
+    } __attribute__((__packed__)) tags[FLASH_TAG_COUNT];
+    uint32_t gc_sectors_erased;
+    uint32_t gc_pages_relocated;
+    uint32_t fs_clean_pages;
+    uint32_t fs_dirty_pages;
+    uint16_t wear[FLASH_STATS_WEAR_BUCKETS]; /* see fs_get_wear_histogram */
+} __attribute__((__packed__)) flash_stats_response;
+
+void protocol_flash_stats(const RebblePacket packet)
+{
+    uint8_t *data = packet_get_data(packet);
+    struct flash_tag_stats tags[FLASH_TAG_COUNT];
+    struct fs_gc_stats gc;
+    uint16_t wear[FLASH_STATS_WEAR_BUCKETS];
+    flash_stats_response *resp;
+    
+    if (packet_get_data_length(packet) < 1 || data[0] != FlashStatsRequest) {
+        SYS_LOG("FWPKT", APP_LOG_LEVEL_ERROR, "Invalid flash stats request");
+        return;
+    }
+    
+    resp = app_calloc(1, sizeof(*resp));
+    if (!resp)
+        return;
+    
+    flash_get_tag_stats(tags);
+    fs_gc_get_stats(&gc);
+    fs_get_wear_histogram(wear, FLASH_STATS_WEAR_BUCKETS);
+    
+    resp->command = FlashStatsResponse;
+    resp->version = 1;
+    resp->ntags = FLASH_TAG_COUNT;
+    resp->nbuckets = FLASH_STATS_WEAR_BUCKETS;
+    for (int i = 0; i < FLASH_TAG_COUNT; i++) {
+        resp->tags[i].read_bytes = htonl(tags[i].read_bytes);
+        resp->tags[i].written_bytes = htonl(tags[i].written_bytes);
+        resp->tags[i].program_bytes = htonl(tags[i].program_bytes);
+        resp->tags[i].programs = htonl(tags[i].programs);
+        resp->tags[i].erases = htonl(tags[i].erases);
+        resp->tags[i].lock_waits = htonl(tags[i].lock_waits);
+        resp->tags[i].lock_ms = htonl(tags[i].lock_ticks * portTICK_PERIOD_MS);
+    }
+    resp->gc_sectors_erased = htonl(gc.sectors_erased);
+    resp->gc_pages_relocated = htonl(gc.pages_relocated);
+    resp->fs_clean_pages = htonl(gc.clean_pages);
+    resp->fs_dirty_pages = htonl(gc.dirty_pages);
+    for (int i = 0; i < FLASH_STATS_WEAR_BUCKETS; i++)
+        resp->wear[i] = htons(wear[i]);
+    
+    packet_reply(packet, (void *)resp, sizeof(*resp));
+    app_free(resp);
+}
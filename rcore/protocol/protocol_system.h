@@ -7,6 +7,7 @@ void protocol_ping_pong(const RebblePacket packet);
 void protocol_watch_reset(const RebblePacket packet);
 void protocol_app_version(const RebblePacket packet);
 void protocol_time(const RebblePacket packet);
+void protocol_flash_stats(const RebblePacket packet);
 
 /* This isn't actually our version, this is a faked out version for Pebble
  * app to at least consider talking to us over bluetooth */
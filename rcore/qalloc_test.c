@@ -0,0 +1,167 @@
+/* qalloc_test.c
+ * Tests for the qalloc heap
+ * RebbleOS
+ *
+ * These run on an arena of their own, not on any of the real heaps, so
+ * that nothing else allocating in the meantime can move things around.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "qalloc.h"
+#include "test.h"
+
+#ifdef REBBLEOS_TESTING
+
+#define QTEST_HEAP_SIZE 2048
+
+static uint8_t _qtest_heap[QTEST_HEAP_SIZE] __attribute__((aligned(8)));
+
+/* Takes everything that's left, so that the only free blocks are the ones
+ * that a test makes by freeing. */
+static void *_qtest_fill(qarena_t *arena)
+{
+    void *p = NULL;
+
+    for (unsigned n = qfreebytes(arena); n >= 4 && !(p = qalloc(arena, n)); n -= 4)
+        ;
+
+    return p;
+}
+
+static int _qtest_check(const uint8_t *p, uint8_t c, unsigned n)
+{
+    for (unsigned i = 0; i < n; i++)
+        if (p[i] != c)
+            return 0;
+
+    return 1;
+}
+
+TEST(qalloc_split) {
+    qarena_t *arena = qinit(_qtest_heap, sizeof(_qtest_heap));
+    uint32_t empty = qfreebytes(arena);
+    uint8_t *a, *b, *c;
+    uint32_t sz;
+
+    if (qalloc(arena, 0) || qalloc(arena, QTEST_HEAP_SIZE + 1)) { *artifact = 1; return TEST_FAIL; }
+
+    /* A block comes off the front of the free space, and the rest stays
+     * free, right behind it. */
+    a = qalloc(arena, 64);
+    sz = qusedbytes(arena);
+    if (!a || sz < 64 || qfreebytes(arena) != empty - sz) { *artifact = 2; return TEST_FAIL; }
+    b = qalloc(arena, 64);
+    if (b != a + sz || qusedbytes(arena) != 2 * sz) { *artifact = 3; return TEST_FAIL; }
+
+    /* Even one byte gets a block big enough to go back on a free list. */
+    c = qalloc(arena, 1);
+    if (!c || c != b + sz || qusedbytes(arena) - 2 * sz == 0) { *artifact = 4; return TEST_FAIL; }
+
+    memset(a, 0xA1, 64);
+    memset(b, 0xB2, 64);
+    *c = 0xC3;
+    if (!_qtest_check(a, 0xA1, 64) || !_qtest_check(b, 0xB2, 64) || *c != 0xC3) { *artifact = 5; return TEST_FAIL; }
+
+    /* The last of it goes whole, or not at all. */
+    if (!_qtest_fill(arena) || qalloc(arena, 1)) { *artifact = 6; return TEST_FAIL; }
+
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+TEST(qalloc_coalesce) {
+    qarena_t *arena = qinit(_qtest_heap, sizeof(_qtest_heap));
+    uint32_t empty = qfreebytes(arena);
+    uint8_t *p[4], *q, *fill;
+    uint32_t sz, hdr;
+
+    for (int i = 0; i < 4; i++)
+        p[i] = qalloc(arena, 64);
+    sz = qusedbytes(arena) / 4;
+    hdr = sz - 64;
+    fill = _qtest_fill(arena);
+    if (!p[3] || !fill) { *artifact = 1; return TEST_FAIL; }
+
+    /* Freeing 0 and 2, and then 1, leaves one hole across all three, which
+     * takes an allocation that needs all of it. */
+    qfree(arena, p[0]);
+    qfree(arena, p[2]);
+    if (qalloc(arena, 3 * sz - hdr)) { *artifact = 2; return TEST_FAIL; }
+    qfree(arena, p[1]);
+    q = qalloc(arena, 3 * sz - hdr);
+    if (q != p[0]) { *artifact = 3; return TEST_FAIL; }
+
+    /* Freeing 3 and then that joins it on from the other side. */
+    qfree(arena, p[3]);
+    qfree(arena, q);
+    q = qalloc(arena, 4 * sz - hdr);
+    if (q != p[0]) { *artifact = 4; return TEST_FAIL; }
+
+    /* And when it all goes, it all comes back together. */
+    qfree(arena, q);
+    qfree(arena, fill);
+    if (qusedbytes(arena) != 0 || qfreebytes(arena) != empty) { *artifact = 5; return TEST_FAIL; }
+    if (_qtest_fill(arena) != p[0]) { *artifact = 6; return TEST_FAIL; }
+
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+TEST(qalloc_realloc) {
+    qarena_t *arena = qinit(_qtest_heap, sizeof(_qtest_heap));
+    uint8_t *a, *b, *c, *fill;
+    uint32_t used;
+
+    /* From nothing, it's an alloc. */
+    a = qrealloc(arena, NULL, 128);
+    b = qalloc(arena, 64);
+    if (!a || !b) { *artifact = 1; return TEST_FAIL; }
+    memset(a, 0xA1, 128);
+    memset(b, 0xB2, 64);
+
+    /* Asking for nothing, or for too much, leaves it be. */
+    used = qusedbytes(arena);
+    if (qrealloc(arena, a, 0) || qrealloc(arena, a, QTEST_HEAP_SIZE + 1)) { *artifact = 2; return TEST_FAIL; }
+    if (qusedbytes(arena) != used || !_qtest_check(a, 0xA1, 128)) { *artifact = 3; return TEST_FAIL; }
+
+    /* Shrinking by a little doesn't leave enough to free; shrinking by
+     * more gives the tail back. */
+    if (qrealloc(arena, a, 126) != a || qusedbytes(arena) != used) { *artifact = 4; return TEST_FAIL; }
+    if (qrealloc(arena, a, 32) != a || qusedbytes(arena) != used - 96) { *artifact = 5; return TEST_FAIL; }
+    if (!_qtest_check(a, 0xA1, 32) || !_qtest_check(b, 0xB2, 64)) { *artifact = 6; return TEST_FAIL; }
+
+    /* Growing back into that tail stays put. */
+    if (qrealloc(arena, a, 128) != a || qusedbytes(arena) != used) { *artifact = 7; return TEST_FAIL; }
+    if (!_qtest_check(a, 0xA1, 32)) { *artifact = 8; return TEST_FAIL; }
+
+    /* With b gone, a grows into where it was, and past it, in place. */
+    qfree(arena, b);
+    used = qusedbytes(arena);
+    if (qrealloc(arena, a, 192) != a || qusedbytes(arena) != used + 64) { *artifact = 9; return TEST_FAIL; }
+    memset(a, 0xA1, 192);
+
+    /* Growing past something in use has to move: the contents go along,
+     * and where it was is freed. */
+    c = qalloc(arena, 64);
+    if (!c || c < a) { *artifact = 10; return TEST_FAIL; }
+    used = qusedbytes(arena);
+    b = qrealloc(arena, a, 512);
+    if (!b || b == a || !_qtest_check(b, 0xA1, 192)) { *artifact = 11; return TEST_FAIL; }
+    if (qusedbytes(arena) != used + 512 - 192) { *artifact = 12; return TEST_FAIL; }
+
+    /* If there's nowhere for it to go, it stays where it was, intact. */
+    fill = _qtest_fill(arena);
+    if (!fill || qrealloc(arena, b, 1024)) { *artifact = 13; return TEST_FAIL; }
+    if (!_qtest_check(b, 0xA1, 192)) { *artifact = 14; return TEST_FAIL; }
+
+    qfree(arena, fill);
+    qfree(arena, c);
+    qfree(arena, b);
+    if (qusedbytes(arena) != 0) { *artifact = 15; return TEST_FAIL; }
+
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+#endif
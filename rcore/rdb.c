@@ -34,12 +34,21 @@
  *
  *   Erased: The RDB_FLAG_ERASED flag is set.  The record should be
  *   ignored.
+ *
+ * A header can also have RDB_FLAG_BATCH set, with no key, in which case its
+ * "data" are the records of one transaction (see rdb_txn_commit).  Those go
+ * through the same states as a record, as a whole: until RDB_FLAG_WRITTEN
+ * is set on the batch header, everything in it gets skipped over, and once
+ * it is, the records inside are read as if the batch header weren't there. 
+ * They are written out complete, so they need nothing more to be valid. 
+ * Compaction copies out the records, and leaves the batch header behind.
  */
  
 #define FLAG_SET(flags, flag) ((flags & flag) == 0)
 #define RDB_FLAG_WRITTEN         1
 #define RDB_FLAG_HEADER_WRITTEN  2
 #define RDB_FLAG_ERASED          4
+#define RDB_FLAG_BATCH           8
 
 typedef struct rdb_hdr {
     uint8_t flags;
@@ -47,49 +56,88 @@ typedef struct rdb_hdr {
     uint16_t data_len;
 } __attribute__((__packed__)) rdb_hdr;
 
+struct rdb_index;
+
 struct rdb_database {
     uint8_t id;
     const char *filename;
     uint16_t def_db_size;
+    uint16_t index_slots; /* 4 bytes of RAM each, or 0 for no index; see rdb_find */
+    uint16_t sort_ofs;    /* of a field to keep the records sorted by, if sort_size; */
+    uint8_t sort_size;    /* see rdb_select_sorted */
+    uint16_t sort_slots;  /* 8 bytes of RAM each, on top of the key index */
+    uint16_t bloom_bytes; /* of RAM, for a filter that rules keys out; see rdb_find */
+    uint8_t per_file;     /* filename is whichever rdb_open_file last said */
     int locked;
+    uint8_t held;      /* filename is held where it is; see fs_gc_hold */
+    uint8_t flash_tag; /* whoever opened it had before */
+    struct rdb_index *index;
     SemaphoreHandle_t mutex;
     StaticSemaphore_t mutex_buf;
 };
 
+/* Where the per-app persist databases' records go, for now. */
+static char _rdb_app_persist_file[FS_NAME_MAX + 1];
+
 static struct rdb_database databases[] = {
     {
         .id = RDB_ID_TEST,
         .filename = "rebble/rdbtest",
         .def_db_size = 1024,
+        .index_slots = 32,
+        .sort_ofs = 0,
+        .sort_size = 4,
+        .sort_slots = 32,
+        .bloom_bytes = 32,
     },
     {
         .id = RDB_ID_NOTIFICATION,
         .filename = "rebble/notifstr",
         .def_db_size = 16384,
+        .index_slots = 512,
+        .sort_ofs = offsetof(timeline_item, timestamp),
+        .sort_size = FIELD_SIZEOF(timeline_item, timestamp),
+        .sort_slots = 256,
     },
     {
         .id = RDB_ID_APP,
         .filename = "rebble/appdb",
         .def_db_size = 16384,
+        .index_slots = 64,
     },
     {
+        /* One per app, of at most PERSIST_MAX_STORAGE_BYTES, and some room
+         * for dead records. */
         .id = RDB_ID_APP_PERSIST,
+        .filename = _rdb_app_persist_file,
+        .per_file = 1,
+        .def_db_size = 8192,
+        .index_slots = 128,
+        .bloom_bytes = 64,
+    },
+    {
+        .id = RDB_ID_APP_PERSIST_LEGACY,
         .filename = "rebble/apppersistdb",
         .def_db_size = 16384,
     },
     {
         .id = RDB_ID_BLUETOOTH,
         .filename = "rebble/bluetooth",
-        .def_db_size = 8192
+        .def_db_size = 8192,
+        .index_slots = 16,
     },
     {
         .id = RDB_ID_PREFS,
         .filename = "rebble/prefs",
-        .def_db_size = 8192
+        .def_db_size = 8192,
+        .index_slots = 64,
     }
 };
 
-struct rdb_database *rdb_open(uint16_t database_id) {
+static void _rdb_index_open(struct rdb_database *db);
+static void _rdb_leave_file(struct rdb_database *db);
+
+static struct rdb_database *_rdb_lock(uint16_t database_id) {
     for (int i = 0; i < sizeof(databases) / sizeof(databases[0]); i++)
     {
         if (databases[i].id == database_id) {
@@ -101,6 +149,7 @@ struct rdb_database *rdb_open(uint16_t database_id) {
             
             xSemaphoreTake(databases[i].mutex, portMAX_DELAY);
             databases[i].locked = 1;
+            databases[i].flash_tag = flash_set_tag(FLASH_TAG_RDB);
             return &databases[i];
         }
     }
@@ -108,9 +157,82 @@ struct rdb_database *rdb_open(uint16_t database_id) {
     return NULL;
 }
 
+/* Keeps the collector from moving the database's file while we have fds
+ * open on it; rdb_close lets go.  Between the two, it can move, so each
+ * rdb_open looks it up again by name. */
+static void _rdb_hold(struct rdb_database *db)
+{
+    fs_gc_hold(db->filename);
+    db->held = 1;
+}
+
+struct rdb_database *rdb_open(uint16_t database_id) {
+    struct rdb_database *db = _rdb_lock(database_id);
+    
+    if (!db)
+        return NULL;
+    if (db->per_file) {
+        LOG_ERROR("rdb %d has a file per owner; use rdb_open_file", database_id);
+        rdb_close(db);
+        return NULL;
+    }
+    
+    _rdb_hold(db);
+    _rdb_index_open(db);
+    return db;
+}
+
+struct rdb_database *rdb_open_file(uint16_t database_id, const char *filename) {
+    struct rdb_database *db = _rdb_lock(database_id);
+    
+    if (!db)
+        return NULL;
+    if (!db->per_file || strlen(filename) > FS_NAME_MAX) {
+        LOG_ERROR("rdb %d can't be opened on %s", database_id, filename);
+        rdb_close(db);
+        return NULL;
+    }
+    
+    if (strcmp(db->filename, filename)) {
+        _rdb_leave_file(db);
+        strcpy((char *)db->filename, filename);
+    }
+    
+    _rdb_hold(db);
+    _rdb_index_open(db);
+    return db;
+}
+
+int rdb_delete_file(uint16_t database_id, const char *filename) {
+    struct rdb_database *db = _rdb_lock(database_id);
+    int rv;
+    
+    if (!db)
+        return Blob_InvalidDatabaseID;
+    if ((filename != NULL) != db->per_file) {
+        rdb_close(db);
+        return Blob_InvalidOperation;
+    }
+    
+    if (!filename || !strcmp(db->filename, filename)) {
+        _rdb_hold(db);
+        _rdb_leave_file(db);
+        filename = db->filename;
+    }
+    rv = fs_unlink(filename) < 0 ? Blob_KeyDoesNotExist : Blob_Success;
+    
+    rdb_close(db);
+    return rv;
+}
+
 void rdb_close(struct rdb_database *db) {
     assert(db->locked);
     db->locked = 0;
+    if (db->held) {
+        fs_gc_release(db->filename);
+        db->held = 0;
+    }
+    flash_set_tag(db->flash_tag);
     xSemaphoreGive(db->mutex);
 }
 
@@ -148,6 +270,11 @@ static int _rdb_seek_valid(struct fd *fdp, struct rdb_hdr *hdrp, int next) {
             continue;
         }
         
+        /* A committed batch?  Step inside, to its first record. */
+        if (FLAG_SET(hdr.flags, RDB_FLAG_BATCH) && FLAG_SET(hdr.flags, RDB_FLAG_WRITTEN) &&
+            !FLAG_SET(hdr.flags, RDB_FLAG_ERASED))
+            continue;
+        
         /* Erased -- or skipping the first? */
         if (FLAG_SET(hdr.flags, RDB_FLAG_ERASED) || 
             !FLAG_SET(hdr.flags, RDB_FLAG_WRITTEN) ||
@@ -184,7 +311,6 @@ static int _rdb_iter_start_from_fd(struct fd *fd, struct rdb_iter *it) {
 int rdb_iter_start(const struct rdb_database *db, struct rdb_iter *it) {
     struct file file;
     struct fd fd;
-    struct rdb_hdr hdr;
     
     assert(db->locked);
     
@@ -229,6 +355,444 @@ int rdb_iter_read_data(struct rdb_iter *it, int ofs, void *data, int len) {
     return fs_read(&fd, data, len);
 }
 
+/*** Key index. ***/
+
+/* A database can keep an index in RAM from the hash of each key to where
+ * its record is in the file, so that looking a key up doesn't mean reading
+ * every header and key in the database.  It gets built the first time that
+ * the database is opened, and insert, delete, and compaction keep it up to
+ * date after that; it only gets rebuilt if the file moves out from under
+ * us, or if a write fails partway and we lose track.
+ *
+ * The index is only a hint: every hit gets checked against the record on
+ * flash, so a collision costs a read, not a wrong answer.  Deleted records
+ * leave tombstones, so that probing carries on past them, which get swept
+ * out when the table fills up.  If it's still more than three quarters full
+ * of live records after that, it stops being complete, and lookups go back
+ * to scanning until the next compaction builds it again. */
+
+#define RDB_INDEX_EMPTY     0
+#define RDB_INDEX_TOMBSTONE 1
+
+struct rdb_index_slot {
+    uint16_t hash;
+    uint16_t ofs;
+};
+
+/* Unlike a slot's, this offset is whole: the struct is padded out to eight
+ * bytes either way, and the scratch entries that rdb_select_sorted makes up
+ * have to cover a file that's grown past 64k. */
+struct rdb_sort_ent {
+    uint32_t val;
+    uint32_t ofs;
+};
+
+struct rdb_index {
+    uint8_t valid;
+    uint8_t complete;   /* every valid record is in here */
+    uint16_t startpage; /* of the file that it's for, or 0xFFFF if there isn't one */
+    uint16_t nused;     /* slots that aren't empty, tombstones included */
+    uint32_t end;       /* where the next record goes */
+    uint32_t live;      /* bytes of valid records, headers and all */
+    uint8_t sorted_complete;
+    uint16_t nsorted;
+    struct rdb_sort_ent *sorted; /* sort_slots of them, right after slots */
+    uint8_t *bloom;              /* bloom_bytes of it, right after sorted */
+    struct rdb_compact *compact; /* if one is going on; see _rdb_compact_tick */
+    struct rdb_index_slot slots[];
+};
+
+static uint32_t _rdb_key_hash32(const uint8_t *key, int len)
+{
+    uint32_t h = 2166136261UL;
+    
+    for (int i = 0; i < len; i++)
+        h = (h ^ key[i]) * 16777619UL;
+    
+    return h;
+}
+
+static uint16_t _rdb_key_hash(const uint8_t *key, int len)
+{
+    uint32_t h = _rdb_key_hash32(key, len);
+    
+    h = (h ^ (h >> 16)) & 0xFFFF;
+    
+    return (h > RDB_INDEX_TOMBSTONE) ? h : h + 2;
+}
+
+static int _rdb_index_usable(const struct rdb_database *db)
+{
+    return db->index && db->index->valid && db->index->complete;
+}
+
+static void _rdb_index_reset(const struct rdb_database *db, uint16_t startpage)
+{
+    struct rdb_index *idx = db->index;
+    
+    memset(idx->slots, 0, db->index_slots * sizeof(struct rdb_index_slot));
+    idx->valid = 1;
+    idx->complete = 1;
+    idx->startpage = startpage;
+    idx->nused = 0;
+    idx->end = 0;
+    idx->live = 0;
+    idx->nsorted = 0;
+    idx->sorted_complete = db->sort_size && db->sort_slots;
+    memset(idx->bloom, 0, db->bloom_bytes);
+}
+
+static void _rdb_index_add(const struct rdb_database *db, uint16_t hash, uint32_t ofs);
+
+/* Sweeps out the tombstones, by putting everything else back in again. */
+static void _rdb_index_rehash(const struct rdb_database *db)
+{
+    struct rdb_index *idx = db->index;
+    struct rdb_index_slot *old = malloc(db->index_slots * sizeof(struct rdb_index_slot));
+    
+    if (!old) {
+        idx->complete = 0;
+        return;
+    }
+    
+    memcpy(old, idx->slots, db->index_slots * sizeof(struct rdb_index_slot));
+    memset(idx->slots, 0, db->index_slots * sizeof(struct rdb_index_slot));
+    idx->nused = 0;
+    for (int i = 0; i < db->index_slots; i++)
+        if (old[i].hash > RDB_INDEX_TOMBSTONE)
+            _rdb_index_add(db, old[i].hash, old[i].ofs);
+    
+    free(old);
+}
+
+static void _rdb_index_add(const struct rdb_database *db, uint16_t hash, uint32_t ofs)
+{
+    struct rdb_index *idx = db->index;
+    
+    if (!idx || !idx->complete)
+        return;
+    if ((idx->nused + 1) * 4 > db->index_slots * 3)
+        _rdb_index_rehash(db);
+    if (ofs > 0xFFFF || (idx->nused + 1) * 4 > db->index_slots * 3) {
+        LOG_INFO("index for %s is full; scanning from now on", db->filename);
+        idx->complete = 0;
+        return;
+    }
+    
+    for (int i = hash % db->index_slots; ; i = (i + 1) % db->index_slots) {
+        if (idx->slots[i].hash == RDB_INDEX_EMPTY)
+            idx->nused++;
+        else if (idx->slots[i].hash != RDB_INDEX_TOMBSTONE)
+            continue;
+        
+        idx->slots[i].hash = hash;
+        idx->slots[i].ofs = ofs;
+        return;
+    }
+}
+
+static void _rdb_index_remove(const struct rdb_database *db, uint16_t hash, uint32_t ofs)
+{
+    struct rdb_index *idx = db->index;
+    
+    for (int i = hash % db->index_slots; idx->slots[i].hash != RDB_INDEX_EMPTY; i = (i + 1) % db->index_slots)
+        if (idx->slots[i].hash == hash && idx->slots[i].ofs == ofs) {
+            idx->slots[i].hash = RDB_INDEX_TOMBSTONE;
+            return;
+        }
+}
+
+/* A database can also keep a Bloom filter of its keys: a few bits for each,
+ * picked by its hash, so that a key whose bits aren't all set can't be
+ * there.  Unlike the index, it never fills up -- it just gets less sure of
+ * itself -- so it carries on ruling keys out after the index has given up
+ * and gone back to scanning.  Deletes can't clear bits, since other keys
+ * might share them, so it only forgets keys when it's rebuilt along with
+ * the index. */
+
+#define RDB_BLOOM_PROBES 3
+
+static void _rdb_bloom_add(const struct rdb_database *db, const uint8_t *key, int len)
+{
+    uint32_t h = _rdb_key_hash32(key, len);
+    uint32_t step = (h >> 16) | 1;
+    
+    for (int i = 0; i < RDB_BLOOM_PROBES; i++, h += step)
+        db->index->bloom[(h / 8) % db->bloom_bytes] |= 1 << (h % 8);
+}
+
+/* Returns false if the key is certainly not in the database. */
+static int _rdb_bloom_maybe(const struct rdb_database *db, const uint8_t *key, int len)
+{
+    if (!db->bloom_bytes || !db->index || !db->index->valid)
+        return 1;
+    
+    uint32_t h = _rdb_key_hash32(key, len);
+    uint32_t step = (h >> 16) | 1;
+    
+    for (int i = 0; i < RDB_BLOOM_PROBES; i++, h += step)
+        if (!(db->index->bloom[(h / 8) % db->bloom_bytes] & (1 << (h % 8))))
+            return 0;
+    
+    return 1;
+}
+
+/* A database can also keep its records in order of a field of up to four
+ * bytes, at a fixed offset in the data -- a timestamp, say -- so that
+ * rdb_select_sorted can go straight to a range of them.  It's kept with the
+ * key index, and gets rebuilt along with it; records whose data is too
+ * short to have the field aren't in it.  If there are ever more records
+ * than sort_slots, it stops being complete, and rdb_select_sorted sorts
+ * for itself until the next compaction. */
+
+static int _rdb_sort_val(const struct rdb_database *db, const uint8_t *data, int data_len, uint32_t *val)
+{
+    if (data_len < db->sort_ofs + db->sort_size)
+        return 0;
+    
+    *val = 0;
+    memcpy(val, data + db->sort_ofs, db->sort_size);
+    
+    return 1;
+}
+
+static int _rdb_iter_sort_val(const struct rdb_database *db, struct rdb_iter *it, uint32_t *val)
+{
+    uint8_t buf[4];
+    
+    if (it->data_len < db->sort_ofs + db->sort_size ||
+        rdb_iter_read_data(it, db->sort_ofs, buf, db->sort_size) != db->sort_size)
+        return 0;
+    
+    *val = 0;
+    memcpy(val, buf, db->sort_size);
+    
+    return 1;
+}
+
+/* Returns the first entry whose value is more than val, or if !after, the
+ * first that's at least val. */
+static int _rdb_sort_search(const struct rdb_sort_ent *ents, int n, uint32_t val, int after)
+{
+    int lo = 0, hi = n;
+    
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        
+        if (ents[mid].val < val || (after && ents[mid].val == val))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    return lo;
+}
+
+/* Equal values stay in the order that they went in, which is file order. */
+static void _rdb_sort_insert(struct rdb_sort_ent *ents, int *n, uint32_t val, uint32_t ofs)
+{
+    int i = _rdb_sort_search(ents, *n, val, 1);
+    
+    memmove(&ents[i + 1], &ents[i], (*n - i) * sizeof(*ents));
+    ents[i].val = val;
+    ents[i].ofs = ofs;
+    (*n)++;
+}
+
+static void _rdb_sorted_add(const struct rdb_database *db, uint32_t val, uint32_t ofs)
+{
+    struct rdb_index *idx = db->index;
+    int n;
+    
+    if (!idx || !idx->sorted_complete)
+        return;
+    if (idx->nsorted == db->sort_slots) {
+        LOG_INFO("sorted index for %s is full; sorting from scratch from now on", db->filename);
+        idx->sorted_complete = 0;
+        return;
+    }
+    
+    n = idx->nsorted;
+    _rdb_sort_insert(idx->sorted, &n, val, ofs);
+    idx->nsorted = n;
+}
+
+static void _rdb_sorted_remove(const struct rdb_database *db, uint32_t ofs)
+{
+    struct rdb_index *idx = db->index;
+    
+    for (int i = 0; i < idx->nsorted; i++)
+        if (idx->sorted[i].ofs == ofs) {
+            memmove(&idx->sorted[i], &idx->sorted[i + 1], (idx->nsorted - i - 1) * sizeof(struct rdb_sort_ent));
+            idx->nsorted--;
+            return;
+        }
+}
+
+/* Puts the record that the iterator points at into the indexes, as if it
+ * were at ofs. */
+static int _rdb_index_note(const struct rdb_database *db, struct rdb_iter *it, uint32_t ofs)
+{
+    uint8_t key[it->key_len];
+    uint32_t val;
+    
+    if (rdb_iter_read_key(it, key) != it->key_len)
+        return 0;
+    _rdb_index_add(db, _rdb_key_hash(key, it->key_len), ofs);
+    if (db->bloom_bytes)
+        _rdb_bloom_add(db, key, it->key_len);
+    if (db->sort_size && _rdb_iter_sort_val(db, it, &val))
+        _rdb_sorted_add(db, val, ofs);
+    db->index->live += sizeof(struct rdb_hdr) + it->key_len + it->data_len;
+    
+    return 1;
+}
+
+static int _rdb_index_lookup(const struct rdb_database *db, const struct fd *fd, const void *key, uint16_t key_size, struct rdb_iter *it);
+
+static void _rdb_index_build(const struct rdb_database *db, const struct file *file)
+{
+    struct rdb_iter it;
+    struct fd fd;
+    int valid;
+    
+    _rdb_index_reset(db, file ? file->startpage : 0xFFFF);
+    if (!file)
+        return;
+    
+    fs_open(&fd, file);
+    for (valid = _rdb_iter_start_from_fd(&fd, &it); valid; valid = rdb_iter_next(&it)) {
+        uint8_t key[it.key_len];
+        struct rdb_iter old;
+        
+        if (rdb_iter_read_key(&it, key) != it.key_len) {
+            db->index->valid = 0;
+            return;
+        }
+        
+        /* An overwrite that got interrupted leaves the old record behind,
+         * as well as the new one; the later one wins. */
+        if (_rdb_index_lookup(db, &fd, key, it.key_len, &old)) {
+            LOG_INFO("%s has a stale copy of a record; erasing it", db->filename);
+            rdb_delete(&old);
+        }
+        
+        if (!_rdb_index_note(db, &it, fs_seek(&it.fd, 0, FS_SEEK_CUR))) {
+            db->index->valid = 0;
+            return;
+        }
+    }
+    db->index->end = fs_seek(&it.fd, 0, FS_SEEK_CUR);
+    
+    LOG_DEBUG("indexed %s: %d slots used, next record at %d", db->filename, db->index->nused, (int)db->index->end);
+}
+
+static void _rdb_index_open(struct rdb_database *db)
+{
+    struct file file;
+    int have;
+    
+    if (!db->index_slots)
+        return;
+    if (!db->index) {
+        db->index = calloc(1, sizeof(struct rdb_index) +
+                              db->index_slots * sizeof(struct rdb_index_slot) +
+                              db->sort_slots * sizeof(struct rdb_sort_ent) +
+                              db->bloom_bytes);
+        if (!db->index)
+            return;
+        db->index->sorted = (struct rdb_sort_ent *)&db->index->slots[db->index_slots];
+        db->index->bloom = (uint8_t *)&db->index->sorted[db->sort_slots];
+    }
+    
+    have = fs_find_file(&file, db->filename) >= 0;
+    if (!db->index->valid || db->index->startpage != (have ? file.startpage : 0xFFFF))
+        _rdb_index_build(db, have ? &file : NULL);
+}
+
+/* Checks that the iterator is sitting on a valid record, and fills in its
+ * lengths if so. */
+static int _rdb_iter_at_valid(struct rdb_iter *it)
+{
+    struct fd fd = it->fd;
+    struct rdb_hdr hdr;
+    
+    if (fs_read(&fd, &hdr, sizeof(hdr)) < sizeof(hdr) ||
+        FLAG_SET(hdr.flags, RDB_FLAG_ERASED) ||
+        !FLAG_SET(hdr.flags, RDB_FLAG_WRITTEN))
+        return 0;
+    
+    it->key_len = hdr.key_len;
+    it->data_len = hdr.data_len;
+    
+    return 1;
+}
+
+static int _rdb_iter_is_key(struct rdb_iter *it, const void *key, uint16_t key_size)
+{
+    uint8_t rdkey[key_size];
+    
+    return _rdb_iter_at_valid(it) && it->key_len == key_size &&
+           rdb_iter_read_key(it, rdkey) == key_size && !memcmp(rdkey, key, key_size);
+}
+
+/* Looks for the key in the index, and checks each hit against fd's file. */
+static int _rdb_index_lookup(const struct rdb_database *db, const struct fd *fd, const void *key, uint16_t key_size, struct rdb_iter *it)
+{
+    struct rdb_index *idx = db->index;
+    uint16_t hash = _rdb_key_hash(key, key_size);
+    
+    for (int i = hash % db->index_slots; idx->slots[i].hash != RDB_INDEX_EMPTY; i = (i + 1) % db->index_slots) {
+        if (idx->slots[i].hash != hash)
+            continue;
+        it->fd = *fd;
+        fs_seek(&it->fd, idx->slots[i].ofs, FS_SEEK_SET);
+        if (_rdb_iter_is_key(it, key, key_size))
+            return 1;
+    }
+    
+    return 0;
+}
+
+int rdb_find(const struct rdb_database *db, const void *key, uint16_t key_size, struct rdb_iter *it)
+{
+    struct file file;
+    int valid;
+    
+    assert(db->locked);
+    
+    /* Most misses don't have to touch flash at all. */
+    if (!_rdb_bloom_maybe(db, key, key_size))
+        return 0;
+    
+    /* Without an index, there's nothing to have sorted out the two copies
+     * of a record that an interrupted overwrite leaves behind (see
+     * _rdb_index_build).  The later one wins, so that means looking at
+     * every record, even after a hit, but this is already the slow way. 
+     * The earlier one stays put until a compaction leaves it behind (see
+     * _rdb_compact_step): finding a record doesn't write to flash. */
+    if (!_rdb_index_usable(db)) {
+        struct rdb_iter cur;
+        int found = 0;
+        
+        for (valid = rdb_iter_start(db, &cur); valid; valid = rdb_iter_next(&cur)) {
+            if (cur.key_len != key_size || !_rdb_iter_is_key(&cur, key, key_size))
+                continue;
+            *it = cur;
+            found = 1;
+        }
+        return found;
+    }
+    
+    if (db->index->startpage == 0xFFFF || fs_find_file(&file, db->filename) < 0)
+        return 0;
+    
+    struct fd fd;
+    
+    fs_open(&fd, &file);
+    return _rdb_index_lookup(db, &fd, key, key_size, it);
+}
+
 static bool _compare(rdb_operator_t operator, uint8_t *where_prop, uint8_t *where_val, size_t size)
 {
     uint16_t i = 0;
@@ -240,31 +804,26 @@ static bool _compare(rdb_operator_t operator, uint8_t *where_prop, uint8_t *wher
         memcpy(&val2, where_val, size);
     }
     
-    char type = '>';
     bool rval = false;
 
     switch(operator) {
         case RDB_OP_GREATER:
-            type = '>';
             if (size > 4) break;
             if (val1 > val2)
                 rval = true;
             break;
         case RDB_OP_LESS:
-            type = '<';
             if (size > 4) break;
             if (val1 < val2)
                 rval = true;
             break;
         case RDB_OP_EQ:
-            type = '=';
             rval = true;
             for(i = 0; i < size; i++)
                 if (where_prop[i] != where_val[i])
                     rval = false;
             break;
         case RDB_OP_NEQ:
-            type = '!';
             for(i = 0; i < size; i++)
                 if (where_prop[i] != where_val[i])
                     break;
@@ -278,110 +837,270 @@ static bool _compare(rdb_operator_t operator, uint8_t *where_prop, uint8_t *wher
     return rval;
 }
 
-int rdb_select(struct rdb_iter *it, list_head/*<rdb_select_result>*/ *head, struct rdb_selector *selectors) {
-    int n = 0;
+/* Returns true if the record that the iterator points at passes every
+ * comparison in the selectors. */
+static bool _rdb_matches(struct rdb_iter *it, struct rdb_selector *selectors)
+{
+    struct rdb_selector *selp;
     
-    int valid = 1;
-    for (; valid; valid = rdb_iter_next(it)) {
-        bool comp = true;
-        struct rdb_selector *selp;
-        int nrv = 0;
-        
-        /* Do comparisons first. */
-        for (selp = selectors; selp->operator; selp++) {
-            if (selp->operator >= RDB_OP_RESULT) {
-                nrv++;
-                continue;
-            }
-            
-            uint8_t prop[selp->size];
-            if (selp->offsetof == RDB_SELECTOR_OFFSET_KEY) {
-                if (it->key_len != selp->size) {
-                    comp = false;
-                    break;
-                }
-                if (rdb_iter_read_key(it, prop) != selp->size) {
-                    comp = false;
-                    break;
-                }
-            } else {
-                if (rdb_iter_read_data(it, selp->offsetof, prop, selp->size) != selp->size) {
-                    comp = false;
-                    break;
-                }
-            }
-            
-            if (!_compare(selp->operator, prop, selp->val, selp->size)) {
-                comp = false;
-                break;
-            }
-        }
-        
-        if (!comp)
+    for (selp = selectors; selp->operator; selp++) {
+        if (selp->operator >= RDB_OP_RESULT)
             continue;
         
-        /* Now construct and add a result. */
-        struct rdb_select_result *res = calloc(1, sizeof(struct rdb_select_result) + nrv * sizeof(void *));
-        if (!res)
-            return n;
-        
-        res->it = *it;
-        res->key = calloc(1, it->key_len);
-        if (!res->key) {
-            free(res);
-            return n;
-        }
-        
-        /* Construct result values. */
-        int crv = 0;
-        for (selp = selectors; selp->operator; selp++) {	
-            void *r;
-            
-            if (selp->operator < RDB_OP_RESULT)
-                continue;
-            
-            if (selp->operator == RDB_OP_RESULT) {
-                r = calloc(1, selp->size);
-                if (!r)
-                    break;
-                if (rdb_iter_read_data(it, selp->offsetof, r, selp->size) != selp->size) {
-                    free(r);
-                    break;
-                }
-            } else if (selp->operator == RDB_OP_RESULT_FULLY_LOAD) {
-                r = calloc(1, it->data_len);
-                if (!r)
-                    break;
-                if (rdb_iter_read_data(it, 0, r, it->data_len) != it->data_len) {
-                    LOG_ERROR("short read in fully load");
-                    free(r);
-                    break;
-                }
-            }
-            
-            res->result[crv] = r;
-            crv++;
-        }
-        
-        /* if one fails, clean it all up */
-        if (crv != nrv) {
-            for (int i = 0; i < crv; i++)
-                free(res->result[i]);
-            free(res);
-            return n;
+        uint8_t prop[selp->size];
+        if (selp->offsetof == RDB_SELECTOR_OFFSET_KEY) {
+            if (it->key_len != selp->size)
+                return false;
+            if (rdb_iter_read_key(it, prop) != selp->size)
+                return false;
+        } else {
+            if (rdb_iter_read_data(it, selp->offsetof, prop, selp->size) != selp->size)
+                return false;
         }
         
-        res->nres = nrv;
-        list_insert_tail(head, &res->node);
-        
-        n++;
+        if (!_compare(selp->operator, prop, selp->val, selp->size))
+            return false;
     }
     
-    return n;
+    return true;
 }
 
-void rdb_select_free_result(struct rdb_select_result *res) {
-    for (int i = 0; i < res->nres; i++)
+/* Adds the record that the iterator points at to a list of results;
+ * returns false if we ran out of memory. */
+static int _rdb_select_add(struct rdb_iter *it, list_head *head, struct rdb_selector *selectors)
+{
+    struct rdb_selector *selp;
+    int nrv = 0;
+    
+    for (selp = selectors; selp->operator; selp++)
+        if (selp->operator >= RDB_OP_RESULT)
+            nrv++;
+    
+    struct rdb_select_result *res = calloc(1, sizeof(struct rdb_select_result) + nrv * sizeof(void *));
+    if (!res)
+        return 0;
+    
+    res->it = *it;
+    res->key = calloc(1, it->key_len);
+    if (!res->key || rdb_iter_read_key(it, res->key) != it->key_len) {
+        free(res->key);
+        free(res);
+        return 0;
+    }
+    
+    /* Construct result values. */
+    int crv = 0;
+    for (selp = selectors; selp->operator; selp++) {	
+        void *r = NULL;
+        
+        if (selp->operator < RDB_OP_RESULT)
+            continue;
+        
+        if (selp->operator == RDB_OP_RESULT) {
+            r = calloc(1, selp->size);
+            if (!r)
+                break;
+            if (rdb_iter_read_data(it, selp->offsetof, r, selp->size) != selp->size) {
+                free(r);
+                break;
+            }
+        } else if (selp->operator == RDB_OP_RESULT_FULLY_LOAD) {
+            r = calloc(1, it->data_len);
+            if (!r)
+                break;
+            if (rdb_iter_read_data(it, 0, r, it->data_len) != it->data_len) {
+                LOG_ERROR("short read in fully load");
+                free(r);
+                break;
+            }
+        } else {
+            LOG_ERROR("unknown result operator %d", selp->operator);
+            break;
+        }
+        
+        res->result[crv] = r;
+        crv++;
+    }
+    
+    /* if one fails, clean it all up */
+    if (crv != nrv) {
+        for (int i = 0; i < crv; i++)
+            free(res->result[i]);
+        free(res->key);
+        free(res);
+        return 0;
+    }
+    
+    res->nres = nrv;
+    list_insert_tail(head, &res->node);
+    
+    return 1;
+}
+
+int rdb_select(struct rdb_iter *it, list_head/*<rdb_select_result>*/ *head, struct rdb_selector *selectors) {
+    int n = 0;
+    
+    int valid = 1;
+    for (; valid; valid = rdb_iter_next(it)) {
+        if (!_rdb_matches(it, selectors))
+            continue;
+        
+        if (!_rdb_select_add(it, head, selectors))
+            return n;
+        
+        n++;
+    }
+    
+    return n;
+}
+
+/* Without a sorted index to go on, we make one up just for now. */
+static int _rdb_sort_scan(const struct rdb_database *db, struct fd *fd, struct rdb_sort_ent **ents)
+{
+    struct rdb_iter it;
+    uint32_t val;
+    int valid, n = 0, max = 0;
+    
+    for (valid = _rdb_iter_start_from_fd(fd, &it); valid; valid = rdb_iter_next(&it))
+        max++;
+    
+    *ents = malloc((max ? max : 1) * sizeof(struct rdb_sort_ent));
+    if (!*ents)
+        return -1;
+    
+    for (valid = _rdb_iter_start_from_fd(fd, &it); valid && n < max; valid = rdb_iter_next(&it))
+        if (_rdb_iter_sort_val(db, &it, &val))
+            _rdb_sort_insert(*ents, &n, val, fs_seek(&it.fd, 0, FS_SEEK_CUR));
+    
+    return n;
+}
+
+int rdb_select_sorted(const struct rdb_database *db, uint32_t lo, uint32_t hi, int newest_first, int max, list_head/*<rdb_select_result>*/ *head, struct rdb_selector *selectors)
+{
+    struct rdb_sort_ent *ents;
+    struct rdb_iter it;
+    struct file file;
+    struct fd fd;
+    int n, first, last, found = 0;
+    int scratch = 0;
+    
+    assert(db->locked && db->sort_size);
+    
+    if (lo > hi || fs_find_file(&file, db->filename) < 0)
+        return 0;
+    fs_open(&fd, &file);
+    
+    if (db->index && db->index->valid && db->index->sorted_complete) {
+        ents = db->index->sorted;
+        n = db->index->nsorted;
+    } else {
+        n = _rdb_sort_scan(db, &fd, &ents);
+        if (n < 0)
+            return 0;
+        scratch = 1;
+    }
+    
+    first = _rdb_sort_search(ents, n, lo, 0);
+    last = _rdb_sort_search(ents, n, hi, 1);
+    for (int k = 0; k < last - first && (!max || found < max); k++) {
+        int i = newest_first ? last - 1 - k : first + k;
+        
+        it.fd = fd;
+        fs_seek(&it.fd, ents[i].ofs, FS_SEEK_SET);
+        if (!_rdb_iter_at_valid(&it) || !_rdb_matches(&it, selectors))
+            continue;
+        if (!_rdb_select_add(&it, head, selectors))
+            break;
+        found++;
+    }
+    
+    if (scratch)
+        free(ents);
+    
+    return found;
+}
+
+/*** Cursors. ***/
+
+/* rdb_select builds a list of everything that matches, and allocates each
+ * result as it goes; a cursor hands back one match at a time instead, with
+ * its key and results read into a buffer that the caller owns, so that
+ * walking a big database doesn't take any more memory than walking a small
+ * one. */
+
+void rdb_cursor_start(struct rdb_cursor *cur, const struct rdb_database *db, struct rdb_selector *selectors, void *buf, size_t bufsz)
+{
+    memset(cur, 0, sizeof(*cur));
+    cur->selectors = selectors;
+    cur->buf = buf;
+    cur->bufsz = bufsz;
+    cur->valid = rdb_iter_start(db, &cur->it);
+    cur->started = 0;
+}
+
+/* Takes len bytes from the cursor's buffer, keeping everything after it
+ * word-aligned, or returns NULL if there isn't room. */
+static void *_rdb_cursor_take(struct rdb_cursor *cur, size_t *pos, size_t len)
+{
+    void *p;
+    
+    if (len > cur->bufsz - *pos)
+        return NULL;
+    p = cur->buf + *pos;
+    *pos += (len + 3) & ~3;
+    if (*pos > cur->bufsz)
+        *pos = cur->bufsz;
+    
+    return p;
+}
+
+int rdb_cursor_next(struct rdb_cursor *cur)
+{
+    if (cur->valid && cur->started)
+        cur->valid = rdb_iter_next(&cur->it);
+    cur->started = 1;
+    
+    for (; cur->valid; cur->valid = rdb_iter_next(&cur->it)) {
+        struct rdb_iter *it = &cur->it;
+        struct rdb_selector *selp;
+        size_t pos = 0;
+        int nres = 0;
+        
+        if (!_rdb_matches(it, cur->selectors))
+            continue;
+        
+        cur->key = _rdb_cursor_take(cur, &pos, it->key_len);
+        if (cur->key && rdb_iter_read_key(it, cur->key) != it->key_len)
+            cur->key = NULL;
+        
+        for (selp = cur->selectors; selp->operator && nres < RDB_CURSOR_MAX_RESULTS; selp++) {
+            int ofs, len;
+            
+            if (selp->operator < RDB_OP_RESULT)
+                continue;
+            
+            if (selp->operator == RDB_OP_RESULT) {
+                ofs = selp->offsetof;
+                len = selp->size;
+            } else {
+                ofs = 0;
+                len = it->data_len;
+            }
+            
+            void *r = _rdb_cursor_take(cur, &pos, len);
+            if (r && rdb_iter_read_data(it, ofs, r, len) != len)
+                r = NULL;
+            cur->result[nres++] = r;
+        }
+        
+        return 1;
+    }
+    
+    return 0;
+}
+
+void rdb_select_free_result(struct rdb_select_result *res) {
+    for (int i = 0; i < res->nres; i++)
         free(res->result[i]);
     free(res->key);
     free(res);
@@ -399,73 +1118,397 @@ void rdb_select_free_all(list_head *head)
     }
 }
 
-int _rdb_gc_for_bytes(const struct rdb_database *db, struct fd *fd, int bytes) {
-    fs_seek(fd, 0, FS_SEEK_SET);
-    
-    /* Count up how many bytes we stand to liberate. */
-    struct rdb_iter it;
-    int valid;
+/*** Compaction. ***/
+
+/* Erased records only go away when the live ones get copied into a new
+ * file, which then replaces the old one.  Doing that all at once, inside
+ * whichever insert ran out of room, holds the database for as long as it
+ * takes to copy all of it; so once a database is getting full, and a good
+ * part of it is dead, each insert also copies a few records across (see
+ * _rdb_compact_tick), and by the time that it would have run out of room,
+ * the new file is usually done.  If it isn't, the insert that runs out
+ * finishes it off.
+ *
+ * Until then, the old file is still the database: inserts go on the end of
+ * it, and the copying catches up with them, and records that get deleted
+ * after they were copied get deleted from the new file too.  Overwriting in
+ * place would have to happen to both, so that waits until it's over.  The
+ * old file stays held where it is until then, even between rdb_open and
+ * rdb_close, or else the collector could move it out from underneath the
+ * copying.  If we lose power partway, the new file is still a temporary
+ * one, and the filesystem throws it away. */
+
+struct rdb_compact {
+    struct fd to;
+    uint32_t from;      /* where the next record to copy is, in the old file */
+    uint16_t startpage; /* of the old file */
+    uint8_t buf[256];
+};
+
+/* Starts copying file into a new one, which has room for bytes more, or
+ * returns NULL if even then there wouldn't be room for them. */
+static struct rdb_compact *_rdb_compact_begin(const struct rdb_database *db, const struct file *file, int bytes)
+{
+    struct rdb_compact *c;
+    int room = file->size > db->def_db_size ? file->size : db->def_db_size;
     int used = 0;
-    for (valid = _rdb_iter_start_from_fd(fd, &it); valid; valid = rdb_iter_next(&it))
-        used += sizeof(struct rdb_hdr) + it.key_len + it.data_len;
-    int tlen = fs_seek(&it.fd, 0, FS_SEEK_CUR);
-    int fsz = fs_size(fd);
-    LOG_INFO("gc: rdb %s will have %d/%d bytes used after, has %d/%d bytes used", db->filename, used, fsz, tlen, fsz);
     
-    if (bytes >= (fsz - used)) {
+    /* Count up how many bytes we stand to liberate, unless the index
+     * already knows. */
+    if (db->index && db->index->valid && db->index->startpage == file->startpage) {
+        used = db->index->live;
+    } else {
+        struct rdb_iter it;
+        struct fd fd;
+        int valid;
+        
+        fs_open(&fd, file);
+        for (valid = _rdb_iter_start_from_fd(&fd, &it); valid; valid = rdb_iter_next(&it))
+            used += sizeof(struct rdb_hdr) + it.key_len + it.data_len;
+    }
+    LOG_INFO("gc: rdb %s will have %d/%d bytes used after", db->filename, used, room);
+    
+    if (bytes >= (room - used)) {
         LOG_ERROR("gc: which is not enough space for a %d byte entry, sadly", bytes);
-        return 0;
+        return NULL;
     }
     
-    /* Ok, here we go. */
-    valid = _rdb_iter_start_from_fd(fd, &it);
-    struct file oldfile = fd->file;
-    if (fs_creat_replacing(fd, db->filename, db->def_db_size, &oldfile) == NULL) {
+    c = malloc(sizeof(struct rdb_compact));
+    if (!c)
+        return NULL;
+    
+    /* The new one only needs to be as big as what's left over, and the
+     * new entry; it can grow from there. */
+    if (fs_creat_growable(&c->to, db->filename, used + bytes ? used + bytes : 1, file) == NULL) {
         LOG_ERROR("gc: failed to create new file");
+        free(c);
+        return NULL;
+    }
+    fs_set_write_combine(&c->to, 1);
+    c->from = 0;
+    c->startpage = file->startpage;
+    fs_gc_hold(db->filename);
+    
+    return c;
+}
+
+/* Whether the record that fd points to has a later copy, which an
+ * interrupted overwrite would have left behind; key is for its key. */
+static int _rdb_compact_superseded(const struct fd *fd, const struct rdb_hdr *hdr, uint8_t *key)
+{
+    struct rdb_iter it = { .fd = *fd };
+    int valid;
+    
+    it.key_len = hdr->key_len;
+    it.data_len = hdr->data_len;
+    if (rdb_iter_read_key(&it, key) != hdr->key_len)
         return 0;
+    
+    for (valid = rdb_iter_next(&it); valid; valid = rdb_iter_next(&it))
+        if (it.key_len == hdr->key_len && _rdb_iter_is_key(&it, key, hdr->key_len))
+            return 1;
+    
+    return 0;
+}
+
+/* Copies records until at least budget bytes have gone, or there are none
+ * left, in which case the new file takes over.  Returns 0 if there's more
+ * to do, 1 once it's done, or -1 if it can't go on. */
+static int _rdb_compact_step(const struct rdb_database *db, struct rdb_compact *c, int budget)
+{
+    struct file file;
+    struct fd fd;
+    struct rdb_hdr hdr;
+    int copied = 0;
+    
+    /* The old file might have grown since last time. */
+    if (fs_find_file(&file, db->filename) < 0 || file.startpage != c->startpage) {
+        LOG_ERROR("gc: %s went away while it was being compacted", db->filename);
+        return -1;
     }
-    for (; valid; valid = rdb_iter_next(&it)) {
-        int nbytes = sizeof(struct rdb_hdr) + it.key_len + it.data_len;
-        struct fd from = it.fd;
+    fs_open(&fd, &file);
+    fs_seek(&fd, c->from, FS_SEEK_SET);
+    
+    while (copied < budget) {
+        if (!_rdb_seek_valid(&fd, &hdr, 0)) {
+            if (fs_flush(&c->to))
+                return -1;
+            fs_mark_written(&c->to); /* the old file is now dead */
+            return 1;
+        }
+        
+        int nbytes = sizeof(struct rdb_hdr) + hdr.key_len + hdr.data_len;
+        
+        c->from = fs_seek(&fd, 0, FS_SEEK_CUR) + nbytes;
+        copied += nbytes;
+        
+        /* Without an index, nothing has erased the earlier of two copies of
+         * a record (see rdb_find), so it gets left behind here. */
+        if (!_rdb_index_usable(db) && _rdb_compact_superseded(&fd, &hdr, c->buf)) {
+            LOG_INFO("gc: %s has a stale copy of a record; dropping it", db->filename);
+            fs_seek(&fd, nbytes, FS_SEEK_CUR);
+            continue;
+        }
+        
         while (nbytes) {
-            uint8_t buf[16];
-            size_t ibytes = nbytes < 16 ? nbytes : 16;
+            int ibytes = nbytes < sizeof(c->buf) ? nbytes : sizeof(c->buf);
             
-            if (fs_read(&from, buf, ibytes) != ibytes) {
+            if (fs_read(&fd, c->buf, ibytes) != ibytes) {
                 LOG_ERROR("gc: failed to read");
-                return 0;
+                return -1;
             }
-            if (fs_write(fd, buf, ibytes) != ibytes) {
+            if (fs_write(&c->to, c->buf, ibytes) != ibytes) {
                 LOG_ERROR("gc: failed to write");
-                return 0;
+                return -1;
             }
-            
             nbytes -= ibytes;
         }
     }
-    fs_mark_written(fd); /* oldfile is now dead */
     
+    /* Whatever gets deleted next might need to be found in here. */
+    return fs_flush(&c->to) ? -1 : 0;
+}
+
+/* Cleans up after a compaction that finished, or failed, with rv. */
+static void _rdb_compact_end(const struct rdb_database *db, struct rdb_compact *c, int rv)
+{
+    struct file file;
+    
+    if (db->index && db->index->compact == c)
+        db->index->compact = NULL;
+    
+    if (rv < 0) {
+        /* The new file stays a temporary one, for fs_init to clean up. */
+        LOG_ERROR("gc: gave up compacting %s", db->filename);
+        fs_flush(&c->to);
+    } else if (db->index) {
+        /* Everything moved, so the index starts over, too. */
+        _rdb_index_build(db, fs_find_file(&file, db->filename) >= 0 ? &file : NULL);
+    }
+    
+    fs_gc_release(db->filename);
+    free(c);
+}
+
+/* A record that was deleted from the old file, after it was copied, has
+ * to be deleted from the new one too. */
+static void _rdb_compact_forget(struct rdb_compact *c, const uint8_t *key, uint16_t key_size)
+{
+    struct rdb_iter it;
+    struct fd fd;
+    int valid;
+    
+    fs_open(&fd, &c->to.file);
+    for (valid = _rdb_iter_start_from_fd(&fd, &it); valid; valid = rdb_iter_next(&it))
+        if (it.key_len == key_size && _rdb_iter_is_key(&it, key, key_size)) {
+            rdb_delete(&it);
+            return;
+        }
+}
+
+/* Runs the compaction that's going on -- or else a new one, with room for
+ * bytes more -- to the end. */
+static int _rdb_compact_finish(const struct rdb_database *db, const struct file *file, int bytes)
+{
+    struct rdb_compact *c = db->index ? db->index->compact : NULL;
+    int rv;
+    
+    if (!c && !(c = _rdb_compact_begin(db, file, bytes)))
+        return 0;
+    rv = _rdb_compact_step(db, c, INT32_MAX);
+    _rdb_compact_end(db, c, rv);
+    
+    return rv == 1;
+}
+
+/* Called after an insert wrote bytes.  Each step copies RDB_COMPACT_STEP
+ * bytes, plus twice what the insert wrote, so that it always gains on the
+ * writers; if they carry on writing as much as this one did, it's done by
+ * the time that they've written live * bytes / (RDB_COMPACT_STEP + 2 *
+ * bytes).  The longer that it waits to start, the more it gets back for
+ * copying the live records, so it waits until there's only that much room
+ * left (and a record to spare), as long as at least a quarter of the
+ * database is dead by then; if the writers are quicker than that, the
+ * insert that runs out finishes it off. */
+static void _rdb_compact_tick(const struct rdb_database *db, int bytes)
+{
+    struct rdb_index *idx = db->index;
+    struct file file;
+    int rv;
+    
+    if (!idx || !idx->valid)
+        return;
+    
+    if (!idx->compact) {
+        if (fs_find_file(&file, db->filename) < 0 || file.startpage != idx->startpage)
+            return;
+        
+        uint32_t room = file.size > db->def_db_size ? file.size : db->def_db_size;
+        uint32_t lead = idx->live * bytes / (RDB_COMPACT_STEP + 2 * bytes) + bytes;
+        if (idx->end + lead < room || idx->end < idx->live + room / 4)
+            return;
+        
+        LOG_INFO("gc: %s is %d/%d bytes full, %d of them live; compacting as we go", db->filename, (int)idx->end, (int)room, (int)idx->live);
+        if (!(idx->compact = _rdb_compact_begin(db, &file, 0)))
+            return;
+    }
+    
+    rv = _rdb_compact_step(db, idx->compact, RDB_COMPACT_STEP + 2 * bytes);
+    if (rv)
+        _rdb_compact_end(db, idx->compact, rv);
+}
+
+/* A database is about to lose its file, or (if it's per-file) to move to
+ * another one.  A compaction that's going on has to finish first, or else it'd
+ * find itself on the wrong file next time, and give up, and leave its
+ * half-copied file about until the next boot; and the index has to be
+ * built again, even if the next file happens to start where this one
+ * did. */
+static void _rdb_leave_file(struct rdb_database *db)
+{
+    struct rdb_index *idx = db->index;
+    
+    if (!idx)
+        return;
+    if (idx->compact)
+        _rdb_compact_end(db, idx->compact, _rdb_compact_step(db, idx->compact, INT32_MAX));
+    idx->valid = 0;
+}
+
+/* Puts fd at the end of the records, where the next one goes. */
+static int _rdb_seek_end(const struct rdb_database *db, struct rdb_iter *it)
+{
+    struct file file;
+    struct fd fd;
+    int valid;
+    
+    if (fs_find_file(&file, db->filename) < 0)
+        return 0;
+    fs_open(&fd, &file);
+    
+    /* The index knows where the end is. */
+    if (_rdb_index_usable(db)) {
+        it->fd = fd;
+        fs_seek(&it->fd, db->index->end, FS_SEEK_SET);
+        return 1;
+    }
+    
+    for (valid = _rdb_iter_start_from_fd(&fd, it); valid; valid = rdb_iter_next(it))
+        ;
     return 1;
 }
 
+/* Makes sure that there are bytes free at fd, which is at the end of the
+ * records: by growing the file, if it can, or else by compacting it, which
+ * moves fd to the end of the new one. */
+static int _rdb_reserve(const struct rdb_database *db, struct fd *fd, int bytes)
+{
+    int need = fs_seek(fd, 0, FS_SEEK_CUR) + bytes;
+    int room = fd->file.size > db->def_db_size ? fd->file.size : db->def_db_size;
+    struct rdb_iter it;
+    
+    if (need <= fd->file.size || (need <= db->def_db_size && fs_grow(fd, need) >= 0))
+        return 1;
+    
+    /* Any compaction that's going on has to finish now; if there wasn't
+     * one, it all happens now. */
+    if (!_rdb_compact_finish(db, &fd->file, bytes) || !_rdb_seek_end(db, &it)) {
+        LOG_ERROR("not enough space %d %d for new entry", fd->file.size, need - bytes);
+        return 0;
+    }
+    *fd = it.fd;
+    
+    need = fs_seek(fd, 0, FS_SEEK_CUR) + bytes;
+    if (need <= fd->file.size || (need <= room && fs_grow(fd, need) >= 0))
+        return 1;
+    
+    LOG_ERROR("not enough space %d %d for new entry", fd->file.size, need - bytes);
+    return 0;
+}
+
 int rdb_create(const struct rdb_database *db)
 {
     struct file file;
     if (fs_find_file(&file, db->filename) < 0) {
         struct fd fd;
         LOG_ERROR("rdb %s does not exist, so I'm going to go create it, wish me luck", db->filename);
-        if (fs_creat(&fd, db->filename, db->def_db_size) == NULL) {
+        /* Start out small; it grows a page at a time, up to def_db_size. */
+        if (fs_creat_growable(&fd, db->filename, 1, NULL) == NULL) {
             LOG_ERROR("nope, that did not work either, I give up");
             return Blob_DatabaseFull;
         }
         fs_mark_written(&fd);
+        if (db->index)
+            _rdb_index_reset(db, fd.file.startpage);
     }
     return Blob_Success;
 }
 
+/* If a record's new value is the same as the old one, there's nothing to
+ * write.  Otherwise, if it's the same length, and the bytes that differ
+ * only clear bits that are still set, and all sit in one program page of
+ * flash (see fs_in_one_program), they can go right on top of the old ones. 
+ * That is the one write in here that isn't all-or-nothing -- if we lose
+ * power partway, the value can come back with some bits of each -- which is
+ * why it's kept to what goes down in one program operation.  (Nor while a
+ * compaction is going on, which might already have a copy of the old one.) 
+ * Returns false if the value needs a new record instead. */
+static int _rdb_overwrite_in_place(const struct rdb_database *db, struct rdb_iter *it, const uint8_t *data, uint16_t data_size, int *rv)
+{
+    uint8_t old[32];
+    int first = -1, last = -1;
+    int fits = !(db->index && db->index->compact);
+    
+    if (it->data_len != data_size)
+        return 0;
+    
+    for (int ofs = 0; ofs < data_size && (fits || first < 0); ofs += sizeof(old)) {
+        int n = data_size - ofs < sizeof(old) ? data_size - ofs : sizeof(old);
+        
+        if (rdb_iter_read_data(it, ofs, old, n) != n)
+            return 0;
+        for (int i = 0; i < n; i++) {
+            if (old[i] == data[ofs + i])
+                continue;
+            if (first < 0)
+                first = ofs + i;
+            last = ofs + i;
+            fits = fits && !(data[ofs + i] & ~old[i]);
+        }
+    }
+    
+    *rv = Blob_Success;
+    if (first < 0)
+        return 1;
+    if (!fits)
+        return 0;
+    
+    struct fd fd = it->fd;
+    uint32_t ofs = fs_seek(&fd, 0, FS_SEEK_CUR);
+    uint32_t val;
+    
+    fs_seek(&fd, sizeof(struct rdb_hdr) + it->key_len + first, FS_SEEK_CUR);
+    if (!fs_in_one_program(&fd, last - first + 1))
+        return 0;
+    if (fs_write(&fd, data + first, last - first + 1) < last - first + 1) {
+        LOG_ERROR("failed to write data");
+        *rv = Blob_GeneralFailure;
+        return 1;
+    }
+    
+    /* The sort field might have been what changed. */
+    if (db->index && db->index->valid && db->sort_size) {
+        _rdb_sorted_remove(db, ofs);
+        if (_rdb_sort_val(db, data, data_size, &val))
+            _rdb_sorted_add(db, val, ofs);
+    }
+    
+    return 1;
+}
+
 int rdb_insert(const struct rdb_database *db, const uint8_t *key, uint16_t key_size, const uint8_t *data, uint16_t data_size)
 {
-    struct rdb_iter it;
+    struct rdb_iter it, old;
     assert(db->locked);
     
     /* Create the db if it doesn't already exist. */      
@@ -473,35 +1516,30 @@ int rdb_insert(const struct rdb_database *db, const uint8_t *key, uint16_t key_s
     if (rv != Blob_Success)
         return rv;    
     
-    /* Iterate looking for dup keys, then position us at eof. */
-    int valid;
-    for (valid = rdb_iter_start(db, &it); valid; valid = rdb_iter_next(&it)) {
-        if (it.key_len != key_size)
-            continue;
-        
-        uint8_t rdkey[key_size];
-        if (rdb_iter_read_key(&it, rdkey) < key_size) {
-            LOG_ERROR("short read on disk in key read");
-            return Blob_GeneralFailure;
-        }
-        
-        /* XXX: Overwrite the dup key, rather than failing.  Do this by
-         * writing a new one at the end, then marking this one as deleted. 
-         * Special care needed if there are multiple interrupted overwrites.
-         */
-        if (memcmp(key, rdkey, key_size) == 0) {
-            LOG_ERROR("rdb overwrite not supported");
-            return Blob_InvalidData;
-        }
-    }
-
+    /* A key that's already there gets the new value: on top of the old
+     * one, if it can go there, or else in a new record at the end, after
+     * which the old one gets erased.  If we lose power in between, there
+     * are two of them, and the later one wins: _rdb_index_build erases the
+     * other, or without an index, rdb_find passes it over until compaction
+     * leaves it behind. */
+    int found = rdb_find(db, key, key_size, &old);
+    if (found && _rdb_overwrite_in_place(db, &old, data, data_size, &rv))
+        return rv;
+    
+    if (!_rdb_seek_end(db, &it))
+        return Blob_GeneralFailure;
+    if (!_rdb_reserve(db, &it.fd, sizeof(struct rdb_hdr) + key_size + data_size))
+        return Blob_DatabaseFull;
+    
+    /* Compaction moves the old one, too. */
+    if (found && old.fd.file.startpage != it.fd.file.startpage && !rdb_find(db, key, key_size, &old))
+        return Blob_GeneralFailure;
     int pos = fs_seek(&it.fd, 0, FS_SEEK_CUR);
-    if (pos + sizeof(struct rdb_hdr) + key_size + data_size > it.fd.file.size) {
-        if (!_rdb_gc_for_bytes(db, &it.fd, sizeof(struct rdb_hdr) + key_size + data_size)) {
-            LOG_ERROR("not enough space %d %d for new entry", it.fd.file.size, pos); //+ sizeof(struct rdb_hdr) + key_size + data_size);
-            return Blob_DatabaseFull;
-        }
-    }
+    
+    /* If we don't make it all the way, the index gets rebuilt next time. */
+    int indexed = db->index && db->index->valid;
+    if (indexed)
+        db->index->valid = 0;
 
     /* Carefully start by writing a header. */
     struct rdb_hdr hdr;
@@ -523,7 +1561,10 @@ int rdb_insert(const struct rdb_database *db, const uint8_t *key, uint16_t key_s
         return Blob_GeneralFailure;
     }
     
-    /* Write the data. */
+    /* Write the data.  The key and data can go down together, but they
+     * can't share a program operation with the header flag before them, or
+     * with the one after them. */
+    fs_set_write_combine(&hfd, 1);
     if (fs_write(&hfd, key, key_size) < key_size) {
         LOG_ERROR("failed to write key");
         return Blob_GeneralFailure;
@@ -533,6 +1574,11 @@ int rdb_insert(const struct rdb_database *db, const uint8_t *key, uint16_t key_s
         return Blob_GeneralFailure;
     }
     
+    if (fs_flush(&hfd)) {
+        LOG_ERROR("failed to write data");
+        return Blob_GeneralFailure;
+    }
+    
     /* Mark the data as written. */
     hfd = it.fd;
     hdr.flags &= ~RDB_FLAG_WRITTEN;
@@ -541,42 +1587,35 @@ int rdb_insert(const struct rdb_database *db, const uint8_t *key, uint16_t key_s
         return Blob_GeneralFailure;
     }
     
-    return Blob_Success;
+    if (indexed) {
+        uint32_t val;
+        
+        db->index->valid = 1;
+        _rdb_index_add(db, _rdb_key_hash(key, key_size), pos);
+        if (db->bloom_bytes)
+            _rdb_bloom_add(db, key, key_size);
+        if (db->sort_size && _rdb_sort_val(db, data, data_size, &val))
+            _rdb_sorted_add(db, val, pos);
+        db->index->end = pos + sizeof(struct rdb_hdr) + key_size + data_size;
+        db->index->live += sizeof(struct rdb_hdr) + key_size + data_size;
+    }
+    
+    if (found)
+        rv = rdb_delete(&old);
+    _rdb_compact_tick(db, sizeof(struct rdb_hdr) + key_size + data_size);
+    
+    return rv;
 }
 
 int rdb_update(const struct rdb_database *db, const uint8_t *key, const uint16_t key_size, const uint8_t *data, const size_t data_size)
 {
     struct rdb_iter it;
-    rdb_select_result_list head;
     assert(db);
-    list_init_head(&head);
-
-    int rv = rdb_iter_start(db, &it);
-    if (!rv) {
-        return Blob_InvalidDatabaseID;
-    }
-    
-    struct rdb_selector selectors[] = {
-        { RDB_SELECTOR_OFFSET_KEY, key_size, RDB_OP_EQ, key },
-        { }
-    };
 
-    if (!rdb_select(&it, &head, selectors))
+    if (!rdb_find(db, key, key_size, &it))
         return Blob_KeyDoesNotExist;
 
-    /* Always delete and re-insert */    
-    struct rdb_select_result *res;
-    rdb_select_result_foreach(res, &head) {
-        if (!rdb_delete(&res->it) ||
-            !rdb_insert(db, key, res->it.key_len, data, data_size)) {
-            rdb_select_free_all(&head);
-            LOG_ERROR("update: failed to create value");
-            return Blob_GeneralFailure;
-        }
-    }
-    
-    rdb_select_free_all(&head);
-    return Blob_Success;
+    return rdb_insert(db, key, key_size, data, data_size);
 }
 
 int rdb_delete(struct rdb_iter *it)
@@ -591,6 +1630,319 @@ int rdb_delete(struct rdb_iter *it)
     fd = it->fd;
     if (fs_write(&fd, &hdr, sizeof(hdr)) < sizeof(hdr))
         return Blob_GeneralFailure;
+    
+    /* Whichever database this came out of, it's open. */
+    uint32_t ofs = fs_seek(&it->fd, 0, FS_SEEK_CUR);
+    for (int i = 0; i < sizeof(databases) / sizeof(databases[0]); i++) {
+        struct rdb_database *db = &databases[i];
+        struct rdb_index *idx = db->index;
+        
+        if (!db->locked || !idx)
+            continue;
+        
+        int indexed = idx->valid && idx->startpage == it->fd.file.startpage;
+        int copied = idx->compact && idx->compact->startpage == it->fd.file.startpage && ofs < idx->compact->from;
+        if (!indexed && !copied)
+            continue;
+        
+        uint8_t key[hdr.key_len];
+        if (rdb_iter_read_key(it, key) != hdr.key_len) {
+            idx->valid = 0;
+            if (copied)
+                _rdb_compact_end(db, idx->compact, -1);
+            break;
+        }
+        if (indexed) {
+            _rdb_index_remove(db, _rdb_key_hash(key, hdr.key_len), ofs);
+            _rdb_sorted_remove(db, ofs);
+            idx->live -= sizeof(struct rdb_hdr) + hdr.key_len + hdr.data_len;
+        }
+        if (copied)
+            _rdb_compact_forget(idx->compact, key, hdr.key_len);
+        break;
+    }
+
+    return Blob_Success;
+}
+
+/*** Transactions. ***/
+
+/* Inserts and deletes get staged in RAM, and then the commit does them all
+ * in one go.  The inserts land on flash together, as one batch record (see
+ * the top of this file), and one flag makes all of them valid at once; if
+ * we lose power before that, or the batch doesn't fit, none of them
+ * happened.  Nothing gets erased until then, either: the records that get
+ * deleted, and the ones that inserts replace, go after the batch, one at a
+ * time, the same way that rdb_insert erases the old one.  So a commit that
+ * fails leaves the database the way that it was.  (Losing power partway
+ * through the erasing can leave a deleted record behind, though; deletes
+ * aren't written down anywhere but in the erasing.) */
 
+struct rdb_txn_op {
+    list_node node;
+    uint8_t del;    /* or else, an insert */
+    uint8_t live;   /* an insert that is still going to get written */
+    uint8_t flash;  /* deletes, or replaces, a record that's on flash */
+    uint8_t status;
+    uint8_t key_len;
+    uint16_t data_len;
+    uint32_t old;   /* where the record that it replaces is */
+    uint8_t buf[];  /* the key, then the data */
+};
+
+void rdb_txn_begin(struct rdb_txn *txn, const struct rdb_database *db)
+{
+    txn->db = db;
+    txn->nops = 0;
+    txn->bytes = 0;
+    list_init_head(&txn->ops);
+}
+
+static int _rdb_txn_stage(struct rdb_txn *txn, int del, const uint8_t *key, uint16_t key_size, const uint8_t *data, uint16_t data_size)
+{
+    int bytes = del ? 0 : sizeof(struct rdb_hdr) + key_size + data_size;
+    
+    /* The whole batch has to fit in one header. */
+    if (txn->nops == RDB_TXN_MAX_OPS || sizeof(struct rdb_hdr) + txn->bytes + bytes > 0xFFFF)
+        return Blob_TryLater;
+    if (key_size > 0xFF)
+        return Blob_InvalidData;
+    
+    struct rdb_txn_op *op = calloc(1, sizeof(struct rdb_txn_op) + key_size + data_size);
+    if (!op)
+        return Blob_GeneralFailure;
+    
+    op->del = del;
+    op->key_len = key_size;
+    op->data_len = data_size;
+    memcpy(op->buf, key, key_size);
+    if (data_size)
+        memcpy(op->buf + key_size, data, data_size);
+    
+    list_init_node(&op->node);
+    list_insert_tail(&txn->ops, &op->node);
+    txn->nops++;
+    txn->bytes += bytes;
+    
     return Blob_Success;
 }
+
+int rdb_txn_insert(struct rdb_txn *txn, const uint8_t *key, uint16_t key_size, const uint8_t *data, uint16_t data_size)
+{
+    return _rdb_txn_stage(txn, 0, key, key_size, data, data_size);
+}
+
+int rdb_txn_delete(struct rdb_txn *txn, const uint8_t *key, uint16_t key_size)
+{
+    return _rdb_txn_stage(txn, 1, key, key_size, NULL, 0);
+}
+
+void rdb_txn_abort(struct rdb_txn *txn)
+{
+    list_node *n;
+    
+    while ((n = list_get_head(&txn->ops))) {
+        list_remove(&txn->ops, n);
+        free(list_elem(n, struct rdb_txn_op, node));
+    }
+    txn->nops = 0;
+    txn->bytes = 0;
+}
+
+/* The last op before upto, on the same key, that is going to go through. */
+static struct rdb_txn_op *_rdb_txn_last(struct rdb_txn *txn, struct rdb_txn_op *upto)
+{
+    struct rdb_txn_op *op, *last = NULL;
+    
+    list_foreach(op, &txn->ops, struct rdb_txn_op, node) {
+        if (op == upto)
+            break;
+        if (op->status == Blob_Success && op->key_len == upto->key_len &&
+            memcmp(op->buf, upto->buf, upto->key_len) == 0)
+            last = op;
+    }
+    
+    return last;
+}
+
+/* Writes out the live inserts as one batch at it, which has room. */
+static int _rdb_txn_write(struct rdb_txn *txn, struct rdb_iter *it, int bytes)
+{
+    struct rdb_txn_op *op;
+    struct rdb_hdr hdr;
+    struct fd hfd = it->fd;
+    
+    /* The batch header goes down the same way as any other... */
+    hdr.flags = 0xFF;
+    hdr.key_len = 0;
+    hdr.data_len = bytes;
+    if (fs_write(&hfd, &hdr, sizeof(hdr)) < sizeof(hdr))
+        return 0;
+    
+    hdr.flags &= ~(RDB_FLAG_HEADER_WRITTEN | RDB_FLAG_BATCH);
+    hfd = it->fd;
+    if (fs_write(&hfd, &hdr, sizeof(hdr)) < sizeof(hdr))
+        return 0;
+    
+    /* ... but the records inside can be written whole, and all together,
+     * since nobody looks at them until the batch is marked written. */
+    fs_set_write_combine(&hfd, 1);
+    list_foreach(op, &txn->ops, struct rdb_txn_op, node) {
+        if (!op->live)
+            continue;
+        
+        struct rdb_hdr rhdr;
+        rhdr.flags = 0xFF & ~(RDB_FLAG_HEADER_WRITTEN | RDB_FLAG_WRITTEN);
+        rhdr.key_len = op->key_len;
+        rhdr.data_len = op->data_len;
+        if (fs_write(&hfd, &rhdr, sizeof(rhdr)) < sizeof(rhdr))
+            return 0;
+        if (fs_write(&hfd, op->buf, op->key_len + op->data_len) < op->key_len + op->data_len)
+            return 0;
+    }
+    if (fs_flush(&hfd))
+        return 0;
+    
+    /* And this is where it all becomes true. */
+    hdr.flags &= ~RDB_FLAG_WRITTEN;
+    hfd = it->fd;
+    if (fs_write(&hfd, &hdr, sizeof(hdr)) < sizeof(hdr))
+        return 0;
+    
+    return 1;
+}
+
+int rdb_txn_commit(struct rdb_txn *txn, uint8_t *status)
+{
+    const struct rdb_database *db = txn->db;
+    struct rdb_txn_op *op;
+    struct rdb_iter it;
+    int bytes = 0;
+    int rv;
+    
+    assert(db->locked);
+    
+    rv = rdb_create(db);
+    if (rv != Blob_Success) {
+        list_foreach(op, &txn->ops, struct rdb_txn_op, node)
+            op->status = rv;
+        goto done;
+    }
+    
+    /* Work out what each op is going to do, in order, before any of them
+     * do anything. */
+    list_foreach(op, &txn->ops, struct rdb_txn_op, node) {
+        struct rdb_txn_op *last = _rdb_txn_last(txn, op);
+        int exists = last ? !last->del : rdb_find(db, op->buf, op->key_len, &it);
+        
+        if (!op->del && !exists) {
+            op->status = Blob_Success;
+            op->live = 1;
+            bytes += sizeof(struct rdb_hdr) + op->key_len + op->data_len;
+        } else if (!exists) {
+            op->status = Blob_KeyDoesNotExist;
+        } else {
+            op->status = Blob_Success;
+            if (last) {
+                /* It never makes it to flash, but whatever it replaced
+                 * still has to go. */
+                last->live = 0;
+                bytes -= sizeof(struct rdb_hdr) + last->key_len + last->data_len;
+                op->flash = last->flash;
+            } else {
+                op->flash = 1;
+            }
+            if (!op->del) {
+                op->live = 1;
+                bytes += sizeof(struct rdb_hdr) + op->key_len + op->data_len;
+            }
+        }
+    }
+    
+    if (!_rdb_seek_end(db, &it)) {
+        rv = Blob_GeneralFailure;
+        goto failed;
+    }
+    if (bytes && !_rdb_reserve(db, &it.fd, sizeof(struct rdb_hdr) + bytes)) {
+        rv = Blob_DatabaseFull;
+        goto failed;
+    }
+    int pos = fs_seek(&it.fd, 0, FS_SEEK_CUR);
+    
+    /* Find what gets erased now, while there's only one of each (and after
+     * any compaction that making room did). */
+    list_foreach(op, &txn->ops, struct rdb_txn_op, node) {
+        struct rdb_iter old;
+        
+        if (!(op->live || op->del) || !op->flash || op->status != Blob_Success)
+            continue;
+        if (!rdb_find(db, op->buf, op->key_len, &old)) {
+            rv = Blob_GeneralFailure;
+            goto failed;
+        }
+        op->old = fs_seek(&old.fd, 0, FS_SEEK_CUR);
+    }
+    
+    if (!bytes)
+        goto erase;
+    
+    /* If we don't make it all the way, the index gets rebuilt next time. */
+    int indexed = db->index && db->index->valid;
+    if (indexed)
+        db->index->valid = 0;
+    
+    if (!_rdb_txn_write(txn, &it, bytes)) {
+        LOG_ERROR("failed to write batch of %d bytes", bytes);
+        rv = Blob_GeneralFailure;
+        goto failed;
+    }
+    
+    if (indexed) {
+        uint32_t ofs = pos + sizeof(struct rdb_hdr);
+        uint32_t val;
+        
+        db->index->valid = 1;
+        list_foreach(op, &txn->ops, struct rdb_txn_op, node) {
+            if (!op->live)
+                continue;
+            _rdb_index_add(db, _rdb_key_hash(op->buf, op->key_len), ofs);
+            if (db->bloom_bytes)
+                _rdb_bloom_add(db, op->buf, op->key_len);
+            if (db->sort_size && _rdb_sort_val(db, op->buf + op->key_len, op->data_len, &val))
+                _rdb_sorted_add(db, val, ofs);
+            ofs += sizeof(struct rdb_hdr) + op->key_len + op->data_len;
+        }
+        db->index->live += ofs - (pos + sizeof(struct rdb_hdr));
+        db->index->end = ofs;
+    }
+    
+erase:
+    list_foreach(op, &txn->ops, struct rdb_txn_op, node) {
+        struct rdb_iter old = { .fd = it.fd };
+        
+        if (!(op->live || op->del) || !op->flash || op->status != Blob_Success)
+            continue;
+        fs_seek(&old.fd, op->old, FS_SEEK_SET);
+        if (!_rdb_iter_at_valid(&old) || rdb_delete(&old) != Blob_Success)
+            op->status = Blob_GeneralFailure;
+    }
+    if (bytes)
+        _rdb_compact_tick(db, sizeof(struct rdb_hdr) + bytes);
+    
+    goto done;
+
+failed:
+    list_foreach(op, &txn->ops, struct rdb_txn_op, node)
+        if (op->live || (op->del && op->status == Blob_Success))
+            op->status = rv;
+done:
+    if (status) {
+        int i = 0;
+        
+        list_foreach(op, &txn->ops, struct rdb_txn_op, node)
+            status[i++] = op->status;
+    }
+    rdb_txn_abort(txn);
+    
+    return rv;
+}
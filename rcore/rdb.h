@@ -43,6 +43,7 @@ enum {
     RDB_ID_APP_PERSIST = 16,
     RDB_ID_BLUETOOTH = 128,
     RDB_ID_PREFS = 129,
+    RDB_ID_APP_PERSIST_LEGACY = 130, /* what every app's persist data used to share */
 };
 
 struct rdb_database;
@@ -73,9 +74,24 @@ struct rdb_select_result {
 typedef list_head rdb_select_result_list;
 
 struct rdb_database *rdb_open(uint16_t database_id);
+/* Some databases (see databases[] in rdb.c) are kept in a file per owner --
+ * per app, say -- rather than in one that they all share, so that nobody
+ * ever has to look through anybody else's records, and an owner's can all
+ * go at once, with rdb_delete_file.  Those are opened on the owner's file;
+ * opening one on a different file than last time costs an index build. 
+ * rdb_delete_file can also throw away the one file of any other database,
+ * given a NULL filename. */
+struct rdb_database *rdb_open_file(uint16_t database_id, const char *filename);
+int rdb_delete_file(uint16_t database_id, const char *filename);
 void rdb_close(struct rdb_database *db);
+/* Inserting a key that's already there replaces its value.  Once a database
+ * is getting full, each insert also spends about RDB_COMPACT_STEP bytes of
+ * writes on compacting it, rather than all of it at once when it fills. */
+#define RDB_COMPACT_STEP 512
+
 int rdb_insert(const struct rdb_database *db, const uint8_t *key, uint16_t key_size, const uint8_t *data, uint16_t data_size);
 int rdb_delete(struct rdb_iter *it);
+/* Like rdb_insert, but only if the key is there already. */
 int rdb_update(const struct rdb_database *db, const uint8_t *key, const uint16_t key_size, const uint8_t *data, const size_t data_size);
 int rdb_create(const struct rdb_database *db);
 
@@ -86,10 +102,74 @@ int rdb_iter_next(struct rdb_iter *it);
 int rdb_iter_read_key(struct rdb_iter *it, void *key);
 int rdb_iter_read_data(struct rdb_iter *it, int ofs, void *data, int len);
 
+/* Points the iterator at the record with the given key, and returns true,
+ * if there is one.  With the database's index, that's one read (or a few,
+ * on a collision); without, it's a scan.  Either way, a key that the
+ * database's Bloom filter rules out costs no reads at all. */
+int rdb_find(const struct rdb_database *db, const void *key, uint16_t key_size, struct rdb_iter *it);
+
 int rdb_select(struct rdb_iter *it, rdb_select_result_list *head, struct rdb_selector *selectors);
+/* Like rdb_select, but only looks at records whose sort field (see
+ * databases[] in rdb.c) is from lo to hi, inclusive, and adds them to head
+ * in order of it -- or the other way round, if newest_first -- stopping
+ * after max results, unless max is 0.  Records whose data stop short of
+ * the sort field have no place in the order, so they never match. */
+int rdb_select_sorted(const struct rdb_database *db, uint32_t lo, uint32_t hi, int newest_first, int max, rdb_select_result_list *head, struct rdb_selector *selectors);
 void rdb_select_free_result(struct rdb_select_result *res);
 void rdb_select_free_all(rdb_select_result_list *head);
 
+/* A cursor goes through the records that match a set of selectors one at
+ * a time, without allocating anything.  Each time that rdb_cursor_next
+ * returns true, key and result[] point at the match's key and at what each
+ * RDB_OP_RESULT or RDB_OP_RESULT_FULLY_LOAD selector asked for, in order;
+ * they're all read into buf, and the next call reuses it.  Anything that
+ * doesn't fit in buf (or that fails to read) comes back NULL, and can still
+ * be had from it with rdb_iter_read_data.  it can also be passed to
+ * rdb_delete, and the walk carries on after it. */
+#define RDB_CURSOR_MAX_RESULTS 4
+
+struct rdb_cursor {
+    struct rdb_iter it;
+    struct rdb_selector *selectors;
+    uint8_t *buf;
+    size_t bufsz;
+    int valid;
+    int started;
+    void *key;
+    void *result[RDB_CURSOR_MAX_RESULTS];
+};
+
+void rdb_cursor_start(struct rdb_cursor *cur, const struct rdb_database *db, struct rdb_selector *selectors, void *buf, size_t bufsz);
+int rdb_cursor_next(struct rdb_cursor *cur);
+
+/* A transaction stages a run of inserts and deletes on a database, and
+ * rdb_txn_commit does them all together: they get checked in one pass, and
+ * the inserts are written out back to back, and become durable all at
+ * once.  Nothing gets deleted or replaced until they have, so a commit
+ * that fails changes nothing.  The database only has to be open for the
+ * commit.  Each op is
+ * checked against the ones staged before it, so a key can be inserted and
+ * then deleted, or the other way round; and, as with rdb_insert, inserting
+ * a key that's already there replaces it.  The commit returns Blob_Success
+ * unless it failed as a whole, and fills in status (if not NULL) with a
+ * Blob_* code for each op, in the order they were staged.  A commit or an
+ * abort frees what was staged.  Staging returns Blob_TryLater once the
+ * transaction is full; commit it, and start another. */
+#define RDB_TXN_MAX_OPS 32
+
+struct rdb_txn {
+    const struct rdb_database *db;
+    list_head ops;
+    int nops;
+    int bytes;
+};
+
+void rdb_txn_begin(struct rdb_txn *txn, const struct rdb_database *db);
+int rdb_txn_insert(struct rdb_txn *txn, const uint8_t *key, uint16_t key_size, const uint8_t *data, uint16_t data_size);
+int rdb_txn_delete(struct rdb_txn *txn, const uint8_t *key, uint16_t key_size);
+int rdb_txn_commit(struct rdb_txn *txn, uint8_t *status);
+void rdb_txn_abort(struct rdb_txn *txn);
+
 #define rdb_select_result_foreach(res, lh) list_foreach(res, lh, struct rdb_select_result, node)
 #define rdb_select_result_head(lh) list_elem(list_get_head(lh), struct rdb_select_result, node)
 #define rdb_select_result_next(res, lh) list_elem(list_get_next(lh, &(res)->node), struct rdb_select_result, node)
@@ -8,6 +8,8 @@
 #include "node_list.h"
 #include "timeline.h"
 #include "rdb.h"
+#include "flash.h"
+#include "fs.h"
 #include "test.h"
 #include "debug.h"
 
@@ -140,8 +142,9 @@ TEST(rdb_basic) {
         return TEST_FAIL;
     }
     
-    if (_insert(1, 16) == 0) {
-        LOG_ERROR("double rdb_insert(1) succeeded");
+    /* Inserting it again replaces it. */
+    if (_insert(1, 16) != 0) {
+        LOG_ERROR("double rdb_insert(1) failed");
         return TEST_FAIL;
     }
 
@@ -180,8 +183,10 @@ TEST(rdb_basic) {
 }
 
 TEST(rdb_fill) {
+    struct flash_io_stats st0, st1;
     int i;
     
+    flash_get_io_stats(&st0);
     for (i = 0; i < 1024; i++) {
         if (_insert(i, 128) != 0) {
             LOG_INFO("rdb_insert(%d) failed", i);
@@ -190,6 +195,9 @@ TEST(rdb_fill) {
     }
     
     int nents = i;
+    flash_get_io_stats(&st1);
+    LOG_INFO("inserted %d records in %d program operations", nents, (int)(st1.programs - st0.programs));
+    
     for (i = 0; i < nents; i++)  {
         if (_retrieve(i, 128, 0) != 0) {
             LOG_ERROR("failure on retrieve(%d)", i);
@@ -204,12 +212,15 @@ TEST(rdb_fill) {
         return TEST_FAIL;
     }
     
+    /* This one has to compact the database first. */
+    flash_get_io_stats(&st0);
     if (_insert(nents, 128) != 0) {
         LOG_ERROR("rdb_insert(nents) failed");
         return TEST_FAIL;
     }
+    flash_get_io_stats(&st1);
 
-    LOG_INFO("inserted to replace");
+    LOG_INFO("inserted to replace, in %d program operations", (int)(st1.programs - st0.programs));
     
     for (i = 1; i <= nents; i++)  {
         if (_retrieve(i, 128, 0) != 0) {
@@ -224,4 +235,941 @@ TEST(rdb_fill) {
     return TEST_PASS;
 }
 
+static int _find(int key, int dsize) {
+    struct rdb_database *db = rdb_open(RDB_ID_TEST);
+    struct rdb_iter it;
+    uint8_t rd[dsize];
+    int ret = 0;
+    
+    if (!rdb_find(db, &key, 4, &it)) {
+        ret = 1;
+        goto fail;
+    }
+    
+    if (it.key_len != 4 || it.data_len != dsize || rdb_iter_read_data(&it, 0, rd, dsize) != dsize) {
+        ret = 2;
+        goto fail;
+    }
+    
+    for (int i = 0; i < dsize; i++)
+        if (rd[i] != ((key & 0xFF) ^ i)) {
+            LOG_ERROR("rdb_find incorrect readback key %d ofs %d, should be %02x is %02x", key, i, (key & 0xFF) ^ i, rd[i]);
+            ret = 3;
+            goto fail;
+        }
+    
+fail:
+    rdb_close(db);
+    
+    return ret;
+}
+
+TEST(rdb_index) {
+    struct flash_tag_stats st0[FLASH_TAG_COUNT], st1[FLASH_TAG_COUNT];
+    struct rdb_database *db;
+    struct rdb_iter it;
+    int i, valid;
+    
+    /* Start from empty; rdb_fill leaves it full. */
+    db = rdb_open(RDB_ID_TEST);
+    for (valid = rdb_iter_start(db, &it); valid; valid = rdb_iter_next(&it))
+        rdb_delete(&it);
+    rdb_close(db);
+    
+    for (i = 0; i < 16; i++)
+        if (_insert(0x100 + i, 40) != 0) {
+            LOG_ERROR("rdb_insert(%d) failed", i);
+            return TEST_FAIL;
+        }
+    
+    flash_get_tag_stats(st0);
+    for (i = 0; i < 16; i++)
+        if (_find(0x100 + i, 40) != 0) {
+            LOG_ERROR("rdb_find(%d) failed", i);
+            return TEST_FAIL;
+        }
+    flash_get_tag_stats(st1);
+    LOG_INFO("found 16 records with %d bytes read", (int)(st1[FLASH_TAG_RDB].read_bytes - st0[FLASH_TAG_RDB].read_bytes));
+    
+    if (_find(0x200, 40) == 0) {
+        LOG_ERROR("rdb_find found a key that isn't there");
+        return TEST_FAIL;
+    }
+    
+    for (i = 0; i < 16; i++) {
+        if (i % 4 == 3)
+            continue;
+        db = rdb_open(RDB_ID_TEST);
+        int key = 0x100 + i;
+        if (!rdb_find(db, &key, 4, &it) || rdb_delete(&it) != Blob_Success) {
+            rdb_close(db);
+            LOG_ERROR("rdb_delete(%d) failed", i);
+            return TEST_FAIL;
+        }
+        rdb_close(db);
+    }
+    
+    for (i = 0; i < 16; i++)
+        if ((_find(0x100 + i, 40) == 0) != (i % 4 == 3)) {
+            LOG_ERROR("rdb_find(%d) wrong after deleting", i);
+            return TEST_FAIL;
+        }
+    
+    /* Churn through it until it has to compact, which moves everything. */
+    struct file file;
+    uint16_t startpage;
+    int last = 0;
+    
+    if (fs_find_file(&file, "rebble/rdbtest") < 0)
+        return TEST_FAIL;
+    startpage = file.startpage;
+    for (i = 16; i < 1024 && (!last || i < last + 8); i++) {
+        if (_insert(0x100 + i, 40) != 0) {
+            LOG_ERROR("rdb_insert(%d) failed", i);
+            return TEST_FAIL;
+        }
+        
+        int key = 0x100 + i - 4;
+        db = rdb_open(RDB_ID_TEST);
+        if (i >= 20 && (!rdb_find(db, &key, 4, &it) || rdb_delete(&it) != Blob_Success)) {
+            rdb_close(db);
+            LOG_ERROR("rdb_delete(%d) failed", i - 4);
+            return TEST_FAIL;
+        }
+        rdb_close(db);
+        
+        if (!last && fs_find_file(&file, "rebble/rdbtest") >= 0 && file.startpage != startpage)
+            last = i;
+    }
+    
+    if (!last) {
+        LOG_ERROR("never compacted");
+        return TEST_FAIL;
+    }
+    LOG_INFO("compacted after %d records", last);
+    
+    for (int j = 0; j < i; j++)
+        if ((_find(0x100 + j, 40) == 0) != ((j < 16 && j % 4 == 3) || j >= i - 4)) {
+            LOG_ERROR("rdb_find(%d) wrong after compaction", j);
+            return TEST_FAIL;
+        }
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+TEST(rdb_cursor) {
+    struct rdb_database *db;
+    struct rdb_cursor cur;
+    struct rdb_iter it;
+    uint32_t buf[8];
+    int i, n, valid;
+    
+    db = rdb_open(RDB_ID_TEST);
+    for (valid = rdb_iter_start(db, &it); valid; valid = rdb_iter_next(&it))
+        rdb_delete(&it);
+    rdb_close(db);
+    
+    for (i = 0; i < 32; i++)
+        if (_insert(0x300 + i, 16) != 0) {
+            LOG_ERROR("rdb_insert(%d) failed", i);
+            return TEST_FAIL;
+        }
+    
+    /* Byte 0 of each record is (key & 0xFF); take the first half. */
+    uint8_t lim = 0x10;
+    struct rdb_selector selectors[] = {
+        { 0, 1, RDB_OP_LESS, &lim },
+        { 2, 2, RDB_OP_RESULT },
+        { 0, 0, RDB_OP_RESULT_FULLY_LOAD },
+        { }
+    };
+    
+    /* Everything fits, and deleting along the way is fine. */
+    db = rdb_open(RDB_ID_TEST);
+    n = 0;
+    rdb_cursor_start(&cur, db, selectors, buf, sizeof(buf));
+    while (rdb_cursor_next(&cur)) {
+        int key = *(int *)cur.key;
+        uint8_t *full = cur.result[1];
+        
+        if ((key & 0xFF) >= 0x10 || !cur.result[0] || !full ||
+            ((uint8_t *)cur.result[0])[0] != ((key & 0xFF) ^ 2) ||
+            full[15] != ((key & 0xFF) ^ 15)) {
+            LOG_ERROR("cursor returned the wrong thing for key %x", key);
+            rdb_close(db);
+            return TEST_FAIL;
+        }
+        if (rdb_delete(&cur.it) != Blob_Success) {
+            rdb_close(db);
+            return TEST_FAIL;
+        }
+        n++;
+    }
+    rdb_close(db);
+    
+    if (n != 16) {
+        LOG_ERROR("cursor found %d records, not 16", n);
+        return TEST_FAIL;
+    }
+    
+    /* The rest don't fit in a smaller buffer, but the walk still goes on. */
+    lim = 0x20;
+    db = rdb_open(RDB_ID_TEST);
+    n = 0;
+    rdb_cursor_start(&cur, db, selectors, buf, 12);
+    while (rdb_cursor_next(&cur)) {
+        if (!cur.key || !cur.result[0] || cur.result[1]) {
+            LOG_ERROR("cursor filled in the wrong results with a small buffer");
+            rdb_close(db);
+            return TEST_FAIL;
+        }
+        n++;
+    }
+    rdb_close(db);
+    
+    if (n != 16) {
+        LOG_ERROR("cursor found %d remaining records, not 16", n);
+        return TEST_FAIL;
+    }
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+/* The test database is sorted by the first four bytes of data. */
+static int _insert_stamped(int key, uint32_t stamp) {
+    struct rdb_database *db = rdb_open(RDB_ID_TEST);
+    uint32_t val[4] = { stamp, key, 0, 0 };
+    
+    int rv = rdb_insert(db, (void *)&key, 4, (void *)val, sizeof(val));
+    
+    rdb_close(db);
+    
+    return rv != Blob_Success;
+}
+
+/* Checks that a sorted select comes back with n results, in order, all in
+ * range. */
+static int _check_sorted(uint32_t lo, uint32_t hi, int newest_first, int max, int n) {
+    struct rdb_database *db = rdb_open(RDB_ID_TEST);
+    rdb_select_result_list head;
+    struct rdb_select_result *res;
+    int i = 0, ret = 0;
+    uint32_t last = newest_first ? UINT32_MAX : 0;
+    
+    struct rdb_selector selectors[] = {
+        { 0, 4, RDB_OP_RESULT },
+        { }
+    };
+    
+    list_init_head(&head);
+    if (rdb_select_sorted(db, lo, hi, newest_first, max, &head, selectors) != n)
+        ret = 1;
+    rdb_select_result_foreach(res, &head) {
+        uint32_t stamp = *(uint32_t *)res->result[0];
+        
+        if (stamp < lo || stamp > hi || (newest_first ? stamp > last : stamp < last))
+            ret = 2;
+        last = stamp;
+        i++;
+    }
+    if (i != n)
+        ret = 3;
+    
+    rdb_select_free_all(&head);
+    rdb_close(db);
+    
+    if (ret)
+        LOG_ERROR("sorted select %u..%u (%d, max %d) failed: %d", lo, hi, newest_first, max, ret);
+    
+    return ret;
+}
+
+TEST(rdb_sorted) {
+    struct rdb_database *db;
+    struct rdb_iter it;
+    int i, valid;
+    
+    db = rdb_open(RDB_ID_TEST);
+    for (valid = rdb_iter_start(db, &it); valid; valid = rdb_iter_next(&it))
+        rdb_delete(&it);
+    rdb_close(db);
+    
+    /* 20 records, in a scrambled order, stamped 1000 to 1190. */
+    for (i = 0; i < 20; i++)
+        if (_insert_stamped(0x400 + i, 1000 + ((i * 7) % 20) * 10) != 0) {
+            LOG_ERROR("rdb_insert(%d) failed", i);
+            return TEST_FAIL;
+        }
+    
+    if (_check_sorted(0, UINT32_MAX, 0, 0, 20) ||
+        _check_sorted(1050, 1100, 0, 0, 6) ||
+        _check_sorted(1001, UINT32_MAX, 1, 3, 3) ||
+        _check_sorted(2000, 3000, 0, 0, 0))
+        return TEST_FAIL;
+    
+    /* Take out 1050 (key 15). */
+    int key = 0x400 + 15;
+    db = rdb_open(RDB_ID_TEST);
+    if (!rdb_find(db, &key, 4, &it) || rdb_delete(&it) != Blob_Success) {
+        rdb_close(db);
+        return TEST_FAIL;
+    }
+    rdb_close(db);
+    
+    if (_check_sorted(1050, 1100, 0, 0, 5))
+        return TEST_FAIL;
+    
+    /* More than it has room for; it has to sort for itself after this. */
+    for (i = 20; i < 40; i++)
+        if (_insert_stamped(0x400 + i, 500 + i) != 0) {
+            LOG_ERROR("rdb_insert(%d) failed", i);
+            return TEST_FAIL;
+        }
+    
+    if (_check_sorted(0, UINT32_MAX, 0, 0, 39) ||
+        _check_sorted(0, 999, 1, 10, 10) ||
+        _check_sorted(1050, 1100, 0, 0, 5))
+        return TEST_FAIL;
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+static int _count_records(void) {
+    struct rdb_database *db = rdb_open(RDB_ID_TEST);
+    struct rdb_iter it;
+    int n = 0;
+    
+    for (int valid = rdb_iter_start(db, &it); valid; valid = rdb_iter_next(&it))
+        n++;
+    rdb_close(db);
+    
+    return n;
+}
+
+/* Inserts a four-byte value, and returns where the record ended up. */
+static int _insert_word(int key, uint32_t val) {
+    struct rdb_database *db = rdb_open(RDB_ID_TEST);
+    struct rdb_iter it;
+    int ofs = -1;
+    
+    if (rdb_insert(db, (void *)&key, 4, (void *)&val, 4) == Blob_Success &&
+        rdb_find(db, &key, 4, &it))
+        ofs = fs_seek(&it.fd, 0, FS_SEEK_CUR);
+    rdb_close(db);
+    
+    return ofs;
+}
+
+static int _read_word(int key, uint32_t *val) {
+    struct rdb_database *db = rdb_open(RDB_ID_TEST);
+    struct rdb_iter it;
+    int rv = rdb_find(db, &key, 4, &it) && rdb_iter_read_data(&it, 0, val, 4) == 4;
+    
+    rdb_close(db);
+    
+    return !rv;
+}
+
+static int _insert_bytes(int key, const uint8_t *buf, int len) {
+    struct rdb_database *db = rdb_open(RDB_ID_TEST);
+    struct rdb_iter it;
+    int ofs = -1;
+    
+    if (rdb_insert(db, (void *)&key, 4, buf, len) == Blob_Success &&
+        rdb_find(db, &key, 4, &it))
+        ofs = fs_seek(&it.fd, 0, FS_SEEK_CUR);
+    rdb_close(db);
+    
+    return ofs;
+}
+
+/* Checks that key holds exactly buf. */
+static int _check_bytes(int key, const uint8_t *buf, int len) {
+    struct rdb_database *db = rdb_open(RDB_ID_TEST);
+    struct rdb_iter it;
+    uint8_t rd[len];
+    int rv = rdb_find(db, &key, 4, &it) && it.data_len == len &&
+             rdb_iter_read_data(&it, 0, rd, len) == len && !memcmp(rd, buf, len);
+    
+    rdb_close(db);
+    
+    return !rv;
+}
+
+TEST(rdb_overwrite) {
+    struct flash_tag_stats st0[FLASH_TAG_COUNT], st1[FLASH_TAG_COUNT];
+    uint32_t val;
+    int i, ofs0, ofs1;
+    
+    /* Start from nothing, so that no compaction is going on. */
+    fs_unlink("rebble/rdbtest");
+    
+    /* The same value again costs nothing. */
+    if (_insert(0x600, 16) != 0)
+        return TEST_FAIL;
+    flash_get_tag_stats(st0);
+    if (_insert(0x600, 16) != 0)
+        return TEST_FAIL;
+    flash_get_tag_stats(st1);
+    if (st1[FLASH_TAG_RDB].programs != st0[FLASH_TAG_RDB].programs || _count_records() != 1) {
+        LOG_ERROR("rewriting the same value wrote something");
+        return TEST_FAIL;
+    }
+    
+    /* A new value of a different size replaces the old one. */
+    if (_update(0x600, 24) != 0 || _count_records() != 1) {
+        LOG_ERROR("rdb_update(600) didn't replace it");
+        return TEST_FAIL;
+    }
+    
+    /* A small one that only clears bits stays where it is, and the sorted
+     * index follows it... */
+    ofs0 = _insert_word(0x601, 0xFFFF00FF);
+    ofs1 = _insert_word(0x601, 0x0F0F000F);
+    if (ofs0 < 0 || ofs1 != ofs0 || _read_word(0x601, &val) != 0 || val != 0x0F0F000F ||
+        _check_sorted(0xFFFF00FF, 0xFFFF00FF, 0, 0, 0) || _check_sorted(0x0F0F000F, 0x0F0F000F, 0, 0, 1)) {
+        LOG_ERROR("small overwrite didn't happen in place (%d, %d, %08x)", ofs0, ofs1, (unsigned)val);
+        return TEST_FAIL;
+    }
+    
+    /* ... but one that needs a bit back moves. */
+    ofs1 = _insert_word(0x601, 0x1F0F000F);
+    if (ofs1 < 0 || ofs1 == ofs0 || _read_word(0x601, &val) != 0 || val != 0x1F0F000F ||
+        _count_records() != 2 || _check_sorted(0x0F0F000F, 0x0F0F000F, 0, 0, 0) ||
+        _check_sorted(0x1F0F000F, 0x1F0F000F, 0, 0, 1)) {
+        LOG_ERROR("overwrite that sets a bit went wrong (%d, %d, %08x)", ofs0, ofs1, (unsigned)val);
+        return TEST_FAIL;
+    }
+    
+    /* A few bytes in a bigger value can change in place too, as long as
+     * they're in one program page of flash... */
+    uint8_t buf[80];
+    struct rdb_database *db;
+    struct rdb_iter it;
+    int key = 0x602, in_one = -1, across = -1;
+    
+    memset(buf, 0xFF, sizeof(buf));
+    ofs0 = _insert_bytes(0x602, buf, sizeof(buf));
+    db = rdb_open(RDB_ID_TEST);
+    if (ofs0 < 0 || !rdb_find(db, &key, 4, &it)) {
+        rdb_close(db);
+        return TEST_FAIL;
+    }
+    fs_seek(&it.fd, 4 /* header */ + 4 /* key */, FS_SEEK_CUR);
+    for (i = 0; i < sizeof(buf) - 1; i++) {
+        if (fs_in_one_program(&it.fd, 2)) {
+            if (in_one < 0)
+                in_one = i;
+        } else if (across < 0) {
+            across = i;
+        }
+        fs_seek(&it.fd, 1, FS_SEEK_CUR);
+    }
+    rdb_close(db);
+    
+    buf[in_one] = 0x12;
+    buf[in_one + 1] = 0x00;
+    ofs1 = _insert_bytes(0x602, buf, sizeof(buf));
+    if (in_one < 0 || ofs1 != ofs0 || _check_bytes(0x602, buf, sizeof(buf))) {
+        LOG_ERROR("overwrite of a few bytes didn't happen in place (%d, %d)", ofs0, ofs1);
+        return TEST_FAIL;
+    }
+    
+    /* ... and not if they straddle two, which could tear.  (With program
+     * pages this big, there mightn't be two to straddle.) */
+    if (across >= 0) {
+        buf[across] &= 0x0F;
+        buf[across + 1] &= 0x0F;
+        ofs1 = _insert_bytes(0x602, buf, sizeof(buf));
+        if (ofs1 < 0 || ofs1 == ofs0 || _check_bytes(0x602, buf, sizeof(buf)) || _count_records() != 3) {
+            LOG_ERROR("overwrite across program pages went wrong (%d, %d)", ofs0, ofs1);
+            return TEST_FAIL;
+        }
+        ofs0 = ofs1;
+    }
+    
+    /* A shorter value goes in a new record, however it's made up. */
+    ofs1 = _insert_bytes(0x602, buf, 24);
+    if (ofs1 < 0 || ofs1 == ofs0 || _check_bytes(0x602, buf, 24) || _count_records() != 3) {
+        LOG_ERROR("shorter overwrite went wrong (%d, %d)", ofs0, ofs1);
+        return TEST_FAIL;
+    }
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+TEST(rdb_bloom) {
+    struct flash_tag_stats st0[FLASH_TAG_COUNT], st1[FLASH_TAG_COUNT];
+    uint32_t val;
+    int i, scanned = 0;
+    
+    /* Start from nothing, so that the filter does, too; then put in more
+     * keys than the index has room for, so that finding them scans. */
+    fs_unlink("rebble/rdbtest");
+    for (i = 0; i < 40; i++)
+        if (_insert_word(0x800 + i, i) < 0) {
+            LOG_ERROR("rdb_insert(%d) failed", i);
+            return TEST_FAIL;
+        }
+    for (i = 0; i < 40; i++)
+        if (_read_word(0x800 + i, &val) != 0 || val != i) {
+            LOG_ERROR("key %d not found", i);
+            return TEST_FAIL;
+        }
+    
+    /* Most keys that aren't there get ruled out without a scan. */
+    for (i = 0; i < 100; i++) {
+        flash_get_tag_stats(st0);
+        if (_read_word(0x900 + i, &val) == 0) {
+            LOG_ERROR("found key %d, which isn't there", i);
+            return TEST_FAIL;
+        }
+        flash_get_tag_stats(st1);
+        if (st1[FLASH_TAG_RDB].read_bytes != st0[FLASH_TAG_RDB].read_bytes)
+            scanned++;
+    }
+    LOG_INFO("%d of 100 misses had to scan", scanned);
+    if (scanned > 20)
+        return TEST_FAIL;
+    
+    /* A deleted key stays in the filter, but it still isn't found. */
+    if (_delete(0x800) != 0 || _read_word(0x800, &val) == 0)
+        return TEST_FAIL;
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+/* Puts a record on the end of the test database behind rdb's back, the way
+ * that an overwrite leaves one if it loses power before it can erase the
+ * old one. */
+static int _append_raw_word(int key, uint32_t val) {
+    uint8_t hdr[4];
+    struct file file;
+    struct fd fd;
+    
+    if (fs_find_file(&file, "rebble/rdbtest") < 0)
+        return -1;
+    fs_open(&fd, &file);
+    while (fs_read(&fd, hdr, sizeof(hdr)) == sizeof(hdr) && !(hdr[0] == 0xFF && hdr[1] == 0xFF))
+        fs_seek(&fd, hdr[1] + (hdr[2] | hdr[3] << 8), FS_SEEK_CUR);
+    fs_seek(&fd, -(long)sizeof(hdr), FS_SEEK_CUR);
+    
+    hdr[0] = 0xFC; /* header, and then data, written */
+    hdr[1] = 4;
+    hdr[2] = 4;
+    hdr[3] = 0;
+    if (fs_write(&fd, hdr, sizeof(hdr)) != sizeof(hdr) ||
+        fs_write(&fd, &key, 4) != 4 || fs_write(&fd, &val, 4) != 4)
+        return -1;
+    
+    return 0;
+}
+
+TEST(rdb_stale) {
+    struct flash_tag_stats st0[FLASH_TAG_COUNT], st1[FLASH_TAG_COUNT];
+    uint32_t val;
+    int i;
+    
+    /* More keys than the index has room for, and the stale one past the
+     * end of it, so that nothing erases that when the index gets built. */
+    fs_unlink("rebble/rdbtest");
+    for (i = 0; i < 40; i++)
+        if (_insert_word(0xA00 + i, i) < 0) {
+            LOG_ERROR("rdb_insert(%d) failed", i);
+            return TEST_FAIL;
+        }
+    if (_append_raw_word(0xA27, 0x1234) < 0 || _count_records() != 41)
+        return TEST_FAIL;
+    
+    /* The later one wins, and finding it doesn't write anything. */
+    flash_get_tag_stats(st0);
+    if (_read_word(0xA27, &val) != 0 || val != 0x1234) {
+        LOG_ERROR("found the stale copy (%08x)", (unsigned)val);
+        return TEST_FAIL;
+    }
+    flash_get_tag_stats(st1);
+    if (st1[FLASH_TAG_RDB].programs != st0[FLASH_TAG_RDB].programs || _count_records() != 41) {
+        LOG_ERROR("rdb_find wrote to flash");
+        return TEST_FAIL;
+    }
+    
+    /* A compaction leaves the stale one behind. */
+    for (i = 0; i < 1000; i++) {
+        if (_insert_word(0xB00, i) < 0)
+            return TEST_FAIL;
+        if (_count_records() == 41)
+            break;
+    }
+    if (i == 1000 || _read_word(0xA27, &val) != 0 || val != 0x1234 || _read_word(0xB00, &val) != 0 || val != i) {
+        LOG_ERROR("stale copy didn't go in a compaction (%d inserts)", i);
+        return TEST_FAIL;
+    }
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+/* Like _read_word, but from one file of the per-app persist database. */
+static int _read_file_word(const char *file, int key, uint32_t *val) {
+    struct rdb_database *db = rdb_open_file(RDB_ID_APP_PERSIST, file);
+    struct rdb_iter it;
+    int rv = db && rdb_find(db, &key, 4, &it) && rdb_iter_read_data(&it, 0, val, 4) == 4;
+    
+    if (db)
+        rdb_close(db);
+    
+    return !rv;
+}
+
+TEST(rdb_files) {
+    static const char *files[] = { "rdbtest/a", "rdbtest/b" };
+    struct rdb_database *db;
+    struct rdb_iter it;
+    uint32_t val;
+    int i, f;
+    
+    for (f = 0; f < 2; f++)
+        rdb_delete_file(RDB_ID_APP_PERSIST, files[f]);
+    
+    /* It doesn't have a file of its own. */
+    if (rdb_open(RDB_ID_APP_PERSIST) != NULL)
+        return TEST_FAIL;
+    
+    /* The same keys in each file, with different values. */
+    for (f = 0; f < 2; f++) {
+        db = rdb_open_file(RDB_ID_APP_PERSIST, files[f]);
+        if (!db)
+            return TEST_FAIL;
+        for (i = 0; i < 10 - 5 * f; i++) {
+            val = 100 * f + i;
+            if (rdb_insert(db, (void *)&i, 4, (void *)&val, 4) != Blob_Success) {
+                LOG_ERROR("rdb_insert(%d) in %s failed", i, files[f]);
+                rdb_close(db);
+                return TEST_FAIL;
+            }
+        }
+        rdb_close(db);
+    }
+    
+    /* Each only sees its own, going back and forth between them. */
+    for (i = 0; i < 10; i++)
+        for (f = 0; f < 2; f++) {
+            int found = _read_file_word(files[f], i, &val) == 0;
+            
+            if (found != (i < 10 - 5 * f) || (found && val != 100 * f + i)) {
+                LOG_ERROR("key %d in %s: found %d, val %d", i, files[f], found, (int)val);
+                return TEST_FAIL;
+            }
+        }
+    
+    /* Deleting one, while it's open or not, leaves the other alone. */
+    for (f = 0; f < 2; f++) {
+        if (rdb_delete_file(RDB_ID_APP_PERSIST, files[f]) != Blob_Success)
+            return TEST_FAIL;
+        db = rdb_open_file(RDB_ID_APP_PERSIST, files[f]);
+        if (rdb_iter_start(db, &it)) {
+            LOG_ERROR("%s still has records", files[f]);
+            rdb_close(db);
+            return TEST_FAIL;
+        }
+        rdb_close(db);
+        if (f == 0 && (_read_file_word(files[1], 3, &val) != 0 || val != 103))
+            return TEST_FAIL;
+    }
+    if (rdb_delete_file(RDB_ID_APP_PERSIST, files[0]) != Blob_KeyDoesNotExist)
+        return TEST_FAIL;
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+static int _txn_insert(struct rdb_txn *txn, int key, int dsize) {
+    uint8_t val[dsize];
+    
+    for (int i = 0; i < dsize; i++)
+        val[i] = (key & 0xFF) ^ i;
+    
+    return rdb_txn_insert(txn, (void *)&key, 4, val, dsize);
+}
+
+TEST(rdb_txn) {
+    struct rdb_database *db;
+    struct rdb_txn txn;
+    struct rdb_iter it;
+    uint8_t status[RDB_TXN_MAX_OPS];
+    int i, n, valid, key;
+    
+    db = rdb_open(RDB_ID_TEST);
+    for (valid = rdb_iter_start(db, &it); valid; valid = rdb_iter_next(&it))
+        rdb_delete(&it);
+    rdb_close(db);
+    
+    if (_insert(0x500, 16) != 0)
+        return TEST_FAIL;
+    
+    /* One batch, that checks each op against the ones before it. */
+    static const uint8_t expect[] = {
+        Blob_Success, Blob_Success, Blob_Success, Blob_Success,
+        Blob_Success, Blob_Success, Blob_Success, Blob_Success,
+        Blob_Success,         /* 0x500 gets replaced, */
+        Blob_Success,         /* and then deleted, */
+        Blob_Success,         /* and put back. */
+        Blob_Success,         /* 0x509 goes in, */
+        Blob_Success,         /* and straight back out again, */
+        Blob_KeyDoesNotExist, /* so it can't go twice, */
+        Blob_KeyDoesNotExist, /* and 0x50A was never there. */
+    };
+    
+    db = rdb_open(RDB_ID_TEST);
+    rdb_txn_begin(&txn, db);
+    for (i = 1; i <= 8; i++)
+        _txn_insert(&txn, 0x500 + i, 16);
+    _txn_insert(&txn, 0x500, 16);
+    key = 0x500;
+    rdb_txn_delete(&txn, (void *)&key, 4);
+    _txn_insert(&txn, 0x500, 16);
+    _txn_insert(&txn, 0x509, 16);
+    key = 0x509;
+    rdb_txn_delete(&txn, (void *)&key, 4);
+    rdb_txn_delete(&txn, (void *)&key, 4);
+    key = 0x50A;
+    rdb_txn_delete(&txn, (void *)&key, 4);
+    
+    if (rdb_txn_commit(&txn, status) != Blob_Success) {
+        LOG_ERROR("rdb_txn_commit failed");
+        rdb_close(db);
+        return TEST_FAIL;
+    }
+    rdb_close(db);
+    
+    for (i = 0; i < sizeof(expect); i++)
+        if (status[i] != expect[i]) {
+            LOG_ERROR("rdb_txn op %d returned %d, should be %d", i, status[i], expect[i]);
+            return TEST_FAIL;
+        }
+    
+    /* The index knows about them, and so does a scan. */
+    for (i = 0; i <= 8; i++)
+        if (_find(0x500 + i, 16) != 0 || _retrieve(0x500 + i, 16, 0) != 0) {
+            LOG_ERROR("rdb_txn lost key %x", 0x500 + i);
+            return TEST_FAIL;
+        }
+    if (_find(0x509, 16) == 0) {
+        LOG_ERROR("rdb_txn inserted a key that it deleted");
+        return TEST_FAIL;
+    }
+    
+    db = rdb_open(RDB_ID_TEST);
+    n = 0;
+    for (valid = rdb_iter_start(db, &it); valid; valid = rdb_iter_next(&it))
+        n++;
+    rdb_close(db);
+    if (n != 9) {
+        LOG_ERROR("rdb_txn left %d records, not 9", n);
+        return TEST_FAIL;
+    }
+    
+    /* Replacing one that's on flash leaves just the new one. */
+    db = rdb_open(RDB_ID_TEST);
+    rdb_txn_begin(&txn, db);
+    _txn_insert(&txn, 0x501, 8);
+    if (rdb_txn_commit(&txn, status) != Blob_Success || status[0] != Blob_Success) {
+        rdb_close(db);
+        return TEST_FAIL;
+    }
+    n = 0;
+    for (valid = rdb_iter_start(db, &it); valid; valid = rdb_iter_next(&it))
+        n++;
+    rdb_close(db);
+    if (n != 9 || _find(0x501, 8) != 0 || _retrieve(0x501, 8, 0) != 0) {
+        LOG_ERROR("rdb_txn didn't replace key 501");
+        return TEST_FAIL;
+    }
+    
+    /* Nothing happens without a commit. */
+    db = rdb_open(RDB_ID_TEST);
+    rdb_txn_begin(&txn, db);
+    _txn_insert(&txn, 0x50B, 16);
+    rdb_txn_abort(&txn);
+    rdb_close(db);
+    if (_find(0x50B, 16) == 0)
+        return TEST_FAIL;
+    
+    /* Things in the batch can be deleted one at a time, like any other. */
+    if (_delete(0x504) != 0 || _find(0x504, 16) == 0 || _find(0x505, 16) != 0)
+        return TEST_FAIL;
+    
+    /* A commit that doesn't fit deletes nothing, either.  The file is
+     * already bigger than the database's default size, so it won't grow to
+     * take something bigger than itself. */
+    struct file file;
+    
+    if (fs_find_file(&file, "rebble/rdbtest") < 0)
+        return TEST_FAIL;
+    n = file.size + 1;
+    db = rdb_open(RDB_ID_TEST);
+    rdb_txn_begin(&txn, db);
+    key = 0x506;
+    rdb_txn_delete(&txn, (void *)&key, 4);
+    _txn_insert(&txn, 0x50C, n);
+    if (rdb_txn_commit(&txn, status) != Blob_DatabaseFull || status[0] != Blob_DatabaseFull) {
+        LOG_ERROR("rdb_txn fit a batch that's bigger than the database");
+        rdb_close(db);
+        return TEST_FAIL;
+    }
+    rdb_close(db);
+    if (_find(0x506, 16) != 0 || _retrieve(0x506, 16, 0) != 0 || _find(0x50C, n) == 0) {
+        LOG_ERROR("rdb_txn deleted key 506 from a batch that failed");
+        return TEST_FAIL;
+    }
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
+/* Writes a value that's different for each gen, so that it never gets
+ * skipped as unchanged. */
+static int _insert_gen(int key, int gen, int dsize) {
+    struct rdb_database *db = rdb_open(RDB_ID_TEST);
+    uint8_t val[dsize];
+    
+    for (int i = 0; i < dsize; i++)
+        val[i] = (key ^ gen ^ i) & 0xFF;
+    int rv = rdb_insert(db, (void *)&key, 4, val, dsize);
+    rdb_close(db);
+    
+    return rv != Blob_Success;
+}
+
+static int _check_gen(int key, int gen, int dsize) {
+    struct rdb_database *db = rdb_open(RDB_ID_TEST);
+    struct rdb_iter it;
+    uint8_t rd[dsize];
+    int ret = 0;
+    
+    if (!rdb_find(db, &key, 4, &it) || it.data_len != dsize || rdb_iter_read_data(&it, 0, rd, dsize) != dsize)
+        ret = 1;
+    for (int i = 0; i < dsize && !ret; i++)
+        if (rd[i] != ((key ^ gen ^ i) & 0xFF))
+            ret = 2;
+    rdb_close(db);
+    
+    return ret;
+}
+
+TEST(rdb_compact) {
+    struct flash_tag_stats st0[FLASH_TAG_COUNT], st1[FLASH_TAG_COUNT];
+    struct rdb_database *db;
+    struct rdb_iter it;
+    struct file file;
+    int i, valid;
+    
+    /* A working set of records that get rewritten over and over, which
+     * leaves a lot to compact, and a lot worth keeping. */
+    const int nkeys = 20, dsize = 192;
+    const int rec = 4 + 4 + dsize;
+    int gen[nkeys];
+    
+    db = rdb_open(RDB_ID_TEST);
+    for (valid = rdb_iter_start(db, &it); valid; valid = rdb_iter_next(&it))
+        rdb_delete(&it);
+    rdb_close(db);
+    
+    for (i = 0; i < nkeys; i++) {
+        gen[i] = 0;
+        if (_insert_gen(0x700 + i, 0, dsize) != 0)
+            return TEST_FAIL;
+    }
+    
+    /* Each rewrite should only ever pay for a slice of a compaction, never
+     * for a whole one: its own record, the step, the one record that the
+     * step can run over by, and what the filesystem writes to swap the
+     * files over. */
+    uint16_t startpage;
+    int compactions = 0, max_bytes = 0, max_ticks = 0;
+    uint32_t bytes = 0, t0 = xTaskGetTickCount();
+    
+    if (fs_find_file(&file, "rebble/rdbtest") < 0)
+        return TEST_FAIL;
+    startpage = file.startpage;
+    for (i = 0; i < 1000 && compactions < 3; i++) {
+        int k = i % nkeys;
+        uint32_t t = xTaskGetTickCount();
+        
+        flash_get_tag_stats(st0);
+        if (_insert_gen(0x700 + k, ++gen[k], dsize) != 0) {
+            LOG_ERROR("rdb_insert(%d) failed", i);
+            return TEST_FAIL;
+        }
+        flash_get_tag_stats(st1);
+        
+        int n = st1[FLASH_TAG_RDB].program_bytes - st0[FLASH_TAG_RDB].program_bytes;
+        bytes += n;
+        if (n > max_bytes)
+            max_bytes = n;
+        if (xTaskGetTickCount() - t > max_ticks)
+            max_ticks = xTaskGetTickCount() - t;
+        
+        if (fs_find_file(&file, "rebble/rdbtest") >= 0 && file.startpage != startpage) {
+            startpage = file.startpage;
+            compactions++;
+        }
+    }
+    t0 = xTaskGetTickCount() - t0;
+    
+    LOG_INFO("%d rewrites, %d compactions: %d bytes written in %d ms; longest took %d bytes, %d ms",
+             i, compactions, (int)bytes, (int)t0, max_bytes, max_ticks);
+    if (compactions < 3) {
+        LOG_ERROR("never compacted");
+        return TEST_FAIL;
+    }
+    if (max_bytes > RDB_COMPACT_STEP + 4 * rec + 256 || max_bytes >= nkeys * rec) {
+        LOG_ERROR("a rewrite wrote %d bytes, which is too many", max_bytes);
+        return TEST_FAIL;
+    }
+    
+    for (i = 0; i < nkeys; i++)
+        if (_check_gen(0x700 + i, gen[i], dsize) != 0) {
+            LOG_ERROR("key %d wrong after compaction", i);
+            return TEST_FAIL;
+        }
+    if (_count_records() != nkeys) {
+        LOG_ERROR("%d records after compaction, not %d", _count_records(), nkeys);
+        return TEST_FAIL;
+    }
+    
+    /* Deletes while it's going on have to stick, whichever side of the
+     * copying they land on. */
+    for (i = 0; i < 200 && compactions < 5; i++) {
+        int k = i % nkeys;
+        
+        if (_insert_gen(0x700 + k, ++gen[k], dsize) != 0)
+            return TEST_FAIL;
+        if (i % 7 == 0 && _delete(0x700 + (i * 3) % nkeys) == 0)
+            gen[(i * 3) % nkeys] = -1;
+        
+        if (fs_find_file(&file, "rebble/rdbtest") >= 0 && file.startpage != startpage) {
+            startpage = file.startpage;
+            compactions++;
+        }
+    }
+    
+    for (i = 0; i < nkeys; i++) {
+        int rv = _check_gen(0x700 + i, gen[i], dsize);
+        
+        if (gen[i] < 0 ? rv != 1 : rv != 0) {
+            LOG_ERROR("key %d wrong after deleting while compacting", i);
+            return TEST_FAIL;
+        }
+    }
+    
+    *artifact = 0;
+    return TEST_PASS;
+}
+
 #endif
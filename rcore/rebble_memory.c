@@ -78,6 +78,17 @@ struct mem_heap mem_heaps[HEAP_MAX] = {
     [HEAP_WORKER]  = { _heap_worker,  MEMORY_SIZE_WORKER_HEAP } 
 };
 
+/* With MEM_HEAP_TRACE defined, every allocation on the app heap gets logged,
+ * in a form that tests/hostsim/qbench can replay. */
+#ifdef MEM_HEAP_TRACE
+#define _TRACE(heap, fmt_, ...) do { \
+    if ((heap) == &mem_heaps[HEAP_APP]) \
+        KERN_LOG("mem", APP_LOG_LEVEL_INFO, "qtrace " fmt_, ##__VA_ARGS__); \
+} while (0)
+#else
+#define _TRACE(heap, fmt_, ...) do { } while (0)
+#endif
+
 void mem_init() {
     mem_heap_init(&mem_heaps[HEAP_SYSTEM]);
     mem_heap_init(&mem_heaps[HEAP_LOWPRIO]);
@@ -99,6 +110,7 @@ void *mem_heap_realloc(struct mem_heap *heap, void *p, size_t newsz) {
     xSemaphoreTake(heap->mutex, portMAX_DELAY);
     void *rp = qrealloc(heap->arena, p, newsz);
     xSemaphoreGive(heap->mutex);
+    _TRACE(heap, "r %p %p %d", p, rp, (int)newsz);
 
     return rp;
 }
@@ -109,6 +121,7 @@ void mem_heap_free(struct mem_heap *heap, void *p) {
     xSemaphoreTake(heap->mutex, portMAX_DELAY);
     qfree(heap->arena, p);
     xSemaphoreGive(heap->mutex);
+    _TRACE(heap, "f %p", p);
 }
 
 void mem_thread_set_heap(struct mem_heap *heap) {
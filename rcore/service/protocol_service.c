@@ -58,6 +58,13 @@ void rebble_protocol_init()
     protocol_init();
 }
 
+/* Packet handlers run on the rx thread; this is for the ones that keep
+ * state from one packet to the next to check that nobody else is in. */
+int protocol_service_is_rx_thread(void)
+{
+    return xTaskGetCurrentTaskHandle() == THREAD_HANDLE(rx);
+}
+
 static void _thread_protocol_rx()
 {
     AppMessage am;
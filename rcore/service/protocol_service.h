@@ -3,6 +3,7 @@
 typedef struct rebble_packet rebble_packet;
 
 void rebble_protocol_init();
+int protocol_service_is_rx_thread(void);
 RebblePacket packet_create(uint16_t endpoint, uint16_t size);
 RebblePacket packet_create_with_data(uint16_t endpoint, uint8_t *data, uint16_t length);
 void packet_destroy(RebblePacket packet);
@@ -207,20 +207,18 @@ rdb_select_result_list *timeline_notifications(uint32_t from_timestamp)
     list_init_head(head);
     
     struct rdb_database *db = rdb_open(RDB_ID_NOTIFICATION);
-    struct rdb_iter it;
-    
-    if (rdb_iter_start(db, &it) == 0)
-        return head;
     
     struct rdb_selector selectors[] = {
-        { offsetof(timeline_item, timestamp), FIELD_SIZEOF(timeline_item, timestamp), RDB_OP_GREATER, &from_timestamp },
         { offsetof(timeline_item, timeline_type), FIELD_SIZEOF(timeline_item, timeline_type), RDB_OP_EQ, &val_type },
         { offsetof(timeline_item, uuid), FIELD_SIZEOF(timeline_item, uuid), RDB_OP_RESULT },
         { offsetof(timeline_item, timestamp), FIELD_SIZEOF(timeline_item, timestamp), RDB_OP_RESULT },
         { }
     };
     
-    rdb_select(&it, head, selectors);
+    /* The notification database is sorted by timestamp, so this only
+     * touches the ones that are new enough, oldest first. */
+    if (from_timestamp != UINT32_MAX)
+        rdb_select_sorted(db, from_timestamp + 1, UINT32_MAX, 0, 0, head, selectors);
     
     rdb_close(db);
 
@@ -229,28 +227,19 @@ rdb_select_result_list *timeline_notifications(uint32_t from_timestamp)
 
 rebble_notification *timeline_get_notification(Uuid *uuid)
 {
-    rdb_select_result_list head;
-    list_init_head(&head);
-    
     struct rdb_database *db = rdb_open(RDB_ID_NOTIFICATION);
     struct rdb_iter it;
     
-    if (rdb_iter_start(db, &it) == 0)
-        assert(!"rdb open on notif db failed");
-
-    struct rdb_selector selectors[] = {
-        { RDB_SELECTOR_OFFSET_KEY, sizeof(Uuid), RDB_OP_EQ, uuid },
-        { 0, 0, RDB_OP_RESULT_FULLY_LOAD },
-        { }
-    };
-    
-    if (rdb_select(&it, &head, selectors) != 1)
+    if (!rdb_find(db, uuid, sizeof(Uuid), &it))
         assert(!"get_notification on nonexistant notif uuid");
     
-    struct rdb_select_result *res = rdb_select_result_head(&head);
-    rebble_notification *notif = timeline_item_process(res->result[0]);
+    void *data = calloc(1, it.data_len);
+    assert(data);
+    if (rdb_iter_read_data(&it, 0, data, it.data_len) != it.data_len)
+        assert(!"get_notification failed to read notif");
+    rebble_notification *notif = timeline_item_process(data);
 
-    rdb_select_free_all(&head);
+    free(data);
     rdb_close(db);
 
     return notif;
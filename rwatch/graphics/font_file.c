@@ -69,19 +69,23 @@ n_GGlyphInfo * n_graphics_font_get_glyph_info(struct file *font, uint32_t codepo
         goto readglyph;
     }
     
-    /* It exists, so we find it in the offset table. */
+    /* It exists, so we find it in the offset table -- in place, if the
+     * flash lets us, rather than an entry at a time. */
     fs_seek(&fd, loc + hash_data.offset_table_offset, FS_SEEK_SET);
-    uint8_t offset_entry[8]; /* 4 bytes max for codepoint, 4 bytes max for glyph offset */
+    uint8_t offset_entry[8] = { 0 }; /* 4 bytes max for codepoint, 4 bytes max for glyph offset */
 
-    uint16_t iters = 0; // theoretical possibility of 255 entries in an offset
-                        // table mean that we can't use a uint8 for safety
-    do {
-        fs_read(&fd, offset_entry, offset_table_item_length);
-        iters++;
-    } while ((codepoint_bytes == 2
-                 ? *((uint16_t *) offset_entry)
-                 : *((uint32_t *) offset_entry)) != codepoint &&
-              iters <= hash_data.offset_table_size);
+    struct fs_mapping map;
+    const uint8_t *bucket = fs_map(&fd, &map, NULL, offset_table_item_length * hash_data.offset_table_size);
+    if (bucket) {
+        for (uint16_t i = 0; i < hash_data.offset_table_size; i++) {
+            memcpy(offset_entry, bucket + i * offset_table_item_length, offset_table_item_length);
+            if ((codepoint_bytes == 2
+                    ? *((uint16_t *) offset_entry)
+                    : *((uint32_t *) offset_entry)) == codepoint)
+                break;
+        }
+        fs_unmap(&map);
+    }
 
     if ((codepoint_bytes == 2
             ? *((uint16_t *) offset_entry)
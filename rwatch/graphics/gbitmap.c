@@ -13,34 +13,43 @@
 #include "fs.h"
 
 /*
- * Load a resource into the GBitmap by resource id
+ * Decode a PNG resource out of a copy in RAM.  Decoding it straight out of a
+ * flash mapping would hold off every flash program and erase until the
+ * decode was done.
  */
-GBitmap *gbitmap_create_with_resource(uint32_t resource_id)
+static GBitmap *_gbitmap_create_with_file(struct file *file)
 {
-    struct file file;
-    void *png_data;
+    uint8_t *png_data;
     size_t png_data_size;
+    GBitmap *bitmap;
     
-    resource_file(&file, resource_get_handle_system(resource_id));
-    png_data = resource_fully_load_file(&file, &png_data_size);
+    png_data = resource_fully_load_file(file, &png_data_size);
     if (!png_data)
         return NULL;
 
-    return gbitmap_create_from_png_data(png_data, png_data_size);
+    bitmap = gbitmap_create_from_png_data(png_data, png_data_size);
+    app_free(png_data);
+    
+    return bitmap;
+}
+
+/*
+ * Load a resource into the GBitmap by resource id
+ */
+GBitmap *gbitmap_create_with_resource(uint32_t resource_id)
+{
+    struct file file;
+    
+    resource_file(&file, resource_get_handle_system(resource_id));
+    return _gbitmap_create_with_file(&file);
 }
 
 GBitmap *gbitmap_create_with_resource_app(uint32_t resource_id, const struct file *ifile)
 {
     struct file file;
-    void *png_data;
-    size_t png_data_size;
     
     resource_file_from_file_handle(&file, ifile, resource_get_handle(resource_id));
-    png_data = resource_fully_load_file(&file, &png_data_size);
-    if (!png_data)
-        return NULL;
-
-    return gbitmap_create_from_png_data(png_data, png_data_size);
+    return _gbitmap_create_with_file(&file);
 }
 
 /*
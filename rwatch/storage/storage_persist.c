@@ -7,72 +7,552 @@
 #include "rebbleos.h"
 #include "rdb.h"
 #include "storage_persist.h"
+#include "storage_persist_internal.h"
 #include "appmanager_thread.h"
 
 #define MODULE_NAME "stor"
 #define MODULE_TYPE "RWAT"
 #define LOG_LEVEL RBL_LOG_LEVEL_DEBUG //RBL_LOG_LEVEL_ERROR
 
-#define PERSIST_MAX_STORAGE_BYTES 4096
+/*** Files. ***/
 
+/* Each app's values are in a file of their own, named for its UUID, which
+ * is too long for a filename in hex; so it's in URL-safe base64 instead. */
+#define PERSIST_FILE_PREFIX "persist/"
+#define PERSIST_FILE_NAME_LEN (sizeof(PERSIST_FILE_PREFIX) - 1 + 22)
+
+static const char _persist_b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static void _persist_file_name(char *name, const Uuid *uuid)
+{
+    const uint8_t *p = (const uint8_t *)uuid;
+    uint32_t bits = 0;
+    int nbits = 0;
+    
+    strcpy(name, PERSIST_FILE_PREFIX);
+    name += sizeof(PERSIST_FILE_PREFIX) - 1;
+    for (int i = 0; i < UUID_SIZE; i++) {
+        bits = (bits << 8) | p[i];
+        nbits += 8;
+        for (; nbits >= 6; nbits -= 6)
+            *name++ = _persist_b64[(bits >> (nbits - 6)) & 63];
+    }
+    *name++ = _persist_b64[(bits << (6 - nbits)) & 63];
+    *name = 0;
+}
+
+/* The other way round; returns false if it isn't one of ours. */
+static int _persist_file_uuid(const char *name, Uuid *uuid)
+{
+    uint8_t *p = (uint8_t *)uuid;
+    uint32_t bits = 0;
+    int nbits = 0, n = 0;
+    
+    if (strlen(name) != PERSIST_FILE_NAME_LEN || strncmp(name, PERSIST_FILE_PREFIX, sizeof(PERSIST_FILE_PREFIX) - 1))
+        return 0;
+    
+    for (name += sizeof(PERSIST_FILE_PREFIX) - 1; *name; name++) {
+        const char *c = strchr(_persist_b64, *name);
+        if (!c)
+            return 0;
+        bits = (bits << 6) | (c - _persist_b64);
+        nbits += 6;
+        if (nbits >= 8 && n < UUID_SIZE) {
+            nbits -= 8;
+            p[n++] = bits >> nbits;
+        }
+    }
+    
+    return n == UUID_SIZE;
+}
+
+/* What every app's values went in, before they each had a file. */
 typedef struct app_persist_key_t {
     Uuid appid;
     uint32_t key;
 } app_persist_key;
 
-static void _create_composite_key(app_persist_key *c_key, uint32_t key)
+/*** Write-back cache. ***/
+
+/* The values that the running app has touched are kept here, in the system
+ * heap, so that reading one again doesn't go back to flash, and writing one
+ * just changes it here.  Whatever has changed goes out to the app's file
+ * together, in a transaction: when the app quits, or is killed, or
+ * PERSIST_FLUSH_MS after the first change, whichever comes first -- so a
+ * crash can lose at most that much.  Only the main app's thread keeps things in the cache
+ * between calls; a worker's calls write through, and leave it empty, so
+ * that the two never see different values.
+ *
+ * The list only ever changes with the scheduler held off, so even if the
+ * app is killed while it holds the cache, what's on it is whole, and can be
+ * thrown away. */
+
+struct persist_ent {
+    list_node node;
+    uint32_t key;
+    int16_t len; /* -1 if the key doesn't exist */
+    uint8_t dirty; /* 2 once it's staged in a transaction */
+    uint8_t data[];
+};
+
+static struct {
+    list_head ents; /* most recently used first */
+    Uuid appid;
+    char file[FS_NAME_MAX + 1];
+    size_t bytes;
+    int ndirty;
+    int armed;
+    CoreTimer timer;
+    TaskHandle_t app_task; /* the main app's, to tell if it died holding the mutex */
+    SemaphoreHandle_t mutex;
+    StaticSemaphore_t mutex_buf;
+} _cache;
+
+static void _persist_lock(void)
 {
-    struct App *app = appmanager_get_current_app();
-    assert(app);
-    c_key->key = key;
-    memcpy(c_key, &app->uuid, UUID_SIZE);
+    /* Avoid race on mutex setup. */
+    taskENTER_CRITICAL();
+    if (!_cache.mutex) {
+        _cache.mutex = xSemaphoreCreateMutexStatic(&_cache.mutex_buf);
+        list_init_head(&_cache.ents);
+    }
+    taskEXIT_CRITICAL();
+    
+    xSemaphoreTake(_cache.mutex, portMAX_DELAY);
 }
 
-bool persist_exists(const uint32_t key)
+static void _persist_unlock(void)
 {
-    char buffer[1];
-    return persist_read(key, buffer, 1) == 1;
+    xSemaphoreGive(_cache.mutex);
 }
 
-int persist_get_size(const uint32_t key)
+#ifdef REBBLEOS_TESTING
+/* The tests aren't an app, so they stand in for one with this. */
+static app_running_thread *_persist_test_thread;
+#endif
+
+static app_running_thread *_persist_thread(void)
 {
-    struct rdb_iter it;
-    rdb_select_result_list head;
-    list_init_head(&head);
+#ifdef REBBLEOS_TESTING
+    if (_persist_test_thread)
+        return _persist_test_thread;
+#endif
+    return appmanager_get_current_thread();
+}
+
+static void _persist_free(struct persist_ent *ent)
+{
+    taskENTER_CRITICAL();
+    list_remove(&_cache.ents, &ent->node);
+    _cache.bytes -= sizeof(struct persist_ent) + (ent->len > 0 ? ent->len : 0);
+    if (ent->dirty)
+        _cache.ndirty--;
+    taskEXIT_CRITICAL();
+    mem_heap_free(&mem_heaps[HEAP_SYSTEM], ent);
+}
+
+static void _persist_drop(void)
+{
+    list_node *n;
+    
+    while ((n = list_get_head(&_cache.ents)))
+        _persist_free(list_elem(n, struct persist_ent, node));
+}
+
+/* Marks what was staged as clean, if it went through, or as still dirty, if
+ * not. */
+static void _persist_staged(int ok)
+{
+    struct persist_ent *ent;
     
-    struct rdb_database *db = rdb_open(RDB_ID_APP_PERSIST);
+    list_foreach(ent, &_cache.ents, struct persist_ent, node) {
+        if (ent->dirty != 2)
+            continue;
+        ent->dirty = !ok;
+        if (ok)
+            _cache.ndirty--;
+    }
+}
+
+/* Writes everything that has changed out to the database. */
+static int _persist_flush(void)
+{
+    struct persist_ent *ent;
+    struct rdb_txn txn;
+    int rv = Blob_Success;
+    
+    if (!_cache.ndirty)
+        return S_SUCCESS;
+    
+    struct rdb_database *db = rdb_open_file(RDB_ID_APP_PERSIST, _cache.file);
     assert(db);
     
-    int rv = rdb_iter_start(db, &it);
-    if (!rv) {
+    if (rdb_create(db) != Blob_Success) {
         rdb_close(db);
+        LOG_ERROR("persist: no room to write back %d values", _cache.ndirty);
+        return E_OUT_OF_STORAGE;
+    }
+    
+    rdb_txn_begin(&txn, db);
+    list_foreach(ent, &_cache.ents, struct persist_ent, node) {
+        if (!ent->dirty)
+            continue;
+        
+        for (;;) {
+            if (ent->len < 0)
+                rv = rdb_txn_delete(&txn, (uint8_t *)&ent->key, sizeof(uint32_t));
+            else
+                rv = rdb_txn_insert(&txn, (uint8_t *)&ent->key, sizeof(uint32_t), ent->data, ent->len);
+            if (rv != Blob_TryLater || txn.nops == 0)
+                break;
+            
+            /* That one's full; send it, and start another. */
+            rv = rdb_txn_commit(&txn, NULL);
+            _persist_staged(rv == Blob_Success);
+            if (rv != Blob_Success)
+                break;
+            rdb_txn_begin(&txn, db);
+        }
+        if (rv != Blob_Success)
+            break;
+        ent->dirty = 2;
+    }
+    
+    if (rv == Blob_Success)
+        rv = rdb_txn_commit(&txn, NULL);
+    else
+        rdb_txn_abort(&txn);
+    _persist_staged(rv == Blob_Success);
+    
+    rdb_close(db);
+    
+    if (rv != Blob_Success) {
+        LOG_ERROR("persist: write back failed: %d", rv);
         return E_ERROR;
     }
+    return S_SUCCESS;
+}
+
+static void _persist_timer(CoreTimer *timer)
+{
+    /* The timer's already off the list by now. */
+    _persist_lock();
+    _cache.armed = 0;
+    _persist_flush();
+    _persist_unlock();
+}
+
+/* Locks the cache for the calling app, emptying it first if it was some
+ * other app's. */
+static void _persist_begin(void)
+{
+    app_running_thread *thread = _persist_thread();
+    App *app = thread->app;
+    assert(app);
     
-    app_persist_key c_key;
-    _create_composite_key(&c_key, key);
+    if (thread->thread_type == AppThreadMainApp)
+        _cache.app_task = xTaskGetCurrentTaskHandle();
+    _persist_lock();
+    if (!_cache.file[0] || !uuid_equal(&app->uuid, &_cache.appid)) {
+        _persist_flush();
+        _persist_drop();
+        memcpy(&_cache.appid, &app->uuid, UUID_SIZE);
+        _persist_file_name(_cache.file, &app->uuid);
+    }
+}
+
+static void _persist_end(void)
+{
+    app_running_thread *thread = _persist_thread();
     
-    struct rdb_selector selectors[] = {
-        { RDB_SELECTOR_OFFSET_KEY, sizeof(app_persist_key) , RDB_OP_EQ, &c_key },
-        { }
-    };
+    if (thread->thread_type != AppThreadMainApp) {
+        _persist_flush();
+        _persist_drop();
+    } else if (_cache.ndirty && !_cache.armed) {
+        _cache.timer.when = xTaskGetTickCount() + pdMS_TO_TICKS(PERSIST_FLUSH_MS);
+        _cache.timer.callback = _persist_timer;
+        appmanager_timer_add(&thread->timer_head, &_cache.timer);
+        _cache.armed = 1;
+    }
+    _persist_unlock();
+}
+
+static struct persist_ent *_persist_lookup(uint32_t key)
+{
+    struct persist_ent *ent;
     
-    int n = rdb_select(&it, &head, selectors);
-    if (!n)
-        return  E_DOES_NOT_EXIST;
+    list_foreach(ent, &_cache.ents, struct persist_ent, node)
+        if (ent->key == key) {
+            taskENTER_CRITICAL();
+            list_remove(&_cache.ents, &ent->node);
+            list_insert_head(&_cache.ents, &ent->node);
+            taskEXIT_CRITICAL();
+            return ent;
+        }
     
-    struct rdb_select_result *res = rdb_select_result_head(&head);
+    return NULL;
+}
+
+/* Evicts the least recently used clean values (after writing back the
+ * dirty ones, if it has to) until there's room for another of len bytes;
+ * all but keep, which the caller is still holding on to. */
+static int _persist_make_room(int len, struct persist_ent *keep)
+{
+    size_t need = sizeof(struct persist_ent) + (len > 0 ? len : 0);
+    list_node *n, *prev;
+    int rv;
     
-    if (!rdb_delete(&res->it)) {
-        rdb_close(db);
-        return E_ERROR;
+    for (n = list_get_tail(&_cache.ents); n && _cache.bytes + need > PERSIST_MAX_STORAGE_BYTES; n = prev) {
+        struct persist_ent *ent = list_elem(n, struct persist_ent, node);
+        
+        prev = list_get_prev(&_cache.ents, n);
+        if (ent == keep)
+            continue;
+        if (ent->dirty) {
+            if ((rv = _persist_flush()) != S_SUCCESS)
+                return rv;
+            prev = list_get_tail(&_cache.ents);
+            continue;
+        }
+        _persist_free(ent);
+    }
+    
+    return S_SUCCESS;
+}
+
+static struct persist_ent *_persist_new(uint32_t key, int len)
+{
+    struct persist_ent *ent = mem_heap_alloc(&mem_heaps[HEAP_SYSTEM], sizeof(struct persist_ent) + (len > 0 ? len : 0));
+    if (!ent)
+        return NULL;
+    
+    ent->key = key;
+    ent->len = len;
+    ent->dirty = 0;
+    list_init_node(&ent->node);
+    taskENTER_CRITICAL();
+    list_insert_head(&_cache.ents, &ent->node);
+    _cache.bytes += sizeof(struct persist_ent) + (len > 0 ? len : 0);
+    taskEXIT_CRITICAL();
+    
+    return ent;
+}
+
+/* Finds a key's value, reading it in if it isn't cached yet.  A key that
+ * doesn't exist gets cached too, as such. */
+static struct persist_ent *_persist_get(uint32_t key)
+{
+    struct persist_ent *ent = _persist_lookup(key);
+    struct rdb_iter it;
+    
+    if (ent)
+        return ent;
+    
+    /* Might be as big as any; find out while the database is open. */
+    if (_persist_make_room(PERSIST_DATA_MAX_LENGTH, NULL) != S_SUCCESS)
+        return NULL;
+    
+    struct rdb_database *db = rdb_open_file(RDB_ID_APP_PERSIST, _cache.file);
+    assert(db);
+    
+    if (!rdb_find(db, &key, sizeof(uint32_t), &it)) {
+        ent = _persist_new(key, -1);
+    } else {
+        int len = it.data_len < PERSIST_DATA_MAX_LENGTH ? it.data_len : PERSIST_DATA_MAX_LENGTH;
+        
+        ent = _persist_new(key, len);
+        if (ent && rdb_iter_read_data(&it, 0, ent->data, len) != len) {
+            _persist_free(ent);
+            ent = NULL;
+        }
     }
     
     rdb_close(db);
-    rdb_select_free_all(&head);
+    return ent;
+}
+
+/* Sets a key's value (or, with len -1, deletes it), to be written back
+ * later.  If there's no room for it, the old value, written back or not,
+ * stays as it was. */
+static int _persist_put(uint32_t key, const void *data, int len)
+{
+    struct persist_ent *old = _persist_lookup(key);
+    struct persist_ent *ent = old;
+    int rv;
+    
+    if (!old || old->len != len) {
+        /* Making room might write back the old one; that's fine, as long
+         * as it's still there to write. */
+        if ((rv = _persist_make_room(len, old)) != S_SUCCESS)
+            return rv;
+        if (!(ent = _persist_new(key, len)))
+            return E_OUT_OF_MEMORY;
+        if (old)
+            _persist_free(old);
+    }
     
-    LOG_DEBUG("persist: size(%d)", res->it.data_len);
-    return res->it.data_len;
+    if (len > 0)
+        memcpy(ent->data, data, len);
+    if (!ent->dirty)
+        _cache.ndirty++;
+    ent->dirty = 1;
+    
+    return S_SUCCESS;
+}
+
+void persist_app_exit(bool killed)
+{
+    /* An app that was killed holding the cache is never going to give it
+     * back.  What it had is lost, and what it was in the middle of doing
+     * can't be trusted, so throw it all away and start over with a new
+     * mutex. */
+    if (killed && _cache.mutex && _cache.app_task &&
+        xSemaphoreGetMutexHolder(_cache.mutex) == _cache.app_task) {
+        LOG_ERROR("persist: app was killed holding the cache; %d values lost", _cache.ndirty);
+        _persist_drop();
+        _cache.file[0] = 0;
+        _cache.ndirty = 0;
+        _cache.armed = 0;
+        _cache.app_task = NULL;
+        _cache.mutex = xSemaphoreCreateMutexStatic(&_cache.mutex_buf);
+        return;
+    }
+    
+    _persist_lock();
+    
+    /* A killed app's timers go away with it. */
+    if (_cache.armed && !killed)
+        appmanager_timer_remove(&_persist_thread()->timer_head, &_cache.timer);
+    _cache.armed = 0;
+    
+    _persist_flush();
+    _persist_drop();
+    _cache.app_task = NULL;
+    _persist_unlock();
+}
+
+/*** Apps. ***/
+
+/* Moves each app's values out of the old shared database, into a file of
+ * its own, and then throws the old one away.  If we lose power partway, it
+ * starts over next time, and just rewrites what it had already moved. */
+void persist_init(void)
+{
+    struct rdb_database *legacy = rdb_open(RDB_ID_APP_PERSIST_LEGACY);
+    struct rdb_database *db = NULL;
+    struct rdb_iter it;
+    struct rdb_txn txn;
+    app_persist_key c_key;
+    Uuid appid;
+    uint8_t buf[PERSIST_DATA_MAX_LENGTH];
+    char file[FS_NAME_MAX + 1];
+    int valid, n = 0, rv = Blob_Success;
+    
+    assert(legacy);
+    if (!rdb_iter_start(legacy, &it)) {
+        rdb_close(legacy);
+        return;
+    }
+    
+    for (valid = 1; valid && rv == Blob_Success; valid = rdb_iter_next(&it)) {
+        if (it.key_len != sizeof(c_key) || it.data_len > sizeof(buf) ||
+            rdb_iter_read_key(&it, &c_key) != sizeof(c_key) ||
+            rdb_iter_read_data(&it, 0, buf, it.data_len) != it.data_len)
+            continue;
+        
+        /* Each app's values go over in as few transactions as they'll
+         * fit in. */
+        if (!db || !uuid_equal(&c_key.appid, &appid)) {
+            if (db) {
+                rv = rdb_txn_commit(&txn, NULL);
+                rdb_close(db);
+                db = NULL;
+                if (rv != Blob_Success)
+                    break;
+            }
+            memcpy(&appid, &c_key.appid, UUID_SIZE);
+            _persist_file_name(file, &appid);
+            db = rdb_open_file(RDB_ID_APP_PERSIST, file);
+            assert(db);
+            rdb_txn_begin(&txn, db);
+        }
+        
+        rv = rdb_txn_insert(&txn, (uint8_t *)&c_key.key, sizeof(uint32_t), buf, it.data_len);
+        if (rv == Blob_TryLater && (rv = rdb_txn_commit(&txn, NULL)) == Blob_Success) {
+            rdb_txn_begin(&txn, db);
+            rv = rdb_txn_insert(&txn, (uint8_t *)&c_key.key, sizeof(uint32_t), buf, it.data_len);
+        }
+        n++;
+    }
+    
+    if (db) {
+        if (rv == Blob_Success)
+            rv = rdb_txn_commit(&txn, NULL);
+        else
+            rdb_txn_abort(&txn);
+        rdb_close(db);
+    }
+    rdb_close(legacy);
+    
+    if (rv != Blob_Success) {
+        LOG_ERROR("persist: couldn't move the old values out: %d", rv);
+        return;
+    }
+    LOG_INFO("persist: moved %d values into a file per app", n);
+    rdb_delete_file(RDB_ID_APP_PERSIST_LEGACY, NULL);
+}
+
+void persist_delete_app(const Uuid *uuid)
+{
+    char file[FS_NAME_MAX + 1];
+    
+    /* Whatever's cached for it goes too, without being written back. */
+    _persist_lock();
+    if (uuid_equal(uuid, &_cache.appid))
+        _persist_drop();
+    _persist_file_name(file, uuid);
+    rdb_delete_file(RDB_ID_APP_PERSIST, file);
+    _persist_unlock();
+}
+
+/* Deletes the values of every app that isn't installed any more. */
+void persist_reclaim(void)
+{
+    struct fs_dir dir;
+    struct fs_dirent ent;
+    Uuid uuid;
+    
+    fs_opendir(&dir, PERSIST_FILE_PREFIX);
+    while (fs_readdir(&dir, &ent)) {
+        if (!_persist_file_uuid(ent.name, &uuid) || appmanager_get_app_by_uuid(&uuid))
+            continue;
+        
+        LOG_INFO("persist: reclaiming %s, which belongs to no app", ent.name);
+        persist_delete_app(&uuid);
+    }
+}
+
+/*** Persist API. ***/
+
+bool persist_exists(const uint32_t key)
+{
+    _persist_begin();
+    struct persist_ent *ent = _persist_get(key);
+    bool found = ent && ent->len >= 0;
+    _persist_end();
+    
+    return found;
+}
+
+int persist_get_size(const uint32_t key)
+{
+    _persist_begin();
+    struct persist_ent *ent = _persist_get(key);
+    int rv = !ent ? E_ERROR : ent->len < 0 ? E_DOES_NOT_EXIST : ent->len;
+    _persist_end();
+    
+    LOG_DEBUG("persist: size(%d)", rv);
+    return rv;
 }
 
 bool persist_read_bool(const uint32_t key)
@@ -125,39 +605,19 @@ int persist_write_string(const uint32_t key, const char * cstring)
           
 status_t persist_delete(const uint32_t key)
 {
-    struct rdb_iter it;
-    rdb_select_result_list head;
-    list_init_head(&head);
-    struct rdb_database *db = rdb_open(RDB_ID_APP_PERSIST);
-    assert(db);
-    
-    int rv = rdb_iter_start(db, &it);
-    if (!rv) {
-        rdb_close(db);
-        return E_ERROR;
-    }
-    
-    app_persist_key c_key;
-    _create_composite_key(&c_key, key);
+    _persist_begin();
+    struct persist_ent *ent = _persist_get(key);
+    int rv;
     
-    struct rdb_selector selectors[] = {
-        { RDB_SELECTOR_OFFSET_KEY, sizeof(app_persist_key) , RDB_OP_EQ, &c_key },
-        { }
-    };
-    
-    int n = rdb_select(&it, &head, selectors);
-    if (!n)
-        return  E_DOES_NOT_EXIST;
-    
-    struct rdb_select_result *res = rdb_select_result_head(&head);
-    
-    if (!rdb_delete(&res->it)) {
-        rdb_close(db);
-        return E_ERROR;
-    }
+    if (!ent)
+        rv = E_ERROR;
+    else if (ent->len < 0)
+        rv = E_DOES_NOT_EXIST;
+    else
+        rv = _persist_put(key, NULL, -1);
+    _persist_end();
     
-    rdb_close(db);
-    return S_SUCCESS;
+    return rv;
 }
 
 status_t persist_write_int(const uint32_t key, const int32_t value)
@@ -168,75 +628,75 @@ status_t persist_write_int(const uint32_t key, const int32_t value)
 
 status_t persist_write(const uint32_t key, const void *data, const size_t size)
 {
-    rdb_select_result_list head;
-    list_init_head(&head);
-    
     if (size > PERSIST_DATA_MAX_LENGTH)
         return E_INVALID_ARGUMENT;
     
-    bool exists = persist_exists(key);
-
-    struct rdb_database *db = rdb_open(RDB_ID_APP_PERSIST);
-    assert(db);
-    
-    if (rdb_create(db) != Blob_Success)
-        return E_OUT_OF_STORAGE;  
-    
-    app_persist_key c_key;
-    _create_composite_key(&c_key, key);
-    
-    if (!exists) {
-        if (rdb_insert(db, (uint8_t *)&c_key, sizeof(app_persist_key), data, size) != Blob_Success) {
-            rdb_close(db);
-            return E_ERROR;
-        }
-    } else {    
-        if (rdb_update(db, &c_key, sizeof(c_key), data, size) != Blob_Success) {
-            rdb_close(db);
-            return E_ERROR;
-        }
-    }
+    /* This replaces the old value, if there is one. */
+    _persist_begin();
+    int rv = _persist_put(key, data, size);
+    _persist_end();
     
-    rdb_close(db);
-    return size;
+    return rv == S_SUCCESS ? size : rv;
 }
 
 status_t persist_read(const uint32_t key, const void *buffer, const size_t size)
 {
-    struct rdb_iter it;
-    rdb_select_result_list head;
-    list_init_head(&head);
-    struct rdb_database *db = rdb_open(RDB_ID_APP_PERSIST);
-    assert(db);
+    _persist_begin();
+    struct persist_ent *ent = _persist_get(key);
+    int rv;
     
-    int rv = rdb_iter_start(db, &it);
-    if (!rv) {
-        rdb_close(db);
-        return E_ERROR;
+    if (!ent) {
+        rv = E_ERROR;
+    } else if (ent->len < 0) {
+        rv = E_DOES_NOT_EXIST;
+    } else {
+        rv = size <= ent->len ? size : ent->len;
+        memcpy((void *)buffer, ent->data, rv);
     }
+    _persist_end();
     
-    app_persist_key c_key;
-    _create_composite_key(&c_key, key);
-    
-    struct rdb_selector selectors[] = {
-        { RDB_SELECTOR_OFFSET_KEY, sizeof(app_persist_key) , RDB_OP_EQ, &c_key },
-        { 0, 0, RDB_OP_RESULT_FULLY_LOAD },
-        { }
-    };
-    int n = rdb_select(&it, &head, selectors);
+    return rv;
+}
 
-    if (!n) {
-        rv =  E_DOES_NOT_EXIST;
-        goto done;
-    }
+#ifdef REBBLEOS_TESTING
+void persist_test_set_thread(app_running_thread *thread)
+{
+    _persist_test_thread = thread;
+}
+
+void persist_test_file_name(char *name, const Uuid *uuid)
+{
+    _persist_file_name(name, uuid);
+}
+
+void persist_test_get_cache(size_t *bytes, int *ndirty, int *armed)
+{
+    _persist_lock();
+    *bytes = _cache.bytes;
+    *ndirty = _cache.ndirty;
+    *armed = _cache.armed;
+    _persist_unlock();
+}
+
+int persist_test_cached(uint32_t key)
+{
+    struct persist_ent *ent;
+    int rv = 0;
     
-    struct rdb_select_result *res = rdb_select_result_head(&head);
-    size_t sz = size <= res->it.data_len ? size : res->it.data_len;
-    memcpy(buffer, res->result[0], sz);
-    rv =  sz;
+    _persist_lock();
+    list_foreach(ent, &_cache.ents, struct persist_ent, node)
+        if (ent->key == key) {
+            rv = 1;
+            break;
+        }
+    _persist_unlock();
     
-done:
-    rdb_close(db);
-    rdb_select_free_all(&head);
     return rv;
 }
+
+void persist_test_hold_cache(void)
+{
+    _cache.app_task = xTaskGetCurrentTaskHandle();
+    _persist_lock();
+}
+#endif
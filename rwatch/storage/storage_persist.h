@@ -1,5 +1,6 @@
 #pragma once
 
+#include "uuid.h"
 
 //! @addtogroup Storage
 //! \brief A mechanism to store persistent application data and state
@@ -170,3 +171,15 @@ status_t persist_delete(const uint32_t key);
 
 status_t persist_write(const uint32_t key, const void *data, size_t size);
 status_t persist_read(const uint32_t key, const void *buffer, const size_t size);
+/* Writes back whatever the app left in the persist cache, and empties it.
+ * The main app's thread calls this as it finishes; the app manager calls it
+ * instead, with killed set, if it has to kill the app.  If the app died in
+ * the middle of a persist call, what it had cached is lost. */
+void persist_app_exit(bool killed);
+/* Moves what's left in the database that all apps used to share into a
+ * file per app; call once, at boot. */
+void persist_init(void);
+/* Deletes all of an app's values, all at once. */
+void persist_delete_app(const Uuid *uuid);
+/* Deletes the values of every app that isn't in the manifest. */
+void persist_reclaim(void);
@@ -0,0 +1,26 @@
+/* storage_persist_internal.h
+ * Persist storage innards, for the persist code and its tests
+ * libRebbleOS
+ */
+
+#pragma once
+#include "appmanager_thread.h"
+
+/* How much of the system heap the write-back cache may take. */
+#define PERSIST_MAX_STORAGE_BYTES 4096
+/* How long after its first change the cache is written back. */
+#define PERSIST_FLUSH_MS 5000
+
+#ifdef REBBLEOS_TESTING
+/* The tests aren't an app, so they stand in for one with this; NULL to
+ * stop. */
+void persist_test_set_thread(app_running_thread *thread);
+/* The file that an app's values are in. */
+void persist_test_file_name(char *name, const Uuid *uuid);
+void persist_test_get_cache(size_t *bytes, int *ndirty, int *armed);
+/* Whether a key is cached, without making it the most recently used. */
+int persist_test_cached(uint32_t key);
+/* Takes the cache and keeps it, as the app would if it were killed in the
+ * middle of a call; only persist_app_exit(true) gets it back. */
+void persist_test_hold_cache(void);
+#endif
@@ -0,0 +1,179 @@
+/* storage_persist_test.c
+ * tests for persist storage
+ * libRebbleOS
+ */
+#include "rebbleos.h"
+#include "rdb.h"
+#include "storage_persist.h"
+#include "storage_persist_internal.h"
+#include "appmanager_thread.h"
+#include "test.h"
+
+#define MODULE_NAME "stor"
+#define MODULE_TYPE "TEST"
+#define LOG_LEVEL RBL_LOG_LEVEL_DEBUG //RBL_LOG_LEVEL_ERROR
+
+#ifdef REBBLEOS_TESTING
+
+/* What an app's file has for a key, going around the cache: its length, or
+ * -1 if it isn't there. */
+static int _test_on_flash(const Uuid *uuid, uint32_t key, void *buf, int len)
+{
+    char file[FS_NAME_MAX + 1];
+    struct rdb_iter it;
+    int rv = -1;
+    
+    persist_test_file_name(file, uuid);
+    struct rdb_database *db = rdb_open_file(RDB_ID_APP_PERSIST, file);
+    assert(db);
+    if (rdb_find(db, &key, sizeof(uint32_t), &it)) {
+        rv = it.data_len;
+        if (buf)
+            rdb_iter_read_data(&it, 0, buf, len < rv ? len : rv);
+    }
+    rdb_close(db);
+    
+    return rv;
+}
+
+TEST(persist_cache) {
+    static App app;
+    static app_running_thread th;
+    uint8_t buf[200];
+    int32_t val;
+    size_t bytes;
+    int ndirty, armed;
+    int i, rv = TEST_FAIL;
+    
+    memset(&app.uuid, 0xA5, UUID_SIZE);
+    th.thread_type = AppThreadMainApp;
+    th.app = &app;
+    th.timer_head = NULL;
+    persist_test_set_thread(&th);
+    persist_delete_app(&app.uuid);
+    
+    /* Writing one key over and over leaves one value, in the cache. */
+    for (i = 0; i < 100; i++)
+        if (persist_write_int(1, i) != sizeof(int32_t))
+            goto fail;
+    persist_test_get_cache(&bytes, &ndirty, &armed);
+    if (ndirty != 1 || _test_on_flash(&app.uuid, 1, NULL, 0) >= 0) {
+        LOG_ERROR("persist: %d dirty values, or written through", ndirty);
+        goto fail;
+    }
+    if (persist_read_int(1) != 99)
+        goto fail;
+    
+    /* The timer was set once, for PERSIST_FLUSH_MS after the first write,
+     * and when it goes off, that goes out. */
+    if (!th.timer_head || th.timer_head->next ||
+        th.timer_head->when - xTaskGetTickCount() > pdMS_TO_TICKS(PERSIST_FLUSH_MS)) {
+        LOG_ERROR("persist: flush timer isn't set");
+        goto fail;
+    }
+    appmanager_timer_expired(&th.timer_head, th.timer_head);
+    persist_test_get_cache(&bytes, &ndirty, &armed);
+    if (ndirty || _test_on_flash(&app.uuid, 1, &val, sizeof(val)) != sizeof(val) || val != 99) {
+        LOG_ERROR("persist: flush timer didn't write back");
+        goto fail;
+    }
+    
+    /* Reading doesn't set it again. */
+    if (persist_read_int(1) != 99)
+        goto fail;
+    persist_test_get_cache(&bytes, &ndirty, &armed);
+    if (th.timer_head || armed)
+        goto fail;
+    
+    /* Filling the cache evicts the least recently used, after writing it
+     * back; 10 was used again before 11 through 14. */
+    memset(buf, 0, sizeof(buf));
+    for (i = 10; i < 30; i++) {
+        if (i == 15 && persist_read_data(10, buf, sizeof(buf)) != sizeof(buf))
+            goto fail;
+        buf[0] = i;
+        if (persist_write_data(i, buf, sizeof(buf)) != sizeof(buf))
+            goto fail;
+        persist_test_get_cache(&bytes, &ndirty, &armed);
+        if (bytes > PERSIST_MAX_STORAGE_BYTES) {
+            LOG_ERROR("persist: cache grew to %d bytes", (int)bytes);
+            goto fail;
+        }
+    }
+    if (persist_test_cached(1) || persist_test_cached(11) || !persist_test_cached(10) || !persist_test_cached(29)) {
+        LOG_ERROR("persist: evicted the wrong values");
+        goto fail;
+    }
+    if (_test_on_flash(&app.uuid, 11, NULL, 0) != sizeof(buf))
+        goto fail;
+    for (i = 10; i < 30; i++)
+        if (persist_read_data(i, buf, sizeof(buf)) != sizeof(buf) || buf[0] != i || buf[sizeof(buf) - 1] != 0) {
+            LOG_ERROR("persist: lost key %d", i);
+            goto fail;
+        }
+    
+    /* A value changing size in a full cache keeps its new size. */
+    if (persist_write_data(29, buf, 100) != 100 || persist_get_size(29) != 100)
+        goto fail;
+    
+    /* A killed app's values still get written back, */
+    if (persist_write_int(2, 22) != sizeof(int32_t) || !th.timer_head)
+        goto fail;
+    persist_app_exit(true);
+    th.timer_head = NULL; /* which goes with the app */
+    persist_test_get_cache(&bytes, &ndirty, &armed);
+    if (bytes || ndirty ||
+        _test_on_flash(&app.uuid, 2, &val, sizeof(val)) != sizeof(val) || val != 22 ||
+        _test_on_flash(&app.uuid, 29, NULL, 0) != 100) {
+        LOG_ERROR("persist: killed app's values weren't written back");
+        goto fail;
+    }
+    
+    /* unless it died holding the cache.  Then they're lost, but that
+     * mustn't hang, and the next app still gets to use it. */
+    if (persist_write_int(3, 33) != sizeof(int32_t))
+        goto fail;
+    persist_test_hold_cache();
+    persist_app_exit(true);
+    th.timer_head = NULL;
+    persist_test_get_cache(&bytes, &ndirty, &armed);
+    if (bytes || ndirty || armed || _test_on_flash(&app.uuid, 3, NULL, 0) >= 0) {
+        LOG_ERROR("persist: cache wasn't reset after the app died holding it");
+        goto fail;
+    }
+    if (persist_write_int(3, 34) != sizeof(int32_t) || persist_read_int(3) != 34)
+        goto fail;
+    
+    /* Quitting takes the timer off, and writes back. */
+    persist_app_exit(false);
+    persist_test_get_cache(&bytes, &ndirty, &armed);
+    if (th.timer_head || armed || ndirty ||
+        _test_on_flash(&app.uuid, 3, &val, sizeof(val)) != sizeof(val) || val != 34)
+        goto fail;
+    
+    /* A worker's writes go straight through, and don't stay cached. */
+    th.thread_type = AppThreadWorker;
+    if (persist_write_int(4, 44) != sizeof(int32_t))
+        goto fail;
+    persist_test_get_cache(&bytes, &ndirty, &armed);
+    if (bytes || th.timer_head ||
+        _test_on_flash(&app.uuid, 4, &val, sizeof(val)) != sizeof(val) || val != 44) {
+        LOG_ERROR("persist: worker's write didn't go through");
+        goto fail;
+    }
+    if (persist_read_int(1) != 99)
+        goto fail;
+    persist_test_get_cache(&bytes, &ndirty, &armed);
+    if (bytes)
+        goto fail;
+    
+    *artifact = 0;
+    rv = TEST_PASS;
+    
+fail:
+    persist_test_set_thread(NULL);
+    persist_delete_app(&app.uuid);
+    return rv;
+}
+
+#endif
@@ -0,0 +1,591 @@
+/* fsbench.c
+ * Filesystem and rdb benchmarks, on the host, against simulated flash
+ * RebbleOS
+ *
+ * Each workload starts from a freshly formatted filesystem, and reports
+ * how many operations it did, how fast they went -- both in modelled flash
+ * time, which is what the watch would see, and in host time, which is
+ * mostly interesting for catching CPU-bound code -- and what it cost the
+ * flash.
+ *
+ * Usage: fsbench [-s] [-v] [-n count] [-w workload]...
+ *                [-R read_byte_ns] [-P program_byte_ns] [-E erase_ns]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "rebbleos.h"
+#include "fs.h"
+#include "rdb.h"
+#include "hostsim.h"
+
+static int _n = 0; /* if nonzero, overrides each workload's default count */
+static uint64_t _think_ns = 0; /* time a workload spent idle on purpose */
+
+static uint64_t _host_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int _count(int def)
+{
+    return _n ? _n : def;
+}
+
+/*** Workloads.  Each returns how many operations it did, or -1. ***/
+
+static int _bench_create(void)
+{
+    struct fd fd;
+    char name[24];
+    uint8_t buf[128];
+    int n = _count(256);
+
+    memset(buf, 0xA5, sizeof(buf));
+    for (int i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "create%d", i);
+        if (!fs_creat(&fd, name, sizeof(buf)))
+            return -1;
+        fs_write(&fd, buf, sizeof(buf));
+        fs_mark_written(&fd);
+    }
+
+    return n;
+}
+
+static int _bench_append(void)
+{
+    struct fd fd;
+    uint8_t buf[24];
+    int n = _count(65536 / sizeof(buf));
+
+    if (!fs_creat(&fd, "append", n * sizeof(buf)))
+        return -1;
+    for (int i = 0; i < n; i++) {
+        memset(buf, i, sizeof(buf));
+        if (fs_write(&fd, buf, sizeof(buf)) != sizeof(buf))
+            return -1;
+    }
+    fs_mark_written(&fd);
+
+    return n;
+}
+
+static int _bench_seek(void)
+{
+#define SEEKFILE_SIZE 65536
+    struct fd fd;
+    struct file file;
+    uint8_t buf[256];
+    int n = _count(4096);
+
+    if (!fs_creat(&fd, "seek", SEEKFILE_SIZE))
+        return -1;
+    for (int ofs = 0; ofs < SEEKFILE_SIZE; ofs += sizeof(buf)) {
+        for (int i = 0; i < sizeof(buf); i++)
+            buf[i] = (ofs + i) * 13;
+        fs_write(&fd, buf, sizeof(buf));
+    }
+    fs_mark_written(&fd);
+
+    if (fs_find_file(&file, "seek") < 0)
+        return -1;
+    fs_open(&fd, &file);
+
+    srand(1);
+    for (int i = 0; i < n; i++) {
+        long ofs = rand() % (SEEKFILE_SIZE - 8);
+
+        fs_seek(&fd, ofs, FS_SEEK_SET);
+        if (fs_read(&fd, buf, 8) != 8 || buf[0] != (uint8_t)(ofs * 13))
+            return -1;
+    }
+
+    return n;
+}
+
+/* The same as seek, but reading in place, where we can. */
+static int _bench_map(void)
+{
+    struct fd fd;
+    struct file file;
+    uint8_t buf[256];
+    int n = _count(4096);
+
+    if (!fs_creat(&fd, "map", SEEKFILE_SIZE))
+        return -1;
+    for (int ofs = 0; ofs < SEEKFILE_SIZE; ofs += sizeof(buf)) {
+        for (int i = 0; i < sizeof(buf); i++)
+            buf[i] = (ofs + i) * 13;
+        fs_write(&fd, buf, sizeof(buf));
+    }
+    fs_mark_written(&fd);
+
+    if (fs_find_file(&file, "map") < 0)
+        return -1;
+    fs_open(&fd, &file);
+
+    srand(1);
+    for (int i = 0; i < n; i++) {
+        long ofs = rand() % (SEEKFILE_SIZE - 8);
+        struct fs_mapping map;
+        const uint8_t *p;
+
+        fs_seek(&fd, ofs, FS_SEEK_SET);
+        p = fs_map(&fd, &map, buf, 8);
+        if (!p || p[0] != (uint8_t)(ofs * 13))
+            return -1;
+        fs_unmap(&map);
+    }
+
+    return n;
+}
+
+static int _rdb_insert_n(int n)
+{
+    struct rdb_database *db = rdb_open(RDB_ID_NOTIFICATION);
+    uint8_t val[48];
+    int rv = n;
+
+    for (int key = 0; key < n; key++) {
+        memset(val, key, sizeof(val));
+        if (rdb_insert(db, (uint8_t *)&key, sizeof(key), val, sizeof(val)) != Blob_Success) {
+            rv = -1;
+            break;
+        }
+    }
+    rdb_close(db);
+
+    return rv;
+}
+
+static int _bench_rdb_insert(void)
+{
+    return _rdb_insert_n(_count(200));
+}
+
+/* The same records as rdb_insert, a BlobDB sync burst at a time. */
+static int _bench_rdb_txn(void)
+{
+    struct rdb_database *db = rdb_open(RDB_ID_NOTIFICATION);
+    struct rdb_txn txn;
+    uint8_t status[RDB_TXN_MAX_OPS];
+    uint8_t val[48];
+    int n = _count(200);
+    int rv = n;
+
+    for (int key = 0; key < n && rv >= 0; ) {
+        int nops = 0;
+
+        rdb_txn_begin(&txn, db);
+        for (; key < n && nops < RDB_TXN_MAX_OPS; key++, nops++) {
+            memset(val, key, sizeof(val));
+            if (rdb_txn_insert(&txn, (uint8_t *)&key, sizeof(key), val, sizeof(val)) != Blob_Success) {
+                rv = -1;
+                break;
+            }
+        }
+        if (rdb_txn_commit(&txn, status) != Blob_Success)
+            rv = -1;
+        for (int i = 0; i < nops; i++)
+            if (status[i] != Blob_Success)
+                rv = -1;
+    }
+    rdb_close(db);
+
+    return rv;
+}
+
+/* A few hot keys, rewritten over and over, the way that prefs and persist
+ * get used: half the time with the value that's already there, and the
+ * rest of the time with one that might or might not fit on top of it. */
+static int _bench_rdb_hotkey(void)
+{
+    struct rdb_database *db = rdb_open(RDB_ID_PREFS);
+    uint32_t vals[8];
+    int n = _count(400);
+    int rv = n;
+
+    for (int key = 0; key < 8; key++) {
+        vals[key] = 0xFFFFFFFF;
+        if (rdb_insert(db, (uint8_t *)&key, sizeof(key), (uint8_t *)&vals[key], sizeof(vals[key])) != Blob_Success)
+            rv = -1;
+    }
+    for (int i = 0; i < n && rv >= 0; i++) {
+        int key = i % 8;
+
+        if (i % 4 == 0)
+            vals[key] >>= 1;
+        else if (i % 4 == 1)
+            vals[key] = i;
+        if (rdb_update(db, (uint8_t *)&key, sizeof(key), (uint8_t *)&vals[key], sizeof(vals[key])) != Blob_Success)
+            rv = -1;
+    }
+    rdb_close(db);
+
+    return rv;
+}
+
+/* A working set of notifications, rewritten over and over, so that the
+ * database keeps having to be compacted; what matters is the worst that
+ * any one rewrite has to wait. */
+static int _bench_rdb_churn(void)
+{
+    struct rdb_database *db = rdb_open(RDB_ID_NOTIFICATION);
+    uint8_t val[200];
+    uint64_t worst = 0;
+    int n = _count(1000);
+    int rv = n;
+
+    for (int i = 0; i < n && rv >= 0; i++) {
+        int key = i % 32;
+        uint64_t t0 = sim_clock_ns();
+
+        memset(val, i, sizeof(val));
+        if (rdb_insert(db, (uint8_t *)&key, sizeof(key), val, sizeof(val)) != Blob_Success)
+            rv = -1;
+        if (sim_clock_ns() - t0 > worst)
+            worst = sim_clock_ns() - t0;
+    }
+    rdb_close(db);
+
+    printf("  rdb: worst rewrite took %.1f ms\n", worst / 1e6);
+
+    return rv;
+}
+
+static int _bench_rdb_select(void)
+{
+    int nrec = 200;
+    int n = _count(100);
+
+    /* Setting up isn't what we're measuring, but it's not free, either;
+     * the report includes it. */
+    if (_rdb_insert_n(nrec) < 0)
+        return -1;
+
+    struct rdb_database *db = rdb_open(RDB_ID_NOTIFICATION);
+    for (int i = 0; i < n; i++) {
+        struct rdb_iter it;
+        rdb_select_result_list head;
+        int key = (i * 37) % nrec;
+        struct rdb_selector selectors[] = {
+            { RDB_SELECTOR_OFFSET_KEY, sizeof(key), RDB_OP_EQ, &key },
+            { 0, 0, RDB_OP_RESULT_FULLY_LOAD },
+            { }
+        };
+
+        list_init_head(&head);
+        if (!rdb_iter_start(db, &it) || rdb_select(&it, &head, selectors) != 1) {
+            rdb_select_free_all(&head);
+            rdb_close(db);
+            return -1;
+        }
+        rdb_select_free_all(&head);
+    }
+    rdb_close(db);
+
+    return n;
+}
+
+/* The same lookups as rdb_select, through the key index. */
+static int _bench_rdb_find(void)
+{
+    int nrec = 200;
+    int n = _count(100);
+
+    if (_rdb_insert_n(nrec) < 0)
+        return -1;
+
+    struct rdb_database *db = rdb_open(RDB_ID_NOTIFICATION);
+    for (int i = 0; i < n; i++) {
+        struct rdb_iter it;
+        uint8_t val[48];
+        int key = (i * 37) % nrec;
+
+        if (!rdb_find(db, &key, sizeof(key), &it) ||
+            rdb_iter_read_data(&it, 0, val, sizeof(val)) != sizeof(val)) {
+            rdb_close(db);
+            return -1;
+        }
+    }
+    rdb_close(db);
+
+    return n;
+}
+
+/* Persist keys for a few apps, each in a file of its own, and then one
+ * app's keys looked up, and probed for ones that aren't there, the way
+ * that an app does when it starts up for the first time. */
+#define BENCH_APPS 10
+#define BENCH_APP_KEYS 50
+
+static int _bench_rdb_probe(void)
+{
+    struct flash_tag_stats st0[FLASH_TAG_COUNT], st1[FLASH_TAG_COUNT];
+    struct rdb_database *db;
+    struct rdb_iter it;
+    char name[16];
+    uint32_t key, val = 0;
+    int n = _count(500);
+    int rv = n;
+
+    for (int app = 0; app < BENCH_APPS && rv >= 0; app++) {
+        snprintf(name, sizeof(name), "persist/%d", app);
+        db = rdb_open_file(RDB_ID_APP_PERSIST, name);
+        for (key = 0; key < BENCH_APP_KEYS && rv >= 0; key++)
+            if (rdb_insert(db, (uint8_t *)&key, sizeof(key), (uint8_t *)&val, sizeof(val)) != Blob_Success)
+                rv = -1;
+        rdb_close(db);
+    }
+
+    flash_get_tag_stats(st0);
+    db = rdb_open_file(RDB_ID_APP_PERSIST, "persist/0");
+    for (int i = 0; i < n && rv >= 0; i++) {
+        key = i % BENCH_APP_KEYS;
+        if (!rdb_find(db, &key, sizeof(key), &it))
+            rv = -1;
+        key = 1000 + i;
+        if (rdb_find(db, &key, sizeof(key), &it))
+            rv = -1;
+    }
+    rdb_close(db);
+    flash_get_tag_stats(st1);
+
+    printf("  rdb: %d hits and %d misses read %u B\n", n, n, (unsigned)(st1[FLASH_TAG_RDB].read_bytes - st0[FLASH_TAG_RDB].read_bytes));
+
+    return rv;
+}
+
+static int _gc_write(const char *name, uint8_t fill)
+{
+    struct fd fd;
+    struct file file;
+    uint8_t buf[256];
+    int have = fs_find_file(&file, name) >= 0;
+
+    memset(buf, fill, sizeof(buf));
+    if (!fs_creat_replacing(&fd, name, REGION_FS_PAGE_SIZE / 2, have ? &file : NULL))
+        return -1;
+    for (int ofs = 0; ofs < REGION_FS_PAGE_SIZE / 2; ofs += sizeof(buf))
+        fs_write(&fd, buf, sizeof(buf));
+    fs_mark_written(&fd);
+
+    return 0;
+}
+
+/* Rewrites a handful of files over and over, sitting still for think_ms
+ * in between each, the way that somebody using the watch might.  Installed
+ * apps are spread between the rewrites first, so that no sector ever goes
+ * entirely dead by itself, and the prefs database stays open the whole
+ * time; the collector has to move the apps out of its way. */
+static int _gc_churn(int n, int think_ms)
+{
+    struct rdb_database *db = rdb_open(RDB_ID_PREFS);
+    uint32_t key = 1;
+    char name[24];
+
+    if (!db || rdb_insert(db, (uint8_t *)&key, sizeof(key), (uint8_t *)&key, sizeof(key)) != Blob_Success)
+        return -1;
+    /* The database has the flash tagged for itself while it's open; the
+     * rest of this is the filesystem's. */
+    uint8_t tag = flash_set_tag(FLASH_TAG_FS);
+    for (int i = 0; i < REGION_FS_N_PAGES / 2; i++) {
+        snprintf(name, sizeof(name), "@%08x/app", i);
+        if (_gc_write(name, 0xA5) < 0 || _gc_write("churn0", 0x5A) < 0)
+            return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (think_ms) {
+            uint64_t t0 = sim_clock_ns();
+            
+            vTaskDelay(pdMS_TO_TICKS(think_ms));
+            _think_ns += sim_clock_ns() - t0;
+        }
+        snprintf(name, sizeof(name), "churn%d", i % 8);
+        if (_gc_write(name, 0x5A) < 0)
+            return -1;
+    }
+    flash_set_tag(tag);
+    rdb_close(db);
+
+    return n;
+}
+
+static int _bench_gc(void)
+{
+    /* Enough rewrites to go around the whole filesystem a couple of times. */
+    return _gc_churn(_count(2 * REGION_FS_N_PAGES), 0);
+}
+
+/* The same, but with the flash left alone long enough in between for the
+ * background thread to erase dead sectors ahead of time.  The time spent
+ * sitting still doesn't count against the modelled rate. */
+static int _bench_gc_idle(void)
+{
+    return _gc_churn(_count(REGION_FS_N_PAGES), 2000);
+}
+
+static const struct {
+    const char *name;
+    int (*run)(void);
+} _workloads[] = {
+    { "create",     _bench_create },
+    { "append",     _bench_append },
+    { "seek",       _bench_seek },
+    { "map",        _bench_map },
+    { "rdb_insert", _bench_rdb_insert },
+    { "rdb_txn",    _bench_rdb_txn },
+    { "rdb_hotkey", _bench_rdb_hotkey },
+    { "rdb_churn",  _bench_rdb_churn },
+    { "rdb_select", _bench_rdb_select },
+    { "rdb_find",   _bench_rdb_find },
+    { "rdb_probe",  _bench_rdb_probe },
+    { "gc",         _bench_gc },
+    { "gc_idle",    _bench_gc_idle },
+};
+
+#define N_WORKLOADS (sizeof(_workloads) / sizeof(_workloads[0]))
+
+/*** Reporting. ***/
+
+static double _per_sec(int ops, uint64_t ns)
+{
+    return ns ? ops * 1e9 / ns : 0;
+}
+
+/* Where the programming went, and how much of it anyone asked for. */
+static void _report_tags(const struct flash_tag_stats *before, const struct flash_tag_stats *after)
+{
+    static const char *names[FLASH_TAG_COUNT] = { "other", "fs", "gc", "rdb" };
+    uint32_t asked = 0, programmed = 0;
+    
+    printf("  by tag:");
+    for (int i = 0; i < FLASH_TAG_COUNT; i++) {
+        uint32_t w = after[i].written_bytes - before[i].written_bytes;
+        uint32_t p = after[i].program_bytes - before[i].program_bytes;
+        uint32_t r = after[i].read_bytes - before[i].read_bytes;
+        uint32_t e = after[i].erases - before[i].erases;
+        
+        if (!w && !p && !r && !e)
+            continue;
+        printf(" %s: read %u B, asked %u B, programmed %u B, %u erases;", names[i], (unsigned)r, (unsigned)w, (unsigned)p, (unsigned)e);
+        asked += w;
+        programmed += p;
+    }
+    if (asked)
+        printf(" write amplification %.2f", (double)programmed / asked);
+    printf("\n");
+}
+
+/* What the garbage collector did during the workload, if anything. */
+static void _report_gc(void)
+{
+    struct fs_gc_stats gc;
+    
+    fs_gc_get_stats(&gc);
+    if (!gc.sectors_erased && !gc.sectors_preerased && !gc.files_relocated)
+        return;
+    printf("  gc: %u sectors erased (%u while idle), %u files and %u pages relocated; %u ticks in fs_creat (worst %u), %u in the background; %u pages came pre-erased\n",
+        (unsigned)gc.sectors_erased, (unsigned)gc.sectors_preerased, (unsigned)gc.files_relocated, (unsigned)gc.pages_relocated,
+        (unsigned)gc.foreground_ticks, (unsigned)gc.max_pause_ticks, (unsigned)gc.background_ticks, (unsigned)gc.preerased_allocs);
+}
+
+static int _run(int w)
+{
+    struct simflash_stats before, after;
+    struct flash_tag_stats tags0[FLASH_TAG_COUNT], tags1[FLASH_TAG_COUNT];
+    uint64_t sim0, host0, sim, host;
+    int ops;
+
+    fs_format();
+    fs_gc_reset_stats();
+    _think_ns = 0;
+
+    simflash_get_stats(&before);
+    flash_get_tag_stats(tags0);
+    sim0 = sim_clock_ns();
+    host0 = _host_ns();
+
+    ops = _workloads[w].run();
+
+    sim = sim_clock_ns() - sim0 - _think_ns;
+    host = _host_ns() - host0;
+    simflash_get_stats(&after);
+    flash_get_tag_stats(tags1);
+
+    if (ops < 0) {
+        printf("%-10s FAILED\n", _workloads[w].name);
+        return 1;
+    }
+
+    printf("%-10s %7d ops %12.1f ops/s modelled %12.1f ops/s host | "
+           "read %8" PRIu64 " B in %6" PRIu64 ", %6" PRIu64 " maps | wrote %8" PRIu64 " B in %6" PRIu64 " programs | %4" PRIu64 " erases | %.1f ms busy\n",
+        _workloads[w].name, ops, _per_sec(ops, sim), _per_sec(ops, host),
+        after.read_bytes - before.read_bytes, after.reads - before.reads, after.maps - before.maps,
+        after.program_bytes - before.program_bytes, after.programs - before.programs,
+        after.erases - before.erases,
+        ((after.read_ns - before.read_ns) + (after.program_ns - before.program_ns) + (after.erase_ns - before.erase_ns)) / 1e6);
+    _report_tags(tags0, tags1);
+    _report_gc();
+
+    if (after.violations != before.violations) {
+        printf("%-10s %" PRIu64 " programs over unerased flash!\n", _workloads[w].name, after.violations - before.violations);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int selected[N_WORKLOADS] = { 0 };
+    int any = 0, rv = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "svn:w:R:P:E:")) != -1) {
+        switch (c) {
+        case 's': simflash_strict = 1; break;
+        case 'v': simflash_verbose = 1; break;
+        case 'n': _n = atoi(optarg); break;
+        case 'R': simflash_timing.read_byte_ns = atoi(optarg); break;
+        case 'P': simflash_timing.program_byte_ns = atoi(optarg); break;
+        case 'E': simflash_timing.erase_ns = atoi(optarg); break;
+        case 'w': {
+            int w;
+
+            for (w = 0; w < N_WORKLOADS; w++)
+                if (!strcmp(optarg, _workloads[w].name))
+                    break;
+            if (w == N_WORKLOADS) {
+                fprintf(stderr, "fsbench: no workload called %s\n", optarg);
+                return 2;
+            }
+            selected[w] = any = 1;
+            break;
+        }
+        default:
+            fprintf(stderr, "usage: %s [-s] [-v] [-n count] [-w workload]... [-R read_byte_ns] [-P program_byte_ns] [-E erase_ns]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    printf("fsbench: %d fs pages of %d bytes, %d-byte erase blocks, %d-byte program pages\n",
+        REGION_FS_N_PAGES, REGION_FS_PAGE_SIZE, REGION_FS_ERASE_SIZE, PLATFORM_FLASH_PAGE_SIZE);
+
+    /* This brings up the flash threads, and mounts the filesystem. */
+    flash_init();
+
+    for (int w = 0; w < N_WORKLOADS; w++)
+        if (!any || selected[w])
+            rv |= _run(w);
+
+    return rv;
+}
@@ -0,0 +1,42 @@
+#pragma once
+/* hostsim.h
+ * Knobs and counters for the host-native flash simulator
+ * RebbleOS
+ */
+
+#include <stdint.h>
+
+/* The simulator's clock only moves when the flash is busy (or when every
+ * task is asleep, and someone is waiting on a timeout), so tick counts
+ * measure modelled flash time, not how long the host took. */
+uint64_t sim_clock_ns(void);
+void sim_clock_advance(uint64_t ns);
+
+/* How long each kind of flash operation takes.  The defaults are roughly a
+ * Macronix MX25U, as on snowy. */
+struct simflash_timing {
+    uint32_t read_op_ns;      /* command, address, and dummy cycles */
+    uint32_t read_byte_ns;
+    uint32_t program_op_ns;
+    uint32_t program_byte_ns;
+    uint32_t erase_ns;        /* per erase block */
+};
+
+struct simflash_stats {
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t read_ns;
+    uint64_t programs;
+    uint64_t program_bytes;
+    uint64_t program_ns;
+    uint64_t erases;
+    uint64_t erase_ns;
+    uint64_t maps;       /* reads in place, which cost nothing here */
+    uint64_t violations; /* programs that tried to set a bit without an erase */
+};
+
+extern struct simflash_timing simflash_timing;
+extern int simflash_strict;  /* abort on a violation, rather than count it */
+extern int simflash_verbose; /* print everything that the OS logs */
+
+void simflash_get_stats(struct simflash_stats *stats);
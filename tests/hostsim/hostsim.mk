@@ -0,0 +1,74 @@
+# hostsim.mk
+# Builds the filesystem, rdb, and the flash layer for the host, on top of a
+# RAM-backed flash model, for benchmarking without a watch (or QEMU); and
+# qalloc, to replay heap traces against.
+#
+#   make hostsim                      builds $(BUILD)/hostsim/fsbench and qbench
+#   make hostsim_bench                runs every workload
+#   make hostsim_bench HOSTSIM_ARGS="-w gc -s"
+#   make hostsim_qbench QBENCH_ARGS="-t trace.log"
+#
+# The flash geometry can be changed with HOSTSIM_FS_PAGE_SIZE,
+# HOSTSIM_ERASE_SIZE, and HOSTSIM_PROGRAM_SIZE; see tests/hostsim/include/platform.h.
+
+HOSTCC ?= cc
+
+HOSTSIM_FS_PAGE_SIZE ?= 0x2000
+HOSTSIM_ERASE_SIZE ?= 0x8000
+HOSTSIM_PROGRAM_SIZE ?= 64
+
+CFLAGS_hostsim = -O2 -g -std=gnu99 -pthread
+CFLAGS_hostsim += -Wall
+CFLAGS_hostsim += -DHOSTSIM_FS_PAGE_SIZE=$(HOSTSIM_FS_PAGE_SIZE)
+CFLAGS_hostsim += -DHOSTSIM_ERASE_SIZE=$(HOSTSIM_ERASE_SIZE)
+CFLAGS_hostsim += -DHOSTSIM_PROGRAM_SIZE=$(HOSTSIM_PROGRAM_SIZE)
+CFLAGS_hostsim += -Itests/hostsim/include -Itests/hostsim -Ircore
+# Not -I, or its stdarg.h would stand in for the host's.
+CFLAGS_hostsim += -idirafter lib/minilib/inc
+
+# These are built from copies, since otherwise, #include "rebbleos.h" finds
+# the real one next to the source before the one in tests/hostsim/include.
+SRCS_hostsim_rcore = rcore/fs.c rcore/fs_crc.c rcore/rdb.c rcore/flash.c
+SRCS_hostsim = tests/hostsim/rtos.c tests/hostsim/simflash.c tests/hostsim/fsbench.c
+
+OBJS_hostsim = $(addprefix $(BUILD)/hostsim/,$(notdir $(SRCS_hostsim_rcore:.c=.o) $(SRCS_hostsim:.c=.o)))
+HDRS_hostsim = $(wildcard tests/hostsim/*.h tests/hostsim/include/*.h) rcore/fs.h rcore/fs_internal.h rcore/rdb.h rcore/flash.h lib/minilib/inc/qalloc.h
+
+OBJS_qbench = $(BUILD)/hostsim/qalloc.o $(BUILD)/hostsim/qbench.o
+
+hostsim: $(BUILD)/hostsim/fsbench $(BUILD)/hostsim/qbench
+
+hostsim_bench: $(BUILD)/hostsim/fsbench
+	$(BUILD)/hostsim/fsbench $(HOSTSIM_ARGS)
+
+hostsim_qbench: $(BUILD)/hostsim/qbench
+	$(BUILD)/hostsim/qbench $(QBENCH_ARGS)
+
+$(BUILD)/hostsim/src/%.c: rcore/%.c
+	@mkdir -p $(dir $@)
+	$(QUIET)cp $< $@
+
+$(BUILD)/hostsim/%.o: $(BUILD)/hostsim/src/%.c $(HDRS_hostsim)
+	$(call SAY,[hostsim] CC $<)
+	$(QUIET)$(HOSTCC) $(CFLAGS_hostsim) -c -o $@ $<
+
+$(BUILD)/hostsim/%.o: tests/hostsim/%.c $(HDRS_hostsim)
+	@mkdir -p $(dir $@)
+	$(call SAY,[hostsim] CC $<)
+	$(QUIET)$(HOSTCC) $(CFLAGS_hostsim) -c -o $@ $<
+
+$(BUILD)/hostsim/%.o: lib/minilib/%.c $(HDRS_hostsim)
+	@mkdir -p $(dir $@)
+	$(call SAY,[hostsim] CC $<)
+	$(QUIET)$(HOSTCC) $(CFLAGS_hostsim) -c -o $@ $<
+
+$(BUILD)/hostsim/fsbench: $(OBJS_hostsim)
+	$(call SAY,[hostsim] LD $@)
+	$(QUIET)$(HOSTCC) $(CFLAGS_hostsim) -o $@ $^
+
+$(BUILD)/hostsim/qbench: $(OBJS_qbench)
+	$(call SAY,[hostsim] LD $@)
+	$(QUIET)$(HOSTCC) $(CFLAGS_hostsim) -o $@ $^
+
+.SECONDARY: $(addprefix $(BUILD)/hostsim/src/,$(notdir $(SRCS_hostsim_rcore)))
+.PHONY: hostsim hostsim_bench hostsim_qbench
@@ -0,0 +1,67 @@
+#pragma once
+/* FreeRTOS.h
+ * Just enough of the FreeRTOS API to run the filesystem on a host; the
+ * scheduler behind it lives in tests/hostsim/rtos.c.
+ * RebbleOS
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t StackType_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define pdTRUE  1
+#define pdFALSE 0
+#define pdPASS  pdTRUE
+#define pdFAIL  pdFALSE
+
+#define configTICK_RATE_HZ 1000
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+#define portMAX_DELAY      ((TickType_t)0xFFFFFFFF)
+#define pdMS_TO_TICKS(ms)  ((TickType_t)(((TickType_t)(ms) * configTICK_RATE_HZ) / 1000))
+
+#define tskIDLE_PRIORITY 0
+
+/* The same slots as Config/FreeRTOSConfig.h. */
+#define configNUM_THREAD_LOCAL_STORAGE_POINTERS 2
+#define FREERTOS_TLS_CUR_HEAP 0
+#define FREERTOS_TLS_FLASH_TAG 1
+
+/* Every task is a pthread, but only one of them ever runs at a time; see
+ * rtos.c. */
+struct sim_task {
+    pthread_t thread;
+    pthread_cond_t cv;
+    const char *name;
+    TaskFunction_t entry;
+    void *par;
+    UBaseType_t prio;
+    
+    int ready;
+    const void *blocked_on;
+    int timed;
+    TickType_t wake_at;
+    int woken; /* 0 if we timed out instead */
+    uint32_t notify;
+    void *tls[configNUM_THREAD_LOCAL_STORAGE_POINTERS];
+    
+    struct sim_task *next;
+};
+
+struct sim_sem {
+    int count;
+    int max;
+    int recursive;
+    int depth;
+    struct sim_task *owner;
+};
+
+typedef struct sim_task StaticTask_t;
+typedef struct sim_task *TaskHandle_t;
+
+#define portYIELD_FROM_ISR(x) do { (void)(x); } while (0)
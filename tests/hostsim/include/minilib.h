@@ -0,0 +1,10 @@
+#pragma once
+/* minilib.h
+ * The host has a real libc.
+ * RebbleOS
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
@@ -0,0 +1,5 @@
+#pragma once
+/* pebble_protocol.h
+ * Nothing from here is needed by rdb on the host.
+ * RebbleOS
+ */
@@ -0,0 +1,46 @@
+#pragma once
+/* platform.h
+ * Flash layout for the host simulator.  The geometry comes in from
+ * hostsim.mk, and defaults to snowy's.
+ * RebbleOS
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef HOSTSIM_FLASH_SIZE
+#define HOSTSIM_FLASH_SIZE   0x1000000
+#endif
+
+#ifndef HOSTSIM_FS_START
+#define HOSTSIM_FS_START     0x400000
+#endif
+
+#ifndef HOSTSIM_FS_PAGE_SIZE
+#define HOSTSIM_FS_PAGE_SIZE 0x2000
+#endif
+
+#ifndef HOSTSIM_ERASE_SIZE
+#define HOSTSIM_ERASE_SIZE   0x8000
+#endif
+
+#ifndef HOSTSIM_PROGRAM_SIZE
+#define HOSTSIM_PROGRAM_SIZE 64
+#endif
+
+#define REGION_FS_START         HOSTSIM_FS_START
+#define REGION_FS_PAGE_SIZE     HOSTSIM_FS_PAGE_SIZE
+#define REGION_FS_N_PAGES       ((HOSTSIM_FLASH_SIZE - REGION_FS_START) / REGION_FS_PAGE_SIZE)
+#define REGION_FS_ERASE_SIZE    HOSTSIM_ERASE_SIZE
+
+#define PLATFORM_FLASH_PAGE_MASK (~(uint32_t)(HOSTSIM_PROGRAM_SIZE - 1))
+#define PLATFORM_FLASH_PAGE_SIZE HOSTSIM_PROGRAM_SIZE
+
+/* The simulated flash is just memory, so it can be read in place like
+ * snowy's; build with -DHOSTSIM_NO_MAP to see what everyone else gets. */
+#ifndef HOSTSIM_NO_MAP
+#define PLATFORM_FLASH_MAPPED
+#endif
+
+/* Where flash_dump sends things; on the host, that's stdout. */
+void ss_debug_write(const unsigned char *p, size_t len);
@@ -0,0 +1,5 @@
+#pragma once
+/* protocol_system.h
+ * Nothing from here is needed by rdb on the host.
+ * RebbleOS
+ */
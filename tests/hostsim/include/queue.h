@@ -0,0 +1,10 @@
+#pragma once
+/* queue.h
+ * The host simulator has no queues; this is here for rtoswrap.h.
+ * RebbleOS
+ */
+
+#include "FreeRTOS.h"
+
+typedef struct sim_queue *xQueueHandle;
+typedef struct { int unused; } StaticQueue_t;
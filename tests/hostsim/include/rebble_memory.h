@@ -0,0 +1,12 @@
+#pragma once
+/* rebble_memory.h
+ * On the host, there's only the one heap.
+ * RebbleOS
+ */
+
+#include <stdlib.h>
+
+#define app_malloc malloc
+#define app_calloc calloc
+#define app_realloc realloc
+#define app_free free
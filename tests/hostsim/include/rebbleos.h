@@ -0,0 +1,20 @@
+#pragma once
+/* rebbleos.h
+ * The parts of the firmware's catch-all header that the filesystem, rdb,
+ * and the flash layer use, without dragging in the rest of the OS.
+ * RebbleOS
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "platform.h"
+#include "log.h"
+#include "debug.h"
+#include "flash.h"
@@ -0,0 +1,24 @@
+#pragma once
+/* task.h
+ * Task API for the host simulator.
+ * RebbleOS
+ */
+
+#include "FreeRTOS.h"
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t entry, const char *name, uint32_t depth, void *par, UBaseType_t prio, StackType_t *stack, StaticTask_t *buf);
+TickType_t xTaskGetTickCount(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+void vTaskDelay(TickType_t ticks);
+void vTaskSuspendAll(void);
+BaseType_t xTaskResumeAll(void);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t timeout);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+void vTaskSetThreadLocalStoragePointer(TaskHandle_t task, BaseType_t idx, void *p);
+void *pvTaskGetThreadLocalStoragePointer(TaskHandle_t task, BaseType_t idx);
+
+/* There are no interrupts to keep out, and the scheduler only switches
+ * tasks inside RTOS calls, so keeping other tasks from being woken is all
+ * that a critical section needs to do. */
+#define taskENTER_CRITICAL() vTaskSuspendAll()
+#define taskEXIT_CRITICAL()  xTaskResumeAll()
@@ -0,0 +1,22 @@
+#pragma once
+/* timeline.h
+ * rdb only needs the layout of a timeline item on the host, to sort
+ * notifications by timestamp; this has to match rcore/service/timeline.h.
+ * RebbleOS
+ */
+
+#include <stdint.h>
+
+typedef struct timeline_item_t {
+    uint8_t uuid[16];
+    uint8_t parent_uuid[16];
+    uint32_t timestamp;
+    uint16_t duration;
+    uint8_t timeline_type;
+    uint16_t flags;
+    uint8_t layout;
+    uint16_t data_size;
+    uint8_t attr_count;
+    uint8_t action_count;
+    uint8_t data[];
+} __attribute__((__packed__)) timeline_item;
@@ -0,0 +1,367 @@
+/* qbench.c
+ * Replays heap allocation traces against qalloc, on the host
+ * RebbleOS
+ *
+ * A trace is a run of allocations, reallocations, and frees, in the order
+ * that an app made them.  One can be recorded off a watch by building with
+ * MEM_HEAP_TRACE (see rebble_memory.c) and saving the log; -t replays it,
+ * skipping any line that isn't from the trace.  Without -t, qbench replays
+ * one that it makes up, of an app that pushes and pops windows full of
+ * layers and strings, runs animations, and reformats its text every tick,
+ * with a few bitmaps and some things that it never lets go of, so that the
+ * heap ends up good and fragmented.
+ *
+ * Every block gets filled in with a pattern, and checked before it's
+ * reallocated or freed, so that blocks that overlap get caught.  After each
+ * pass, whatever the trace left allocated gets freed, and the heap has to
+ * come back together into one block.
+ *
+ * Usage: qbench [-t trace] [-h heap_bytes] [-n passes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include "qalloc.h"
+
+/* snowy's app heap */
+#define QBENCH_HEAP_SIZE (90000 - 3000 * 4)
+
+struct qop {
+    char op; /* 'a'lloc, 'r'ealloc, or 'f'ree */
+    int slot;
+    unsigned size;
+};
+
+static struct qop *_ops;
+static int _nops, _maxops;
+static int _nslots;
+
+static uint64_t _host_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void _add(char op, int slot, unsigned size)
+{
+    if (_nops == _maxops) {
+        _maxops = _maxops ? _maxops * 2 : 1024;
+        _ops = realloc(_ops, _maxops * sizeof(*_ops));
+        if (!_ops) {
+            fprintf(stderr, "qbench: out of memory for the trace\n");
+            exit(1);
+        }
+    }
+    _ops[_nops++] = (struct qop) { op, slot, size };
+}
+
+/*** Recorded traces. ***/
+
+/* What each pointer in the trace, that's still allocated, became. */
+struct qlive {
+    unsigned long ptr;
+    int slot;
+};
+
+static struct qlive *_live;
+static int _nlive, _maxlive;
+
+static int _live_find(unsigned long ptr)
+{
+    for (int i = _nlive - 1; i >= 0; i--)
+        if (_live[i].ptr == ptr)
+            return i;
+    return -1;
+}
+
+static void _live_add(unsigned long ptr, int slot)
+{
+    if (_nlive == _maxlive) {
+        _maxlive = _maxlive ? _maxlive * 2 : 256;
+        _live = realloc(_live, _maxlive * sizeof(*_live));
+    }
+    _live[_nlive++] = (struct qlive) { ptr, slot };
+}
+
+static void _live_del(int i)
+{
+    _live[i] = _live[--_nlive];
+}
+
+static int _load(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    char line[256];
+
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = strstr(line, "qtrace ");
+        unsigned long old, new;
+        int size, i;
+
+        if (!p)
+            continue;
+        if (sscanf(p, "qtrace r %lx %lx %d", &old, &new, &size) == 3) {
+            /* A failed allocation didn't happen; nor did a failed
+             * reallocation, as far as the heap is concerned. */
+            if (!new)
+                continue;
+            if (!old) {
+                _add('a', _nslots, size);
+                _live_add(new, _nslots++);
+            } else if ((i = _live_find(old)) >= 0) {
+                _add('r', _live[i].slot, size);
+                _live[i].ptr = new;
+            }
+        } else if (sscanf(p, "qtrace f %lx", &old) == 1) {
+            if (old && (i = _live_find(old)) >= 0) {
+                _add('f', _live[i].slot, 0);
+                _live_del(i);
+            }
+        }
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+/*** A made-up trace. ***/
+
+static uint32_t _seed = 1;
+
+static unsigned _rand(unsigned lo, unsigned hi)
+{
+    _seed = _seed * 1103515245 + 12345;
+    return lo + (_seed >> 8) % (hi - lo + 1);
+}
+
+static int _alloc(unsigned size)
+{
+    _add('a', _nslots, size);
+    return _nslots++;
+}
+
+#define GEN_MAX 64
+
+static void _make(int screens)
+{
+    int kept[256], nkept = 0;
+    int anim[GEN_MAX], nanim = 0;
+
+    /* The app's own window and state, and a couple of resources. */
+    _alloc(120);
+    for (int i = 0; i < 6; i++)
+        _alloc(_rand(40, 120));
+    _alloc(_rand(1500, 3000));
+    _alloc(_rand(4000, 6000));
+
+    for (int s = 0; s < screens; s++) {
+        int objs[GEN_MAX], nobjs = 0;
+        int text = _alloc(16);
+        unsigned textsz = 16;
+
+        /* Push a window: layers, strings, and sometimes a bitmap. */
+        objs[nobjs++] = _alloc(80);
+        for (int i = _rand(5, 20); i > 0; i--) {
+            objs[nobjs++] = _alloc(_rand(40, 120));
+            if (_rand(0, 2) == 0)
+                objs[nobjs++] = _alloc(_rand(8, 64));
+        }
+        if (_rand(0, 3) == 0)
+            objs[nobjs++] = _alloc(_rand(1000, 6000));
+
+        /* Tick away on it for a while. */
+        for (int t = _rand(10, 30); t > 0; t--) {
+            int buf = _alloc(_rand(16, 32));
+
+            if (_rand(0, 2) == 0 && nanim < GEN_MAX - 2) {
+                anim[nanim++] = _alloc(96);
+                anim[nanim++] = _alloc(64);
+            }
+            if (nanim && _rand(0, 1) == 0) {
+                int i = _rand(0, nanim - 1);
+
+                _add('f', anim[i], 0);
+                anim[i] = anim[--nanim];
+            }
+            if (_rand(0, 3) == 0) {
+                textsz = _rand(16, 128);
+                _add('r', text, textsz);
+            }
+            if (_rand(0, 7) == 0 && nkept < 256)
+                kept[nkept++] = _alloc(_rand(8, 48));
+            _add('f', buf, 0);
+        }
+
+        /* Pop it, in no particular order, but leave some of it behind. */
+        while (nobjs) {
+            int i = _rand(0, nobjs - 1);
+
+            if (_rand(0, 15) == 0 && nkept < 256)
+                kept[nkept++] = objs[i];
+            else
+                _add('f', objs[i], 0);
+            objs[i] = objs[--nobjs];
+        }
+        _add('f', text, 0);
+
+        /* Every so often, the app clears out its caches. */
+        if (nkept > 160) {
+            while (nkept > 40) {
+                int i = _rand(0, nkept - 1);
+
+                _add('f', kept[i], 0);
+                kept[i] = kept[--nkept];
+            }
+        }
+    }
+}
+
+/*** Replay. ***/
+
+static void _fill(uint8_t *p, int slot, unsigned size)
+{
+    memset(p, (uint8_t)(slot * 7 + 1), size);
+}
+
+static void _check(const uint8_t *p, int slot, unsigned size)
+{
+    for (unsigned i = 0; i < size; i++)
+        if (p[i] != (uint8_t)(slot * 7 + 1)) {
+            fprintf(stderr, "qbench: block %d got overwritten at byte %u\n", slot, i);
+            abort();
+        }
+}
+
+struct qresult {
+    uint64_t ns, worst_ns;
+    unsigned peak;
+    int failed;
+};
+
+static void _replay(qarena_t *arena, void **ptrs, unsigned *sizes, struct qresult *res)
+{
+    for (int i = 0; i < _nops; i++) {
+        struct qop *op = &_ops[i];
+        void *p = ptrs[op->slot];
+        uint64_t t0, ns;
+
+        if (op->op != 'a' && !p)
+            continue; /* it never got allocated */
+        if (p)
+            _check(p, op->slot, op->op == 'r' && op->size < sizes[op->slot] ? op->size : sizes[op->slot]);
+
+        t0 = _host_ns();
+        if (op->op == 'a')
+            p = qalloc(arena, op->size);
+        else if (op->op == 'r')
+            p = qrealloc(arena, p, op->size);
+        else
+            qfree(arena, p);
+        ns = _host_ns() - t0;
+
+        res->ns += ns;
+        if (ns > res->worst_ns)
+            res->worst_ns = ns;
+
+        if (op->op == 'f') {
+            ptrs[op->slot] = NULL;
+            continue;
+        }
+        if (!p) {
+            res->failed++;
+            continue;
+        }
+        ptrs[op->slot] = p;
+        sizes[op->slot] = op->size;
+        _fill(p, op->slot, op->size);
+        if (qusedbytes(arena) > res->peak)
+            res->peak = qusedbytes(arena);
+    }
+}
+
+void panic(const char *s)
+{
+    fprintf(stderr, "PANIC: %s\n", s);
+    abort();
+}
+
+int main(int argc, char **argv)
+{
+    const char *trace = NULL;
+    unsigned heapsz = QBENCH_HEAP_SIZE;
+    int passes = 20;
+    struct qresult res = { 0 };
+    int c;
+
+    while ((c = getopt(argc, argv, "t:h:n:")) != -1) {
+        switch (c) {
+        case 't': trace = optarg; break;
+        case 'h': heapsz = atoi(optarg); break;
+        case 'n': passes = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-t trace] [-h heap_bytes] [-n passes]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (trace) {
+        if (_load(trace) < 0)
+            return 1;
+    } else {
+        _make(200);
+    }
+
+    uint8_t *heap = calloc(1, heapsz);
+    void **ptrs = calloc(_nslots ? _nslots : 1, sizeof(*ptrs));
+    unsigned *sizes = calloc(_nslots ? _nslots : 1, sizeof(*sizes));
+    qarena_t *arena = qinit(heap, heapsz);
+    uint32_t empty = qfreebytes(arena);
+
+    printf("qbench: %s, %d ops on %d blocks, into a %u-byte heap\n",
+        trace ? trace : "made-up trace", _nops, _nslots, heapsz);
+
+    for (int pass = 0; pass < passes; pass++) {
+        _replay(arena, ptrs, sizes, &res);
+
+        /* Clean up after it, and make sure that it all comes back. */
+        for (int s = 0; s < _nslots; s++)
+            if (ptrs[s]) {
+                _check(ptrs[s], s, sizes[s]);
+                qfree(arena, ptrs[s]);
+                ptrs[s] = NULL;
+            }
+        if (qusedbytes(arena) != 0 || qfreebytes(arena) != empty) {
+            printf("qbench: %u bytes still allocated after freeing everything\n", (unsigned)qusedbytes(arena));
+            return 1;
+        }
+        if (!(ptrs[0] = qalloc(arena, empty - 64))) {
+            printf("qbench: the heap didn't come back together\n");
+            return 1;
+        }
+        qfree(arena, ptrs[0]);
+        ptrs[0] = NULL;
+    }
+
+    printf("qalloc     %7d ops %8.0f ns/op host, worst %6.0f ns | peak %u B in use, %d failed\n",
+        _nops * passes, (double)res.ns / (_nops * passes), (double)res.worst_ns,
+        res.peak, res.failed / passes);
+
+    free(sizes);
+    free(ptrs);
+    free(heap);
+    free(_ops);
+    free(_live);
+
+    return 0;
+}
@@ -0,0 +1,421 @@
+/* rtos.c
+ * A deterministic stand-in for the FreeRTOS scheduler, for the host simulator
+ * RebbleOS
+ *
+ * Every task gets a pthread, but only one of them runs at any time: the
+ * rest sit on their own condition variables until the running task hands
+ * over.  That only happens inside an RTOS call -- when a task blocks, or
+ * wakes up something of a higher priority -- so a run of the simulator
+ * always goes the same way, and there are no races that the firmware
+ * wouldn't have on a single core.  There is no time slicing; tasks of the
+ * same priority take turns only when one of them blocks.
+ *
+ * The calling thread of main() becomes a task of priority 1, like the
+ * threads that tests run on in the firmware.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "hostsim.h"
+
+static pthread_mutex_t _sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sim_task _sim_main = {
+    .cv = PTHREAD_COND_INITIALIZER,
+    .name = "main",
+    .prio = tskIDLE_PRIORITY + 1,
+    .ready = 1,
+};
+static struct sim_task *_sim_tasks = &_sim_main;
+static struct sim_task *_sim_current = &_sim_main;
+static int _sim_suspended = 0;
+static uint64_t _sim_now_ns = 0;
+
+/* Something to block on that nobody ever gives. */
+static const int _sim_delay_token;
+
+/*** Time. ***/
+
+uint64_t sim_clock_ns(void)
+{
+    return _sim_now_ns;
+}
+
+/* Called from the flash model, by the running task, without the lock;
+ * nobody else can be looking. */
+void sim_clock_advance(uint64_t ns)
+{
+    _sim_now_ns += ns;
+}
+
+static TickType_t _sim_ticks(void)
+{
+    return (TickType_t)(_sim_now_ns / (1000000000ULL / configTICK_RATE_HZ));
+}
+
+/*** Scheduling.  Everything below here runs with _sim_lock held. ***/
+
+/* Wakes up anyone whose timeout has passed. */
+static void _sim_expire(void)
+{
+    TickType_t now = _sim_ticks();
+
+    for (struct sim_task *t = _sim_tasks; t; t = t->next)
+        if (!t->ready && t->timed && (int32_t)(now - t->wake_at) >= 0) {
+            t->ready = 1;
+            t->woken = 0;
+            t->timed = 0;
+            t->blocked_on = NULL;
+        }
+}
+
+static struct sim_task *_sim_pick(struct sim_task *me)
+{
+    struct sim_task *best = NULL;
+
+    for (struct sim_task *t = _sim_tasks; t; t = t->next)
+        if (t->ready && (!best || t->prio > best->prio))
+            best = t;
+
+    /* Don't switch between equals for no reason. */
+    if (best && me->ready && me->prio == best->prio)
+        return me;
+    return best;
+}
+
+/* Runs whoever ought to be running, and returns once it is our turn
+ * again. */
+static void _sim_reschedule(struct sim_task *me)
+{
+    struct sim_task *next;
+
+    _sim_expire();
+    while (!(next = _sim_pick(me))) {
+        /* Everyone is asleep; skip ahead to the first timeout. */
+        struct sim_task *first = NULL;
+
+        for (struct sim_task *t = _sim_tasks; t; t = t->next)
+            if (t->timed && (!first || (int32_t)(t->wake_at - first->wake_at) < 0))
+                first = t;
+        if (!first) {
+            fprintf(stderr, "hostsim: every task is blocked forever; deadlock\n");
+            for (struct sim_task *t = _sim_tasks; t; t = t->next)
+                fprintf(stderr, "  %s (prio %d): blocked on %p\n", t->name, (int)t->prio, t->blocked_on);
+            abort();
+        }
+
+        if ((int32_t)(first->wake_at - _sim_ticks()) > 0)
+            _sim_now_ns += (uint64_t)(first->wake_at - _sim_ticks()) * (1000000000ULL / configTICK_RATE_HZ);
+        _sim_expire();
+    }
+
+    if (next == me)
+        return;
+
+    _sim_current = next;
+    pthread_cond_signal(&next->cv);
+    while (_sim_current != me)
+        pthread_cond_wait(&me->cv, &_sim_lock);
+}
+
+/* If something more important than us can run, let it. */
+static void _sim_preempt(struct sim_task *me)
+{
+    if (_sim_suspended)
+        return;
+
+    _sim_expire();
+    struct sim_task *best = _sim_pick(me);
+    if (best && best != me && best->prio > me->prio)
+        _sim_reschedule(me);
+}
+
+/* Returns 1 if someone woke us up, or 0 if we timed out. */
+static int _sim_block(struct sim_task *me, const void *on, TickType_t timeout)
+{
+    if (timeout == 0)
+        return 0;
+
+    if (_sim_suspended) {
+        fprintf(stderr, "hostsim: task %s blocked with the scheduler suspended\n", me->name);
+        abort();
+    }
+
+    me->ready = 0;
+    me->blocked_on = on;
+    me->woken = 0;
+    me->timed = timeout != portMAX_DELAY;
+    me->wake_at = _sim_ticks() + timeout;
+
+    _sim_reschedule(me);
+
+    return me->woken;
+}
+
+static void _sim_wake(struct sim_task *t)
+{
+    t->ready = 1;
+    t->woken = 1;
+    t->timed = 0;
+    t->blocked_on = NULL;
+}
+
+static struct sim_task *_sim_first_waiter(const void *on)
+{
+    struct sim_task *best = NULL;
+
+    for (struct sim_task *t = _sim_tasks; t; t = t->next)
+        if (!t->ready && t->blocked_on == on && (!best || t->prio > best->prio))
+            best = t;
+
+    return best;
+}
+
+/*** Tasks. ***/
+
+static void *_sim_task_start(void *par)
+{
+    struct sim_task *t = par;
+
+    pthread_mutex_lock(&_sim_lock);
+    while (_sim_current != t)
+        pthread_cond_wait(&t->cv, &_sim_lock);
+    pthread_mutex_unlock(&_sim_lock);
+
+    t->entry(t->par);
+
+    fprintf(stderr, "hostsim: task %s returned\n", t->name);
+    abort();
+}
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t entry, const char *name, uint32_t depth, void *par, UBaseType_t prio, StackType_t *stack, StaticTask_t *buf)
+{
+    struct sim_task *t = buf;
+
+    pthread_mutex_lock(&_sim_lock);
+
+    memset(t, 0, sizeof(*t));
+    pthread_cond_init(&t->cv, NULL);
+    t->name = name;
+    t->entry = entry;
+    t->par = par;
+    t->prio = prio;
+    t->ready = 1;
+    t->next = _sim_tasks;
+    _sim_tasks = t;
+
+    if (pthread_create(&t->thread, NULL, _sim_task_start, t) != 0) {
+        fprintf(stderr, "hostsim: couldn't start task %s\n", name);
+        abort();
+    }
+
+    _sim_preempt(_sim_current);
+    pthread_mutex_unlock(&_sim_lock);
+
+    return t;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    TickType_t now;
+
+    pthread_mutex_lock(&_sim_lock);
+    now = _sim_ticks();
+    _sim_preempt(_sim_current);
+    pthread_mutex_unlock(&_sim_lock);
+
+    return now;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    pthread_mutex_lock(&_sim_lock);
+    _sim_block(_sim_current, &_sim_delay_token, ticks);
+    pthread_mutex_unlock(&_sim_lock);
+}
+
+void vTaskSuspendAll(void)
+{
+    pthread_mutex_lock(&_sim_lock);
+    _sim_suspended++;
+    pthread_mutex_unlock(&_sim_lock);
+}
+
+BaseType_t xTaskResumeAll(void)
+{
+    pthread_mutex_lock(&_sim_lock);
+    if (--_sim_suspended == 0)
+        _sim_preempt(_sim_current);
+    pthread_mutex_unlock(&_sim_lock);
+
+    return pdFALSE;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return _sim_current;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t timeout)
+{
+    struct sim_task *me;
+    uint32_t rv = 0;
+
+    pthread_mutex_lock(&_sim_lock);
+    me = _sim_current;
+    if (me->notify || _sim_block(me, &me->notify, timeout)) {
+        rv = me->notify;
+        me->notify = clear ? 0 : rv - 1;
+    }
+    pthread_mutex_unlock(&_sim_lock);
+
+    return rv;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&_sim_lock);
+    task->notify++;
+    if (!task->ready && task->blocked_on == &task->notify)
+        _sim_wake(task);
+    _sim_preempt(_sim_current);
+    pthread_mutex_unlock(&_sim_lock);
+
+    return pdPASS;
+}
+
+/* Only the running task ever looks at these, so they don't need the
+ * lock. */
+void vTaskSetThreadLocalStoragePointer(TaskHandle_t task, BaseType_t idx, void *p)
+{
+    (task ? task : _sim_current)->tls[idx] = p;
+}
+
+void *pvTaskGetThreadLocalStoragePointer(TaskHandle_t task, BaseType_t idx)
+{
+    return (task ? task : _sim_current)->tls[idx];
+}
+
+/*** Semaphores. ***/
+
+static SemaphoreHandle_t _sim_sem_init(StaticSemaphore_t *buf, int count, int max, int recursive)
+{
+    memset(buf, 0, sizeof(*buf));
+    buf->count = count;
+    buf->max = max;
+    buf->recursive = recursive;
+
+    return buf;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buf)
+{
+    return _sim_sem_init(buf, 1, 1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutexStatic(StaticSemaphore_t *buf)
+{
+    return _sim_sem_init(buf, 1, 1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buf)
+{
+    return _sim_sem_init(buf, 0, 1, 0);
+}
+
+static BaseType_t _sim_sem_take(SemaphoreHandle_t sem, TickType_t timeout)
+{
+    struct sim_task *me = _sim_current;
+
+    if (sem->count) {
+        sem->count--;
+        sem->owner = me;
+        return pdTRUE;
+    }
+
+    /* Whoever gives it to us sets the owner. */
+    return _sim_block(me, sem, timeout) ? pdTRUE : pdFALSE;
+}
+
+static BaseType_t _sim_sem_give(SemaphoreHandle_t sem)
+{
+    struct sim_task *t = _sim_first_waiter(sem);
+
+    if (t) {
+        sem->owner = t;
+        _sim_wake(t);
+    } else if (sem->count < sem->max) {
+        sem->owner = NULL;
+        sem->count++;
+    } else {
+        return pdFALSE;
+    }
+
+    _sim_preempt(_sim_current);
+
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t timeout)
+{
+    BaseType_t rv;
+
+    pthread_mutex_lock(&_sim_lock);
+    rv = _sim_sem_take(sem, timeout);
+    pthread_mutex_unlock(&_sim_lock);
+
+    return rv;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    BaseType_t rv;
+
+    pthread_mutex_lock(&_sim_lock);
+    rv = _sim_sem_give(sem);
+    pthread_mutex_unlock(&_sim_lock);
+
+    return rv;
+}
+
+TaskHandle_t xSemaphoreGetMutexHolder(SemaphoreHandle_t sem)
+{
+    TaskHandle_t owner;
+
+    pthread_mutex_lock(&_sim_lock);
+    owner = sem->count ? NULL : sem->owner;
+    pthread_mutex_unlock(&_sim_lock);
+
+    return owner;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t sem, TickType_t timeout)
+{
+    BaseType_t rv = pdTRUE;
+
+    pthread_mutex_lock(&_sim_lock);
+    if (sem->count == 0 && sem->owner == _sim_current)
+        sem->depth++;
+    else if ((rv = _sim_sem_take(sem, timeout)))
+        sem->depth = 1;
+    pthread_mutex_unlock(&_sim_lock);
+
+    return rv;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t sem)
+{
+    BaseType_t rv = pdTRUE;
+
+    pthread_mutex_lock(&_sim_lock);
+    if (sem->owner != _sim_current || sem->depth == 0)
+        rv = pdFALSE;
+    else if (--sem->depth == 0)
+        rv = _sim_sem_give(sem);
+    pthread_mutex_unlock(&_sim_lock);
+
+    return rv;
+}
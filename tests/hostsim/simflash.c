@@ -0,0 +1,166 @@
+/* simflash.c
+ * RAM-backed NOR flash for the host simulator
+ * RebbleOS
+ *
+ * This stands in for a platform's hw_flash_* driver.  It behaves like NOR:
+ * erases set whole blocks to 0xFF, and programming can only clear bits, so
+ * a program that tries to set one (because somebody forgot to erase first)
+ * is counted as a violation -- or is fatal, with simflash_strict.  Programs
+ * may not cross a program page, and erases have to be whole, aligned
+ * blocks, same as on the real parts.
+ *
+ * Every operation costs some modelled time, per simflash_timing, and that
+ * is what moves the simulator's clock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "platform.h"
+#include "flash.h"
+#include "log.h"
+#include "hostsim.h"
+
+struct simflash_timing simflash_timing = {
+    .read_op_ns      = 1000,
+    .read_byte_ns    = 40,     /* quad SPI at ~50MHz, and some DMA setup */
+    .program_op_ns   = 50000,
+    .program_byte_ns = 1500,   /* ~0.4ms for a 256-byte page */
+    .erase_ns        = 150000000, /* 32k block */
+};
+
+int simflash_strict = 0;
+int simflash_verbose = 0;
+
+static uint8_t *_simflash_mem;
+static struct simflash_stats _simflash_stats;
+
+static void _simflash_check(const char *what, uint32_t addr, size_t len)
+{
+    if (addr > HOSTSIM_FLASH_SIZE || len > HOSTSIM_FLASH_SIZE - addr) {
+        fprintf(stderr, "simflash: %s of %zu bytes at 0x%08x runs off the end of flash\n", what, len, addr);
+        abort();
+    }
+}
+
+void hw_flash_init(void)
+{
+    if (_simflash_mem)
+        return;
+
+    _simflash_mem = malloc(HOSTSIM_FLASH_SIZE);
+    if (!_simflash_mem) {
+        fprintf(stderr, "simflash: out of memory for %d bytes of flash\n", HOSTSIM_FLASH_SIZE);
+        abort();
+    }
+    memset(_simflash_mem, 0xFF, HOSTSIM_FLASH_SIZE);
+}
+
+void hw_flash_read_bytes(uint32_t addr, uint8_t *buf, size_t len)
+{
+    _simflash_check("read", addr, len);
+
+    memcpy(buf, _simflash_mem + addr, len);
+
+    uint64_t ns = simflash_timing.read_op_ns + (uint64_t)simflash_timing.read_byte_ns * len;
+    _simflash_stats.reads++;
+    _simflash_stats.read_bytes += len;
+    _simflash_stats.read_ns += ns;
+    sim_clock_advance(ns);
+
+    /* On hardware, this comes from the DMA interrupt. */
+    flash_operation_complete(0);
+}
+
+const void *hw_flash_map(uint32_t addr, size_t len)
+{
+    _simflash_check("map", addr, len);
+    _simflash_stats.maps++;
+    
+    return _simflash_mem + addr;
+}
+
+void hw_flash_unmap(const void *p, size_t len)
+{
+}
+
+int hw_flash_write_sync(uint32_t addr, uint8_t *buf, size_t len)
+{
+    _simflash_check("program", addr, len);
+    if (len && (addr / HOSTSIM_PROGRAM_SIZE) != ((addr + len - 1) / HOSTSIM_PROGRAM_SIZE)) {
+        fprintf(stderr, "simflash: program of %zu bytes at 0x%08x crosses a %d-byte page\n", len, addr, HOSTSIM_PROGRAM_SIZE);
+        abort();
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t *p = _simflash_mem + addr + i;
+
+        if (buf[i] & ~*p) {
+            _simflash_stats.violations++;
+            if (simflash_strict) {
+                fprintf(stderr, "simflash: program at 0x%08zx wants %02x over %02x without an erase\n", addr + i, buf[i], *p);
+                abort();
+            }
+        }
+        *p &= buf[i];
+    }
+
+    uint64_t ns = simflash_timing.program_op_ns + (uint64_t)simflash_timing.program_byte_ns * len;
+    _simflash_stats.programs++;
+    _simflash_stats.program_bytes += len;
+    _simflash_stats.program_ns += ns;
+    sim_clock_advance(ns);
+
+    return 0;
+}
+
+int hw_flash_erase_sync(uint32_t addr, uint32_t len)
+{
+    _simflash_check("erase", addr, len);
+    if ((addr % HOSTSIM_ERASE_SIZE) || (len % HOSTSIM_ERASE_SIZE)) {
+        fprintf(stderr, "simflash: erase of %u bytes at 0x%08x isn't in whole %d-byte blocks\n", len, addr, HOSTSIM_ERASE_SIZE);
+        abort();
+    }
+
+    memset(_simflash_mem + addr, 0xFF, len);
+
+    uint64_t ns = (uint64_t)simflash_timing.erase_ns * (len / HOSTSIM_ERASE_SIZE);
+    _simflash_stats.erases += len / HOSTSIM_ERASE_SIZE;
+    _simflash_stats.erase_ns += ns;
+    sim_clock_advance(ns);
+
+    return 0;
+}
+
+void simflash_get_stats(struct simflash_stats *stats)
+{
+    *stats = _simflash_stats;
+}
+
+/*** The rest of what the firmware would have provided. ***/
+
+void ss_debug_write(const unsigned char *p, size_t len)
+{
+    fwrite(p, 1, len, stdout);
+}
+
+void panic(const char *s)
+{
+    fprintf(stderr, "PANIC: %s\n", s);
+    abort();
+}
+
+void log_printf_to_ar(const char *layer, const char *module, uint8_t level, const char *filename, uint32_t line_no, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!simflash_verbose && level != APP_LOG_LEVEL_ERROR)
+        return;
+
+    fprintf(stderr, "[%s/%s] ", layer, module);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
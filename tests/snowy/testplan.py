@@ -17,15 +17,45 @@ testplan = [
     Test("Simple", testname = b'simple', golden = 42),
 #    Test("bad-artifact", testname = b'simple', golden = 43),
 #    Test("non-exist", testname = b'ne', golden = 42),
+    Test("Flash: read cache", testname = b'flash_cache', golden = 0),
+    Test("Flash: asynchronous requests", testname = b'flash_async', golden = 0),
+    Test("Flash: statistics by tag", testname = b'flash_tag_stats', golden = 0),
+    Test("Flash: writers waiting on a mapping", testname = b'flash_map_wait', golden = 0),
     Test("Filesystem: find nonexistent file", testname = b'fs_find_noent', golden = 0),
     Test("Filesystem: basic create test", testname = b'fs_creat_basic', golden = 0),
+    Test("Filesystem: filename index churn", testname = b'fs_name_index', golden = 0),
     Test("Filesystem: I/O on two files", testname = b'fs_two_files', golden = 0),
     Test("Filesystem: basic file replacement test", testname = b'fs_replace_file_basic', golden = 0),
     Test("Filesystem: file as smaller file", testname = b'fs_sub_file', golden = 0),
     Test("Filesystem: big files", testname = b'fs_bigfiles', golden = 0),
+    Test("Filesystem: seek performance", testname = b'fs_seek_perf', golden = 0),
+    Test("Filesystem: garbage collection", testname = b'fs_gc', golden = 0),
+    Test("Filesystem: moving files to collect", testname = b'fs_gc_relocate', golden = 0),
+    Test("Filesystem: holding files where they are", testname = b'fs_gc_hold', golden = 0),
+    Test("Filesystem: erasing while idle", testname = b'fs_preerase', golden = 0),
+    Test("Filesystem: mount time", testname = b'fs_mount_time', golden = 0),
+    Test("Filesystem: write combining", testname = b'fs_write_combine', golden = 0),
+    Test("Filesystem: mapped reads", testname = b'fs_map', golden = 0),
+    Test("Filesystem: directory listing", testname = b'fs_readdir', golden = 0),
+    Test("Filesystem: growable files", testname = b'fs_growable', golden = 0),
+    Test("Filesystem: CRC kernel", testname = b'fs_crc', golden = 0),
+    Test("Filesystem: CRC performance", testname = b'fs_crc_perf', golden = 0),
+    Test("qalloc: splitting blocks", testname = b'qalloc_split', golden = 0),
+    Test("qalloc: coalescing", testname = b'qalloc_coalesce', golden = 0),
+    Test("qalloc: realloc", testname = b'qalloc_realloc', golden = 0),
     Test("rdb: basic", testname = b'rdb_basic', golden = 0),
     Test("rdb: fill", testname = b'rdb_fill', golden = 0),
+    Test("rdb: key index", testname = b'rdb_index', golden = 0),
+    Test("rdb: cursors", testname = b'rdb_cursor', golden = 0),
+    Test("rdb: sorted selects", testname = b'rdb_sorted', golden = 0),
+    Test("rdb: overwrites", testname = b'rdb_overwrite', golden = 0),
+    Test("rdb: Bloom filter", testname = b'rdb_bloom', golden = 0),
+    Test("rdb: stale copies", testname = b'rdb_stale', golden = 0),
+    Test("rdb: per-app files", testname = b'rdb_files', golden = 0),
+    Test("rdb: transactions", testname = b'rdb_txn', golden = 0),
+    Test("rdb: incremental compaction", testname = b'rdb_compact', golden = 0),
     Test("Protocol: buffer", testname = b'protocol_basic', golden = 0),
     Test("Protocol: packet", testname = b'protocol_packet', golden = 0),
     Test("dictionary: basic", testname = b'dictionary', golden = 0),
+    Test("persist: write-back cache", testname = b'persist_cache', golden = 0),
 ]